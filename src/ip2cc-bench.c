@@ -0,0 +1,964 @@
+/*
+ip2cc-bench.c
+ANSI C
+POSIX.1-2001 (clock_gettime(), posix_fadvise())
+(C) 2003 Corebase, Easymatic, Cynergi, Pedro Freire
+
+Benchmark of the lookup engines of libip2cc (see ip2cc.c). This can be
+called with:
+	[-c] [-d <ip4db>] [-f <text-db>] [-g <geoip-db>] [-r <trace>]
+	[-n <lookups>] [-z <exponent>] [-w <workload>]... [-e <engine>]...
+
+(the IPv4 database's header says which clusters it has, see ip2cc.c)
+
+-c	Cold runs: drop the database files from the page cache before each
+	timed pass, instead of running a warm-up pass first
+-d	IPv4 database to benchmark (default DBFILE4, see ip2cc.h)
+-f	Source data file of the database, in the ip-to-country format of
+	mk-ip4db -1 or -2: its ranges are sampled by the "weighted" and "zipf"
+	workloads, and searched by the "text" engine
+-g	MaxMind legacy GeoIP country database (GeoIP.dat, gzipped or not),
+	searched by the "geoip" engine
+-r	Trace file to replay, with an IPv4 or IPv6 address at the start of
+	each line (as the first column of a web server log)
+-n	Lookups in each timed pass (default 1000000)
+-z	Exponent of the "zipf" workload (default 1.0)
+-w	Run only this workload (may be repeated):
+	uniform   random IPv4 addresses (and IPv6 ones in 2000::/3)
+	weighted  IPv4 addresses sampled from the ranges of <text-db>, each
+	          address equally likely (so larger allocations more often)
+	zipf      ZIPF_KEYS addresses, sampled as for "weighted", each looked
+	          up as often as 1/rank^<exponent>, like real traffic
+	trace     the addresses of <trace>, in order (from the start again,
+	          if fewer than <lookups>)
+-e	Run only this engine (may be repeated):
+	disk, pin, map                 open_ip4_db() with IP4DB_DISK, PIN, MAP
+	map-loop                       the same as map, with IP4DB_LOOP (to
+	                               compare the cluster search kernels)
+	disk-jump, pin-jump, map-jump  the same, with IP4DB_JUMP
+	trie                           open_ip4_db() with IP4DB_TRIE
+	map-batch                      find_ip4_countries_db(), on IP4DB_MAP
+	disk-cached, map-cached        find_ip4_country_cached(), on IP4DB_DISK
+	                               or IP4DB_MAP
+	ip6                            find_ip6_country() on DBFILE6
+	text                           binary search of <text-db>, as in
+	                               php-alone.php (the reference)
+	geoip                          walk of the trie of <geoip-db>, as
+	                               libGeoIP does (see ip2cc-geoip.h)
+
+By default, every workload and engine is run whose files are there.
+
+For each workload and engine, a pass over all its lookups is timed as a
+whole, for the throughput, and another one lookup by lookup, for the
+latency percentiles (map-batch is timed BENCH_BATCH lookups at a time,
+and each given the average). The timer's own overhead, included in every
+latency, is output first. Every engine's answers are checked against the
+first one's ("text" and "geoip" search other files, so their differences
+are only counted), and the "ip6" engine only runs the uniform and trace
+workloads.
+
+To compare the clusters with GeoIP's trie on the same data, build the
+database from the GeoIP database itself (mk-ip4db -g), and give both:
+ip2cc-bench -d <ip4db> -g <geoip-db> -e map -e geoip, say.
+
+The lookup servers are benchmarked by ip2cc-client -l, instead.
+
+The return value is one of:
+	0 -> ok
+	1 -> any error
+
+To compile it with GCC (it also needs libip2cc):
+
+	gcc -O2 -Wall -DNDEBUG -DSECTOR_SIZE=512 ip2cc-bench.c libip2cc.c -lm -lz -o ip2cc-bench
+
+(or with -DNO_ZLIB, and without -lz, if gzipped GeoIP databases needn't
+be read).
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+#include "ip2cc.h"
+#include "ip2cc-geoip.h"
+
+
+/* System return values:
+*/
+#define RV_OK			0
+#define RV_ERROR		1
+
+
+/* Lookups timed together by the map-batch engine, addresses looked up by
+   the zipf workload, and latency percentiles output
+*/
+#define BENCH_BATCH		64
+#define ZIPF_KEYS		65536L
+#define BENCH_PERCENTILES	3
+#define TIMER_READINGS		1001
+
+
+/* Kinds of engines
+*/
+#define ENGINE_DB		0  /* find_ip4_country_db() */
+#define ENGINE_BATCH		1  /* find_ip4_countries_db() */
+#define ENGINE_CACHED		2  /* find_ip4_country_cached() */
+#define ENGINE_IP6		3  /* find_ip6_country() */
+#define ENGINE_TEXT		4  /* find_text_country() */
+#define ENGINE_GEOIP		5  /* find_geoip_country() */
+
+
+/* Lookup engines, with their open_ip4_db() modes (see -e above)
+*/
+const struct s_engine
+	{
+	const char *name;
+	int kind;
+	int mode;
+	}
+	engines[] = {
+	{ "disk",        ENGINE_DB,     IP4DB_DISK },
+	{ "pin",         ENGINE_DB,     IP4DB_PIN },
+	{ "map",         ENGINE_DB,     IP4DB_MAP },
+	{ "map-loop",    ENGINE_DB,     IP4DB_MAP  | IP4DB_LOOP },
+	{ "disk-jump",   ENGINE_DB,     IP4DB_DISK | IP4DB_JUMP },
+	{ "pin-jump",    ENGINE_DB,     IP4DB_PIN  | IP4DB_JUMP },
+	{ "map-jump",    ENGINE_DB,     IP4DB_MAP  | IP4DB_JUMP },
+	{ "trie",        ENGINE_DB,     IP4DB_TRIE },
+	{ "map-batch",   ENGINE_BATCH,  IP4DB_MAP },
+	{ "disk-cached", ENGINE_CACHED, IP4DB_DISK },
+	{ "map-cached",  ENGINE_CACHED, IP4DB_MAP },
+	{ "ip6",         ENGINE_IP6,    0 },
+	{ "text",        ENGINE_TEXT,   0 },
+	{ "geoip",       ENGINE_GEOIP,  0 } };
+#define ENGINES			( (int) (sizeof(engines) / sizeof(engines[0])) )
+
+
+/* Workloads (see -w above), in the order of workloads[]
+*/
+#define WORKLOAD_UNIFORM	0
+#define WORKLOAD_WEIGHTED	1
+#define WORKLOAD_ZIPF		2
+#define WORKLOAD_TRACE		3
+
+const char *workloads[] = { "uniform", "weighted", "zipf", "trace" };
+#define WORKLOADS		( (int) (sizeof(workloads) / sizeof(workloads[0])) )
+
+
+/* Source data file in memory: its lines (searched by the text engine),
+   and the ranges in them (sampled by the weighted and zipf workloads)
+*/
+struct s_textdb
+	{
+	char *pbuf;		/* whole file, with each line ended by '\0' */
+	char **plines;		/* start of each line with a range */
+	unsigned32 *pfrom;	/* first IP of the range of each line */
+	unsigned32 *pto;	/* last IP of the range of each line */
+	long int lines;
+	};
+
+
+/* Keys of a workload: "n4" IPv4 addresses and "n6" IPv6 ones
+*/
+struct s_keys
+	{
+	unsigned32 *pip4;
+	unsigned32 *pip6;	/* 4 per address */
+	long int n4, n6;
+	};
+
+
+/* Engine open for a timed pass
+*/
+struct s_run
+	{
+	const struct s_engine *pe;
+	struct s_ip4db *pdb;
+	struct s_ip4cache *pcache;
+	FILE *fp6;
+	const struct s_textdb *ptext;
+	const struct s_geoip *pgeoip;
+	};
+
+
+/* Function prototypes
+*/
+struct s_textdb *load_text( const char *filename );
+void free_text( struct s_textdb *ptext );
+int find_text_country( unsigned32 ip4, const struct s_textdb *ptext );
+int load_trace( const char *filename, struct s_keys *ptrace );
+int make_keys( int workload, struct s_keys *pk, long int n, const struct s_textdb *ptext,
+	       const struct s_keys *ptrace, double exponent );
+unsigned32 sample_range( const struct s_textdb *ptext, const unsigned64 *pcum, unsigned32 *px );
+int bench( const struct s_engine *pe, const struct s_keys *pk, const char *ip4db,
+	   const struct s_textdb *ptext, const char *textfile, const struct s_geoip *pgeoip,
+	   int cold, int *pref, int *pcc, double *plat );
+int open_run( struct s_run *pr, const struct s_engine *pe, const char *ip4db,
+	      const struct s_textdb *ptext, const struct s_geoip *pgeoip );
+void close_run( struct s_run *pr );
+void run_keys( const struct s_run *pr, const struct s_keys *pk, long int from, long int to, int *pcc );
+void drop_cache( const char *filename, const char *suffix );
+int file_exists( const char *filename, const char *suffix );
+unsigned32 next_random( unsigned32 *px );
+double now_ns( void );
+int compare_double( const void *p1, const void *p2 );
+
+
+/* Main
+*/
+int main( int argc, char *argv[] )
+{
+	const char *ip4db = DBFILE4;
+	const char *textfile = NULL;
+	const char *geoipfile = NULL;
+	const char *tracefile = NULL;
+	int opt_cold = 0;	/* default: warm runs */
+	long int n = 1000000L;
+	double exponent = 1.0;
+	int wsel[WORKLOADS], esel[ENGINES];
+	int wany = 0, eany = 0;
+	struct s_textdb *ptext = NULL;
+	struct s_geoip *pgeoip = NULL;
+	struct s_keys trace, keys;
+	int *pref, *pcc;	/* country codes of the first engine, and of each */
+	double *plat;		/* latency of each lookup, in ns */
+	double timer[TIMER_READINGS], t;
+	char *pexe;
+	int i, w, e, rv;
+
+	memset( wsel, 0, sizeof(wsel) );
+	memset( esel, 0, sizeof(esel) );
+	pexe = argv[0];
+	for( i = 1;  i < argc;  i++ )
+		{
+		if( !strcmp(argv[i], "-c") )
+			opt_cold = 1;  /* true */
+		else if( !strcmp(argv[i], "-d")  &&  i+1 < argc )
+			ip4db = argv[++i];
+		else if( !strcmp(argv[i], "-f")  &&  i+1 < argc )
+			textfile = argv[++i];
+		else if( !strcmp(argv[i], "-g")  &&  i+1 < argc )
+			geoipfile = argv[++i];
+		else if( !strcmp(argv[i], "-r")  &&  i+1 < argc )
+			tracefile = argv[++i];
+		else if( !strcmp(argv[i], "-n")  &&  i+1 < argc )
+			n = atol( argv[++i] );
+		else if( !strcmp(argv[i], "-z")  &&  i+1 < argc )
+			exponent = atof( argv[++i] );
+		else if( !strcmp(argv[i], "-w")  &&  i+1 < argc )
+			{
+			for( w = 0;  w < WORKLOADS  &&  strcmp(argv[i+1], workloads[w]);  w++ )
+				;
+			if( w == WORKLOADS )
+				break;  /* bad workload */
+			wsel[w] = wany = 1;  /* true */
+			i++;
+			}
+		else if( !strcmp(argv[i], "-e")  &&  i+1 < argc )
+			{
+			for( e = 0;  e < ENGINES  &&  strcmp(argv[i+1], engines[e].name);  e++ )
+				;
+			if( e == ENGINES )
+				break;  /* bad engine */
+			esel[e] = eany = 1;  /* true */
+			i++;
+			}
+		else
+			break;  /* bad option */
+		}
+	if( i < argc  ||  n < (long int) BENCH_BATCH  ||  exponent < 0.0 )
+		{
+		fprintf( stderr, "Usage: %s [-c] [-d <ip4db>] [-f <text-db>] [-g <geoip-db>] [-r <trace>]\n"
+				 "       [-n <lookups>] [-z <exponent>] [-w <workload>]... [-e <engine>]...\n"
+				 "(<lookups> from %i; see ip2cc-bench.c for the workloads and engines)\n",
+				 pexe, BENCH_BATCH );
+		return RV_ERROR;
+		}
+
+	/* by default, every workload and engine whose files are there */
+	for( w = 0;  w < WORKLOADS;  w++ )
+		if( !wany )
+			wsel[w] = (w != WORKLOAD_WEIGHTED  &&  w != WORKLOAD_ZIPF  &&  w != WORKLOAD_TRACE)  ||
+				  (w == WORKLOAD_TRACE ? tracefile : textfile) != NULL;
+	for( e = 0;  e < ENGINES;  e++ )
+		if( !eany )
+			esel[e] = !(engines[e].mode & IP4DB_JUMP  &&  !file_exists(ip4db, JUMP_SUFFIX4))  &&
+				  !(engines[e].mode & IP4DB_TRIE  &&  !file_exists(ip4db, TRIE_SUFFIX4))  &&
+				  !(engines[e].kind == ENGINE_IP6  &&  !file_exists(DBFILE6, ""))  &&
+				  !(engines[e].kind == ENGINE_TEXT  &&  textfile == NULL)  &&
+				  !(engines[e].kind == ENGINE_GEOIP  &&  geoipfile == NULL);
+	for( e = 0;  e < ENGINES  &&  !(esel[e]  &&  engines[e].kind == ENGINE_TEXT);  e++ )
+		;
+	if( (wsel[WORKLOAD_WEIGHTED]  ||  wsel[WORKLOAD_ZIPF]  ||  e < ENGINES)  &&  textfile == NULL )
+		{
+		fputs( "The weighted and zipf workloads, and the text engine, need a source data file (-f).\n", stderr );
+		return RV_ERROR;
+		}
+	for( e = 0;  e < ENGINES  &&  !(esel[e]  &&  engines[e].kind == ENGINE_GEOIP);  e++ )
+		;
+	if( e < ENGINES  &&  geoipfile == NULL )
+		{
+		fputs( "The geoip engine needs a GeoIP database (-g).\n", stderr );
+		return RV_ERROR;
+		}
+	if( wsel[WORKLOAD_TRACE]  &&  tracefile == NULL )
+		{
+		fputs( "The trace workload needs a trace file (-r).\n", stderr );
+		return RV_ERROR;
+		}
+
+	if( textfile != NULL  &&  (ptext = load_text(textfile)) == NULL )
+		{
+		fprintf( stderr, "Cannot load %s.\n", textfile );
+		return RV_ERROR;
+		}
+	if( geoipfile != NULL  &&  (pgeoip = load_geoip(geoipfile)) == NULL )
+		{
+		free_text( ptext );
+		fprintf( stderr, "Cannot load %s (or it is not a GeoIP country database).\n", geoipfile );
+		return RV_ERROR;
+		}
+	memset( &trace, 0, sizeof(trace) );
+	if( tracefile != NULL  &&  load_trace(tracefile, &trace) != RV_OK )
+		{
+		free_text( ptext );
+		free_geoip( pgeoip );
+		fprintf( stderr, "Cannot load %s (or it has no IP addresses).\n", tracefile );
+		return RV_ERROR;
+		}
+	pref = malloc( (size_t) n * sizeof(int) );
+	pcc  = malloc( (size_t) n * sizeof(int) );
+	plat = malloc( (size_t) n * sizeof(double) );
+	if( pref == NULL  ||  pcc == NULL  ||  plat == NULL )
+		{
+		free( pref );
+		free( pcc );
+		free( plat );
+		free( trace.pip4 );
+		free( trace.pip6 );
+		free_text( ptext );
+		free_geoip( pgeoip );
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* timer overhead: the median of many back-to-back readings */
+	for( i = 0;  i < TIMER_READINGS;  i++ )
+		{
+		t = now_ns();
+		timer[i] = now_ns() - t;
+		}
+	qsort( timer, (size_t) TIMER_READINGS, sizeof(double), compare_double );
+	printf( "Timer overhead: %.0f ns (included in every latency).\n", timer[ TIMER_READINGS / 2 ] );
+
+	rv = RV_OK;
+	for( w = 0;  w < WORKLOADS  &&  rv == RV_OK;  w++ )
+		{
+		if( !wsel[w] )
+			continue;
+		if( make_keys(w, &keys, n, ptext, &trace, exponent) != RV_OK )
+			{
+			fputs( "Not enough memory.\n", stderr );
+			rv = RV_ERROR;
+			break;
+			}
+		printf( "\nWorkload %s: %li lookups per pass, %s\n"
+			"%-12s %12s %10s %10s %10s %10s\n",
+			workloads[w], n, opt_cold ? "cold" : "warm",
+			"engine", "lookups/s", "p50 ns", "p99 ns", "p99.9 ns", "max ns" );
+		pref[0] = -3;  /* signal no reference answers yet */
+		for( e = 0;  e < ENGINES  &&  rv == RV_OK;  e++ )
+			if( esel[e]  &&  (engines[e].kind == ENGINE_IP6 ? keys.n6 : keys.n4) > 0L )
+				rv = bench( &engines[e], &keys, ip4db, ptext, textfile, pgeoip, opt_cold, pref, pcc, plat );
+		free( keys.pip4 );
+		free( keys.pip6 );
+		}
+
+	free( pref );
+	free( pcc );
+	free( plat );
+	free( trace.pip4 );
+	free( trace.pip6 );
+	free_text( ptext );
+	free_geoip( pgeoip );
+	return rv;
+}
+
+
+/*
+Loads source data file "filename" (see struct s_textdb) into memory.
+Lines that don't start with a range, as "<ip-start>","<ip-end>", are
+left out.
+Returns the new struct, or NULL on error
+*/
+struct s_textdb *load_text( const char *filename )
+{
+	struct s_textdb *ptext;
+	FILE *fp;
+	long int size, lines;
+	char *ps, *pe;
+
+	fp = fopen( filename, "rb" );
+	if( fp == NULL )
+		return NULL;
+	ptext = calloc( 1, sizeof(struct s_textdb) );
+	if( ptext == NULL  ||  fseek(fp, 0L, SEEK_END) != 0  ||  (size = ftell(fp)) < 0L  ||
+	    fseek(fp, 0L, SEEK_SET) != 0  ||  (ptext->pbuf = malloc((size_t) size + 1)) == NULL  ||
+	    fread(ptext->pbuf, 1, (size_t) size, fp) != (size_t) size )
+		{
+		fclose( fp );
+		free_text( ptext );
+		return NULL;
+		}
+	fclose( fp );
+	ptext->pbuf[size] = '\0';
+
+	/* there are at most as many ranges as '\n's, plus 1 */
+	lines = 1L;
+	for( ps = ptext->pbuf;  (ps = strchr(ps, '\n')) != NULL;  ps++ )
+		lines++;
+	ptext->plines = malloc( (size_t) lines * sizeof(char *) );
+	ptext->pfrom  = malloc( (size_t) lines * sizeof(unsigned32) );
+	ptext->pto    = malloc( (size_t) lines * sizeof(unsigned32) );
+	if( ptext->plines == NULL  ||  ptext->pfrom == NULL  ||  ptext->pto == NULL )
+		{
+		free_text( ptext );
+		return NULL;
+		}
+	for( ps = ptext->pbuf;  ps != NULL;  ps = pe )
+		{
+		if( (pe = strchr(ps, '\n')) != NULL )
+			*pe++ = '\0';
+		if( ps[0] == '"'  &&  ps[1] >= '0'  &&  ps[1] <= '9' )
+			{
+			ptext->plines[ ptext->lines ] = ps;
+			ptext->pfrom[ ptext->lines ] = (unsigned32) strtoul( ps + 1, &ps, 10 );
+			if( strncmp(ps, "\",\"", 3) )
+				continue;
+			ptext->pto[ ptext->lines ] = (unsigned32) strtoul( ps + 3, NULL, 10 );
+			if( ptext->pto[ptext->lines] >= ptext->pfrom[ptext->lines] )
+				ptext->lines++;
+			}
+		}
+	if( ptext->lines == 0L )
+		{
+		free_text( ptext );
+		return NULL;
+		}
+	return ptext;
+}
+
+
+/*
+Frees "ptext" (if not NULL), as returned by load_text()
+*/
+void free_text( struct s_textdb *ptext )
+{
+	if( ptext == NULL )
+		return;
+	free( ptext->pbuf );
+	free( ptext->plines );
+	free( ptext->pfrom );
+	free( ptext->pto );
+	free( ptext );
+}
+
+
+/*
+Binary search for "ip4" in the lines of "ptext", parsing the range and
+country of each line as it is reached, as php-alone.php does (but with the
+file already in memory).
+Returns the country code of "ip4", or -1 if not found
+*/
+int find_text_country( unsigned32 ip4, const struct s_textdb *ptext )
+{
+	long int low, high, mid;
+	unsigned long int num1, num2;
+	char *ps, ccstr[3];
+
+	low = 0L;
+	high = ptext->lines - 1;
+	while( low <= high )
+		{
+		mid = (low + high) / 2;
+		ps = ptext->plines[ mid ];
+		num1 = strtoul( ps + 1, &ps, 10 );
+		num2 = strtoul( ps + 3, &ps, 10 );
+		if( num1 <= ip4  &&  ip4 <= num2 )
+			{
+			ccstr[0] = ps[3];
+			ccstr[1] = ps[4];
+			ccstr[2] = '\0';
+			return find_cc( ccstr );
+			}
+		if( ip4 < num1 )
+			high = mid - 1;
+		else
+			low = mid + 1;
+		}
+	return -1;
+}
+
+
+/*
+Loads the IP addresses at the start of the lines of trace file "filename"
+into "ptrace" (IPv4-compatible and IPv4-mapped IPv6 addresses as IPv4
+ones). Lines without one are left out.
+Returns RV_OK, or RV_ERROR on error (or if there were none)
+*/
+int load_trace( const char *filename, struct s_keys *ptrace )
+{
+	char buf[BUFSIZ];
+	unsigned32 ip6[4];
+	long int max4, max6;
+	void *p;
+	FILE *fp;
+	size_t len;
+
+	fp = fopen( filename, "r" );
+	if( fp == NULL )
+		return RV_ERROR;
+	max4 = max6 = 0L;
+	while( fgets(buf, (int) sizeof(buf), fp) != NULL )
+		{
+		len = strcspn( buf, " \t,;\r\n" );
+		if( ptrace->n4 == max4 )
+			{
+			p = realloc( ptrace->pip4, (size_t) (max4 = 2 * max4 + 1024L) * sizeof(unsigned32) );
+			if( p == NULL )
+				break;
+			ptrace->pip4 = p;
+			}
+		if( ptrace->n6 == max6 )
+			{
+			p = realloc( ptrace->pip6, (size_t) (max6 = 2 * max6 + 1024L) * 4 * sizeof(unsigned32) );
+			if( p == NULL )
+				break;
+			ptrace->pip6 = p;
+			}
+		if( memchr(buf, ':', len) == NULL )
+			{
+			if( parse_ip4(buf, len, &ptrace->pip4[ptrace->n4]) == len )
+				ptrace->n4++;
+			}
+		else if( parse_ip6(buf, len, ip6) == len )
+			{
+			if( IP6_IS_IP4(ip6) )
+				ptrace->pip4[ ptrace->n4++ ] = ip6[0];
+			else
+				memcpy( &ptrace->pip6[4 * ptrace->n6++], ip6, sizeof(ip6) );
+			}
+		}
+	if( ferror(fp)  ||  !feof(fp)  ||  ptrace->n4 + ptrace->n6 == 0L )
+		{
+		fclose( fp );
+		return RV_ERROR;
+		}
+	fclose( fp );
+	return RV_OK;
+}
+
+
+/*
+Generates the keys of "workload" (WORKLOAD_UNIFORM, ...) into "pk":
+"n" IPv4 addresses, and "n" IPv6 ones for the uniform and trace workloads
+(none for the trace workload if "ptrace" has none). The weighted and zipf
+workloads sample the ranges of "ptext"; the trace one repeats "ptrace";
+the zipf one uses "exponent".
+Returns RV_OK, or RV_ERROR if there's not enough memory
+*/
+int make_keys( int workload, struct s_keys *pk, long int n, const struct s_textdb *ptext,
+	       const struct s_keys *ptrace, double exponent )
+{
+	unsigned64 *pcum = NULL;	/* sizes of the ranges of "ptext", added up */
+	double *pzcum = NULL;		/* probabilities of the zipf keys, added up */
+	unsigned32 *pzkeys = NULL;	/* zipf keys, by rank */
+	unsigned32 x;			/* xorshift random generator state */
+	double u;
+	long int i, low, high, mid;
+
+	memset( pk, 0, sizeof(struct s_keys) );
+	pk->n4 = n;
+	if( workload == WORKLOAD_UNIFORM  ||  (workload == WORKLOAD_TRACE  &&  ptrace->n6 > 0L) )
+		pk->n6 = n;
+	if( (pk->pip4 = malloc((size_t) pk->n4 * sizeof(unsigned32))) == NULL  ||
+	    (pk->n6  &&  (pk->pip6 = malloc((size_t) pk->n6 * 4 * sizeof(unsigned32))) == NULL) )
+		{
+		free( pk->pip4 );
+		return RV_ERROR;
+		}
+
+	x = 5;
+	switch( workload )
+		{
+		case WORKLOAD_UNIFORM:
+			for( i = 0L;  i < n;  i++ )
+				pk->pip4[i] = next_random( &x );
+			for( i = 0L;  i < n;  i++ )
+				{
+				pk->pip6[4*i+3] = (next_random(&x) & (unsigned32) 0x1FFFFFFFU) | (unsigned32) 0x20000000U;
+				pk->pip6[4*i+2] = next_random( &x );
+				pk->pip6[4*i+1] = next_random( &x );
+				pk->pip6[4*i]   = next_random( &x );
+				}
+			break;
+		case WORKLOAD_WEIGHTED:
+		case WORKLOAD_ZIPF:
+			pcum = malloc( (size_t) ptext->lines * sizeof(unsigned64) );
+			if( pcum == NULL )
+				break;
+			for( i = 0L;  i < ptext->lines;  i++ )
+				pcum[i] = (i ? pcum[i-1] : (unsigned64) 0U) + (ptext->pto[i] - ptext->pfrom[i]) + 1U;
+			if( workload == WORKLOAD_WEIGHTED )
+				{
+				for( i = 0L;  i < n;  i++ )
+					pk->pip4[i] = sample_range( ptext, pcum, &x );
+				break;
+				}
+			pzcum  = malloc( (size_t) ZIPF_KEYS * sizeof(double) );
+			pzkeys = malloc( (size_t) ZIPF_KEYS * sizeof(unsigned32) );
+			if( pzcum == NULL  ||  pzkeys == NULL )
+				break;
+			for( i = 0L;  i < ZIPF_KEYS;  i++ )
+				{
+				pzkeys[i] = sample_range( ptext, pcum, &x );
+				pzcum[i] = (i ? pzcum[i-1] : 0.0) + pow( (double) (i + 1), -exponent );
+				}
+			for( i = 0L;  i < n;  i++ )
+				{
+				/* rank of the first added up probability above "u" */
+				u = next_random( &x ) / 4294967296.0 * pzcum[ ZIPF_KEYS - 1 ];
+				low = 0L;
+				high = ZIPF_KEYS - 1;
+				while( low < high )
+					{
+					mid = (low + high) / 2;
+					if( pzcum[mid] <= u )
+						low = mid + 1;
+					else
+						high = mid;
+					}
+				pk->pip4[i] = pzkeys[ low ];
+				}
+			break;
+		case WORKLOAD_TRACE:
+			for( i = 0L;  i < n;  i++ )
+				pk->pip4[i] = ptrace->n4 ? ptrace->pip4[ i % ptrace->n4 ] : (unsigned32) 0U;
+			if( !ptrace->n4 )
+				pk->n4 = 0L;
+			for( i = 0L;  i < pk->n6;  i++ )
+				memcpy( &pk->pip6[4*i], &ptrace->pip6[4 * (i % ptrace->n6)], 4 * sizeof(unsigned32) );
+			break;
+		}
+	if( workload == WORKLOAD_WEIGHTED  ||  workload == WORKLOAD_ZIPF )
+		{
+		free( pcum );
+		free( pzcum );
+		free( pzkeys );
+		if( pcum == NULL  ||  (workload == WORKLOAD_ZIPF  &&  (pzcum == NULL  ||  pzkeys == NULL)) )
+			{
+			free( pk->pip4 );
+			free( pk->pip6 );
+			return RV_ERROR;
+			}
+		}
+	return RV_OK;
+}
+
+
+/*
+Picks an address from the ranges of "ptext", each address equally
+likely, with "pcum" as set up by make_keys() and "px" as for
+next_random().
+Returns the address
+*/
+unsigned32 sample_range( const struct s_textdb *ptext, const unsigned64 *pcum, unsigned32 *px )
+{
+	unsigned64 r;
+	long int low, high, mid;
+
+	r = ( ((unsigned64) next_random(px) << 32) | (unsigned64) next_random(px) ) % pcum[ ptext->lines - 1 ];
+	/* first range whose added up size is above "r" */
+	low = 0L;
+	high = ptext->lines - 1;
+	while( low < high )
+		{
+		mid = (low + high) / 2;
+		if( pcum[mid] <= r )
+			low = mid + 1;
+		else
+			high = mid;
+		}
+	return ptext->pto[low] - (unsigned32) (pcum[low] - 1U - r);
+}
+
+
+/*
+Runs the throughput and the latency passes of engine "pe" over keys "pk"
+(see the top of this file), and outputs their results. The first engine
+run on these keys stores its answers in pref[] (if pref[0] is -3), and
+the others are checked against them. "pcc" and "plat" hold the answers
+and latencies of each pass.
+Returns RV_OK or RV_ERROR
+*/
+int bench( const struct s_engine *pe, const struct s_keys *pk, const char *ip4db,
+	   const struct s_textdb *ptext, const char *textfile, const struct s_geoip *pgeoip,
+	   int cold, int *pref, int *pcc, double *plat )
+{
+	static const double percentiles[BENCH_PERCENTILES] = { 0.50, 0.99, 0.999 };
+	struct s_run run;
+	long int n, i, j, differ;
+	double t0, t1, tput;
+	int pass;
+
+	n = pe->kind == ENGINE_IP6 ? pk->n6 : pk->n4;
+	tput = 0.0;
+	for( pass = 0;  pass < 2;  pass++ )
+		{
+		if( cold )
+			{
+			drop_cache( ip4db, "" );
+			drop_cache( ip4db, JUMP_SUFFIX4 );
+			drop_cache( ip4db, TRIE_SUFFIX4 );
+			drop_cache( DBFILE6, "" );
+			if( textfile != NULL )
+				drop_cache( textfile, "" );
+			}
+		if( open_run(&run, pe, ip4db, ptext, pgeoip) != RV_OK )
+			{
+			fprintf( stderr, "Cannot open the database of engine %s.\n", pe->name );
+			return RV_ERROR;
+			}
+		if( !cold )
+			run_keys( &run, pk, 0L, n, pcc );  /* warm-up */
+		if( pass == 0 )
+			{
+			t0 = now_ns();
+			run_keys( &run, pk, 0L, n, pcc );
+			t1 = now_ns();
+			tput = n / ((t1 - t0) / 1e9);
+			}
+		else if( pe->kind == ENGINE_BATCH )
+			{
+			for( i = 0L;  i < n;  i += BENCH_BATCH )
+				{
+				j = i + BENCH_BATCH < n ? i + BENCH_BATCH : n;
+				t0 = now_ns();
+				run_keys( &run, pk, i, j, pcc );
+				t1 = now_ns();
+				while( j > i )
+					plat[--j] = (t1 - t0) / BENCH_BATCH;
+				}
+			}
+		else
+			{
+			for( i = 0L;  i < n;  i++ )
+				{
+				t0 = now_ns();
+				run_keys( &run, pk, i, i + 1, pcc );
+				plat[i] = now_ns() - t0;
+				}
+			}
+		close_run( &run );
+		}
+
+	qsort( plat, (size_t) n, sizeof(double), compare_double );
+	printf( "%-12s %12.0f", pe->name, tput );
+	for( i = 0L;  i < BENCH_PERCENTILES;  i++ )
+		printf( " %10.0f", plat[ (long int) (n * percentiles[i]) ] );
+	printf( " %10.0f\n", plat[ n - 1 ] );
+	fflush( stdout );
+
+	if( pe->kind == ENGINE_IP6 )
+		return RV_OK;
+	if( pref[0] == -3 )
+		{
+		memcpy( pref, pcc, (size_t) n * sizeof(int) );
+		return RV_OK;
+		}
+	for( differ = i = 0L;  i < n;  i++ )
+		differ += pcc[i] != pref[i];
+	if( differ  &&  pe->kind != ENGINE_TEXT  &&  pe->kind != ENGINE_GEOIP )
+		{
+		fprintf( stderr, "Internal error: engine %s differs from the first one in %li lookups.\n", pe->name, differ );
+		return RV_ERROR;
+		}
+	if( differ )
+		printf( "%-12s (%li answers differ from the first engine's)\n", "", differ );
+	return RV_OK;
+}
+
+
+/*
+Opens engine "pe" into "pr", on IPv4 database "ip4db", or on DBFILE6, or
+on "ptext" or "pgeoip".
+Returns RV_OK or RV_ERROR
+*/
+int open_run( struct s_run *pr, const struct s_engine *pe, const char *ip4db,
+	      const struct s_textdb *ptext, const struct s_geoip *pgeoip )
+{
+	memset( pr, 0, sizeof(struct s_run) );
+	pr->pe = pe;
+	switch( pe->kind )
+		{
+		case ENGINE_IP6:
+			pr->fp6 = fopen( DBFILE6, "rb" );
+			if( pr->fp6 == NULL )
+				return RV_ERROR;
+			setbuf( pr->fp6, NULL );  /* turn off buffering, as ip2cc does */
+			return RV_OK;
+		case ENGINE_TEXT:
+			pr->ptext = ptext;
+			return RV_OK;
+		case ENGINE_GEOIP:
+			pr->pgeoip = pgeoip;
+			return RV_OK;
+		}
+	pr->pdb = open_ip4_db( ip4db, pe->mode );
+	if( pr->pdb == NULL )
+		return RV_ERROR;
+	if( pe->kind == ENGINE_CACHED  &&  (pr->pcache = open_ip4_cache(pr->pdb, (size_t) IP4CACHE_ENTRIES)) == NULL )
+		{
+		close_ip4_db( pr->pdb );
+		return RV_ERROR;
+		}
+	return RV_OK;
+}
+
+
+/*
+Closes what open_run() opened into "pr"
+*/
+void close_run( struct s_run *pr )
+{
+	if( pr->pcache != NULL )
+		close_ip4_cache( pr->pcache );
+	if( pr->pdb != NULL )
+		close_ip4_db( pr->pdb );
+	if( pr->fp6 != NULL )
+		fclose( pr->fp6 );
+}
+
+
+/*
+Looks up keys "from" to "to"-1 of "pk" (the IPv6 ones, for the ip6
+engine) with the engine open in "pr", into the same entries of pcc[]
+*/
+void run_keys( const struct s_run *pr, const struct s_keys *pk, long int from, long int to, int *pcc )
+{
+	long int i;
+
+	switch( pr->pe->kind )
+		{
+		case ENGINE_DB:
+			for( i = from;  i < to;  i++ )
+				pcc[i] = find_ip4_country_db( pk->pip4[i], pr->pdb );
+			break;
+		case ENGINE_BATCH:
+			find_ip4_countries_db( pk->pip4 + from, pcc + from, (size_t) (to - from), pr->pdb );
+			break;
+		case ENGINE_CACHED:
+			for( i = from;  i < to;  i++ )
+				pcc[i] = find_ip4_country_cached( pk->pip4[i], pr->pcache );
+			break;
+		case ENGINE_IP6:
+			for( i = from;  i < to;  i++ )
+				pcc[i] = find_ip6_country( &pk->pip6[4*i], pr->fp6 );
+			break;
+		case ENGINE_TEXT:
+			for( i = from;  i < to;  i++ )
+				pcc[i] = find_text_country( pk->pip4[i], pr->ptext );
+			break;
+		case ENGINE_GEOIP:
+			for( i = from;  i < to;  i++ )
+				pcc[i] = find_geoip_country( pk->pip4[i], pr->pgeoip );
+			break;
+		}
+}
+
+
+/*
+Drops file "filename" with "suffix" appended (if it exists) from the page
+cache, so that it's read from disk again. Pages of it still mapped by
+another process are kept.
+*/
+void drop_cache( const char *filename, const char *suffix )
+{
+	char name[FILENAME_MAX];
+	int fd;
+
+	if( strlen(filename) + strlen(suffix) >= sizeof(name) )
+		return;
+	strcpy( name, filename );
+	strcat( name, suffix );
+	fd = open( name, O_RDONLY );
+	if( fd < 0 )
+		return;
+	posix_fadvise( fd, (off_t) 0, (off_t) 0, POSIX_FADV_DONTNEED );
+	close( fd );
+}
+
+
+/*
+Returns 1 (true) if file "filename" with "suffix" appended can be read,
+or 0 (false) if not
+*/
+int file_exists( const char *filename, const char *suffix )
+{
+	char name[FILENAME_MAX];
+	FILE *fp;
+
+	if( strlen(filename) + strlen(suffix) >= sizeof(name) )
+		return 0;  /* false */
+	strcpy( name, filename );
+	strcat( name, suffix );
+	fp = fopen( name, "rb" );
+	if( fp == NULL )
+		return 0;  /* false */
+	fclose( fp );
+	return 1;  /* true */
+}
+
+
+/*
+Advances the xorshift random generator state at "px".
+Returns its new value
+*/
+unsigned32 next_random( unsigned32 *px )
+{
+	unsigned32 x = *px;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *px = x;
+}
+
+
+/*
+Returns the time of a monotonic clock, in nanoseconds
+*/
+double now_ns( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+
+/*
+qsort() comparison function for doubles
+*/
+int compare_double( const void *p1, const void *p2 )
+{
+	double d1 = *(const double *) p1, d2 = *(const double *) p2;
+
+	return d1 < d2 ? -1 : d1 > d2;
+}
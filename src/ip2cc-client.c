@@ -0,0 +1,515 @@
+/*
+ip2cc-client.c
+ANSI C
+POSIX.1 (Unix domain sockets, clock_gettime())
+(C) 2003 Corebase, Easymatic, Cynergi, Pedro Freire
+
+Client (and load generator) for ip2cc --serve and --serve-shm (see
+ip2cc.c). This can be called with:
+	[-u] [-M] [-s <socket>] <ip>...
+	[-M] [-s <socket>] -l [-r <requests>] [-k <keys>] [-d <depth>]
+	-x <program> -l [-r <requests>] [-k <keys>]
+
+-s	Connect to this Unix domain socket (default SOCKFILE, see ip2cc.h), or
+	with -M, to this shared memory segment (default SHMFILE)
+-M	Connect to ip2cc --serve-shm, instead of ip2cc --serve
+-x	With -l, run <program> for each request, with its IPs as arguments,
+	instead of connecting to a server (to compare with running ip2cc)
+-u	Output country codes in UPPERCASE (default is lowercase)
+-l	Instead of looking up the <ip> arguments, send <requests> requests
+	(default 100000) of <keys> random IPv4 addresses each (default 64),
+	with up to <depth> requests in flight at any time (default 16; always
+	1 with -M or -x), and output the requests per second and their latency
+	percentiles
+
+Each <ip> is an IPv4 or IPv6 address, looked up in a single request, and
+one line is output for each, in the same order, as ip2cc does. Through
+shared memory (-M), only IPv4 addresses are looked up, and IPv6 ones are
+not found.
+
+The return value is one of:
+	0 -> ok
+	1 -> any error
+
+To compile it with GCC (it also needs libip2cc, for parse_ip4() and the
+others):
+
+	gcc -O2 -Wall -DNDEBUG ip2cc-client.c libip2cc.c -o ip2cc-client
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+#include "ip2cc.h"
+
+
+/* System return values:
+*/
+#define RV_OK			0
+#define RV_ERROR		1
+
+
+/* Function prototypes
+*/
+int connect_server( const char *sockfile );
+int lookup( int fd, char **pargs, int n, int uppercase );
+int lookup_shm( struct s_ip4shm *pshm, char **pargs, int n, int uppercase );
+int load( int fd, struct s_ip4shm *pshm, const char *program, long int requests, int keys, int depth );
+int run_program( const char *program, const unsigned32 *pip4, int n );
+int write_all( int fd, const void *p, size_t size );
+int read_all( int fd, void *p, size_t size );
+double now_us( void );
+int compare_double( const void *p1, const void *p2 );
+
+
+/* Main
+*/
+int main( int argc, char *argv[] )
+{
+	const char *sockfile = NULL;
+	const char *program = NULL;
+	int opt_uppercase = 0;  /* default: return ISO2 code in lower-case */
+	int opt_load = 0;	/* default: look up the arguments */
+	int opt_shm = 0;	/* default: connect to ip2cc --serve */
+	long int requests = 100000L;
+	int keys = 64, depth = 16;
+	struct s_ip4shm *pshm;
+	char *pexe;
+	int fd, i, rv;
+
+	pexe = argv[0];
+	for( i = 1;  i < argc  &&  argv[i][0] == '-'  &&  argv[i][1];  i++ )
+		{
+		if( !strcmp(argv[i], "-u") )
+			opt_uppercase = 1;  /* true */
+		else if( !strcmp(argv[i], "-l") )
+			opt_load = 1;  /* true */
+		else if( !strcmp(argv[i], "-M") )
+			opt_shm = 1;  /* true */
+		else if( !strcmp(argv[i], "-x")  &&  i+1 < argc )
+			program = argv[++i];
+		else if( !strcmp(argv[i], "-s")  &&  i+1 < argc )
+			sockfile = argv[++i];
+		else if( !strcmp(argv[i], "-r")  &&  i+1 < argc )
+			requests = atol( argv[++i] );
+		else if( !strcmp(argv[i], "-k")  &&  i+1 < argc )
+			keys = atoi( argv[++i] );
+		else if( !strcmp(argv[i], "-d")  &&  i+1 < argc )
+			depth = atoi( argv[++i] );
+		else
+			break;  /* bad option */
+		}
+	if( (opt_load ? i < argc : i >= argc)  ||  (program != NULL  &&  (!opt_load  ||  opt_shm))  ||
+	    requests < 1L  ||  keys < 1  ||  keys > SERVE_MAXKEYS  ||  depth < 1 )
+		{
+		fprintf( stderr, "Usage: %s [-u] [-M] [-s <socket>] <ip>...\n"
+				 "       %s [-M] [-s <socket>] -l [-r <requests>] [-k <keys>] [-d <depth>]\n"
+				 "       %s -x <program> -l [-r <requests>] [-k <keys>]\n"
+				 "(<keys> from 1 to %i)\n",
+				 pexe, pexe, pexe, SERVE_MAXKEYS );
+		return RV_ERROR;
+		}
+
+	if( program != NULL )
+		return load( -1, NULL, program, requests, keys, depth );
+	if( opt_shm )
+		{
+		if( sockfile == NULL )
+			sockfile = SHMFILE;
+		pshm = open_ip4_shm( sockfile );
+		if( pshm == NULL )
+			{
+			fprintf( stderr, "Cannot attach to %s (or no free slot in it).\n", sockfile );
+			return RV_ERROR;
+			}
+		rv = opt_load ? load( -1, pshm, NULL, requests, keys, depth ) :
+				lookup_shm( pshm, argv + i, argc - i, opt_uppercase );
+		close_ip4_shm( pshm );
+		return rv;
+		}
+	if( sockfile == NULL )
+		sockfile = SOCKFILE;
+	fd = connect_server( sockfile );
+	if( fd < 0 )
+		{
+		perror( sockfile );
+		return RV_ERROR;
+		}
+	rv = opt_load ? load( fd, NULL, NULL, requests, keys, depth ) :
+			lookup( fd, argv + i, argc - i, opt_uppercase );
+	close( fd );
+	return rv;
+}
+
+
+/*
+Returns a socket connected to the server at "sockfile",
+or -1 on error
+*/
+int connect_server( const char *sockfile )
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if( strlen(sockfile) >= sizeof(addr.sun_path) )
+		return -1;
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, sockfile );
+	fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fd < 0 )
+		return -1;
+	if( connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 )
+		{
+		close( fd );
+		return -1;
+		}
+	return fd;
+}
+
+
+/*
+Looks up the "n" IPs in "pargs[]" in a single request, and outputs their
+country codes, as ip2cc does.
+Returns RV_OK or RV_ERROR
+*/
+int lookup( int fd, char **pargs, int n, int uppercase )
+{
+	struct s_servereq req;
+	struct s_serveresp resp;
+	unsigned32 *pkeys;	/* IPv4 keys first, then IPv6 ones */
+	unsigned16 *pcc;
+	int *pslot;		/* key index of each argument (-1 - index for IPv6) */
+	int i, j, rv;
+
+	if( n > SERVE_MAXKEYS )
+		{
+		fputs( "Too many IPs for a single request.\n", stderr );
+		return RV_ERROR;
+		}
+	pkeys = malloc( (size_t) n * 5 * sizeof(unsigned32) );
+	pcc   = malloc( (size_t) n * sizeof(unsigned16) );
+	pslot = malloc( (size_t) n * sizeof(int) );
+	if( pkeys == NULL  ||  pcc == NULL  ||  pslot == NULL )
+		{
+		free( pkeys );
+		free( pcc );
+		free( pslot );
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* IPv4 keys are put at the start of "pkeys", IPv6 ones
+	   from its n-th entry on, and then moved after the IPv4 ones */
+	req.id = 0;
+	req.n4 = req.n6 = 0;
+	rv = RV_OK;
+	for( i = 0;  i < n  &&  rv == RV_OK;  i++ )
+		{
+		if( !strchr(pargs[i], ':') )
+			{
+			if( !parse_ip4(pargs[i], strlen(pargs[i]), &pkeys[req.n4]) )
+				{
+				fputs( "Bad IPv4 number or bad argument.\n", stderr );
+				rv = RV_ERROR;
+				}
+			pslot[i] = req.n4++;
+			}
+		else
+			{
+			if( !parse_ip6(pargs[i], strlen(pargs[i]), &pkeys[n + 4*req.n6]) )
+				{
+				fputs( "Bad IPv6 number or bad argument.\n", stderr );
+				rv = RV_ERROR;
+				}
+			pslot[i] = -1 - req.n6++;
+			}
+		}
+	if( rv == RV_OK )
+		{
+		memmove( &pkeys[req.n4], &pkeys[n], 4 * (size_t) req.n6 * sizeof(unsigned32) );
+		if( write_all(fd, &req, sizeof(req))  ||
+		    write_all(fd, pkeys, (req.n4 + 4 * (size_t) req.n6) * sizeof(unsigned32))  ||
+		    read_all(fd, &resp, sizeof(resp))  ||
+		    resp.n != n  ||
+		    read_all(fd, pcc, (size_t) n * sizeof(unsigned16)) )
+			{
+			fputs( "Bad response from server.\n", stderr );
+			rv = RV_ERROR;
+			}
+		}
+	for( i = 0;  i < n  &&  rv == RV_OK;  i++ )
+		{
+		j = pslot[i] >= 0 ? pslot[i] : req.n4 - 1 - pslot[i];
+		puts( get_cc_name(pcc[j] == SERVE_NONE ? -1 : (int) pcc[j], uppercase) );
+		}
+	free( pkeys );
+	free( pcc );
+	free( pslot );
+	return rv;
+}
+
+
+/*
+Looks up the "n" IPs in "pargs[]" one by one, through the shared memory
+rings of "pshm", and outputs their country codes, as ip2cc does.
+Returns RV_OK or RV_ERROR
+*/
+int lookup_shm( struct s_ip4shm *pshm, char **pargs, int n, int uppercase )
+{
+	unsigned32 ip4, ip6[4];
+	int i, cc;
+
+	for( i = 0;  i < n;  i++ )
+		{
+		if( !strchr(pargs[i], ':') )
+			{
+			if( !parse_ip4(pargs[i], strlen(pargs[i]), &ip4) )
+				{
+				fputs( "Bad IPv4 number or bad argument.\n", stderr );
+				return RV_ERROR;
+				}
+			}
+		else
+			{
+			if( !parse_ip6(pargs[i], strlen(pargs[i]), ip6) )
+				{
+				fputs( "Bad IPv6 number or bad argument.\n", stderr );
+				return RV_ERROR;
+				}
+			if( !IP6_IS_IP4(ip6) )
+				{
+				puts( "??" );  /* IPv6 not served this way */
+				continue;
+				}
+			ip4 = ip6[0];  /* an IPv4 within an IPv6 */
+			}
+		cc = find_ip4_country_shm( ip4, pshm );
+		if( cc == -3 )
+			{
+			fputs( "Lookup service is gone.\n", stderr );
+			return RV_ERROR;
+			}
+		puts( get_cc_name(cc, uppercase) );
+		}
+	return RV_OK;
+}
+
+
+/*
+Sends "requests" requests of "keys" random IPv4 addresses each, and
+outputs how many requests per second were answered, and the percentiles
+of their latency. The requests go to the server on socket "fd" (if not
+-1), with up to "depth" of them in flight at any time; or else through the
+shared memory rings of "pshm" (if not NULL), or else to a new process
+running "program" for each request, one at a time.
+Returns RV_OK or RV_ERROR
+*/
+int load( int fd, struct s_ip4shm *pshm, const char *program, long int requests, int keys, int depth )
+{
+	struct s_servereq req;
+	struct s_serveresp resp;
+	unsigned32 *pbuf;	/* request, then response */
+	int *pcc;		/* country codes, if not through a socket */
+	double *psent;		/* time each request was sent, in us */
+	double *plat;		/* latency of each request, in us */
+	double t0, t1;
+	unsigned32 x;
+	long int sent, received;
+	int k, rv;
+
+	if( fd < 0 )
+		depth = 1;
+	if( (double) depth * (sizeof(resp) + keys * sizeof(unsigned16)) > (double) SERVE_MAXKEYS * 4 * sizeof(unsigned32) )
+		{
+		/* keep the responses in flight within what the server buffers,
+		   as these blocking writes don't read them meanwhile */
+		fputs( "Too many keys in flight (lower -k or -d).\n", stderr );
+		return RV_ERROR;
+		}
+	pbuf  = malloc( (size_t) keys * sizeof(unsigned32) );
+	pcc   = malloc( (size_t) keys * sizeof(int) );
+	psent = malloc( (size_t) requests * sizeof(double) );
+	plat  = malloc( (size_t) requests * sizeof(double) );
+	if( pbuf == NULL  ||  pcc == NULL  ||  psent == NULL  ||  plat == NULL )
+		{
+		free( pbuf );
+		free( pcc );
+		free( psent );
+		free( plat );
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+
+	x = 5;  /* xorshift random generator state */
+	req.n4 = (unsigned16) keys;
+	req.n6 = 0;
+	sent = received = 0L;
+	rv = RV_OK;
+	t0 = now_us();
+	while( received < requests  &&  rv == RV_OK )
+		{
+		while( sent < requests  &&  sent - received < depth )
+			{
+			for( k = 0;  k < keys;  k++ )
+				{
+				x ^= x << 13;
+				x ^= x >> 17;
+				x ^= x << 5;
+				pbuf[k] = x;
+				}
+			req.id = (unsigned32) sent;
+			psent[sent] = now_us();
+			if( fd < 0 )
+				break;
+			if( write_all(fd, &req, sizeof(req))  ||
+			    write_all(fd, pbuf, (size_t) keys * sizeof(unsigned32)) )
+				break;
+			sent++;
+			}
+		if( fd >= 0 )
+			{
+			if( read_all(fd, &resp, sizeof(resp))  ||
+			    resp.id >= (unsigned32) sent  ||  resp.n != keys  ||
+			    read_all(fd, pbuf, (size_t) keys * sizeof(unsigned16)) )
+				{
+				fputs( "Bad response from server.\n", stderr );
+				rv = RV_ERROR;
+				}
+			}
+		else
+			{
+			resp.id = (unsigned32) sent++;
+			if( pshm != NULL )
+				{
+				find_ip4_countries_shm( pbuf, pcc, (size_t) keys, pshm );
+				if( pcc[0] == -3 )
+					{
+					fputs( "Lookup service is gone.\n", stderr );
+					rv = RV_ERROR;
+					}
+				}
+			else if( run_program(program, pbuf, keys) != 0 )
+				{
+				fprintf( stderr, "Cannot run %s.\n", program );
+				rv = RV_ERROR;
+				}
+			}
+		plat[received++] = now_us() - psent[resp.id];
+		}
+	t1 = now_us();
+
+	if( rv == RV_OK )
+		{
+		qsort( plat, (size_t) requests, sizeof(double), compare_double );
+		printf( "%li requests of %i IPv4 addresses, up to %i in flight: %.0f requests per second (%.0f lookups per second).\n",
+			requests, keys, depth, requests / ((t1 - t0) / 1e6), requests * (double) keys / ((t1 - t0) / 1e6) );
+		printf( "Latency: p50 %.2f us, p99 %.2f us, max %.2f us.\n",
+			plat[ requests / 2 ], plat[ requests * 99 / 100 ], plat[ requests - 1 ] );
+		}
+	free( pbuf );
+	free( pcc );
+	free( psent );
+	free( plat );
+	return rv;
+}
+
+
+/*
+Runs "program" with the "n" IPv4 addresses at "pip4" as arguments (as a
+web server would, to look them up), and discards its output.
+Returns 0 if ok, or -1 on error
+*/
+int run_program( const char *program, const unsigned32 *pip4, int n )
+{
+	char *pcmd, *ps;
+	char buf[BUFSIZ];
+	FILE *fp;
+	int i;
+
+	pcmd = malloc( strlen(program) + (size_t) n * 16 + 1 );
+	if( pcmd == NULL )
+		return -1;
+	ps = pcmd + sprintf( pcmd, "%s", program );
+	for( i = 0;  i < n;  i++ )
+		ps += sprintf( ps, " %u.%u.%u.%u",
+			       (unsigned int) (pip4[i] >> 24), (unsigned int) (pip4[i] >> 16) & 0xFFU,
+			       (unsigned int) (pip4[i] >> 8) & 0xFFU, (unsigned int) pip4[i] & 0xFFU );
+	fp = popen( pcmd, "r" );
+	free( pcmd );
+	if( fp == NULL )
+		return -1;
+	while( fread(buf, 1, sizeof(buf), fp) > 0 )
+		;
+	return pclose( fp ) == 0 ? 0 : -1;
+}
+
+
+/*
+Writes all "size" bytes at "p" to socket "fd".
+Returns 0 if ok, or -1 on error
+*/
+int write_all( int fd, const void *p, size_t size )
+{
+	ssize_t n;
+
+	while( size )
+		{
+		n = write( fd, p, size );
+		if( n <= 0 )
+			return -1;
+		p = (const char *) p + n;
+		size -= (size_t) n;
+		}
+	return 0;
+}
+
+
+/*
+Reads exactly "size" bytes from socket "fd" into "p".
+Returns 0 if ok, or -1 on error (or if the server closed the connection)
+*/
+int read_all( int fd, void *p, size_t size )
+{
+	ssize_t n;
+
+	while( size )
+		{
+		n = read( fd, p, size );
+		if( n <= 0 )
+			return -1;
+		p = (char *) p + n;
+		size -= (size_t) n;
+		}
+	return 0;
+}
+
+
+/*
+Returns the time of a monotonic clock, in microseconds
+*/
+double now_us( void )
+{
+	struct timespec ts;
+
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+/*
+qsort() comparison function for doubles
+*/
+int compare_double( const void *p1, const void *p2 )
+{
+	double d1 = *(const double *) p1, d2 = *(const double *) p2;
+
+	return d1 < d2 ? -1 : d1 > d2;
+}
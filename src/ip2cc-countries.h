@@ -64,66 +64,79 @@ const char *cname_low[] = {
 #define CNAME_SIZE  ( sizeof(cname_low) / sizeof(cname_low[0]) )
 
 
-/* Returns the country code of "ccstr",
-   or -1 if not found
+/* Country code of each 2-letter ISO code, by its first and second letters
+   ('a' to 'z'), or -1 if none; old codes "cs", "tp" and "uk" have those of
+   "cz", "tl" and "gb"
+*/
+const short int cname_index[26][26] = {
+	/* a */ {  -1,  -1,  -1,   0,   1,   2,   3,  -1,   4,  -1,  -1,   5,   6,
+		    7,   8,  -1,   9,  10,  11,  12,  13,  -1,  14,  -1,  -1,  15 },
+	/* b */ {  16,  17,  -1,  18,  19,  20,  21,  22,  23,  24,  -1,  -1,  25,
+		   26,  27,  -1,  -1,  28,  29,  30,  -1,  31,  32,  -1,  33,  34 },
+	/* c */ {  35,  -1,  36,  37,  -1,  38,  39,  40,  41,  -1,  42,  43,  44,
+		   45,  46,  -1,  -1,  47,  52,  -1,  48,  49,  -1,  50,  51,  52 },
+	/* d */ {  -1,  -1,  -1,  -1,  53,  -1,  -1,  -1,  -1,  54,  55,  -1,  56,
+		   -1,  57,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  58 },
+	/* e */ {  -1,  -1,  59,  -1,  60,  -1,  61,  62,  -1,  -1,  -1,  -1,  -1,
+		   -1,  -1,  -1,  -1,  63,  64,  65,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* f */ {  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  66,  67,  68,  -1,  69,
+		   -1,  70,  -1,  -1,  71,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* g */ {  72,  73,  -1,  74,  75,  76,  -1,  77,  78,  -1,  -1,  79,  80,
+		   81,  -1,  82,  83,  84,  85,  86,  87,  -1,  88,  -1,  89,  -1 },
+	/* h */ {  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  90,  -1,  91,
+		   92,  -1,  -1,  -1,  93,  -1,  94,  95,  -1,  -1,  -1,  -1,  -1 },
+	/* i */ {  -1,  -1,  -1,  96,  97,  -1,  -1,  -1,  -1,  -1,  -1,  98,  -1,
+		   99, 100,  -1, 101, 102, 103, 104,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* j */ {  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, 105,
+		   -1, 106, 107,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* k */ {  -1,  -1,  -1,  -1, 108,  -1, 109, 110, 111,  -1,  -1,  -1, 112,
+		  113,  -1, 114,  -1, 115,  -1,  -1,  -1,  -1, 116,  -1, 117, 118 },
+	/* l */ { 119, 120, 121,  -1,  -1,  -1,  -1,  -1, 122,  -1, 123,  -1,  -1,
+		   -1,  -1,  -1,  -1, 124, 125, 126, 127, 128,  -1,  -1, 129,  -1 },
+	/* m */ { 130,  -1, 131, 132,  -1,  -1, 133, 134,  -1,  -1, 135, 136, 137,
+		  138, 139, 140, 141, 142, 143, 144, 145, 146, 147, 148, 149, 150 },
+	/* n */ { 151,  -1, 152,  -1, 153, 154, 155,  -1, 156,  -1,  -1, 157,  -1,
+		   -1, 158, 159,  -1, 160,  -1,  -1, 161,  -1,  -1,  -1,  -1, 162 },
+	/* o */ {  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, 163,
+		   -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* p */ { 164,  -1,  -1,  -1, 165, 166, 167, 168,  -1,  -1, 169, 170, 171,
+		  172,  -1,  -1,  -1, 173, 174, 175,  -1,  -1, 176,  -1, 177,  -1 },
+	/* q */ { 178,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+		   -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* r */ {  -1,  -1,  -1,  -1, 179,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+		   -1, 180,  -1,  -1,  -1,  -1,  -1, 181,  -1, 182,  -1,  -1,  -1 },
+	/* s */ { 183, 184, 185, 186, 187,  -1, 188, 189, 190, 191, 192, 193, 194,
+		  195, 196,  -1,  -1, 197,  -1, 198,  -1, 199,  -1,  -1, 200, 201 },
+	/* t */ {  -1,  -1, 202, 203,  -1, 204, 205, 206,  -1, 207, 208, 209, 210,
+		  211, 212, 209,  -1, 213,  -1, 214,  -1, 215, 216,  -1,  -1, 217 },
+	/* u */ { 218,  -1,  -1,  -1,  -1,  -1, 219,  -1,  -1,  -1,  73,  -1, 220,
+		   -1,  -1,  -1,  -1,  -1, 221,  -1,  -1,  -1,  -1,  -1, 222, 223 },
+	/* v */ { 224,  -1, 225,  -1, 226,  -1, 227,  -1, 228,  -1,  -1,  -1,  -1,
+		  229,  -1,  -1,  -1,  -1,  -1,  -1, 230,  -1,  -1,  -1,  -1,  -1 },
+	/* w */ {  -1,  -1,  -1,  -1,  -1, 231,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+		   -1,  -1,  -1,  -1,  -1, 232,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* x */ {  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+		   -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1 },
+	/* y */ {  -1,  -1,  -1,  -1, 233,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,
+		   -1,  -1,  -1,  -1,  -1,  -1, 234, 235,  -1,  -1,  -1,  -1,  -1 },
+	/* z */ { 236,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, 237,
+		   -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1,  -1, 238,  -1,  -1,  -1 } };
+
+
+/* Returns the country code of "ccstr" (2 letters, either case; see
+   cname_index[]), or -1 if not found
 */
 int find_cc( const char *ccstr )
 {
-	char cc1, cc2, c;
-	const char *ps;
-	int i, step, count;
+	int c1, c2;
 
-	cc1 = tolower( *ccstr++ );
-	if( !cc1 )
+	c1 = tolower( (unsigned char) ccstr[0] ) - 'a';
+	if( c1 < 0  ||  c1 >= 26 )
 		return -1;  /* error */
-	cc2 = tolower( *ccstr++ );
-	if( !cc2  ||  *ccstr )
+	c2 = tolower( (unsigned char) ccstr[1] ) - 'a';
+	if( c2 < 0  ||  c2 >= 26  ||  ccstr[2] != '\0' )
 		return -1;  /* error */
-	i    = CNAME_SIZE / 2;
-	step = CNAME_SIZE / 4;
-	count = 3;  /* base number to make sure all items are found despite
-		       i's and step's rounding errors */
-	do	{
-		ps = cname_low[i];
-		if( cc1 == (c=*ps) )
-			{
-			if( cc2 == (c=*(ps+1)) )
-				return i;
-			if( cc2 < c )
-				{
-				i -= step;
-				if( i < 0 )
-					i = 0;
-				}
-			else
-				{
-				i += step;
-				if( i >= CNAME_SIZE )
-					i = CNAME_SIZE-1;
-				}
-			}
-		else if( cc1 < c )
-			{
-			i -= step;
-			if( i < 0 )
-				i = 0;
-			}
-		else
-			{
-			i += step;
-			if( i >= CNAME_SIZE )
-				i = CNAME_SIZE-1;
-			}
-		if( !(step >>= 1) )
-			{
-			step = 1;
-			count--;
-			}
-		else
-			count++;
-		}
-		while( count );
-	return -1;  /* not found */
+	return cname_index[c1][c2];
 }
 
 #endif  /* _IP2CC_COUNTRIES_H_ */
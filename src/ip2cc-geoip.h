@@ -0,0 +1,204 @@
+/*
+ip2cc-geoip.h
+ANSI C
+(C) 2003 CYNERGI, Pedro Freire
+
+MaxMind's legacy GeoIP country database (GeoIP.dat), as read by
+mk-ip4db -g and by ip2cc-bench's "geoip" engine: a binary trie of the 32
+bits of IPv4 addresses, from the most significant one, starting at node 0.
+Each node is 6 bytes: the records of its 0 and 1 branches, 3 bytes each,
+least significant byte first. A record below GEOIP_COUNTRY_BEGIN is the
+node the branch goes on to, and one from it is a leaf: GEOIP_COUNTRY_BEGIN
+plus an index into geoip_cname[] ("--" for no country). The trie is
+followed by a database info string and, in other editions of the
+database, by a structure info (3 0xFF bytes and the database type).
+
+It is read with zlib, so the database may be gzipped (GeoIP.dat.gz) or
+not. Compile with -lz, or with -DNO_ZLIB to read only ungzipped ones.
+*/
+
+#ifndef _IP2CC_GEOIP_H_
+#define _IP2CC_GEOIP_H_
+
+#include <stdlib.h>
+#include <string.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+
+#include "ip2cc.h"
+
+
+/* First leaf record, number of GeoIP country codes, database type
+   of the country edition, and bytes searched for the structure info
+   from the end of the database
+*/
+#define GEOIP_COUNTRY_BEGIN	16776960UL
+#define GEOIP_COUNTRIES		256
+#define GEOIP_COUNTRY_EDITION	1
+#define GEOIP_STRUCTURE_INFO_MAX	20
+
+
+/* GeoIP country codes, by the index in their leaf records (as in
+   MaxMind's libGeoIP); those that aren't in cname_up[] (as "AP", "EU",
+   "A1" and the newer ones) have no country code of ours
+*/
+const char geoip_cname[GEOIP_COUNTRIES][3] = {
+	"--", "AP", "EU", "AD", "AE", "AF", "AG", "AI", "AL", "AM", "CW",
+	"AO", "AQ", "AR", "AS", "AT", "AU", "AW", "AZ", "BA", "BB", "BD",
+	"BE", "BF", "BG", "BH", "BI", "BJ", "BM", "BN", "BO", "BR", "BS",
+	"BT", "BV", "BW", "BY", "BZ", "CA", "CC", "CD", "CF", "CG", "CH",
+	"CI", "CK", "CL", "CM", "CN", "CO", "CR", "CU", "CV", "CX", "CY",
+	"CZ", "DE", "DJ", "DK", "DM", "DO", "DZ", "EC", "EE", "EG", "EH",
+	"ER", "ES", "ET", "FI", "FJ", "FK", "FM", "FO", "FR", "SX", "GA",
+	"GB", "GD", "GE", "GF", "GH", "GI", "GL", "GM", "GN", "GP", "GQ",
+	"GR", "GS", "GT", "GU", "GW", "GY", "HK", "HM", "HN", "HR", "HT",
+	"HU", "ID", "IE", "IL", "IN", "IO", "IQ", "IR", "IS", "IT", "JM",
+	"JO", "JP", "KE", "KG", "KH", "KI", "KM", "KN", "KP", "KR", "KW",
+	"KY", "KZ", "LA", "LB", "LC", "LI", "LK", "LR", "LS", "LT", "LU",
+	"LV", "LY", "MA", "MC", "MD", "MG", "MH", "MK", "ML", "MM", "MN",
+	"MO", "MP", "MQ", "MR", "MS", "MT", "MU", "MV", "MW", "MX", "MY",
+	"MZ", "NA", "NC", "NE", "NF", "NG", "NI", "NL", "NO", "NP", "NR",
+	"NU", "NZ", "OM", "PA", "PE", "PF", "PG", "PH", "PK", "PL", "PM",
+	"PN", "PR", "PS", "PT", "PW", "PY", "QA", "RE", "RO", "RU", "RW",
+	"SA", "SB", "SC", "SD", "SE", "SG", "SH", "SI", "SJ", "SK", "SL",
+	"SM", "SN", "SO", "SR", "ST", "SV", "SY", "SZ", "TC", "TD", "TF",
+	"TG", "TH", "TJ", "TK", "TM", "TN", "TO", "TL", "TR", "TT", "TV",
+	"TW", "TZ", "UA", "UG", "UM", "US", "UY", "UZ", "VA", "VC", "VE",
+	"VG", "VI", "VN", "VU", "WF", "WS", "YE", "YT", "RS", "ZA", "ZM",
+	"ME", "ZW", "A1", "A2", "O1", "AX", "GG", "IM", "JE", "BL", "MF",
+	"BQ", "SS", "O1" };
+
+
+/* GeoIP database in memory
+*/
+struct s_geoip
+	{
+	unsigned char *pbuf;		/* whole file */
+	long int size;
+	long int nodes;			/* nodes that fit in it */
+	int cc[GEOIP_COUNTRIES];	/* country code of each GeoIP one, or -1 */
+	};
+
+
+/* Record of branch "bit" (0 or 1) of node "node" of "pg"
+*/
+#define GEOIP_RECORD( pg, node, bit )	\
+	( (unsigned long int) (pg)->pbuf[ 6 * (node) + 3 * (bit) ]  |		\
+	  (unsigned long int) (pg)->pbuf[ 6 * (node) + 3 * (bit) + 1 ] << 8  |	\
+	  (unsigned long int) (pg)->pbuf[ 6 * (node) + 3 * (bit) + 2 ] << 16 )
+
+
+/* Frees "pg" (if not NULL), as returned by load_geoip()
+*/
+void free_geoip( struct s_geoip *pg )
+{
+	if( pg == NULL )
+		return;
+	free( pg->pbuf );
+	free( pg );
+}
+
+
+/* Loads GeoIP database "filename" (gzipped or not) into memory.
+   Returns the new struct, or NULL on error (or if it isn't a country
+   database)
+*/
+struct s_geoip *load_geoip( const char *filename )
+{
+	struct s_geoip *pg;
+	unsigned char *p;
+	long int max, i;
+	int n;
+#ifndef NO_ZLIB
+	gzFile fp;
+
+	fp = gzopen( filename, "rb" );
+#else
+	FILE *fp;
+
+	fp = fopen( filename, "rb" );
+#endif
+	if( fp == NULL )
+		return NULL;
+	pg = calloc( 1, sizeof(struct s_geoip) );
+	max = 0L;
+	n = 0;
+	while( pg != NULL )
+		{
+		if( pg->size == max )
+			{
+			p = realloc( pg->pbuf, (size_t) (max = max > 0L ? max << 1 : 1L << 20) );
+			if( p == NULL )
+				{
+				n = -1;  /* error */
+				break;
+				}
+			pg->pbuf = p;
+			}
+#ifndef NO_ZLIB
+		n = gzread( fp, pg->pbuf + pg->size, (unsigned) (max - pg->size) );
+#else
+		n = (int) fread( pg->pbuf + pg->size, 1, (size_t) (max - pg->size), fp );
+#endif
+		if( n <= 0 )
+			break;
+		pg->size += n;
+		}
+#ifndef NO_ZLIB
+	if( gzclose(fp) != Z_OK )
+		n = -1;  /* as for a truncated file */
+#else
+	if( ferror(fp) )
+		n = -1;
+	fclose( fp );
+#endif
+	if( pg == NULL  ||  n != 0  ||  pg->size < 6L )
+		{
+		free_geoip( pg );
+		return NULL;
+		}
+
+	/* other editions than the country one have a structure info */
+	for( i = pg->size - 3L;  i >= 0L  &&  i >= pg->size - 3L - GEOIP_STRUCTURE_INFO_MAX;  i-- )
+		{
+		p = pg->pbuf + i;
+		if( p[0] == 0xFF  &&  p[1] == 0xFF  &&  p[2] == 0xFF )
+			{
+			if( i + 3L >= pg->size  ||  (p[3] >= 106 ? p[3] - 105 : p[3]) != GEOIP_COUNTRY_EDITION )
+				{
+				free_geoip( pg );
+				return NULL;
+				}
+			break;
+			}
+		}
+	pg->nodes = pg->size / 6L;
+	for( i = 0L;  i < GEOIP_COUNTRIES;  i++ )
+		pg->cc[i] = find_cc( geoip_cname[i] );
+	return pg;
+}
+
+
+/* Returns the country code of "ip4" in "pg" (as those of find_cc()),
+   or -1 if not found
+*/
+int find_geoip_country( unsigned32 ip4, const struct s_geoip *pg )
+{
+	unsigned long int x;
+	int bit;
+
+	x = 0UL;
+	for( bit = 31;  bit >= 0;  bit-- )
+		{
+		x = GEOIP_RECORD( pg, x, (ip4 >> bit) & 1U );
+		if( x >= GEOIP_COUNTRY_BEGIN )
+			return x - GEOIP_COUNTRY_BEGIN < GEOIP_COUNTRIES ? pg->cc[ x - GEOIP_COUNTRY_BEGIN ] : -1;
+		if( x >= (unsigned long int) pg->nodes )
+			return -1;  /* error */
+		}
+	return -1;
+}
+
+
+#endif
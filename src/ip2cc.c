@@ -7,10 +7,23 @@ GNU C Compiler-aware, for packed structures (see ip2cc.h)
 (C) 2003 Corebase, Easymatic, Cynergi, Pedro Freire
 
 This script can be called with:
-	[-hbc] [ [-uar46] <arg> ]...
+	[-hcmplvjt] [--stats] [ [-uar46] <arg> | [-u] - | [-u] --annotate[=<field>] <file> |
+	  [-u] --explain <ip> ]...
+or, to serve lookups to other programs (see "Lookup server" below), with:
+	[-mplvjt] [--stats] --serve[=<socket>]
+	[-mplvjt] [--stats] --serve-shm[=<name>]
 
 -h	Show help
--b	Run a short benchmark (only available if NDEBUG not defined)
+-m	Memory-map the database once, instead of reading it one cluster at a
+	time (must precede the first <arg>)
+-p	Pin the top cluster levels of the database in memory, and read only
+	the last level from disk (must precede the first <arg>)
+-v, -l	Ignored: the IPv4 database's header says which clusters it has (see
+	"Database header" below)
+-j	Use the IPv4 database's /16 jump table, as written by mk-ip4db -j
+	(must precede the first <arg>)
+-t	Use the IPv4 database's multibit trie instead of its clusters, as
+	written by mk-ip4db -t (must precede the first <arg>)
 -c	CGI mode: look for an ACCEPT-LANGUAGE HTTP header string in standard
 	input, and for REMOTE_SERVER and REMOTE_ADDR CGI environment strings in
 	the environment, and output and HTTP redirect for the proper language file
@@ -20,12 +33,31 @@ This script can be called with:
 -r	This next argument is a REMOTE_SERVER CGI environment string
 -4	This next argument is an IPv4 address
 -6	This next argument is an IPv6 address
+-, --stream
+	Look up the IPs in standard input instead, one per line, until its end
+	(see "Streaming" below)
+--annotate[=<column>[:<delimiter>]] <file>
+	Output the lines of <file> with the country code of the IP in their
+	<column> (1 by default) appended to each (see "Annotating" below)
+--serve	Serve lookups on a Unix domain socket (SOCKFILE in ip2cc.h, unless
+	given), until killed
+--serve-shm
+	Serve IPv4 lookups on shared memory rings (SHMFILE in ip2cc.h, unless
+	given), until killed
+--explain <ip>
+	Look up an IPv4 address, outputting each step of the search on the way
+	(see "Instrumentation" below)
+--stats	Output the lookup counters to standard error on exit and, while
+	serving, on SIGUSR1 (see "Instrumentation" below)
 
 Note:
-* If none of -a, -r, -4 or -6 are used, there is some sort of auto-detection.
+* If none of -a, -r, -4 or -6 are used, there is some sort of auto-detection
+  (arguments with a ':' are IPv6 addresses, in any of the text forms of
+  RFC 4291, as "2001:db8::1" or "::ffff:192.0.2.1")
 * -a, -r and -c are not yet implemented
-* IPv6 (auto-detected or with -6) will ALWAYS return "??" (not found) as it
-  is not yet implemented
+* IPv6 addresses are looked up in DBFILE6 (as written by mk-ip6db), except
+  for IPv4-compatible and IPv4-mapped ones (::a.b.c.d and ::ffff:a.b.c.d),
+  which are looked up in the IPv4 database
 
 The return value is one of:
 	0 -> ok
@@ -89,7 +121,7 @@ other node.
 
 The idea is to therefore group a tree into clusters similar to this:
 
-                                 cluster 0
+                                 cluster 1
                                     (O)
                           _________/   \_________
                          /                       \
@@ -97,7 +129,7 @@ The idea is to therefore group a tree into clusters similar to this:
 
                   /         \                 /         \
 
-            cluster 4  |  cluster 3  |  cluster 2  |  cluster 1
+            cluster 5  |  cluster 4  |  cluster 3  |  cluster 2
                (O)     |     (O)     |     (O)     |     (O)
               /   \    |    /   \    |    /   \    |    /   \
              (O) (O)   |   (O) (O)   |   (O) (O)   |   (O) (O)
@@ -106,7 +138,8 @@ Clusters are stored sequentially on the database file, so they are numbered
 from top to bottom (in terms of levels), and at each level range, from right
 to left (higher IP ranges are more likelly to contain the IP we're looking
 for), so that the earliest search steps are as close as possible to the
-file's start, and are hence faster.
+file's start, and are hence faster. (Cluster 0 is the database header, see
+"Database header" below.)
 
 Now because we do not need to hop through the database file at *each*
 iteration, but rather only when crossing clusters, the number of file seeks
@@ -124,7 +157,13 @@ about binary trees"), and because we will need an array of pointers to the
 of these array's elements. This is explained in "clusters".
 
 (*) In a very few cases, they *do* overlap, but those are obvious errors in
-the RIRs' databases.
+the RIRs' databases. mk-ip4db keeps the lines it reads first: each line only
+gets the IPs from its start (or from the end of a line before it that has
+that IP) up to its end (or up to the next IP a line before it has), and
+lines left with no IPs are dropped. The lines need not be in IP order
+either: mk-ip4db sorts them all at once, and then builds the tree and
+writes its clusters in a single pass, so it rebuilds the database of the
+2006-07-20 sample (79685 entries) in about 0.1s.
 
 
 "Clusters"
@@ -224,8 +263,8 @@ set of complete balanced tree nodes in the following format:
 
 The "next[]" array holds the cluster numbers where you may find the
 nodes the follow those branches of the tree. If the tree ended just
-in the previous node, these cluster numbers hold 0 (as 0 is the first
-cluster number, no next[] entry can have 0 as a valid "next" cluster).
+in the previous node, these cluster numbers hold 0 (as cluster 0 is the
+database header, no next[] entry can have 0 as a valid "next" cluster).
 
 If the tree ends before these "next[]" entries, we fill the "balanced"
 tree of the cluster with "fake" nodes containing IP = 0xFFFFFFFF. For
@@ -237,6 +276,137 @@ This is to allow a standard binary search algorythm to scan the nodes[]
 array without having to adapt to varying "cluster filled" rates.
 
 
+"Vector" clusters
+-----------------
+
+Inside each cluster, the search above is a binary search through the packed
+6-byte nodes, decoding each range's end as it goes. mk-ip4db -v writes an
+alternative cluster layout, struct s_cluster4v, with the same nodes and
+next[] array, but with each node field in its own array: all start IPs
+first, as a contiguous unsigned32 array (aligned to the cluster), then
+all ccsz values, then next[]. It takes 510 bytes out of
+512, instead of 506.
+
+The start IPs are in IP order (the order nodes were numbered in each
+cluster), and unused nodes just repeat the start IP of the next used node,
+so the array is always sorted. ip2cc can then count how many nodes
+start at or before the searched IP, comparing it with all 63 start IPs at
+once, with AVX2 or SSE2 instructions when compiled for them (a binary search
+otherwise). The last of these nodes is the only one that may contain the IP;
+if it doesn't, the count is also the index into next[].
+
+
+Cache line clusters
+-------------------
+
+A 512 byte cluster spans 8 CPU cache lines, and a search through it touches
+3 to 6 of them. mk-ip4db -l writes clusters the size of a single cache line
+instead (LINE_SIZE, 64 bytes by default, or 128 with mk-ip4db -l -s 128),
+struct s_line4: 7 (or 15) nodes laid out as in a "vector" cluster, covering
+3 (or 4) tree levels, so each cluster level costs at most one cache miss,
+but there are more cluster levels.
+
+There is no room for a next[] array of 8 (or 16) entries, but it isn't
+needed: as clusters are numbered from the top of the tree down, and at each
+level band from the highest IPs to the lowest, all the next clusters of a
+cluster have consecutive indexes. So each cluster only keeps the index of
+its first next cluster (as 32 bits, so these databases are not limited to
+65535 clusters, like the others) and a bit mask of the branches that have
+one; the next cluster of branch i is the first one plus how many branches
+above i have one. mk-ip4db checks that this holds.
+
+As with "vector" clusters, ip2cc compares the searched IP with all
+start IPs at once, with AVX2 or SSE2 instructions when compiled for them.
+
+
+Database header
+---------------
+
+The clusters above are 512 bytes (SECTOR_SIZE) by default, or a cache line
+(LINE_SIZE) with -l, but any other power of 2 from 64 bytes to 16kb (to 128
+bytes for cache line clusters) works the same way: mk-ip4db -s <bytes> sets
+it, and each cluster then holds as many tree levels as fit, along with their
+next[] array (511 nodes in 4096 bytes, for the pages of an NVMe drive, or 7
+in 64 bytes).
+
+So that ip2cc needn't be compiled with the sizes mk-ip4db was, cluster 0 of
+the database is a header, struct s_db4head: a magic number ("IP4D"), the
+byte order of the machine that built the database (0x01020304 as written by
+it), the format version, the cluster layout (default, "vector" or cache
+line), the cluster size, the nodes per cluster, the numbers of clusters,
+ranges and country codes, and a stamp: a checksum of the rest of the file,
+that tells this build of the database from others. The root cluster is
+cluster 1, and the country code table follows the last cluster (2
+uppercase letters per code), as the country codes in the nodes are just
+indexes into it. open_ip4_db() checks all of these, and refuses a database
+built on a machine of the other byte order, by an older mk-ip4db, or with
+another country code table, instead of giving wrong answers;
+get_ip4_db_head() returns the header. Databases built before the header,
+or before the stamp, must be rebuilt. The jump table and the trie start
+with the database's numbers of clusters and ranges and its stamp (struct
+s_db4id), and are refused with any other database, so a stale one is never
+searched.
+
+
+Multibit trie
+-------------
+
+All of the above is one way to search a sorted list of IP ranges. For
+deployments that can afford to keep a little more in memory, mk-ip4db -t
+also writes a multibit trie ("poptrie"), built from the same final list of
+ranges as the database, named as the database plus ".trie" (about 560kb for
+the 2006-07-20 sample), and ip2cc -t loads it and uses it instead of the
+clusters, with the same results (the database is still opened, for its
+header, so that a trie of another build of it is refused).
+
+Each trie node takes the next 6 bits of the IP (TRIE_STRIDE4), so a lookup
+goes through at most 6 nodes (32 bits in 6 levels, the last one with only 2
+bits left), however many ranges there are. Each node has 64 slots, but only
+stores the slots that have a child node (all consecutive in the file, in
+slot order) and one leaf (a country code) for each run of slots with the
+same country code; two 64-bit masks have a bit set for each of those, so the
+child node or leaf of a slot is found by counting the bits set up to it (a
+single POPCNT instruction, when compiled for it). A slot gets a leaf when
+all of its IPs have the same country code, or none.
+
+
+GeoIP databases
+---------------
+
+mk-ip4db -g builds the database from a MaxMind legacy GeoIP country database
+instead of a text file, as data/mod_geoip databases/GeoIP.dat.gz: it gunzips
+it into memory (with zlib) and walks its binary trie (see ip2cc-geoip.h)
+from the lowest IPs to the highest, so the ranges of its leaves come out
+already sorted, and are merged with their neighbours of the same country on
+the way, with no text file in between. GeoIP codes that have no country code
+of ours (as "EU", "AP", "A1" or "RS") are skipped, with a message giving how
+many ranges each had. The database it builds from GeoIP.dat.gz is the same,
+byte for byte, as the one mk-ip4db -4 builds from the GeoIPCountryWhois.csv
+of the same release, in about the same time (0.09s), but without unzipping
+the 12Mb of the latter first.
+
+GeoIP's trie takes one bit of the IP per node (6 bytes, with the records of
+its two branches), so a lookup goes through up to 32 nodes, but compares no
+ranges. ip2cc-bench's geoip engine searches it as libGeoIP does, so that
+both layouts can be compared on the same data: ip2cc-bench -d <ip4db> -g
+GeoIP.dat.gz -e map -e geoip, on a database built from it, checks that they
+give the same answers too. On uniform random IPs, the whole trie in memory
+(1.2Mb) did 9.7 million lookups per second, and the memory-mapped clusters
+(2.1Mb) 9.3 million, with a p99 latency of 364ns against 607ns.
+
+MaxMind's GeoIP country CSV (GeoIPCountryWhois.csv, with the columns
+"<start>","<end>","<start-number>","<end-number>","<country-code>","<country-name>")
+is mk-ip4db -4's format, and it comes in a zip archive, as data/mod_geoip
+databases/GeoIPCountryCSV.zip. mk-ip4db reads gzipped source files and zip
+archives (their first file, which must be deflated) as they are: it inflates
+them a chunk of READ_BLOCK (1Mb) at a time, and each chunk is parsed by a
+thread of its own while the next ones are inflated, as it does with the
+chunks of a plain file. So nothing is unzipped to disk first, and mk-ip4db
+-4 GeoIPCountryCSV.zip took 0.17s, against 0.22s for unzipping it and then
+building from the CSV, on a single CPU, with the same peak memory (about
+20Mb).
+
+
 Facts about binary trees
 ------------------------
 
@@ -298,12 +468,67 @@ there would be 2^n new leafs in that new level.
 Implementation notes
 --------------------
 
+When the database is memory-mapped (-m), it is mapped read-only only once,
+and clusters are used directly from the mapping, with no fseek()/fread()
+system calls nor copies per lookup. Cluster indexes are still bounds-checked
+against the file size, so a damaged file returns an error, not a crash.
+Under WIN32 the file is just read into memory once, instead.
+
+As clusters are numbered from top to bottom, the clusters of the first N
+tree levels are always the first clusters in the database file. When these
+are pinned in memory (-p), ip2cc loads them at open time, and only fetches
+clusters from disk past that point. So a lookup does at most one file access
+instead of three, for a memory footprint of a few dozen kb. How many levels
+are pinned is set by a memory budget, sized from the cluster geometry in
+the database's header to fit the first two cluster levels (or a fixed one,
+with gcc -DPIN_BUDGET4=<bytes>), but the last cluster level is never
+pinned.
+
+All of these modes are available through an opaque database handle (see
+ip2cc.h): open_ip4_db(), find_ip4_country_db() and close_ip4_db(). Clusters
+that aren't resident in memory are read with pread(), so the handle has no
+shared file position nor any other mutable state once open, and any number
+of threads may look up IPs on the same handle at the same time.
+find_ip4_country() is kept for callers that have a FILE * of their own, but
+it reads the database's header again on every lookup (a seek and a read more
+per lookup): open_ip4_db() reads it once.
+
+Callers with many IPs at hand can use find_ip4_countries_db() instead,
+which looks up an array of IPs into an array of country codes. When the
+whole database is in memory, it runs up to BATCH4 (16) lookups at the same
+time, one cluster level at a time: as soon as a lookup knows its next
+cluster, it asks the CPU to prefetch that cluster, and only comes back to
+it after going through all the other lookups. The memory latency of each
+cluster hop is then hidden behind the work on the other clusters.
+
+Callers that look up the same IPs again and again (as in web server logs)
+can put a lookup results cache in front of a handle: open_ip4_cache(),
+find_ip4_country_cached(), get_ip4_cache_stats() and close_ip4_cache(). It
+has IP4CACHE_ENTRIES (4096) entries by default, in sets of 2, picked by a
+hash of the /24 of the IP, and each entry holds the first and last IPs of
+the range a country code was found in (as returned by find_ip4_range_db()),
+so it only answers for IPs that are surely in that range, even when the
+range is smaller than a /24. Only found country codes are cached. A cache
+has counters and is changed by every lookup, so each thread needs its own
+cache, on a shared handle.
+
 It is a BAD idea to try to have different database files to skip a few
 initial steps. This is because when looking at some of the high bits of the
 searched IP number to find the file, we might be taking into consideration
 bits that belong to the host part, not the network part, and will therefore
 throw the search into the wrong database file.
 
+The /16 jump table (-j) gets close to that idea, without the problem:
+mk-ip4db -j also writes a file with one entry for each of the 65536 possible
+upper 16 bits of an IP (256kb, named as the database plus ".idx", after the
+identity of the database it was written with, see struct s_db4id). If all
+IPs in that /16 are in ranges of the same country (or in none), the entry
+just holds the country code, and the lookup ends there, with a single memory
+read. Otherwise, the entry points to the first tree node (cluster and node
+index) whose range overlaps that /16: up to that node, the searches for all
+its IPs would take the same way down the tree anyway, so none of them is
+thrown into the wrong part of the tree.
+
 
 IPv6
 ----
@@ -314,8 +539,10 @@ IPv6 addresses are encoded as unsigned32[4] as
 
 which means array index 0 has the lowest-significant word and
 array index 3 has the highest-significant word. IPv4 addresses encoded
-within an IPv6 address have array indexes 3, 2 and 1 at zero (0).
-In such case, search is referred to the IPv4 address space.
+within an IPv6 address have array indexes 3 and 2 at zero (0), and array
+index 1 at zero (IPv4-compatible) or at 0x0000FFFF (IPv4-mapped, as in
+::ffff:192.0.2.1). In such case, search is referred to the IPv4 address
+space (see IP6_IS_IP4() in ip2cc.h).
 
 In the database, we will only use array indexes 3 and 2. This is because
 under the IPv6 spec, array indexes 1 and 0 hold a globally-unique medium
@@ -323,6 +550,185 @@ ID, such as a MAC. It is indexes 3 and 2 that hold the RIR attributed
 range mask (high 48 bits) and the user/LIR subnet ID (low 16 bits).
 You only need these to figure out the user's country of origin.
 
+The IPv6 database is built by mk-ip6db (see comments at the top of
+mk-ip6db.c), with the same clustered binary tree as the IPv4 one, and the
+same search: s_cluster6 clusters of 31 nodes, each with the start of its
+range (in those upper 64 bits) and its size, in /64s, as a 16-bit mantissa
+and a shift. As IPv6 ranges are far fewer than the 2^64 possible /64s, the
+clusters are filled as in a B-tree: all clusters but the last level ones
+are full, with all their 32 children in their next[] array, so a lookup
+reads at most ceil( log32(nodes+1) ) clusters, one per level (4 for up to a
+million nodes).
+
+
+Library
+-------
+
+All of the lookup code is in libip2cc.c, a library with a plain C interface
+(ip2cc.h), so that programs can link it in and keep a database open, instead
+of running ip2cc (and checking its lock file, and opening the database) once
+per lookup. ip2cc itself is just a command line client of it. Besides the
+database handle and cache functions above, the library has parse_ip4() and
+parse_ip6(), which parse an address from a string that needs no terminating
+NUL (IPv4 ones with SSSE3 instructions, when compiled for them), and
+get_cc_name(), which returns the 2-letter ISO code of a country code (and
+get_ip4_stats(), dump_ip4_stats() and explain_ip4_db(), see
+"Instrumentation" below). Its interface only uses ints, unsigned32s, strings
+and opaque handles, so it can also be called through the foreign function
+interfaces of scripting languages.
+
+ip2cc.hpp adds a thin C++20 layer on top: an ip2cc::ip4db class that closes
+its database handle on destruction, with find() for a single IP or for a
+std::span of them (in one batch), and ip2cc::parse_ip4() and
+ip2cc::cc_name() on std::string_views.
+
+
+Streaming
+---------
+To look up a whole log file, ip2cc - (or --stream) reads IPs from standard
+input, one per line (IPv4 or IPv6, auto-detected, as for <arg>), and outputs
+one line for each, in the same order, as for the command line arguments,
+until the end of its input. Lines with no IP in them (empty, too long or
+otherwise) output "??" too, so output lines always match input lines. Input
+is read in blocks of STREAM_BLOCK (1 MB) bytes, IPv4 addresses are looked
+up in batches of STREAM_BATCH (4096) lines, with find_ip4_countries_db(),
+and output is written a batch at a time, so there are few system calls.
+Put -u before - for uppercase codes.
+
+
+Annotating
+----------
+
+To add a country column to a whole web server access log, ip2cc
+--annotate <file> outputs each line of <file>, in the same order, with a
+space and the country code of the IP in its first field appended to it
+("??" if there is none). --annotate=<column> takes the IP from another
+field, and --annotate=<column>:<delimiter> splits fields at every
+<delimiter> character instead of at runs of spaces and tabs, and appends
+the code after a <delimiter> too (--annotate=2:, for the second column of a
+CSV file). Double quotes around the field are ignored, and a carriage
+return at the end of a line is kept at its end.
+
+The file is mapped into memory (so it must be a regular file, not a pipe),
+and split at newline boundaries into chunks of about ANNOTATE_CHUNK (1 MB)
+bytes, which are annotated by one thread per CPU (up to
+ANNOTATE_MAXTHREADS), all looking up the same, read-only, database handle,
+in batches of ANNOTATE_BATCH (1024) lines. Chunks are dealt out in windows
+of ANNOTATE_SPLIT (8) chunks per thread, in consecutive runs, and a thread
+that runs out of chunks steals the last one left to another thread, so
+threads that got slower chunks (more IPv6 addresses, say) are helped by the
+others. Each thread writes its output into a buffer of its own, and while
+the threads annotate a window, the previous one is output, chunk by chunk,
+in order. Memory use is therefore bound by two windows, however large the
+file.
+
+
+Lookup server
+-------------
+
+Programs that can't link the library in can still avoid running ip2cc for
+every lookup: ip2cc --serve checks its lock file and opens the database once
+(as set by the options before it), and then answers lookups on a Unix domain
+socket, for any number of clients at the same time, from a single epoll loop
+(so this is only available under Linux). Its protocol is binary and
+pipelined: a client may send any number of requests without waiting for
+their responses, each with up to SERVE_MAXKEYS (4096) IPv4 and IPv6
+addresses, and gets back one response per request, in the same order, with a
+country code for each address (see struct s_servereq in ip2cc.h). The IPv4
+addresses of a request are looked up in a single batch, with
+find_ip4_countries_db().
+
+ip2cc-client.c is a small client for it, that looks up its arguments (as
+ip2cc does) in a single request, and, with -l, a load generator, that
+outputs the requests per second and the latency percentiles of a run of
+requests of random IPv4 addresses.
+
+For the hottest paths, even a socket round trip costs more than a lookup.
+ip2cc --serve-shm creates a POSIX shared memory segment instead (struct
+s_shmseg in ip2cc.h), with SHM_CLIENTS (64) slots, each with a request ring
+and a response ring of SHM_RING (1024) entries. A client (each thread of a
+web server worker, say) claims a slot with open_ip4_shm() from the library,
+and then find_ip4_country_shm() or find_ip4_countries_shm() write IPv4
+addresses to its request ring and wait for their country codes on its
+response ring. Each ring has a single producer and a single consumer, which
+only write their own index into it, so there are no locks nor system calls:
+the service polls all rings, and looks up all the requests waiting in one in
+a batch. When all rings have been idle for a while, the service sleeps on a
+futex, and the first client to write a request wakes it up. While either
+side polls in vain for long, it yields the CPU, as on a single CPU the other
+side can only run then. Slots of processes that are gone are taken over by
+new clients.
+
+ip2cc-client -M is a client for it, and ip2cc-client -x <program> -l runs a
+program (such as ip2cc) for each request, for comparison.
+
+
+Reloading
+---------
+
+mk-ip4db and mk-ip6db never write over a database that may be in use: they
+write the new one under a temporary name (the database's plus NEW_SUFFIX,
+".new"), and then rename() it over the old one, which replaces it at once.
+ip2cc then opens either the old database or the new one, never one that is
+half written, and whoever had the old one open goes on reading it, as it
+was, until they close it. mk-ip4db writes the jump table and the trie the
+same way, and renames them just before the database; a jump table or trie
+it didn't write again (without -j or -t) is removed after it, as it belongs
+to the old database.
+
+Each of those renames is atomic, but not all of them together: a reader
+may still open the old database along with the new jump table, or the
+database's header before it is replaced and its clusters after. So
+open_ip4_db() checks that the side files start with the identity of the
+database (struct s_db4id), and that the database file, once opened for its
+clusters, still has the header it read first; if not, it opens them all
+again, up to OPEN_RETRIES4 (10) times, OPEN_RETRY_WAIT4 (1 ms) apart, which
+is ample for mk-ip4db to publish the rest.
+
+Programs that keep a database open, such as the lookup servers, may open it
+with open_ip4_reload() instead, and call reload_ip4_db() every now and then
+(ip2cc --serve and --serve-shm do so every RELOAD_CHECK, 1, seconds): if the
+file was replaced, this opens the new one, and publishes it as a new
+generation (if its files still don't match, the current generation stays in
+use, and the next call tries again). Lookups get the current generation with
+acquire_ip4_db(), and give it back with release_ip4_db(), and none of these
+ever wait for each other, as in RCU (read-copy-update): each lookup only
+counts itself in, and out, on the side of the parity of the generation it
+started in, and a new generation is published by storing its database before
+moving the generation on, so lookups in flight finish on the old one, and
+the old one is only closed (by a later reload_ip4_db()) once all lookups
+counted on its side are gone. The lookup servers also reopen DBFILE6 when it
+is replaced.
+
+
+Instrumentation
+---------------
+
+Compiled with IP2CC_STATS defined (gcc -DIP2CC_STATS), the library counts,
+for each thread, the IPv4 lookups, the clusters they visited, the nodes they
+compared (tree nodes, trie nodes, or vector and cache line IPs), and the
+bytes and system calls they read clusters from disk with. The counters are
+kept in thread-local blocks, so counting takes no locks nor shared cache
+lines; a thread's block is added to a list on its first lookup, and is not
+freed at its exit, so no counts get lost. get_ip4_stats() adds up the
+counters of the calling thread, or of all of them, and dump_ip4_stats()
+outputs them, per thread and in all. Without IP2CC_STATS, the counting
+compiles to nothing, and the counters stay at zero.
+
+ip2cc --stats outputs the counters to standard error on exit, and the
+lookup servers also do so, in between lookups, when sent a SIGUSR1 signal.
+
+ip2cc --explain <ip> looks up an IPv4 address with explain_ip4_db(), which
+outputs each step of the way, with the options before it: the trie node
+and slot at each level, or the jump table entry, and then each cluster,
+whether it was in memory or read from disk, each node compared and which
+way the search went from it (or, in "vector" and cache line clusters, how
+many of their IPs were lower than or equal to it, compared at once), and
+finally the country code, and how many clusters that took. Looking up one
+IP in every /24 of the 2006-07-20 database, with the counters, none took
+more than the 3 cluster levels of "Speed" below (3 for 97.5% of them, and
+2 for the rest, but for 1708 /24s in the root cluster itself).
+
 
 Compile and test
 ----------------
@@ -349,17 +755,40 @@ Optimization for space (smaller code) would be best as the algorythm doesn't
 need to be much sped up. For example, the line to compile this for the GNU
 C Compiler (GCC) under Windows, is:
 
-	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 ip2cc.c -o ip2cc.exe
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 ip2cc.c libip2cc.c -o ip2cc.exe
 
 and for GCC under UNIX (Linux, etc):
 
-	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 ip2cc.c -o ip2cc
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 -pthread ip2cc.c libip2cc.c -o ip2cc
+
+To build the library alone, as a static and as a shared library (GCC under
+UNIX):
+
+	gcc -O2 -Wall -DNDEBUG -DSECTOR_SIZE=512 -fPIC -c libip2cc.c -o libip2cc.o
+	ar rcs libip2cc.a libip2cc.o
+	gcc -shared libip2cc.o -o libip2cc.so
+
+and the lookup server's client:
+
+	gcc -O2 -Wall -DNDEBUG ip2cc-client.c libip2cc.c -o ip2cc-client
+
+(older C libraries also need -lrt, for shm_open()), and the IPv6 database
+builder:
+
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 mk-ip6db.c libip2cc.c -o mk-ip6db
+
+and the benchmark of the lookup engines (see "Speed" below):
 
-PLEASE BEWARE THAT IF YOU COMPILE IP2CC AND MK-IP4DB IN DIFFERENT PLATFORMS,
-THE FILE THAT THE LATTER CREATES MAY NOT WORK WITH THE FORMER, AS EACH
-PLATFORM'S COMPILER MAY HAVE USED DIFFERENT SECTOR_SIZE VALUES! TO PREVENT
-THAT MAKE SURE YOU COMPILER COMMAND LINE DEFINES COMMON SYMBOL SECTOR_SIZE,
-AS IN THE ABOVE EXAMPLE.
+	gcc -O2 -Wall -DNDEBUG -DSECTOR_SIZE=512 ip2cc-bench.c libip2cc.c -lm -lz -o ip2cc-bench
+
+(zlib, -lz, reads gzipped GeoIP databases, see "GeoIP databases" above;
+mk-ip4db needs it too, for those and for gzipped or zip source files, unless
+compiled with -DNO_ZLIB).
+
+IPv4 databases record their cluster size in their header (see "Database
+header" above), so SECTOR_SIZE only sets mk-ip4db's default one. IPv6
+databases don't: mk-ip6db and ip2cc must still be compiled with the same
+SECTOR_SIZE, as in the above examples.
 
 To test the code, you may try IP number 194.65.14.75 which should result in
 country 'pt' (Portugal) - at least in 2003.
@@ -382,7 +811,7 @@ a result, which means the code will load from those 2Mb a maximum of 3*512 =
 1.5kb! And look at the function that performs that search: 45 lines
 (including comments) of a very simple integer-based algorythm.
 
-An informal benchmark (compiled here if NDEBUG is *not* defined), results
+An informal benchmark (then compiled into ip2cc as -b), results
 in speeds of 14 thousand to 50 thousand queries per second, this on a 1GHz
 Pentium-III processor of an under-optimized laptop. The lowest bechmark was
 for the first run of the benchmark (file not cached), and the highest for
@@ -396,18 +825,171 @@ where one similar program that loads the entire database into memory runs,
 (when comparing memory usage) then you get an adjusted benchmark of
 100*50000 = 5 million queries per second!
 
-*/
+Re-measured in 2026, on one core of a virtual x86-64 server, with the
+2006-07-20 sample database (4161 clusters), the page cache warm, and 2
+million random IPs generated before timing, the average time per lookup was:
+
+	mode                  default clusters   "vector" clusters
+	                      (SSE2 / AVX2)      (SSE2 / AVX2)
+	every cluster read    1.39 / 1.32 us     1.21 / 1.23 us
+	pinned (-p)           0.51 / 0.56 us     0.56 / 0.48 us
+	memory-mapped (-m)    106 / 115 ns       104 / 89 ns
+
+When clusters are read from disk, system calls take nearly all the time, so
+the cluster layout barely matters. In memory, "vector" clusters with AVX2
+are about 20% faster than the default ones; SSE2 compares only 4 IPs at a
+time, and just breaks even with the binary search.
+
+With cache line clusters (-l), and the same database (37449 64-byte or
+18519 128-byte clusters), the times were:
+
+	mode                  64-byte lines      128-byte lines
+	                      (SSE2 / AVX2)      (SSE2 / AVX2)
+	every cluster read    2.23 / 2.04 us     1.58 / 1.65 us
+	pinned (-p)           1.29 / 1.18 us     0.99 / 0.85 us
+	memory-mapped (-m)    122 / 131 ns       101 / 100 ns
+
+Here they don't pay off: 17 tree levels take 6 (or 5) cache line clusters
+instead of 3 sector-sized ones, each read from disk costs a system call,
+and this 2Mb database mostly fits in the CPU caches anyway, where the extra
+levels cost more than the cache misses they save. They are meant for larger
+databases, memory-mapped, where most lookups miss the caches.
+
+With the /16 jump table (-j), 61854 of its 65536 entries have a single
+country code (or none) for this database, so most random IPs never reach
+the tree, and the times were (with default clusters, SSE2 / AVX2):
+
+	every cluster read    45 / 45 ns
+	pinned (-p)           34 / 34 ns
+	memory-mapped (-m)    10 / 8 ns
+
+Real traffic comes from allocated address space, which is split into more
+ranges, so fewer of its lookups end in the jump table.
+
+Finally, picking the 2 million IPs from the database's own ranges instead
+(each range equally likely, which makes lookups go deeper into the tree and
+into less uniform /16s), memory-mapped lookups took 189 ns with default
+clusters, 100 ns with the jump table (-m -j), and 48 ns with the multibit
+trie (-t; 41 to 51 ns with POPCNT, 24 ns with fully random IPs).
+
+The old benchmark (ip2cc -b) also ran 50000 lookups on IPs from 2000 random
+/24s that had a country code, through a cache. Memory-mapped (-m), that took
+the lookup speed from 5.8 to 38 million per second (86% hits), and with
+every cluster read from disk, from 0.7 to 5.6 million per second.
+
+With the lookup server (ip2cc -m -j --serve) and its load generator on the
+same machine, one lookup per request, and one request at a time, took 14 us
+(20 us at the 99th percentile), against about 1.3 ms to run ip2cc for it.
+With 16 requests in flight, of 64 IPv4 addresses each, the server answered
+130 to 160 thousand requests per second (8 to 10 million lookups per
+second), with a latency of 110 us (230 us at the 99th percentile).
+
+The virtual server used for these measurements has a single CPU, where the
+shared memory rings (ip2cc -m -j --serve-shm) can't show their worth: a
+lookup needs the client and the service to take turns on it, so one took 25
+us (40 us at the 99th percentile), and 64 took 27 us, against 1.5 ms to run
+ip2cc for one. With a CPU for the service, and another for each client,
+neither ever waits for the other to be scheduled, and a round trip is down
+to the time the CPU caches take to pass a cache line from one to the other
+and back.
+
+Streaming 21 million IPv4 addresses (the same 30000 random ones, over and
+over) through ip2cc -m - took 5.2 s, or 4 million lines per second, and 1.8
+s with the jump table (ip2cc -m -j -), or 11.5 million lines per second
+(about 700 million per minute), against 15 s for one ip2cc -m -j run for
+every 5000 of them (xargs -n 5000).
+
+Parsing those 30000 IPv4 addresses (100 times over) took 330 ns each with
+sscanf(), as ip2cc did before libip2cc, 51 ns with parse_ip4() in ANSI C,
+and 16 ns with SSSE3 instructions (gcc -mssse3, or -march=native). For as
+many random IPv6 addresses, with all 8 groups, sscanf() took 850 ns each,
+and parse_ip6() 90 ns.
+
+From disk, with 60000 IPv6 ranges (4 cluster levels), ip2cc -b did 650
+thousand random IPv6 lookups per second. IPv4-mapped IPv6 addresses,
+parsed from text and looked up in the IPv4 database, did 8.4 million per
+second with -m -j.
+
+Annotating a 400 MB access log (4 million lines, 90% of them with IPv4
+addresses, 10% with IPv6 ones) took 1.7 s with ip2cc -m -j --annotate,
+against 4.1 s for awk '{print $1}' | ip2cc -m -j - | paste. That was on a
+single CPU, with a single thread; as the threads share nothing but the
+database and the chunk runs, it should scale with the number of CPUs,
+until output is bound by the disk.
+
+ip2cc-bench (see ip2cc-bench.c) replaces ip2cc -b, which timed 50000
+lookups of rand()-built IPs with clock(), rand() calls included, and only
+output their mean speed, on uniform IPs that look nothing like real traffic.
+It runs every lookup engine (the open_ip4_db() modes, the batch and cached
+lookups, IPv6 lookups, and a binary search of the source data file, as
+php-alone.php does it, for reference) on several workloads: uniform random
+IPs, IPs sampled from the ranges of the source data file (each address
+equally likely), a Zipf-skewed set of those, and the replay of a trace file.
+Runs are warm, or cold with -c (the database files are dropped from the page
+cache before each pass), and each outputs the throughput and the 50th, 99th
+and 99.9th latency percentiles.
+
+With the 2006-07-20 sample database, 1 million lookups per pass, warm (and
+the timer's overhead of about 40 ns in each latency), it output:
+
+	engine          uniform         weighted          zipf
+	                M/s   p99 ns    M/s   p99 ns    M/s   p99 ns
+	disk            0.65   2224     0.94   1923     0.90   2012
+	pin             1.8    1091     2.4     956     2.0     936
+	map             8.5     360    10       327     9.5     330
+	map-jump       70       248    55       307   135       219
+	trie           30       192    31       299    39       165
+	map-batch       5.5     193     7.0     182     7.3     205
+	map-cached      9.0     373     7.8     395    15       297
+	text            0.84   2292     0.72   2900     0.86   2440
+
+The text search, even with the file already in memory, is no faster than
+the database read from disk, cluster by cluster. The cache only pays off on
+the Zipf workload, and the batch lookups, whose prefetches are meant for
+databases that don't fit in the CPU caches, don't here. Cold runs (-c) only
+raised the 99.9th percentile of disk and pin lookups to 26 us, on this
+virtual server. That source data file ends with a range for 224.0.0.0/3 that
+isn't in the database, so the text search finds a country for 12% of the
+uniform IPs that the engines don't.
+
+The binary search in each default cluster is unrolled, in
+search_cluster4u(): a switch enters a straight sequence of compares, one
+per tree level, at the level of the node the search starts at, so every
+lookup in a database of the same cluster geometry runs the same sequence,
+and each compare picks the next node with a conditional move, instead of a
+branch that random IPs mispredict half of the time. It doesn't stop at the
+node whose range has the IP, as the loop of search_cluster4() does, but
+only at the bottom level (or at an unused node). Comparing the two in the
+same program (open_ip4_db() with and without IP4DB_LOOP, as ip2cc-bench's
+map and map-loop engines do), on the same database built with every
+cluster size (mk-ip4db -s), the best of 15 passes of 1 million
+memory-mapped lookups took, on average:
+
+	cluster size   nodes    IPs in ranges       uniform IPs
+	                        unrolled / loop     unrolled / loop
+	64 bytes          7     117 / 129 ns        138 / 133 ns
+	128              15      96 / 128 ns        123 / 137 ns
+	256              31     135 / 141 ns        126 / 107 ns
+	512              63      89 / 110 ns        116 / 115 ns
+	1024            127     126 / 142 ns        127 / 128 ns
+	2048            255      77 / 99 ns         123 / 121 ns
+	4096            511     113 / 131 ns        124 / 114 ns
+	8192           1023     120 / 122 ns        129 / 107 ns
+	16384          2047     142 / 146 ns        155 / 129 ns
+
+On IPs in the database's ranges, the unrolled search is faster with every
+cluster size, by up to 33%. On uniform random IPs, the loop often finds
+them in large ranges near the top of the tree, and stops there, so it
+mostly breaks even, but in clusters of 8kb and more the unrolled search
+goes through too many tree levels (11 in 16kb), and is up to 17% slower.
+So the library only unrolls the search in clusters of up to 4kb
+(UNROLL_SHIFT_MAX4), and loops in larger ones.
 
+*/
 
-#include <assert.h>
-#include <ctype.h>
 #include <stdio.h>
-#include <limits.h>
 #include <string.h>
-#ifndef NDEBUG
-#include <time.h>
 #include <stdlib.h>
-#endif
 /* for lock code: */
 #ifdef WIN32
 #include <windows.h>  /* req by winbase.h */
@@ -416,10 +998,30 @@ where one similar program that loads the entire database into memory runs,
 #include <time.h>
 #include <sys/stat.h>
 #endif
+/* for --serve: */
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#endif
+/* for --annotate: */
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 
 #include "ip2cc.h"
-#include "ip2cc-countries.h"
 
 
 /* System return values:
@@ -428,22 +1030,157 @@ where one similar program that loads the entire database into memory runs,
 #define RV_ERROR		1
 
 
-/* Sorry - preprocessor doesn't like casts...
-*
-#if INT_MAX < (CC_MASK4 >> CC_SHIFT4)
-#error "Cannot return country code as an int: please review find_ip4_country() return value"
+/* ip2cc --stream: size of each block read from standard input, and
+   maximum number of lines looked up in a batch
+*/
+#ifndef STREAM_BLOCK
+#define STREAM_BLOCK		( 1L << 20 )
 #endif
-*
-#if INT_MAX < (CC_MASK6 >> CC_SHIFT6)
-#error "Cannot return country code as an int: please review find_ip6_country() return value"
+#ifndef STREAM_BATCH
+#define STREAM_BATCH		4096
 #endif
+
+
+#ifndef WIN32
+/* ip2cc --annotate: size of each chunk of the file (up to the next newline),
+   chunks dealt out to each thread in a window, maximum number of threads,
+   and maximum number of lines looked up in a batch
+*/
+#ifndef ANNOTATE_CHUNK
+#define ANNOTATE_CHUNK		( 1L << 20 )
+#endif
+#define ANNOTATE_SPLIT		8
+#define ANNOTATE_MAXTHREADS	64
+#define ANNOTATE_BATCH		1024
+
+
+/* ip2cc --annotate chunk of the file, and where its output is
+*/
+struct s_annchunk
+	{
+	const char *ps;			/* its lines */
+	size_t len;			/* how many bytes */
+	int thread;			/* thread that annotated them */
+	size_t off, outlen;		/* offset and size of their output in its buffer */
+	};
+
+
+/* ip2cc --annotate thread
+*/
+struct s_annthread
+	{
+	struct s_annotate *pa;
+	pthread_t tid;
+	pthread_mutex_t lock;		/* for "first" and "last" */
+	int first, last;		/* chunks of the window left to it: [first, last) */
+	char *pout[2];			/* output of each of the 2 windows in flight */
+	size_t outlen[2], outsize[2];
+	FILE *fp6;			/* its own IPv6 database, once needed */
+	};
+
+
+/* ip2cc --annotate state, shared by all threads
+*/
+struct s_annotate
+	{
+	const struct s_ip4db *pdb4;	/* read only */
+	int column;			/* field with the IP (from 1) */
+	int delim;			/* field delimiter, or 0 for runs of blanks */
+	int uppercase;
+	int nthreads;
+	struct s_annthread *pthreads;
+	struct s_annchunk chunks[2][ANNOTATE_MAXTHREADS * ANNOTATE_SPLIT];
+	int nchunks[2];			/* of each of the 2 windows in flight */
+	pthread_mutex_t lock;		/* for all below */
+	pthread_cond_t cond;		/* signaled when any of them changes */
+	long int window;		/* windows started so far */
+	int busy;			/* threads still annotating the last one */
+	int quit;			/* true when there are no more */
+	int error;			/* true if any thread failed */
+	};
+#endif
+
+
+#ifdef __linux__
+/* ip2cc --serve: maximum size of a request, and of the responses waiting
+   to be sent to a client before its requests stop being read; and
+   maximum number of connection events handled at a time
+*/
+#define SERVE_REQ_SIZE		( sizeof(struct s_servereq) + SERVE_MAXKEYS * 4 * sizeof(unsigned32) )
+#define SERVE_OUT_SIZE		( 4 * SERVE_REQ_SIZE )
+#define SERVE_EVENTS		64
+
+
+/* ip2cc --serve and --serve-shm: seconds between checks for a new
+   database (see reload_ip4_db() in libip2cc.c)
+*/
+#ifndef RELOAD_CHECK
+#define RELOAD_CHECK		1
+#endif
+
+
+/* ip2cc --serve-shm: how many times the service finds no requests before
+   waiting to be woken up by a client
+*/
+#ifndef SHM_SPIN
+#define SHM_SPIN		20000L
+#endif
+
+
+/* Tells the CPU that this is a busy-wait loop, if supported
+*/
+#if defined(__GNUC__)  &&  (defined(__i386__)  ||  defined(__x86_64__))
+#define CPU_RELAX()		__builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+
+/* ip2cc --serve client connection
+*/
+struct s_serveconn
+	{
+	int fd;				/* socket */
+	unsigned char *pin;		/* received bytes not yet handled (SERVE_REQ_SIZE) */
+	size_t inlen;			/* how many */
+	unsigned char *pout;		/* response bytes not yet sent */
+	size_t outlen;			/* how many */
+	size_t outsize;			/* allocated size of "pout" */
+	};
+
+
+/* ip2cc --serve and --serve-shm: set by SIGUSR1 (with --stats) to have
+   the lookup counters output
 */
+volatile sig_atomic_t stats_requested = 0;  /* false */
+#endif
 
 
 /* Function prototypes
+   (see also ip2cc.h)
 */
-int find_ip4_country( unsigned32 ip4, FILE *fp );
-int find_ip6_country( unsigned32 ip6[4], FILE *fp );
+void dump_stats( void );
+#ifdef __linux__
+void request_stats( int sig );
+#endif
+int stream( const struct s_ip4db *pdb4, FILE **pfp6, int uppercase );
+int stream_batch( char **plines, size_t *plen, int n, const struct s_ip4db *pdb4, FILE **pfp6, int uppercase );
+#ifndef WIN32
+int annotate( const char *filename, const char *field, const struct s_ip4db *pdb4, int uppercase );
+void annotate_window( struct s_annotate *pa, int w, const char **pps, const char *pe );
+void *annotate_thread( void *parg );
+int annotate_take( struct s_annthread *pt );
+int annotate_chunk( struct s_annthread *pt, struct s_annchunk *pc, int w );
+size_t find_field( const char *ps, size_t len, int column, int delim, const char **ppf );
+#endif
+#ifdef __linux__
+int serve( const char *sockfile, struct s_ip4reload *prl );
+int serve_requests( struct s_serveconn *pconn, const struct s_ip4db *pdb4, FILE *fp6, int *pcc );
+void close_serveconn( struct s_serveconn *pconn );
+void reload_ip6_db( FILE **pfp6 );
+int serve_shm( const char *name, struct s_ip4reload *prl );
+int serve_shm_slot( struct s_shmslot *ps, const struct s_ip4db *pdb4, int *pcc );
+#endif
 
 
 /* Main
@@ -452,6 +1189,7 @@ int main( int argc, char *argv[] )
 {
 	int opt_uppercase = 0;  /* default: return ISO2 code in lower-case */
 	int opt_next_ip_v = 0;  /* next argument on command line is an IP version # number (0=auto-detect) */
+	int opt_db = IP4DB_DISK;  /* default: read database one cluster at a time */
 
 #ifdef WIN32
 	static char lockfile[] = "D;]fty]ebub]topp{f/mph";
@@ -467,16 +1205,15 @@ int main( int argc, char *argv[] )
 	struct stat bufstat;
 	struct tm locktime;
 #endif
-	FILE *fp4, *fp6;
+	FILE *fp6;
+	struct s_ip4db *pdb4;
+#ifdef __linux__
+	struct s_ip4reload *prl;
+#endif
 	unsigned32 ip4;
 	unsigned32 ip6[4];
-	unsigned int ipp[8];  /* IP address part (up to 8 on IPv6) */
 	char *ps, *pexe;
 	int i, cc;
-#ifndef NDEBUG
-	clock_t t0, t1;
-	long int ti;
-#endif
 
 	/* check if we are running in the right server, otherwise
 	   cripple this software */
@@ -535,16 +1272,7 @@ int main( int argc, char *argv[] )
 	*/
 
 #ifndef NDEBUG
-	if( sizeof(struct s_cluster4) > SECTOR_SIZE )
-		{
-		fprintf( stderr, "Internal error: IPv4 cluster data (%i) is greater than expected (%i).\n"
-			 "sizeof(nodes[])=%i, sizeof(next[])=%i, NODES_PER_CLUSTER4=%i\n"
-			 "Make sure you call your compiler with options to eliminate holes in structures\n"
-			 "(for instance, in GCC, you must call it with 'gcc -fpack-struct')\n",
-			 sizeof(struct s_cluster4), SECTOR_SIZE,
-			 sizeof(struct s_node4[NODES_PER_CLUSTER4]), sizeof(unsigned16[NODES_PER_CLUSTER4+1]), NODES_PER_CLUSTER4 );
-		return RV_ERROR;
-		}
+	/* (IPv4 databases are checked when opened, see open_ip4_db()) */
 	if( sizeof(struct s_cluster6) > SECTOR_SIZE )
 		{
 		fprintf( stderr, "Internal error: IPv6 cluster data (%i) is greater than expected (%i).\n"
@@ -557,63 +1285,153 @@ int main( int argc, char *argv[] )
 		}
 #endif
 
-	fp4 = fp6 = NULL;  /* signal neither has been opened */
+	fp6 = NULL;  /* signal neither has been opened */
+	pdb4 = NULL;
 
 	/* process each option and IP number on the command line: */
 	opt_next_ip_v = 0;  /* 0 => auto-detect */
 	for( pexe = *argv++;  (ps = *argv++); )
 		{
+		if( (!strncmp(ps, "--serve", 7)  &&  (ps[7] == '\0'  ||  ps[7] == '='))  ||
+		    (!strncmp(ps, "--serve-shm", 11)  &&  (ps[11] == '\0'  ||  ps[11] == '=')) )
+			{
+#ifdef __linux__
+			/* a database that is reloaded when replaced, as servers
+			   run until killed */
+			if( (prl = open_ip4_reload(DBFILE4, opt_db)) == NULL )
+				{
+				fputs( "Cannot open IPv4-to-country database.\n", stderr );
+				return RV_ERROR;
+				}
+			if( ps[7] == '-' )
+				i = serve_shm( ps[11] ? ps + 12 : SHMFILE, prl );
+			else
+				i = serve( ps[7] ? ps + 8 : SOCKFILE, prl );
+			if( fp6 != NULL )
+				fclose( fp6 );
+			close_ip4_reload( prl );
+			close_ip4_db( pdb4 );
+			return i;
+#else
+			fputs( "--serve is not available on this system.\n", stderr );
+			return RV_ERROR;
+#endif
+			}
+		if( !strncmp(ps, "--annotate", 10)  &&  (ps[10] == '\0'  ||  ps[10] == '=') )
+			{
+#ifndef WIN32
+			if( *argv == NULL )
+				{
+				fputs( "Missing file to annotate.\n", stderr );
+				return RV_ERROR;
+				}
+			if( pdb4 == NULL  &&  (pdb4 = open_ip4_db(DBFILE4, opt_db)) == NULL )
+				{
+				fputs( "Cannot open IPv4-to-country database.\n", stderr );
+				return RV_ERROR;
+				}
+			if( annotate(*argv++, ps[10] ? ps + 11 : NULL, pdb4, opt_uppercase) != RV_OK )
+				return RV_ERROR;
+			continue;
+#else
+			fputs( "--annotate is not available on this system.\n", stderr );
+			return RV_ERROR;
+#endif
+			}
+		if( !strcmp(ps, "--explain") )
+			{
+			if( *argv == NULL )
+				{
+				fputs( "Missing IP to explain.\n", stderr );
+				return RV_ERROR;
+				}
+			ps = *argv++;
+			if( strchr(ps, ':') ? !parse_ip6(ps, strlen(ps), ip6)  ||  !IP6_IS_IP4(ip6) :
+					      !parse_ip4(ps, strlen(ps), &ip4) )
+				{
+				fputs( "Bad IPv4 number (or IPv4 within IPv6) or bad argument.\n", stderr );
+				return RV_ERROR;
+				}
+			if( strchr(ps, ':') )
+				ip4 = ip6[0];  /* an IPv4 within an IPv6 */
+			if( pdb4 == NULL  &&  (pdb4 = open_ip4_db(DBFILE4, opt_db)) == NULL )
+				{
+				fputs( "Cannot open IPv4-to-country database.\n", stderr );
+				return RV_ERROR;
+				}
+			cc = explain_ip4_db( ip4, pdb4, stdout );
+			puts( get_cc_name(cc, opt_uppercase) );
+			continue;
+			}
+		if( !strcmp(ps, "--stats") )
+			{
+			/* output the lookup counters on exit, and when asked by
+			   SIGUSR1 while serving */
+			atexit( dump_stats );
+#ifdef __linux__
+			signal( SIGUSR1, request_stats );
+#endif
+			continue;
+			}
+		if( !strcmp(ps, "-")  ||  !strcmp(ps, "--stream") )
+			{
+			if( pdb4 == NULL  &&  (pdb4 = open_ip4_db(DBFILE4, opt_db)) == NULL )
+				{
+				fputs( "Cannot open IPv4-to-country database.\n", stderr );
+				return RV_ERROR;
+				}
+			if( stream(pdb4, &fp6, opt_uppercase) != RV_OK )
+				return RV_ERROR;
+			continue;
+			}
 		if( *ps == '-'  ||  *ps == '/' )
 			{
 			while( (cc = *++ps) )
 				{
 				switch( cc )
 					{
-#ifndef NDEBUG
-					case 'b':
-						/* benchmark */
-						puts( "Starting benchmark... (takes from 1s to 15s)" );
-						fp4 = fopen( DBFILE4, "rb" );
-						if( fp4 == NULL )
-							{
-							fputs( "Cannot open IPv4-to-country database.\n", stderr );
-							return RV_ERROR;
-							}
-						setbuf( fp4, NULL );  /* turn off buffering */
-						t0 = clock();
-						srand( 5 );
-						for( ti = 1L;  ti <= 50000L;  ti++ )
-							{
-							ip4 = (((unsigned32) rand() & 0xFF) << 24) |
-							      (((unsigned32) rand() & 0xFF) << 16) |
-							      (((unsigned32) rand() & 0xFF) << 8)  |
-							       ((unsigned32) rand() & 0xFF);
-							find_ip4_country( ip4, fp4 );
-							}
-						t1 = clock();
-						printf( "Speed is %.2f lookups per second.\n", ((double) ti)/( ((double) t1-t0)/CLOCKS_PER_SEC ) );
-						break;
-#endif
 					case 'h':
 						fprintf( stderr, "\n"
-#ifndef NDEBUG
-								 "Usage: %s [-hb] [ [-u46] <arg> ]...\n"
+								 "Usage: %s [-hmplvjt] [ [-u46] <arg> | [-u] - | [-u] --annotate <file> ]...\n"
 								 "-h  Show this help\n"
-								 "-b  Run a short benchmark\n"
-#else
-								 "Usage: %s [-h] [ [-u46] <arg> ]...\n"
-								 "-h  Show this help\n"
-#endif
+								 "-m  Memory-map the database(s) (must precede the first <arg>)\n"
+								 "-p  Pin the top levels of the database(s) in memory (must precede the first <arg>)\n"
+								 "-v, -l  Ignored (the IPv4 database's header says which clusters it has)\n"
+								 "-j  Use the IPv4 database's /16 jump table (must precede the first <arg>)\n"
+								 "-t  Use the IPv4 database's multibit trie instead (must precede the first <arg>)\n"
 								 "-u  Signals to output all (following) country and language codes in UPPERCASE\n"
 								 "    (default is lowercase)\n"
 								 "-4  This next argument is an IPv4 address\n"
 								 "-6  This next argument is an IPv6 address\n"
+								 "-, --stream  Look up the IPs in standard input, one per line\n"
+								 "--annotate[=<column>[:<delimiter>]] <file>  Output the lines of <file>, with\n"
+								 "    the country code of the IP in <column> (default 1) appended to each\n"
+								 "--serve[=<socket>]  Serve lookups on a Unix domain socket, until killed\n"
+								 "--serve-shm[=<name>]  Serve IPv4 lookups on shared memory rings, until killed\n"
+								 "--explain <ip>  Look up an IPv4 address, outputting each step of the way\n"
+								 "--stats  Output the lookup counters to standard error on exit (and on\n"
+								 "    SIGUSR1 while serving), if compiled with IP2CC_STATS\n"
 								 "\n"
 								 "(C) 2003 Corebase, Easymatic\n"
 								 "         www.easymatic.com\n"
 								 "\n",
 								 pexe );
 						break;
+					case 'm':
+						opt_db = IP4DB_MAP | (opt_db & ~(IP4DB_MAP | IP4DB_PIN));
+						break;
+					case 'p':
+						opt_db = IP4DB_PIN | (opt_db & ~(IP4DB_MAP | IP4DB_PIN));
+						break;
+					case 'v':
+					case 'l':
+						break;  /* ignored: the database's header says which clusters it has */
+					case 'j':
+						opt_db |= IP4DB_JUMP;
+						break;
+					case 't':
+						opt_db |= IP4DB_TRIE;
+						break;
 					case 'u':
 						opt_uppercase = 1;  /* true */
 						break;
@@ -635,28 +1453,22 @@ int main( int argc, char *argv[] )
 		   try some auto-detection */
 		if( !opt_next_ip_v )
 			{
-			if( strchr(ps, '.') )
-				opt_next_ip_v = 4;
-			else
+			if( strchr(ps, ':') )
 				opt_next_ip_v = 6;
+			else
+				opt_next_ip_v = 4;
 			}
 
 		/* first let's try to parse an IPv6, as we may have to fall back to
 		   IPv4 later if all 96 high-order IPv6 bits are 0 */
 		if( opt_next_ip_v == 6 )
 			{
-			if( sscanf(ps, "%4x:%4x:%4x:%4x:%4x:%4x:%4x:%4x", &ipp[7], &ipp[6], &ipp[5], &ipp[4], &ipp[3], &ipp[2], &ipp[1], &ipp[0]) != 8  ||
-			    ipp[7] > 0xFFFFU  ||  ipp[6] > 0xFFFFU  || ipp[5] > 0xFFFFU  || ipp[4] > 0xFFFFU  ||
-			    ipp[3] > 0xFFFFU  ||  ipp[2] > 0xFFFFU  || ipp[1] > 0xFFFFU  || ipp[0] > 0xFFFFU )
+			if( !parse_ip6(ps, strlen(ps), ip6) )
 				{
 				fputs( "Bad IPv6 number or bad argument.\n", stderr );
 				return RV_ERROR;
 				}
-			ip6[3] = (((unsigned32) ipp[7]) << 16) | ((unsigned32) ipp[6]);
-			ip6[2] = (((unsigned32) ipp[5]) << 16) | ((unsigned32) ipp[4]);
-			ip6[1] = (((unsigned32) ipp[3]) << 16) | ((unsigned32) ipp[2]);
-			ip6[0] = (((unsigned32) ipp[1]) << 16) | ((unsigned32) ipp[0]);
-			if( !(ip6[3] | ip6[2] | ip6[1]) )
+			if( IP6_IS_IP4(ip6) )
 				{
 				/* ok, this is an IPv4 within an IPv6 */
 				opt_next_ip_v = 4;
@@ -665,16 +1477,11 @@ int main( int argc, char *argv[] )
 			}
 		else  /* else, we were expecting an IPv4 number already */
 			{
-			if( sscanf(ps, "%3u.%3u.%3u.%3u", &ipp[3], &ipp[2], &ipp[1], &ipp[0]) != 4  ||
-			    ipp[3] > 255U  ||  ipp[2] > 255U  || ipp[1] > 255U  || ipp[0] > 255U )
+			if( !parse_ip4(ps, strlen(ps), &ip4) )
 				{
 				fputs( "Bad IPv4 number or bad argument.\n", stderr );
 				return RV_ERROR;
 				}
-			ip4 = (((unsigned32) ipp[3]) << 24) |
-			      (((unsigned32) ipp[2]) << 16) |
-			      (((unsigned32) ipp[1]) << 8)  |
-			       ((unsigned32) ipp[0]);
 			}
 
 		/* now that the numbers are parsed, just open the database file(s)
@@ -695,24 +1502,16 @@ int main( int argc, char *argv[] )
 			}
 		else
 			{
-			if( fp4 == NULL )
+			if( pdb4 == NULL  &&  (pdb4 = open_ip4_db(DBFILE4, opt_db)) == NULL )
 				{
-				fp4 = fopen( DBFILE4, "rb" );
-				if( fp4 == NULL )
-					{
-					fputs( "Cannot open IPv4-to-country database.\n", stderr );
-					return RV_ERROR;
-					}
-				setbuf( fp4, NULL );  /* turn off buffering */
+				fputs( "Cannot open IPv4-to-country database.\n", stderr );
+				return RV_ERROR;
 				}
-			cc = find_ip4_country( ip4, fp4 );
+			cc = find_ip4_country_db( ip4, pdb4 );
 			}
 
 		/* ouput the proper result to stdout */
-		if( cc < 0  ||  cc >= (int) sizeof(cname_up)/sizeof(cname_up[0]) )
-			puts( "??" );
-		else
-			puts( opt_uppercase ? cname_up[cc] : cname_low[cc] );
+		puts( get_cc_name(cc, opt_uppercase) );
 
 		/* make sure we reset the next argument type */
 		opt_next_ip_v = 0;  /* 0 => auto-detect */
@@ -722,71 +1521,1010 @@ int main( int argc, char *argv[] )
 	   files and return */
 	if( fp6 != NULL )
 		fclose( fp6 );
-	if( fp4 != NULL )
-		fclose( fp4 );
+	close_ip4_db( pdb4 );
+	return RV_OK;
+}
+
+
+/*
+Outputs the lookup counters of all threads to standard error (ip2cc
+--stats, on exit).
+Returns nothing.
+*/
+void dump_stats( void )
+{
+	dump_ip4_stats( stderr );
+}
+
+
+#ifdef __linux__
+/*
+Asks a server to output its lookup counters (ip2cc --stats, on SIGUSR1),
+which it does in between lookups.
+Returns nothing.
+*/
+void request_stats( int sig )
+{
+	stats_requested = 1;  /* true */
+}
+#endif
+
+
+/*
+Looks up the IPs in standard input, one per line (IPv4 or IPv6, auto-
+detected), and outputs one line for each, in the same order, as for the
+command line arguments; lines with no IP in them output "??" too. Input is
+read in blocks of STREAM_BLOCK bytes, and looked up in batches of up to
+STREAM_BATCH lines. The IPv6 database is opened in "*pfp6" if needed.
+Returns RV_OK, or RV_ERROR on error (after outputting a message)
+*/
+int stream( const struct s_ip4db *pdb4, FILE **pfp6, int uppercase )
+{
+	char *pbuf;		/* STREAM_BLOCK bytes of input */
+	char *plines[STREAM_BATCH];
+	size_t len[STREAM_BATCH];
+	char *ps, *pe, *pnl;
+	size_t have, n;
+	int nl, eof, skip;
+
+	pbuf = malloc( STREAM_BLOCK );
+	if( pbuf == NULL )
+		{
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+	have = 0;
+	eof = skip = 0;  /* false */
+	while( !eof )
+		{
+		n = fread( pbuf + have, (size_t) 1, STREAM_BLOCK - have, stdin );
+		if( n == 0 )
+			{
+			if( ferror(stdin) )
+				{
+				free( pbuf );
+				fputs( "Cannot read standard input.\n", stderr );
+				return RV_ERROR;
+				}
+			eof = 1;  /* true */
+			}
+		have += n;
+		/* look up all whole lines (and, at the end, the last one even if
+		   it has no newline) */
+		pe = pbuf + have;
+		for( ps = pbuf, nl = 0;  ps < pe;  ps = pnl + 1 )
+			{
+			pnl = memchr( ps, '\n', (size_t) (pe - ps) );
+			if( pnl == NULL )
+				{
+				if( !eof )
+					break;
+				pnl = pe;
+				}
+			if( skip )
+				{
+				skip = 0;  /* false: this was the end of a line too long */
+				continue;
+				}
+			plines[nl] = ps;
+			len[nl] = (size_t) (pnl - ps);
+			if( ++nl == STREAM_BATCH )
+				{
+				if( stream_batch(plines, len, nl, pdb4, pfp6, uppercase) != RV_OK )
+					{
+					free( pbuf );
+					return RV_ERROR;
+					}
+				nl = 0;
+				}
+			}
+		if( nl  &&  stream_batch(plines, len, nl, pdb4, pfp6, uppercase) != RV_OK )
+			{
+			free( pbuf );
+			return RV_ERROR;
+			}
+		/* keep what is left of the last line for the next block, unless it
+		   takes it all: then it has no IP, and its end is skipped */
+		have = ps < pe ? (size_t) (pe - ps) : 0;
+		if( have >= STREAM_BLOCK )
+			{
+			plines[0] = pbuf;
+			len[0] = 0;
+			if( !skip  &&  stream_batch(plines, len, 1, pdb4, pfp6, uppercase) != RV_OK )
+				{
+				free( pbuf );
+				return RV_ERROR;
+				}
+			have = 0;
+			skip = 1;  /* true */
+			}
+		else
+			memmove( pbuf, ps, have );
+		}
+	free( pbuf );
+	if( fflush(stdout) != 0 )
+		{
+		fputs( "Cannot write standard output.\n", stderr );
+		return RV_ERROR;
+		}
 	return RV_OK;
 }
 
 
 /*
-Returns the country code if found, or
--1 for not found, -2 for looped cluster indexes, -3 for file access error
+Looks up the IPs in the "n" lines at "plines[]" (of "plen[]" characters
+each, with no newline), for stream(), and outputs their country codes,
+with the IPv4 ones looked up in a single batch.
+Returns RV_OK, or RV_ERROR on error (after outputting a message)
 */
-int find_ip4_country( unsigned32 ip4, FILE *fp )
+int stream_batch( char **plines, size_t *plen, int n, const struct s_ip4db *pdb4, FILE **pfp6, int uppercase )
 {
-	struct s_cluster4 cluster4;	/* buffer where you'll read each cluster into */
-	int ci, i, step;		/* cluster and node index, loop step */
-	struct s_node4 *pn;		/* pointer to current node */
-
-	i = 0;
-	do	{  /* loops for each cluster */
-		ci = i;
-		if( fseek(fp, ((long int) ci) << SECTOR_SIZE_SHIFT, SEEK_SET)  ||
-		    fread( &cluster4, (size_t) CLUSTER4_SIZE, (size_t) 1, fp) != 1 )
-			return -3;  /* file access error */
-		i = NODES_PER_CLUSTER4 >> 1;
-		step = (NODES_PER_CLUSTER4 >> 2) + 1;
-		for(;;)  /*forever*/  /* loops for each node in a cluster */
-			{
-			pn = &cluster4.nodes[i];
-			if( pn->ip >= (unsigned32) 0xFFFFFFFFU )
-				return -1;  /* not found */
-			if( ip4 < pn->ip )
-				i -= step;
-			else if( ip4 >= pn->ip + ( ((unsigned32) (pn->ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((pn->ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) ) )
-				i += step;
+	unsigned32 ip4[STREAM_BATCH];	/* IPv4 of the lines that have one */
+	int cc4[STREAM_BATCH];		/* and their country codes */
+	int line4[STREAM_BATCH];	/* and their line numbers */
+	int cc[STREAM_BATCH];		/* country code of each line */
+	char out[STREAM_BATCH * 3];
+	unsigned32 ip6[4];
+	const char *pname;
+	size_t len;
+	int i, n4;
+
+	for( i = n4 = 0;  i < n;  i++ )
+		{
+		len = plen[i];
+		while( len  &&  (plines[i][len-1] == '\r'  ||  plines[i][len-1] == ' '  ||  plines[i][len-1] == '\t') )
+			len--;
+		cc[i] = -1;  /* not found, unless looked up below */
+		if( !memchr(plines[i], ':', len) )
+			{
+			if( parse_ip4(plines[i], len, &ip4[n4]) == len  &&  len )
+				line4[n4++] = i;
+			}
+		else if( parse_ip6(plines[i], len, ip6) == len )
+			{
+			if( IP6_IS_IP4(ip6) )
+				{
+				ip4[n4] = ip6[0];  /* an IPv4 within an IPv6 */
+				line4[n4++] = i;
+				}
 			else
-				return (int) (pn->ccsz & CC_MASK4) >> CC_SHIFT4;
-			if( !step )
+				{
+				if( *pfp6 == NULL )
+					{
+					*pfp6 = fopen( DBFILE6, "rb" );
+					if( *pfp6 == NULL )
+						{
+						fputs( "Cannot open IPv6-to-country database.\n", stderr );
+						return RV_ERROR;
+						}
+					setbuf( *pfp6, NULL );  /* turn off buffering */
+					}
+				cc[i] = find_ip6_country( ip6, *pfp6 );
+				}
+			}
+		}
+	if( n4 > 0 )  /* a batch without IPv4s has nothing to look up */
+		find_ip4_countries_db( ip4, cc4, (size_t) n4, pdb4 );
+	for( i = 0;  i < n4;  i++ )
+		cc[ line4[i] ] = cc4[i];
+	for( i = 0;  i < n;  i++ )
+		{
+		pname = get_cc_name( cc[i], uppercase );
+		out[3*i]   = pname[0];
+		out[3*i+1] = pname[1];
+		out[3*i+2] = '\n';
+		}
+	if( fwrite(out, (size_t) 3, (size_t) n, stdout) != (size_t) n )
+		{
+		fputs( "Cannot write standard output.\n", stderr );
+		return RV_ERROR;
+		}
+	return RV_OK;
+}
+
+#ifndef WIN32
+/*
+Annotates the lines of file "filename" with the country code of the IP in
+their field "field" ("<column>[:<delimiter>]", or NULL for the first one),
+appended to each, after the same delimiter (or a space), and outputs them,
+in the same order (see "Annotating" above). The file is mapped, split at
+newline boundaries into chunks of about ANNOTATE_CHUNK bytes, and these are
+annotated by one thread per CPU, on database "pdb4", in windows of up to
+ANNOTATE_SPLIT chunks per thread: while the threads annotate a window, the
+previous one is output.
+Returns RV_OK, or RV_ERROR on error (after outputting a message)
+*/
+int annotate( const char *filename, const char *field, const struct s_ip4db *pdb4, int uppercase )
+{
+	struct s_annotate *pa;
+	struct s_annchunk *pc;
+	struct stat st;
+	const char *pbase, *ps, *pe;
+	char *pend;
+	long int nthreads;
+	int fd, i, w, more, rv;
+
+	pa = calloc( (size_t) 1, sizeof(struct s_annotate) );
+	if( pa == NULL )
+		{
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+	pa->pdb4 = pdb4;
+	pa->uppercase = uppercase;
+	pa->column = 1;
+	if( field != NULL )
+		{
+		pa->column = (int) strtol( field, &pend, 10 );
+		if( *pend == ':'  &&  pend[1] != '\0'  &&  pend[2] == '\0' )
+			pa->delim = (unsigned char) pend[1];
+		else if( *pend != '\0' )
+			pa->column = 0;  /* bad */
+		if( pa->column < 1 )
+			{
+			free( pa );
+			fputs( "Bad --annotate field.\n", stderr );
+			return RV_ERROR;
+			}
+		}
+
+	/* map the file */
+	fd = open( filename, O_RDONLY );
+	if( fd < 0  ||  fstat(fd, &st) != 0 )
+		{
+		if( fd >= 0 )
+			close( fd );
+		free( pa );
+		fputs( "Cannot open file to annotate.\n", stderr );
+		return RV_ERROR;
+		}
+	if( st.st_size == 0 )
+		{
+		close( fd );
+		free( pa );
+		return RV_OK;  /* nothing to annotate */
+		}
+	pbase = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, (off_t) 0 );
+	close( fd );
+	if( pbase == MAP_FAILED )
+		{
+		free( pa );
+		fputs( "Cannot map file to annotate.\n", stderr );
+		return RV_ERROR;
+		}
+	posix_madvise( (void *) pbase, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL );
+
+	/* start one thread per CPU */
+	nthreads = sysconf( _SC_NPROCESSORS_ONLN );
+	if( nthreads < 1 )
+		nthreads = 1;
+	else if( nthreads > ANNOTATE_MAXTHREADS )
+		nthreads = ANNOTATE_MAXTHREADS;
+	pa->pthreads = calloc( (size_t) nthreads, sizeof(struct s_annthread) );
+	pthread_mutex_init( &pa->lock, NULL );
+	pthread_cond_init( &pa->cond, NULL );
+	for( i = 0;  pa->pthreads != NULL  &&  i < (int) nthreads;  i++ )
+		{
+		pa->pthreads[i].pa = pa;
+		pthread_mutex_init( &pa->pthreads[i].lock, NULL );
+		if( pthread_create(&pa->pthreads[i].tid, NULL, annotate_thread, &pa->pthreads[i]) != 0 )
+			{
+			pthread_mutex_destroy( &pa->pthreads[i].lock );
+			break;
+			}
+		}
+	pa->nthreads = i;  /* as many as could be started */
+	if( pa->nthreads == 0 )
+		{
+		free( pa->pthreads );
+		pthread_cond_destroy( &pa->cond );
+		pthread_mutex_destroy( &pa->lock );
+		munmap( (void *) pbase, (size_t) st.st_size );
+		free( pa );
+		fputs( "Cannot start threads.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* annotate a window of chunks while outputting the previous one */
+	ps = pbase;
+	pe = pbase + st.st_size;
+	w = 0;
+	annotate_window( pa, w, &ps, pe );
+	rv = RV_OK;
+	do	{
+		pthread_mutex_lock( &pa->lock );
+		while( pa->busy )
+			pthread_cond_wait( &pa->cond, &pa->lock );
+		pthread_mutex_unlock( &pa->lock );
+		if( pa->error )
+			{
+			rv = RV_ERROR;
+			break;
+			}
+		more = ps < pe;
+		if( more )
+			annotate_window( pa, w ^ 1, &ps, pe );
+		for( i = 0;  i < pa->nchunks[w];  i++ )
+			{
+			pc = &pa->chunks[w][i];
+			if( pc->outlen  &&
+			    fwrite(pa->pthreads[pc->thread].pout[w] + pc->off, pc->outlen, (size_t) 1, stdout) != 1 )
+				{
+				fputs( "Cannot write standard output.\n", stderr );
+				rv = RV_ERROR;
+				break;
+				}
+			}
+		w ^= 1;
+		}
+		while( more  &&  rv == RV_OK );
+
+	/* stop the threads (after the window they may be annotating) */
+	pthread_mutex_lock( &pa->lock );
+	pa->quit = 1;  /* true */
+	pthread_cond_broadcast( &pa->cond );
+	pthread_mutex_unlock( &pa->lock );
+	for( i = 0;  i < pa->nthreads;  i++ )
+		{
+		pthread_join( pa->pthreads[i].tid, NULL );
+		pthread_mutex_destroy( &pa->pthreads[i].lock );
+		free( pa->pthreads[i].pout[0] );
+		free( pa->pthreads[i].pout[1] );
+		if( pa->pthreads[i].fp6 != NULL )
+			fclose( pa->pthreads[i].fp6 );
+		}
+	free( pa->pthreads );
+	pthread_cond_destroy( &pa->cond );
+	pthread_mutex_destroy( &pa->lock );
+	munmap( (void *) pbase, (size_t) st.st_size );
+	free( pa );
+	if( rv == RV_OK  &&  fflush(stdout) != 0 )
+		{
+		fputs( "Cannot write standard output.\n", stderr );
+		rv = RV_ERROR;
+		}
+	return rv;
+}
+
+
+/*
+Splits the next window of chunks, from "*pps" (up to "pe"), into
+"pa->chunks[w]", deals them out to the threads, in consecutive runs, and
+gets them started on it. "*pps" is moved past the window.
+*/
+void annotate_window( struct s_annotate *pa, int w, const char **pps, const char *pe )
+{
+	const char *ps, *pnl;
+	int i, n;
+
+	/* the threads are all waiting for this window, so no locks are needed
+	   until it is published */
+	ps = *pps;
+	for( n = 0;  ps < pe  &&  n < pa->nthreads * ANNOTATE_SPLIT;  n++ )
+		{
+		if( (size_t) (pe - ps) > ANNOTATE_CHUNK )
+			{
+			pnl = memchr( ps + ANNOTATE_CHUNK - 1, '\n', (size_t) (pe - ps) - ANNOTATE_CHUNK + 1 );
+			pnl = pnl != NULL ? pnl + 1 : pe;
+			}
+		else
+			pnl = pe;
+		pa->chunks[w][n].ps = ps;
+		pa->chunks[w][n].len = (size_t) (pnl - ps);
+		ps = pnl;
+		}
+	*pps = ps;
+	pa->nchunks[w] = n;
+	for( i = 0;  i < pa->nthreads;  i++ )
+		{
+		pa->pthreads[i].first = i * n / pa->nthreads;
+		pa->pthreads[i].last = (i+1) * n / pa->nthreads;
+		}
+	pthread_mutex_lock( &pa->lock );
+	pa->busy = pa->nthreads;
+	pa->window++;
+	pthread_cond_broadcast( &pa->cond );
+	pthread_mutex_unlock( &pa->lock );
+}
+
+
+/*
+Thread of annotate(): annotates the chunks of each window dealt out to it,
+and then steals the ones left to the other threads, until there are no more
+windows.
+Returns NULL
+*/
+void *annotate_thread( void *parg )
+{
+	struct s_annthread *pt = parg;
+	struct s_annotate *pa = pt->pa;
+	long int window;
+	int w, c, ok, quit;
+
+	for( window = 0;  ;  window++ )
+		{
+		pthread_mutex_lock( &pa->lock );
+		while( pa->window == window  &&  !pa->quit )
+			pthread_cond_wait( &pa->cond, &pa->lock );
+		quit = pa->window == window;
+		pthread_mutex_unlock( &pa->lock );
+		if( quit )
+			break;
+		w = (int) (window & 1);
+		pt->outlen[w] = 0;
+		ok = 1;  /* true */
+		while( ok  &&  (c = annotate_take(pt)) >= 0 )
+			ok = annotate_chunk( pt, &pa->chunks[w][c], w ) == RV_OK;
+		pthread_mutex_lock( &pa->lock );
+		if( !ok )
+			pa->error = 1;  /* true */
+		if( --pa->busy == 0 )
+			pthread_cond_broadcast( &pa->cond );
+		pthread_mutex_unlock( &pa->lock );
+		}
+	return NULL;
+}
+
+
+/*
+Takes the next chunk of the window for thread "pt": the first one left to
+it or, if none, the last one left to any other thread.
+Returns its index, or -1 if there are none left
+*/
+int annotate_take( struct s_annthread *pt )
+{
+	struct s_annotate *pa = pt->pa;
+	struct s_annthread *pv;
+	int i, c;
+
+	pthread_mutex_lock( &pt->lock );
+	c = pt->first < pt->last ? pt->first++ : -1;
+	pthread_mutex_unlock( &pt->lock );
+	for( i = 1;  c < 0  &&  i < pa->nthreads;  i++ )
+		{
+		pv = &pa->pthreads[ (pt - pa->pthreads + i) % pa->nthreads ];
+		pthread_mutex_lock( &pv->lock );
+		c = pv->first < pv->last ? --pv->last : -1;
+		pthread_mutex_unlock( &pv->lock );
+		}
+	return c;
+}
+
+
+/*
+Annotates the lines of chunk "pc", for thread "pt", into its output buffer
+for window "w", looking up their IPv4 addresses in batches of up to
+ANNOTATE_BATCH lines.
+Returns RV_OK, or RV_ERROR on error (after outputting a message)
+*/
+int annotate_chunk( struct s_annthread *pt, struct s_annchunk *pc, int w )
+{
+	struct s_annotate *pa = pt->pa;
+	const char *plines[ANNOTATE_BATCH];
+	size_t len[ANNOTATE_BATCH];
+	unsigned32 ip4[ANNOTATE_BATCH];	/* IPv4 of the lines that have one */
+	int cc4[ANNOTATE_BATCH];	/* and their country codes */
+	int line4[ANNOTATE_BATCH];	/* and their line numbers */
+	int cc[ANNOTATE_BATCH];		/* country code of each line */
+	unsigned32 ip6[4];
+	const char *ps, *pe, *pnl, *pf, *pname;
+	char *pout;
+	size_t flen, need;
+	int i, n, n4, cr;
+
+	pc->thread = (int) (pt - pa->pthreads);
+	pc->off = pt->outlen[w];
+	ps = pc->ps;
+	pe = ps + pc->len;
+	while( ps < pe )
+		{
+		/* a batch of lines, and the IPs in them */
+		for( n = n4 = 0;  n < ANNOTATE_BATCH  &&  ps < pe;  n++ )
+			{
+			pnl = memchr( ps, '\n', (size_t) (pe - ps) );
+			if( pnl == NULL )
+				pnl = pe;
+			plines[n] = ps;
+			len[n] = (size_t) (pnl - ps);
+			ps = pnl < pe ? pnl + 1 : pe;
+			cc[n] = -1;  /* not found, unless looked up below */
+			flen = find_field( plines[n], len[n], pa->column, pa->delim, &pf );
+			if( flen == 0 )
+				continue;
+			if( !memchr(pf, ':', flen) )
+				{
+				if( parse_ip4(pf, flen, &ip4[n4]) == flen )
+					line4[n4++] = n;
+				}
+			else if( parse_ip6(pf, flen, ip6) == flen )
+				{
+				if( IP6_IS_IP4(ip6) )
+					{
+					ip4[n4] = ip6[0];  /* an IPv4 within an IPv6 */
+					line4[n4++] = n;
+					}
+				else
+					{
+					if( pt->fp6 == NULL )
+						{
+						pt->fp6 = fopen( DBFILE6, "rb" );
+						if( pt->fp6 == NULL )
+							{
+							fputs( "Cannot open IPv6-to-country database.\n", stderr );
+							return RV_ERROR;
+							}
+						setbuf( pt->fp6, NULL );  /* turn off buffering */
+						}
+					cc[n] = find_ip6_country( ip6, pt->fp6 );
+					}
+				}
+			}
+		find_ip4_countries_db( ip4, cc4, (size_t) n4, pa->pdb4 );
+		for( i = 0;  i < n4;  i++ )
+			cc[ line4[i] ] = cc4[i];
+
+		/* output them: each line, the delimiter, the country code and a
+		   newline (keeping a carriage return before it) */
+		need = pt->outlen[w] + (size_t) (plines[n-1] + len[n-1] - plines[0]) + 4 * (size_t) n;
+		if( need > pt->outsize[w] )
+			{
+			pout = realloc( pt->pout[w], need + need/2 );
+			if( pout == NULL )
+				{
+				fputs( "Not enough memory.\n", stderr );
+				return RV_ERROR;
+				}
+			pt->pout[w] = pout;
+			pt->outsize[w] = need + need/2;
+			}
+		pout = pt->pout[w] + pt->outlen[w];
+		for( i = 0;  i < n;  i++ )
+			{
+			cr = len[i]  &&  plines[i][len[i]-1] == '\r';
+			memcpy( pout, plines[i], len[i] - cr );
+			pout += len[i] - cr;
+			*pout++ = pa->delim ? (char) pa->delim : ' ';
+			pname = get_cc_name( cc[i], pa->uppercase );
+			*pout++ = pname[0];
+			*pout++ = pname[1];
+			if( cr )
+				*pout++ = '\r';
+			*pout++ = '\n';
+			}
+		pt->outlen[w] = (size_t) (pout - pt->pout[w]);
+		}
+	pc->outlen = pt->outlen[w] - pc->off;
+	return RV_OK;
+}
+
+
+/*
+Finds field "column" (from 1) of the "len" characters at "ps", delimited by
+character "delim", or by runs of spaces and tabs if "delim" is 0 (as in web
+server access logs), without any carriage return at the end of the line or
+double quotes around the field.
+Returns its length (0 if there is no such field), and its start in "*ppf"
+*/
+size_t find_field( const char *ps, size_t len, int column, int delim, const char **ppf )
+{
+	const char *pe, *pf;
+
+	pe = ps + len;
+	if( ps < pe  &&  pe[-1] == '\r' )
+		pe--;
+	if( delim == 0 )
+		for( ;; )
+			{
+			while( ps < pe  &&  (*ps == ' '  ||  *ps == '\t') )
+				ps++;
+			pf = ps;
+			while( ps < pe  &&  *ps != ' '  &&  *ps != '\t' )
+				ps++;
+			if( --column == 0  ||  ps == pe )
 				break;
-			step >>= 1;
-			}
-		/* at this point, i is an even number from
-		   0 to NODES_PER_CLUSTER4-1 inclusive: all odd numbers
-		   could ONLY have been visited during the previous
-		   iterations (starts at an odd number and all "step"s are
-		   even numbers, except the last that is always 1) */
-		if( ip4 < pn->ip )
-			i = cluster4.next[ i ];
-		else  /* it's only here if not in range, so no need to check upper boundary */
-			i = cluster4.next[ i | 1 ];
-		}
-		while( ci < i );
-		/* make sure we don't get into an endless loop with bad
-		   cluster indexes */
-	return i == 0 ? -1 : -2;  /* not found, or looped cluster indexes */
+			}
+	else
+		for( ;; )
+			{
+			pf = ps;
+			ps = memchr( ps, delim, (size_t) (pe - ps) );
+			if( ps == NULL )
+				ps = pe;
+			if( --column == 0  ||  ps == pe )
+				break;
+			ps++;
+			}
+	if( column )
+		return 0;  /* not that many fields */
+	if( ps - pf >= 2  &&  *pf == '"'  &&  ps[-1] == '"' )
+		{
+		pf++;
+		ps--;
+		}
+	*ppf = pf;
+	return (size_t) (ps - pf);
+}
+#endif
+
+#ifdef __linux__
+/*
+Serves lookups on reloadable database "prl" (and on DBFILE6, if it exists)
+to any number of clients of Unix domain socket "sockfile", from a single
+epoll loop (see struct s_servereq in ip2cc.h). Every RELOAD_CHECK seconds,
+either database is reloaded if it was replaced. Only returns on error.
+Returns RV_ERROR
+*/
+int serve( const char *sockfile, struct s_ip4reload *prl )
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev, events[SERVE_EVENTS];
+	struct s_serveconn *pconn;
+	const struct s_ip4db *pdb4;
+	unsigned long int token;
+	FILE *fp6;
+	time_t checked, now;
+	int *pcc;  /* country codes of a request */
+	int fdl, fde, fd, n, e;
+
+	if( strlen(sockfile) >= sizeof(addr.sun_path) )
+		{
+		fputs( "Socket filename is too long.\n", stderr );
+		return RV_ERROR;
+		}
+	memset( &addr, 0, sizeof(addr) );
+	addr.sun_family = AF_UNIX;
+	strcpy( addr.sun_path, sockfile );
+	unlink( sockfile );  /* left over by a previous server */
+	fdl = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if( fdl < 0  ||
+	    fcntl( fdl, F_SETFL, O_NONBLOCK ) != 0  ||
+	    bind( fdl, (struct sockaddr *) &addr, sizeof(addr) ) != 0  ||
+	    listen( fdl, SOMAXCONN ) != 0 )
+		{
+		perror( sockfile );
+		return RV_ERROR;
+		}
+	fde = epoll_create1( 0 );
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;  /* NULL for the listening socket */
+	pcc = malloc( SERVE_MAXKEYS * sizeof(int) );
+	if( fde < 0  ||  epoll_ctl( fde, EPOLL_CTL_ADD, fdl, &ev ) != 0  ||  pcc == NULL )
+		{
+		fputs( "Cannot start serving.\n", stderr );
+		return RV_ERROR;
+		}
+	signal( SIGPIPE, SIG_IGN );  /* clients that go away are just closed */
+	fp6 = NULL;  /* if it stays NULL, IPv6 addresses are not found */
+	reload_ip6_db( &fp6 );
+	checked = time( NULL );
+
+	for(;;)  /*forever*/
+		{
+		n = epoll_wait( fde, events, SERVE_EVENTS, RELOAD_CHECK * 1000 );
+		if( stats_requested )
+			{
+			stats_requested = 0;  /* false */
+			dump_ip4_stats( stderr );
+			}
+		if( n < 0 )
+			{
+			if( errno == EINTR )
+				continue;
+			perror( "epoll_wait" );
+			return RV_ERROR;
+			}
+		now = time( NULL );
+		if( now - checked >= RELOAD_CHECK )
+			{
+			checked = now;
+			reload_ip4_db( prl );
+			reload_ip6_db( &fp6 );
+			}
+		pdb4 = acquire_ip4_db( prl, &token );
+		for( e = 0;  e < n;  e++ )
+			{
+			pconn = events[e].data.ptr;
+			if( pconn == NULL )
+				{
+				/* new client */
+				fd = accept( fdl, NULL, NULL );
+				if( fd < 0 )
+					continue;
+				pconn = malloc( sizeof(struct s_serveconn) );
+				if( pconn == NULL )
+					{
+					close( fd );
+					continue;
+					}
+				pconn->fd = fd;
+				pconn->pin = malloc( SERVE_REQ_SIZE );
+				pconn->inlen = 0;
+				pconn->pout = NULL;
+				pconn->outlen = pconn->outsize = 0;
+				ev.events = EPOLLIN;
+				ev.data.ptr = pconn;
+				if( pconn->pin == NULL  ||
+				    fcntl( fd, F_SETFL, O_NONBLOCK ) != 0  ||
+				    epoll_ctl( fde, EPOLL_CTL_ADD, fd, &ev ) != 0 )
+					close_serveconn( pconn );
+				continue;
+				}
+			if( serve_requests(pconn, pdb4, fp6, pcc) != 0 )
+				{
+				close_serveconn( pconn );  /* also removes it from epoll */
+				continue;
+				}
+			/* only wait for what can be done next */
+			ev.events = (pconn->outlen < SERVE_OUT_SIZE ? EPOLLIN : 0) |
+				    (pconn->outlen ? EPOLLOUT : 0);
+			ev.data.ptr = pconn;
+			epoll_ctl( fde, EPOLL_CTL_MOD, pconn->fd, &ev );
+			}
+		release_ip4_db( prl, token );
+		}
+}
+
+
+/*
+Reads what it can of connection "pconn", answers all the whole requests
+received so far (while there is room for their responses), and sends
+what it can of the responses, all without blocking. "pcc" has room for
+SERVE_MAXKEYS country codes.
+Returns 0 if ok, or -1 if the connection is to be closed
+*/
+int serve_requests( struct s_serveconn *pconn, const struct s_ip4db *pdb4, FILE *fp6, int *pcc )
+{
+	struct s_servereq req;
+	struct s_serveresp resp;
+	unsigned32 ip6[4];
+	unsigned16 cc;
+	unsigned char *p;
+	size_t off, need, k;
+	ssize_t n;
+
+	if( pconn->outlen < SERVE_OUT_SIZE  &&  pconn->inlen < SERVE_REQ_SIZE )
+		{
+		n = read( pconn->fd, pconn->pin + pconn->inlen, SERVE_REQ_SIZE - pconn->inlen );
+		if( n == 0 )
+			return -1;  /* client closed its connection */
+		if( n < 0 )
+			{
+			if( errno != EAGAIN  &&  errno != EINTR )
+				return -1;
+			n = 0;
+			}
+		pconn->inlen += (size_t) n;
+		}
+
+	/* requests are always a multiple of 4 bytes, so their IPs are aligned
+	   while "pin" is */
+	for( off = 0;  pconn->inlen - off >= sizeof(req)  &&  pconn->outlen < SERVE_OUT_SIZE;  off += need )
+		{
+		memcpy( &req, pconn->pin + off, sizeof(req) );
+		if( (size_t) req.n4 + req.n6 > SERVE_MAXKEYS )
+			return -1;  /* bad request */
+		need = sizeof(req) + (req.n4 + 4 * (size_t) req.n6) * sizeof(unsigned32);
+		if( pconn->inlen - off < need )
+			break;  /* request not whole yet */
+		k = sizeof(resp) + ((size_t) req.n4 + req.n6) * sizeof(unsigned16);
+		if( pconn->outlen + k > pconn->outsize )
+			{
+			p = realloc( pconn->pout, pconn->outlen + k + SERVE_REQ_SIZE );
+			if( p == NULL )
+				return -1;
+			pconn->pout = p;
+			pconn->outsize = pconn->outlen + k + SERVE_REQ_SIZE;
+			}
+		find_ip4_countries_db( (const unsigned32 *) (pconn->pin + off + sizeof(req)), pcc, (size_t) req.n4, pdb4 );
+		for( k = 0;  k < req.n6;  k++ )
+			{
+			memcpy( ip6, pconn->pin + off + sizeof(req) + (req.n4 + 4 * k) * sizeof(unsigned32), sizeof(ip6) );
+			if( IP6_IS_IP4(ip6) )
+				pcc[req.n4 + k] = find_ip4_country_db( ip6[0], pdb4 );  /* an IPv4 within an IPv6 */
+			else
+				pcc[req.n4 + k] = fp6 != NULL ? find_ip6_country( ip6, fp6 ) : -1;
+			}
+		resp.id = req.id;
+		resp.n = (unsigned16) (req.n4 + req.n6);
+		resp.reserved = 0;
+		memcpy( pconn->pout + pconn->outlen, &resp, sizeof(resp) );
+		pconn->outlen += sizeof(resp);
+		for( k = 0;  k < resp.n;  k++ )
+			{
+			cc = pcc[k] < 0 ? SERVE_NONE : (unsigned16) pcc[k];
+			memcpy( pconn->pout + pconn->outlen, &cc, sizeof(cc) );
+			pconn->outlen += sizeof(cc);
+			}
+		}
+	if( off )
+		{
+		pconn->inlen -= off;
+		memmove( pconn->pin, pconn->pin + off, pconn->inlen );
+		}
+
+	if( pconn->outlen )
+		{
+		n = send( pconn->fd, pconn->pout, pconn->outlen, MSG_NOSIGNAL );
+		if( n < 0 )
+			{
+			if( errno != EAGAIN  &&  errno != EINTR )
+				return -1;
+			n = 0;
+			}
+		pconn->outlen -= (size_t) n;
+		memmove( pconn->pout, pconn->pout + n, pconn->outlen );
+		}
+	return 0;
 }
 
 
 /*
-Returns the country code if found, or
--1 for not found, -2 for looped cluster indexes, -3 for file access error
+Closes and releases connection "pconn"; does nothing if NULL
 */
-int find_ip6_country( unsigned32 ip6[4], FILE *fp )
+void close_serveconn( struct s_serveconn *pconn )
 {
-	/* !!! not implemented yet
-	struct s_cluster6 cluster6;*/	/* buffer where you'll read each cluster into */
+	if( pconn == NULL )
+		return;
+	close( pconn->fd );
+	free( pconn->pin );
+	free( pconn->pout );
+	free( pconn );
+}
+
 
-	return -1;  /* not found */
+/*
+Opens DBFILE6 in "*pfp6" (if it isn't open yet), or reopens it if it was
+replaced since, as reload_ip4_db() does for the IPv4 database; lookups on
+it are served one at a time, so the old one can be closed at once. If
+DBFILE6 can't be opened, "*pfp6" is left as it was.
+*/
+void reload_ip6_db( FILE **pfp6 )
+{
+	struct stat st, st6;
+	FILE *fp;
+
+	if( stat(DBFILE6, &st) != 0 )
+		return;
+	if( *pfp6 != NULL  &&  fstat(fileno(*pfp6), &st6) == 0  &&
+	    st.st_dev == st6.st_dev  &&  st.st_ino == st6.st_ino  &&
+	    st.st_mtime == st6.st_mtime  &&  st.st_size == st6.st_size )
+		return;  /* same file */
+	fp = fopen( DBFILE6, "rb" );
+	if( fp == NULL )
+		return;
+	setbuf( fp, NULL );  /* turn off buffering */
+	if( *pfp6 != NULL )
+		fclose( *pfp6 );
+	*pfp6 = fp;
 }
 
+
+/*
+Serves lookups on reloadable database "prl" to the clients of a new shared
+memory segment named "name" (see shm_open() and struct s_shmseg in
+ip2cc.h), polling their request rings, and waiting on a futex when all
+have been idle for a while. Every RELOAD_CHECK seconds (or so, while
+waiting), the database is reloaded if it was replaced. Only returns on
+error.
+Returns RV_ERROR
+*/
+int serve_shm( const char *name, struct s_ip4reload *prl )
+{
+	struct s_shmseg *pseg;
+	struct s_shmslot *ps;
+	const struct s_ip4db *pdb4;
+	unsigned long int token;
+	struct timespec wait;
+	int *pcc;  /* country codes of a ring's worth of requests */
+	unsigned32 doorbell;
+	long int idle, polls;
+	time_t checked, now;
+	int fd, s, busy;
+
+	shm_unlink( name );  /* left over by a previous service */
+	fd = shm_open( name, O_RDWR | O_CREAT | O_EXCL, 0660 );
+	if( fd < 0  ||  ftruncate( fd, (off_t) sizeof(struct s_shmseg) ) != 0 )
+		{
+		perror( name );
+		return RV_ERROR;
+		}
+	pseg = mmap( NULL, sizeof(struct s_shmseg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	pcc = malloc( SHM_RING * sizeof(int) );
+	if( pseg == MAP_FAILED  ||  pcc == NULL )
+		{
+		fputs( "Cannot start serving.\n", stderr );
+		return RV_ERROR;
+		}
+	/* a new segment is all 0s */
+	pseg->service = (unsigned32) getpid();
+	__atomic_store_n( &pseg->magic, SHM_MAGIC, __ATOMIC_RELEASE );
+
+	checked = time( NULL );
+	for( idle = polls = 0L;;  idle++, polls++ )  /*forever*/
+		{
+		if( (polls & 0x3FFL) == 0L  &&  (now = time(NULL)) - checked >= RELOAD_CHECK )
+			{
+			checked = now;
+			reload_ip4_db( prl );
+			}
+		if( (polls & 0x3FFL) == 0L  &&  stats_requested )
+			{
+			stats_requested = 0;  /* false */
+			dump_ip4_stats( stderr );
+			}
+		busy = 0;  /* false */
+		pdb4 = acquire_ip4_db( prl, &token );
+		for( s = 0;  s < SHM_CLIENTS;  s++ )
+			{
+			ps = &pseg->slots[s];
+			if( __atomic_load_n(&ps->owner, __ATOMIC_RELAXED)  &&  serve_shm_slot(ps, pdb4, pcc) )
+				busy = 1;  /* true */
+			}
+		release_ip4_db( prl, token );
+		if( busy )
+			idle = 0L;
+		else if( idle < SHM_YIELD )
+			CPU_RELAX();
+		else if( idle < SHM_SPIN )
+			sched_yield();
+		else
+			{
+			/* no requests for a while: sleep until a client rings
+			   (see find_ip4_countries_shm() in libip2cc.c) */
+			doorbell = __atomic_load_n( &pseg->doorbell, __ATOMIC_SEQ_CST );
+			__atomic_store_n( &pseg->sleeping, 1, __ATOMIC_SEQ_CST );
+			for( s = 0;  s < SHM_CLIENTS;  s++ )
+				{
+				ps = &pseg->slots[s];
+				if( __atomic_load_n(&ps->req.head, __ATOMIC_SEQ_CST) != ps->req.tail )
+					break;
+				}
+			wait.tv_sec = RELOAD_CHECK;  /* then check for a new database */
+			wait.tv_nsec = 0L;
+			if( s >= SHM_CLIENTS )
+				syscall( SYS_futex, &pseg->doorbell, FUTEX_WAIT, doorbell, &wait, NULL, 0 );
+			__atomic_store_n( &pseg->sleeping, 0, __ATOMIC_SEQ_CST );
+			idle = polls = 0L;  /* check now */
+			}
+		}
+}
+
+
+/*
+Looks up all the requests waiting in the request ring of slot "ps" (as
+many as there is room for in its response ring) in a batch, and writes
+their country codes to its response ring. "pcc" has room for SHM_RING
+country codes.
+Returns 1 (true) if there were any requests, 0 (false) if not
+*/
+int serve_shm_slot( struct s_shmslot *ps, const struct s_ip4db *pdb4, int *pcc )
+{
+	unsigned32 head, tail, rhead, n, i, k;
+
+	head = __atomic_load_n( &ps->req.head, __ATOMIC_ACQUIRE );
+	tail = ps->req.tail;   /* only the service writes these two */
+	rhead = ps->resp.head;
+	n = head - tail;
+	k = SHM_RING - (rhead - __atomic_load_n(&ps->resp.tail, __ATOMIC_ACQUIRE));
+	if( n > k )
+		n = k;
+	if( !n )
+		return 0;  /* false */
+	/* the requests may wrap around the end of the ring */
+	for( i = 0;  i < n;  i += k )
+		{
+		k = SHM_RING - (tail + i) % SHM_RING;
+		if( k > n - i )
+			k = n - i;
+		find_ip4_countries_db( &ps->req.entries[ (tail + i) % SHM_RING ], pcc + i, (size_t) k, pdb4 );
+		}
+	for( i = 0;  i < n;  i++ )
+		ps->resp.entries[ rhead++ % SHM_RING ] = pcc[i] < 0 ? SERVE_NONE : (unsigned32) pcc[i];
+	/* responses first, so that a client that sees all its requests
+	   taken also sees their responses */
+	__atomic_store_n( &ps->resp.head, rhead, __ATOMIC_RELEASE );
+	__atomic_store_n( &ps->req.tail, tail + n, __ATOMIC_RELEASE );
+	return 1;  /* true */
+}
+#endif
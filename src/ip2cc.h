@@ -19,6 +19,11 @@ See comments at the top of ip2cc.c for more information.
 #include <stdio.h>
 
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
 /* Compiler-specific "packed structure" attribute
    (using compiler-wide command-line options may break
    existing libraries' structures!)
@@ -66,6 +71,18 @@ typedef unsigned long int	unsigned32;
 #endif
 
 
+/* 64-bit unsigned integer type
+   (only used by the multibit trie, see struct s_trie4node)
+*/
+#if ULONG_MAX == 0xFFFFFFFFFFFFFFFFUL
+typedef unsigned long int	unsigned64;
+#elif defined(ULLONG_MAX)  ||  defined(__GNUC__)
+typedef unsigned long long int	unsigned64;
+#else
+#error "Cannot find a 64-bit integer type"
+#endif
+
+
 /* Optimal disk reading block size
 */
 #ifndef SECTOR_SIZE
@@ -111,6 +128,8 @@ typedef unsigned long int	unsigned32;
 
 /* Given SECTOR_SIZE which will be the maximum size for a cluster,
    how many nodes can we fit into a cluster?
+   (IPv4 databases record their own cluster size, see struct s_db4head:
+   this is only the size mk-ip4db writes by default)
 */
 #define NODES_PER_CLUSTER4	((SECTOR_SIZE >> 3) - 1)  /* for IPv4 */
 #define NODES_PER_CLUSTER6	((SECTOR_SIZE >> 4) - 1)  /* for IPv6 */
@@ -126,6 +145,62 @@ typedef unsigned long int	unsigned32;
 */
 #define CLUSTER4_SIZE		sizeof(struct s_cluster4)
 #define CLUSTER6_SIZE		sizeof(struct s_cluster6)
+#define CLUSTER4V_SIZE		sizeof(struct s_cluster4v)
+#define LINE4_SIZE		sizeof(struct s_line4)
+
+
+/* Alternatively, clusters can be made to fit a single CPU cache line
+   (LINE_SIZE: 64 or 128 bytes); see struct s_line4
+*/
+#ifndef LINE_SIZE
+#define LINE_SIZE		64
+#endif
+#if     LINE_SIZE == 128
+#define LINE_SIZE_SHIFT		7
+#else
+#undef  LINE_SIZE
+#define LINE_SIZE		64
+#define LINE_SIZE_SHIFT		6
+#endif
+#define NODES_PER_LINE4		((LINE_SIZE >> 3) - 1)
+#define TREELEVELS_PER_LINE4	(LINE_SIZE_SHIFT - 3)
+
+
+/* IPv4 database header (struct s_db4head), in cluster 0 of the database:
+   the tree's root is cluster DB4_ROOT. Clusters may be of any size from
+   1 << DB4_SHIFT_MIN to 1 << DB4_SHIFT_MAX bytes (cache line ones, up to
+   1 << DB4_LINE_SHIFT_MAX), whatever SECTOR_SIZE and LINE_SIZE the reader
+   was compiled with: a cluster of 1 << shift bytes has NODES4(shift)
+   nodes, in TREELEVELS4(shift) tree levels, laid out as struct s_cluster4,
+   s_cluster4v or s_line4 (with that many nodes), in CLUSTER4_BYTES(n),
+   CLUSTER4V_BYTES(n) or LINE4_BYTES(n) bytes
+*/
+#define DB4_MAGIC		"IP4D"
+#define DB4_VERSION		2
+#define DB4_BYTEORDER		((unsigned32) 0x01020304U)
+#define DB4_ROOT		1
+#define DB4_SHIFT_MIN		6  /* 64 bytes: count_ip4() compares IPs 8 at a time */
+#define DB4_SHIFT_MAX		14  /* 16kb */
+#define DB4_LINE_SHIFT_MAX	7  /* 128 bytes: "nextmask" has a bit for each of 16 branches */
+#define NODES4(shift)		( (1 << ((shift) - 3)) - 1 )
+#define TREELEVELS4(shift)	( (shift) - 3 )
+#define CLUSTER4_BYTES(n)	( (size_t) (n) * sizeof(struct s_node4) + (size_t) ((n)+1) * sizeof(unsigned16) )
+#define CLUSTER4V_BYTES(n)	( (size_t) ((n)+1) * sizeof(unsigned32) + (size_t) (n) * sizeof(unsigned16) + (size_t) ((n)+1) * sizeof(unsigned16) )
+#define LINE4_BYTES(n)		( (size_t) ((n)+1) * sizeof(unsigned32) + (size_t) (n) * sizeof(unsigned16) + sizeof(struct s_line4next) )
+
+
+/* Memory budget (in bytes) for the top cluster levels pinned in memory,
+   for a database of clusters of "nodes" nodes and 1 << "shift" bytes (as
+   in its header): PIN_BUDGET4 bytes if it is defined (gcc
+   -DPIN_BUDGET4=65536), or else enough for the first two cluster levels,
+   whatever their size: the header's cluster, the root and its nodes+1
+   next clusters
+*/
+#ifdef PIN_BUDGET4
+#define PIN_BYTES4(nodes, shift)	( (long int) (PIN_BUDGET4) )
+#else
+#define PIN_BYTES4(nodes, shift)	( (long int) ((nodes) + 3) << (shift) )
+#endif
 
 
 /* Verious masks and shift counts used to extract information from
@@ -150,10 +225,258 @@ typedef unsigned long int	unsigned32;
 #else
 #define DBFILE4			"/esx/data/ip4.db"
 #define DBFILE6			"/esx/data/ip6.db"
+#define SOCKFILE		"/esx/data/ip2cc.sock"  /* for ip2cc --serve */
+#define SHMFILE			"/ip2cc"  /* for ip2cc --serve-shm (see shm_open()) */
+#endif
+#define NEW_SUFFIX		".new"  /* added to a database filename while it is being written */
+
+
+/* IPv4 /16 jump table: a file named as the database plus JUMP_SUFFIX4,
+   with the database's struct s_db4id, and then one unsigned32 entry for
+   every IP with the same upper 16 bits.
+   If JUMP_UNIFORM4 is set, all those IPs have the country code in the
+   JUMP_CC_MASK4 bits (JUMP_NONE4 for not found); otherwise, their search
+   starts at cluster (entry >> TREELEVELS4(shift)), node (entry &
+   NODES4(shift)), with the "shift" of the database's clusters, instead of
+   at the tree's root
+*/
+#define JUMP_SUFFIX4		".idx"
+#define JUMP_ENTRIES4		65536L
+#define JUMP_SHIFT4		16  /* bits to shift an IP right to get its entry index */
+#define JUMP_UNIFORM4		((unsigned32) 0x80000000U)
+#define JUMP_CC_MASK4		((unsigned32) 0x0000FFFFU)
+#define JUMP_NONE4		((unsigned32) 0x0000FFFFU)
+
+
+/* IPv4 multibit trie ("poptrie"): a file named as the database plus
+   TRIE_SUFFIX4, with the database's struct s_db4id, a struct s_trie4head,
+   then all its nodes, then all its leaves (unsigned16 country codes,
+   TRIE_NONE4 for not found). Each node has one slot for each value of the
+   next TRIE_STRIDE4 bits of the IP (see TRIE_INDEX4()); the last of the
+   TRIE_LEVELS4 levels only has 2 bits left, so these take the top 2 bits
+   of its index
+*/
+#define TRIE_SUFFIX4		".trie"
+#define TRIE_STRIDE4		6
+#define TRIE_LEVELS4		6
+#define TRIE_INDEX4(ip4, d)	( ( (d) < TRIE_LEVELS4-1 ? (ip4) >> (32 - TRIE_STRIDE4*((d)+1)) :	\
+				    (ip4) << (TRIE_STRIDE4*TRIE_LEVELS4 - 32) ) & ((1U << TRIE_STRIDE4) - 1U) )
+#define TRIE_NONE4		((unsigned16) 0xFFFFU)
+
+
+/* IPv4 database handle, and the modes it can be opened in
+   (see open_ip4_db() in libip2cc.c)
+*/
+struct s_ip4db;
+#define IP4DB_DISK		0  /* read every cluster from disk, as needed */
+#define IP4DB_MAP		1  /* memory-map the whole database */
+#define IP4DB_PIN		2  /* load the top cluster levels into memory, read the others from disk */
+#define IP4DB_VECTOR		4  /* "vector" clusters (struct s_cluster4v); the database header says so */
+#define IP4DB_LINE		8  /* cache line clusters (struct s_line4); the database header says so */
+#define IP4DB_JUMP		16  /* OR with the above: also load the database's /16 jump table */
+#define IP4DB_TRIE		32  /* instead of the above: load the database's multibit trie, and use only that */
+#define IP4DB_LOOP		64  /* OR with the above: search default clusters with the binary search loop, not unrolled */
+
+struct s_ip4db *open_ip4_db( const char *filename, int mode );
+int find_ip4_country_db( unsigned32 ip4, const struct s_ip4db *pdb );
+int find_ip4_range_db( unsigned32 ip4, const struct s_ip4db *pdb, unsigned32 *prange );
+void find_ip4_countries_db( const unsigned32 *pip4, int *pcc, size_t n, const struct s_ip4db *pdb );
+void get_ip4_db_stats( const struct s_ip4db *pdb, long int *pclusters, size_t *psize );
+const struct s_db4head *get_ip4_db_head( const struct s_ip4db *pdb );
+void close_ip4_db( struct s_ip4db *pdb );
+
+
+/* Cache of IPv4 lookup results in front of a database handle, and its
+   default number of entries (see open_ip4_cache() in libip2cc.c)
+*/
+struct s_ip4cache;
+#ifndef IP4CACHE_ENTRIES
+#define IP4CACHE_ENTRIES	4096
 #endif
 
+struct s_ip4cache *open_ip4_cache( const struct s_ip4db *pdb, size_t entries );
+int find_ip4_country_cached( unsigned32 ip4, struct s_ip4cache *pcache );
+void get_ip4_cache_stats( const struct s_ip4cache *pcache, unsigned long int *phits, unsigned long int *pmisses );
+void close_ip4_cache( struct s_ip4cache *pcache );
+
+
+/* Lookup counters, kept for each thread only if libip2cc is compiled with
+   IP2CC_STATS defined, and the lookup of an IP step by step (see
+   get_ip4_stats() and explain_ip4_db() in libip2cc.c)
+*/
+struct s_ip4stats
+	{
+	unsigned long int lookups;	/* IPv4 lookups in a database */
+	unsigned long int clusters;	/* clusters fetched, from memory or disk */
+	unsigned long int nodes;	/* nodes compared (or trie nodes visited) */
+	unsigned long int bytes;	/* bytes read from disk */
+	unsigned long int syscalls;	/* system calls issued */
+	};
+
+void get_ip4_stats( struct s_ip4stats *pstats, int all );
+void dump_ip4_stats( FILE *fp );
+int explain_ip4_db( unsigned32 ip4, const struct s_ip4db *pdb, FILE *fp );
+
+
+/* IPv4 database that can be reloaded while in use, when its file is
+   replaced (see open_ip4_reload() in libip2cc.c); only available under
+   POSIX, with the GNU C Compiler
+*/
+struct s_ip4reload;
+
+struct s_ip4reload *open_ip4_reload( const char *filename, int mode );
+const struct s_ip4db *acquire_ip4_db( struct s_ip4reload *prl, unsigned long int *ptoken );
+void release_ip4_db( struct s_ip4reload *prl, unsigned long int token );
+int reload_ip4_db( struct s_ip4reload *prl );
+void close_ip4_reload( struct s_ip4reload *prl );
+
+
+/* Lookups without a handle, on a database file opened by the caller
+   (find_ip4_country() reads the database header on every call: prefer
+   open_ip4_db() for more than a few lookups), and IP address parsing and
+   country code names (see libip2cc.c)
+*/
+int find_ip4_country( unsigned32 ip4, FILE *fp );
+int find_ip6_country( unsigned32 ip6[4], FILE *fp );
+size_t parse_ip4( const char *ps, size_t len, unsigned32 *pip4 );
+size_t parse_ip6( const char *ps, size_t len, unsigned32 ip6[4] );
+const char *get_cc_name( int cc, int uppercase );
+int find_cc( const char *ccstr );
+
+
+/* True if IPv6 address "ip6" is an IPv4 address within an IPv6 one, either
+   IPv4-compatible (::a.b.c.d) or IPv4-mapped (::ffff:a.b.c.d): its IPv4
+   address, in ip6[0], is then searched for in the IPv4 database instead
+*/
+#define IP6_IS_IP4(ip6)		( !((ip6)[3] | (ip6)[2])  &&  ((ip6)[1] == 0U  ||  (ip6)[1] == (unsigned32) 0x0000FFFFU) )
+
 
-/* Actual data structure for an IPv4 cluster
+/* Client of ip2cc --serve-shm, on a slot of its shared memory segment
+   (see struct s_shmseg); only available under Linux
+*/
+struct s_ip4shm;
+
+struct s_ip4shm *open_ip4_shm( const char *name );
+int find_ip4_country_shm( unsigned32 ip4, struct s_ip4shm *pshm );
+void find_ip4_countries_shm( const unsigned32 *pip4, int *pcc, size_t n, struct s_ip4shm *pshm );
+void close_ip4_shm( struct s_ip4shm *pshm );
+
+
+/* ip2cc --serve protocol, on a Unix domain socket (SOCKFILE by default).
+   A client may send any number of requests without waiting for their
+   responses, with all integers in host byte order: each request is a
+   struct s_servereq, followed by "n4" IPv4 addresses (unsigned32 each)
+   and "n6" IPv6 addresses (unsigned32[4] each, as for find_ip6_country()),
+   up to SERVE_MAXKEYS in all. The server answers each request in turn,
+   with a struct s_serveresp followed by its n4+n6 country codes
+   (unsigned16 each, SERVE_NONE for not found), IPv4 first
+*/
+#define SERVE_MAXKEYS		4096
+#define SERVE_NONE		((unsigned16) 0xFFFFU)
+
+PACK_ATTR1 struct s_servereq
+	{
+	unsigned32 id;			/* any value, returned in the response */
+	unsigned16 n4;			/* number of IPv4 addresses that follow */
+	unsigned16 n6;			/* number of IPv6 addresses after those */
+	} PACK_ATTR2;
+
+PACK_ATTR1 struct s_serveresp
+	{
+	unsigned32 id;			/* "id" of the request */
+	unsigned16 n;			/* number of country codes that follow */
+	unsigned16 reserved;		/* 0 */
+	} PACK_ATTR2;
+
+
+/* ip2cc --serve-shm shared memory segment (SHMFILE by default), with
+   SHM_CLIENTS slots. A client claims a free slot (by setting its "owner"),
+   and then writes IPv4 addresses to its request ring, from which the
+   service reads them, and writes their country codes (SERVE_NONE for not
+   found) to its response ring, in the same order. Each ring has a single
+   producer and a single consumer, so there are no locks: each side only
+   writes its own index ("head" for the producer, "tail" for the consumer)
+   of SHM_RING entries, on a cache line of its own. When the service has
+   been idle for a while, it sets "sleeping" and waits for "doorbell" to
+   change (a futex), so clients that write requests meanwhile must bump
+   "doorbell" and wake it up (see find_ip4_countries_shm() in libip2cc.c).
+   Either side yields the CPU while it polls in vain, as the other one may
+   be waiting for it (on a single CPU)
+*/
+#define SHM_CLIENTS		64
+#define SHM_RING		1024  /* a power of 2 */
+#ifndef SHM_YIELD
+#define SHM_YIELD		256  /* empty polls of a ring before each further one yields the CPU */
+#endif
+#define SHM_MAGIC		((unsigned32) 0x69703263U)  /* "ip2c" */
+
+struct s_shmring
+	{
+	unsigned32 head;		/* entries written so far (by the producer) */
+	unsigned32 pad1[15];
+	unsigned32 tail;		/* entries read so far (by the consumer) */
+	unsigned32 pad2[15];
+	unsigned32 entries[SHM_RING];	/* entry i is at entries[i % SHM_RING] */
+	};
+
+struct s_shmseg
+	{
+	unsigned32 magic;		/* SHM_MAGIC, once the service is ready */
+	unsigned32 sleeping;		/* 1 (true) while the service waits on "doorbell" */
+	unsigned32 doorbell;		/* bumped by clients to wake up the service */
+	unsigned32 service;		/* process id of the service */
+	unsigned32 pad[12];
+	struct s_shmslot
+		{
+		unsigned32 owner;	/* process id of the client using it; 0 if free */
+		unsigned32 pad[15];
+		struct s_shmring req;	/* IPv4 addresses, written by the client */
+		struct s_shmring resp;	/* country codes, written by the service */
+		}
+		slots[SHM_CLIENTS];
+	};
+
+
+/* IPv4 database header (see DB4_MAGIC), at the start of cluster 0, which
+   is otherwise all 0s. After the last cluster, the database has a table
+   with the 2-letter ISO code (in uppercase) of each country code, from 0
+   to "countries"-1, which must be the same as the reader's (see
+   ip2cc-countries.h). All integers are in the byte order of the machine
+   that built the database, which "byteorder" tells
+*/
+PACK_ATTR1 struct s_db4head
+	{
+	char magic[4];			/* DB4_MAGIC (no NUL) */
+	unsigned32 byteorder;		/* DB4_BYTEORDER */
+	unsigned16 version;		/* DB4_VERSION */
+	unsigned16 layout;		/* IP4DB_VECTOR or IP4DB_LINE, or 0 for struct s_cluster4 clusters */
+	unsigned16 shift;		/* shift left positions to multiply by the cluster size */
+	unsigned16 nodes;		/* nodes per cluster: NODES4(shift) */
+	unsigned32 clusters;		/* number of clusters, this one included */
+	unsigned32 ranges;		/* number of IP ranges (tree nodes) in them */
+	unsigned16 countries;		/* number of country codes in the table after the last cluster */
+	unsigned16 reserved;		/* 0 */
+	unsigned32 stamp;		/* checksum of the other clusters and the country code table */
+	} PACK_ATTR2;
+
+
+/* Identity of an IPv4 database, at the start of its side files (the jump
+   table and the multibit trie, see JUMP_SUFFIX4 and TRIE_SUFFIX4): the
+   clusters, ranges and stamp of its header. A side file is only used
+   along with the database whose header has the same ones, so a stale side
+   file is refused, not searched
+*/
+PACK_ATTR1 struct s_db4id
+	{
+	unsigned32 clusters;
+	unsigned32 ranges;
+	unsigned32 stamp;
+	} PACK_ATTR2;
+
+
+/* Actual data structure for an IPv4 cluster, of the default geometry
+   (SECTOR_SIZE); clusters of other sizes have the same layout, with
+   NODES4(shift) nodes
 */
 PACK_ATTR1 struct s_cluster4
 	{
@@ -171,14 +494,77 @@ PACK_ATTR1 struct s_cluster4
 	} PACK_ATTR2;
 
 
+/* Alternative "vector" data structure for an IPv4 cluster: the same nodes
+   and next[] array as struct s_cluster4, but with each node field in its
+   own array, so that all start IPs can be compared at once
+*/
+PACK_ATTR1 struct s_cluster4v
+	{
+	unsigned32
+	ip[NODES_PER_CLUSTER4+1];	/* IPv4 network address of each node, in IP order */
+		/* unused nodes repeat the IP of the next used node (all 1s if none),
+		   so that the array is always sorted; the extra last entry is all 1s */
+	unsigned16
+	ccsz[NODES_PER_CLUSTER4];	/* ISO2 country-code and IP range size, as in s_node4; 0xFFFF if unused */
+	unsigned16
+	next[NODES_PER_CLUSTER4+1];	/* next cluster index for branch; 0x0000 if none (leaf) */
+	} PACK_ATTR2;
+
+
+/* Alternative cache line data structure for an IPv4 cluster: laid out as
+   struct s_cluster4v, with fewer nodes, and with the next[] array replaced
+   by the index of the first next cluster and a bit mask of the branches
+   that have one (the next clusters of a cluster are always consecutive,
+   from the highest IPs to the lowest)
+*/
+PACK_ATTR1 struct s_line4
+	{
+	unsigned32
+	ip[NODES_PER_LINE4+1];		/* IPv4 network address of each node, as in s_cluster4v */
+	unsigned16
+	ccsz[NODES_PER_LINE4];		/* ISO2 country-code and IP range size, as in s_cluster4v */
+	unsigned32 next;		/* next cluster index of the highest branch that has one; 0 if none */
+	unsigned16 nextmask;		/* bit i set if branch i has a next cluster */
+	} PACK_ATTR2;
+
+/* The fields after the ccsz[] array of a cache line cluster, of any
+   geometry, as in struct s_line4
+*/
+PACK_ATTR1 struct s_line4next
+	{
+	unsigned32 next;
+	unsigned16 nextmask;
+	} PACK_ATTR2;
+
+
+/* Multibit trie file header and node (see TRIE_SUFFIX4).
+   Only slots holding a child node or starting a run of leaves with a new
+   value are stored, in slot order: a slot's child node or leaf index is
+   found by counting the bits set in "vector" or "leafvec" up to it
+*/
+PACK_ATTR1 struct s_trie4head
+	{
+	unsigned32 nodes;		/* number of nodes (the first one is the root) */
+	unsigned32 leaves;		/* number of leaves */
+	} PACK_ATTR2;
+
+PACK_ATTR1 struct s_trie4node
+	{
+	unsigned64 vector;		/* bit k set if slot k has a child node */
+	unsigned64 leafvec;		/* bit k set if slot k has a leaf, with another value than the previous leaf */
+	unsigned32 base0;		/* index of the first leaf of this node */
+	unsigned32 base1;		/* index of the first child node of this node */
+	} PACK_ATTR2;
+
+
 /* Actual data structure for an IPv6 cluster
 */
 PACK_ATTR1 struct s_cluster6
 	{
 	PACK_ATTR1 struct s_node6
 		{
-		unsigned32 ip[2];	/* upper 64 bits of IPv6 network address (lower 64 bits are MAC address) */
-		unsigned16 iprange;	/* range size minus 1 */
+		unsigned32 ip[2];	/* upper 64 bits of IPv6 network address, ip[1] most significant (lower 64 bits are MAC address) */
+		unsigned16 iprange;	/* range size minus 1 (in /64s, before the shift) */
 		unsigned16 ccsz;	/* ISO2 country-code and IP range size */
 			/* 9 bits (15-7): ISO2 country-code
 			   1 bit     (6): 1 (true) if this a leaf
@@ -190,4 +576,9 @@ PACK_ATTR1 struct s_cluster6
 	} PACK_ATTR2;
 
 
+#ifdef __cplusplus
+}
+#endif
+
+
 #endif
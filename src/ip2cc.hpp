@@ -0,0 +1,110 @@
+/*
+ip2cc.hpp
+C++20 (for std::span)
+(C) 2003 Corebase, Easymatic, Cynergi, Pedro Freire
+
+Thin C++ layer over the C interface of libip2cc (see ip2cc.h), which does
+all the work: database handles that close themselves, batch lookups on
+spans, and parsing from string views.
+
+See comments at the top of ip2cc.c for more information.
+*/
+
+
+#ifndef _IP2CC_HPP_
+#define _IP2CC_HPP_
+
+
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+
+#include "ip2cc.h"
+
+
+namespace ip2cc
+{
+
+
+/* IPv4 database handle; "mode" as for open_ip4_db().
+   Lookups don't change it, so it may be shared by any number of threads
+*/
+class ip4db
+	{
+	public:
+		explicit ip4db( const char *filename = DBFILE4, int mode = IP4DB_DISK )
+			: pdb( open_ip4_db(filename, mode) )
+			{
+			if( pdb == nullptr )
+				throw std::runtime_error( "Cannot open IPv4-to-country database" );
+			}
+		ip4db( const ip4db & ) = delete;
+		ip4db &operator=( const ip4db & ) = delete;
+		ip4db( ip4db &&other ) noexcept
+			: pdb( std::exchange(other.pdb, nullptr) )
+			{
+			}
+		ip4db &operator=( ip4db &&other ) noexcept
+			{
+			std::swap( pdb, other.pdb );
+			return *this;
+			}
+		~ip4db()
+			{
+			close_ip4_db( pdb );
+			}
+
+		/* country code of "ip4", or a negative number if not found
+		   (see find_ip4_country_db()) */
+		int find( unsigned32 ip4 ) const
+			{
+			return find_ip4_country_db( ip4, pdb );
+			}
+
+		/* country codes of all "ip4s" into "ccs", in a single batch
+		   (see find_ip4_countries_db()) */
+		void find( std::span<const unsigned32> ip4s, std::span<int> ccs ) const
+			{
+			if( ccs.size() < ip4s.size() )
+				throw std::length_error( "Fewer country codes than IPs" );
+			find_ip4_countries_db( ip4s.data(), ccs.data(), ip4s.size(), pdb );
+			}
+
+		/* underlying C handle, for the rest of ip2cc.h */
+		const struct s_ip4db *get() const
+			{
+			return pdb;
+			}
+
+	private:
+		struct s_ip4db *pdb;
+	};
+
+
+/* IPv4 address in "s" (the whole of it), if any
+*/
+inline std::optional<unsigned32> parse_ip4( std::string_view s )
+{
+	unsigned32 ip4;
+
+	if( s.empty()  ||  ::parse_ip4(s.data(), s.size(), &ip4) != s.size() )
+		return std::nullopt;
+	return ip4;
+}
+
+
+/* 2-letter ISO code of country code "cc", or "??" if none
+*/
+inline std::string_view cc_name( int cc, bool uppercase = false )
+{
+	return get_cc_name( cc, uppercase );
+}
+
+
+}  /* namespace ip2cc */
+
+
+#endif
@@ -0,0 +1,2309 @@
+/*
+libip2cc.c
+ANSI C
+POSIX.1 / WIN32 (for memory-mapped databases only)
+GNU C Compiler-aware, for packed structures (see ip2cc.h)
+(C) 2003 Corebase, Easymatic, Cynergi, Pedro Freire
+
+The lookup core of ip2cc, as a library: see ip2cc.h for its C interface,
+ip2cc.hpp for its C++ one, and the comments at the top of ip2cc.c for more
+information.
+*/
+
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+/* for memory-mapped databases: */
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#endif
+/* for ip2cc --serve-shm clients: */
+#ifdef __linux__
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <stdlib.h>
+/* for "vector" clusters, and IPv4 address parsing: */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+#include "ip2cc.h"
+#include "ip2cc-countries.h"
+
+
+/* Sorry - preprocessor doesn't like casts...
+*
+#if INT_MAX < (CC_MASK4 >> CC_SHIFT4)
+#error "Cannot return country code as an int: please review find_ip4_country() return value"
+#endif
+*
+#if INT_MAX < (CC_MASK6 >> CC_SHIFT6)
+#error "Cannot return country code as an int: please review find_ip6_country() return value"
+#endif
+*/
+
+
+/* Number of lookups run at the same time by find_ip4_countries_db(),
+   and CPU cache line size, for prefetching
+*/
+#ifndef BATCH4
+#define BATCH4			16
+#endif
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE		64
+#endif
+
+
+/* Largest default clusters (as the shift of their size, see struct
+   s_db4head) searched by search_cluster4u() instead of search_cluster4():
+   in larger ones, its descent through all their tree levels costs more
+   than the branches it saves (see "Speed" in ip2cc.c)
+*/
+#ifndef UNROLL_SHIFT_MAX4
+#define UNROLL_SHIFT_MAX4	12  /* 4kb */
+#endif
+
+
+/* Smallest memory page size (a power of 2), so that parse_ip4() knows how
+   far past the end of a string it can safely read
+*/
+#ifndef PAGE_SIZE
+#define PAGE_SIZE		4096
+#endif
+
+
+/* Times open_ip4_db() tries again to open a database whose files don't
+   match (as while mk-ip4db has published its side files, but not yet the
+   database itself), and how long it waits before each, in microseconds
+   (not under WIN32)
+*/
+#ifndef OPEN_RETRIES4
+#define OPEN_RETRIES4		10
+#endif
+#ifndef OPEN_RETRY_WAIT4
+#define OPEN_RETRY_WAIT4	1000L
+#endif
+
+
+/* Population count (number of bits at 1) of an unsigned int
+*/
+#ifdef __GNUC__
+#define POPCOUNT(x)		__builtin_popcount( x )
+#else
+#define POPCOUNT(x)		popcount( x )
+#endif
+
+
+/* Number of trailing bits at 0 of an unsigned int other than 0; BSF or
+   TZCNT instructions with GCC
+*/
+#ifdef __GNUC__
+#define TRAILING0(x)		__builtin_ctz( x )
+#else
+#define TRAILING0(x)		popcount( ((x) & -(x)) - 1U )
+#endif
+
+
+/* Same as POPCOUNT(), for an unsigned64; without the POPCNT instruction,
+   GCC would make a library call for it
+*/
+#if defined(__GNUC__)  &&  defined(__POPCNT__)
+#define POPCOUNT64(x)		__builtin_popcountll( x )
+#else
+#define POPCOUNT64(x)		popcount64( x )
+#endif
+
+
+/* Tells the CPU that this is a busy-wait loop, if supported
+*/
+#if defined(__GNUC__)  &&  (defined(__i386__)  ||  defined(__x86_64__))
+#define CPU_RELAX()		__builtin_ia32_pause()
+#else
+#define CPU_RELAX()
+#endif
+
+
+/* How many times a client of ip2cc --serve-shm waits for a response before
+   checking whether the service is still running
+*/
+#ifndef SHM_PATIENCE
+#define SHM_PATIENCE		(1L << 20)
+#endif
+
+
+/* Asks the CPU to start loading the cache line at "p", if supported
+*/
+#ifdef __GNUC__
+#define PREFETCH(p)		__builtin_prefetch( p )
+#else
+#define PREFETCH(p)
+#endif
+
+
+/* Counts lookups, and what they fetch, into this thread's counters (see
+   get_ip4_stats()), only if compiled with IP2CC_STATS defined
+*/
+#ifdef IP2CC_STATS
+#ifdef __GNUC__
+#define THREAD_LOCAL		__thread
+#else
+#define THREAD_LOCAL
+#endif
+#define COUNT_LOOKUPS4(n)	do	{									\
+					if( pstats4 == NULL )						\
+						list_ip4_stats();					\
+					pstats4->stats.lookups += (unsigned long int) (n);		\
+					}								\
+					while( 0 )
+#define COUNT4(field, n)	( pstats4->stats.field += (unsigned long int) (n) )
+#else
+#define COUNT_LOOKUPS4(n)
+#define COUNT4(field, n)
+#endif
+
+
+/* IPv4 database handle (opaque in ip2cc.h), with its first "clusters"
+   clusters resident in memory (memory-mapped or loaded), and the others
+   (if any) read from "fd", and the cluster geometry of its header
+*/
+struct s_ip4db
+	{
+	const unsigned char *pmem;	/* start of resident clusters; NULL if none */
+	size_t size;			/* size of resident clusters, in bytes */
+	long int clusters;		/* number of resident clusters */
+	int fd;				/* database file for the other clusters; -1 if none */
+	int mapped;			/* 1 (true) if "pmem" is mmap()ed, 0 if malloc()ed */
+	int layout;			/* IP4DB_VECTOR or IP4DB_LINE, or 0 for struct s_cluster4 clusters */
+	int loop;			/* 1 (true) to search those with search_cluster4() (see UNROLL_SHIFT_MAX4) */
+	int nodes;			/* nodes per cluster */
+	size_t csize;			/* CLUSTER4_BYTES(), CLUSTER4V_BYTES() or LINE4_BYTES() of "nodes", to match */
+	int shift;			/* shift left positions to multiply by the cluster size */
+	struct s_db4head head;		/* database header */
+	unsigned32 *pjump;		/* /16 jump table (JUMP_ENTRIES4 entries); NULL if none */
+	struct s_trie4node *ptrie;	/* multibit trie nodes, if used instead of clusters; NULL if not */
+	unsigned16 *pleaves;		/* and its leaves */
+	};
+
+
+/* IPv4 lookup results cache (opaque in ip2cc.h), with 1 << (32 - "shift")
+   sets of 2 entries
+*/
+struct s_ip4cache
+	{
+	const struct s_ip4db *pdb;	/* database it caches */
+	struct s_ip4cacheentry
+		{
+		unsigned32 ip_start;	/* first IP of the range with this country code */
+		unsigned32 ip_end;	/* last one (less than ip_start if entry is empty) */
+		int cc;			/* country code */
+		}
+		*pentries;
+	int shift;			/* shift right positions of the /24 hash to get the set */
+	unsigned long int hits;		/* lookups answered by the cache */
+	unsigned long int misses;	/* lookups that went to the database */
+	};
+
+
+#if !defined(WIN32)  &&  defined(__GNUC__)
+/* Reloadable IPv4 database (opaque in ip2cc.h): its current generation,
+   and the previous one, until no lookups are left on it
+*/
+struct s_ip4reload
+	{
+	struct s_ip4db *pdb;		/* current generation */
+	struct s_ip4db *pold;		/* previous one; NULL if none */
+	unsigned long int generation;	/* generations published so far */
+	long int readers[2];		/* lookups in progress, by parity of the generation they started in */
+	const char *filename;		/* database file, and as it was when "pdb" was opened: */
+	int mode;			/* mode it is opened in */
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	off_t size;
+	};
+#endif
+
+
+#ifdef IP2CC_STATS
+/* Lookup counters of a thread, listed in "pstatslist4" the first time it
+   looks up an IP, and never freed, so that get_ip4_stats() can add up
+   those of all threads, past or present. Threads that cannot get a block
+   of their own share "statsspare4"
+*/
+struct s_ip4statsblock
+	{
+	struct s_ip4stats stats;
+	struct s_ip4statsblock *pnext;	/* next block listed; NULL if none */
+	};
+
+static struct s_ip4statsblock statsspare4;
+static struct s_ip4statsblock *pstatslist4 = &statsspare4;
+static THREAD_LOCAL struct s_ip4statsblock *pstats4 = NULL;	/* this thread's */
+#endif
+
+
+#ifdef __linux__
+/* ip2cc --serve-shm client (opaque in ip2cc.h)
+*/
+struct s_ip4shm
+	{
+	struct s_shmseg *pseg;		/* shared memory segment */
+	struct s_shmslot *pslot;	/* and the slot this client owns */
+	};
+#endif
+
+
+/* Function prototypes
+   (see also ip2cc.h)
+*/
+static int read_db4_head( struct s_ip4db *pdb, FILE *fp, int countries );
+static int read_db4_id( const struct s_ip4db *pdb, FILE *fp );
+static struct s_ip4db *open_ip4_files( const char *filename, int mode, int *pstale );
+static int same_db4_head( const struct s_ip4db *pdb );
+static int map_ip4_db( struct s_ip4db *pdb, const char *filename );
+static int pin_ip4_db( struct s_ip4db *pdb, const char *filename, long int budget );
+static int load_jump4( struct s_ip4db *pdb, const char *filename );
+static int jump_ip4( unsigned32 ip4, const struct s_ip4db *pdb, int *pci, int *pni, int *pcc, unsigned32 *prange );
+static int load_trie4( struct s_ip4db *pdb, const char *filename );
+static int find_ip4_country_trie( unsigned32 ip4, const struct s_ip4db *pdb, unsigned32 *prange );
+static int search_cluster4( const void *pc, int n, unsigned32 ip4, int i, int *pcc, unsigned32 *prange );
+static int search_cluster4u( const void *pc, int n, unsigned32 ip4, int i, int *pcc, unsigned32 *prange );
+static int search_cluster4v( const void *pc, int n, unsigned32 ip4, int *pcc, unsigned32 *prange );
+static int search_cluster( const struct s_ip4db *pdb, const void *pc, unsigned32 ip4, int ni, int *pcc, unsigned32 *prange );
+static int search_line4( const void *pc, int n, unsigned32 ip4, int *pcc, unsigned32 *prange );
+static int count_ip4( const void *pip, int n, unsigned32 ip4 );
+#ifdef IP2CC_STATS
+static void list_ip4_stats( void );
+#endif
+static void explain_node4( FILE *fp, int i, unsigned32 ip, unsigned16 ccsz, const char *what );
+static void print_ip4( FILE *fp, unsigned32 ip4 );
+#ifdef __linux__
+static void wake_shm( struct s_shmseg *pseg );
+#endif
+#ifndef __GNUC__
+static int popcount( unsigned int x );
+#endif
+#if !(defined(__GNUC__)  &&  defined(__POPCNT__))
+static int popcount64( unsigned64 x );
+#endif
+
+/*
+Looks up "ip4" in the IPv4 database in "fp", reading its header (see
+struct s_db4head) and then each cluster it needs, of whatever geometry
+the header says (the country code table is not checked: open_ip4_db()
+does that, once). Nothing is kept between calls, as "fp" may be another
+file, or the same file rewritten, on the next one: so every lookup reads
+the header again, a seek and a read more than the clusters' (about half
+as much I/O again on a 3-level database). Callers that look up more than
+a few IPs should open the database with open_ip4_db() instead, which reads
+the header once.
+Returns the country code if found, or
+-1 for not found, -2 for looped cluster indexes, -3 for file access error
+(or not a database this library can read)
+*/
+int find_ip4_country( unsigned32 ip4, FILE *fp )
+{
+	struct s_ip4db db;		/* geometry of the database, from its header */
+	unsigned32 buf[ (1 << DB4_SHIFT_MAX) / sizeof(unsigned32) ];
+					/* buffer where you'll read each cluster into */
+	unsigned32 range[2];		/* range of the result, unused */
+	int ci, i, ni, cc;		/* cluster index, next cluster index, node index, country code */
+
+	COUNT_LOOKUPS4( 1 );
+	COUNT4( syscalls, 2 );  /* unbuffered: a seek and a read */
+	if( read_db4_head(&db, fp, 0) )
+		return -3;  /* file access error, or not a database */
+	i = DB4_ROOT;
+	ni = db.nodes >> 1;
+	do	{  /* loops for each cluster */
+		ci = i;
+		COUNT4( clusters, 1 );
+		COUNT4( syscalls, 2 );
+		if( fseek(fp, ((long int) ci) << db.shift, SEEK_SET)  ||
+		    fread( buf, db.csize, (size_t) 1, fp) != 1 )
+			return -3;  /* file access error */
+		COUNT4( bytes, db.csize );
+		i = search_cluster( &db, buf, ip4, ni, &cc, range );
+		if( i < 0 )
+			return cc;
+		}
+		while( ci < i );
+		/* make sure we don't get into an endless loop with bad
+		   cluster indexes */
+	return i == 0 ? -1 : -2;  /* not found, or looped cluster indexes */
+}
+
+
+/*
+Opens the IPv4 database "filename" in one of these modes:
+IP4DB_DISK	every cluster is read from disk, as needed
+IP4DB_MAP	the file is memory-mapped once, read-only
+IP4DB_PIN	the clusters of the top tree levels are loaded into memory,
+		the others are read from disk as needed (see pin_ip4_db())
+Under WIN32 (no mmap() nor pread()) the whole file is always read into
+memory once, instead. The cluster layout and size are the ones in the
+database's header (see read_db4_head()), so IP4DB_VECTOR and IP4DB_LINE
+are ignored. OR the mode with IP4DB_JUMP to also load its /16 jump table
+(see load_jump4()), or with IP4DB_LOOP to search default clusters with
+search_cluster4() whatever their size (as for benchmarks; see
+search_cluster()). With IP4DB_TRIE, only its header and its multibit trie
+are loaded (see load_trie4()), and the trie is used instead of the
+clusters.
+The database file and its side files are only used together if they were
+written together (see struct s_db4id); if not, as while mk-ip4db is
+replacing them, one after the other, they are opened again, up to
+OPEN_RETRIES4 times.
+The handle keeps no mutable state once open, so any number of threads may
+call find_ip4_country_db() on it at the same time.
+Returns the new handle, or NULL on error (or if "filename" is not a
+database this library can read, or its files still don't match)
+*/
+struct s_ip4db *open_ip4_db( const char *filename, int mode )
+{
+	struct s_ip4db *pdb;
+	int tries, stale;
+#ifndef WIN32
+	struct timespec ts;
+#endif
+
+	for( tries = 0;  ;  tries++ )
+		{
+		pdb = open_ip4_files( filename, mode, &stale );
+		if( pdb != NULL  ||  !stale  ||  tries >= OPEN_RETRIES4 )
+			return pdb;
+#ifndef WIN32
+		ts.tv_sec = OPEN_RETRY_WAIT4 / 1000000L;
+		ts.tv_nsec = OPEN_RETRY_WAIT4 % 1000000L * 1000L;
+		nanosleep( &ts, NULL );
+#endif
+		}
+}
+
+
+/*
+Opens database "filename" in "mode", for open_ip4_db(), which tries
+again if "*pstale" is set true: if the database file and a side file, or
+the database file and itself, opened again by map_ip4_db() or
+pin_ip4_db(), turned out to be of different builds.
+Returns the new handle, or NULL on error
+*/
+static struct s_ip4db *open_ip4_files( const char *filename, int mode, int *pstale )
+{
+	struct s_ip4db *pdb;
+	FILE *fp;
+	int e;
+
+	*pstale = 0;  /* false */
+	pdb = calloc( 1, sizeof(struct s_ip4db) );
+	if( pdb == NULL )
+		return NULL;
+	pdb->pmem = NULL;
+	pdb->size = (size_t) 0;
+	pdb->clusters = 0L;
+	pdb->mapped = 0;  /* false */
+	pdb->fd = -1;  /* none */
+	pdb->pjump = NULL;
+	pdb->ptrie = NULL;
+	pdb->pleaves = NULL;
+	fp = fopen( filename, "rb" );
+	if( fp == NULL  ||  read_db4_head(pdb, fp, 1) )
+		{
+		if( fp != NULL )
+			fclose( fp );
+		free( pdb );
+		return NULL;
+		}
+	fclose( fp );
+	if( mode & IP4DB_TRIE )
+		{
+		if( (e = load_trie4(pdb, filename)) != 0 )
+			{
+			*pstale = e == -2;
+			free( pdb );
+			return NULL;
+			}
+		return pdb;
+		}
+	if( mode & IP4DB_LOOP )
+		pdb->loop = 1;  /* true */
+	if( (mode & IP4DB_JUMP)  &&  (e = load_jump4(pdb, filename)) != 0 )
+		{
+		*pstale = e == -2;
+		free( pdb );
+		return NULL;
+		}
+	mode &= ~(IP4DB_VECTOR | IP4DB_LINE | IP4DB_JUMP | IP4DB_LOOP);
+#ifdef WIN32
+	mode = IP4DB_MAP;
+#endif
+	if( (mode == IP4DB_MAP  &&  map_ip4_db(pdb, filename))  ||
+	    (mode == IP4DB_PIN  &&  pin_ip4_db(pdb, filename, PIN_BYTES4(pdb->nodes, pdb->shift))) )
+		{
+		free( pdb->pjump );
+		free( pdb );
+		return NULL;
+		}
+#ifndef WIN32
+	if( mode == IP4DB_DISK  &&  (pdb->fd = open(filename, O_RDONLY)) < 0 )
+		{
+		free( pdb->pjump );
+		free( pdb );
+		return NULL;
+		}
+#endif
+	if( same_db4_head(pdb) )
+		{
+		/* replaced since its header was read */
+		*pstale = 1;  /* true */
+		close_ip4_db( pdb );
+		return NULL;
+		}
+	return pdb;
+}
+
+
+/*
+Checks that the database file of "pdb", as opened again by map_ip4_db()
+or pin_ip4_db() (or for IP4DB_DISK), still has the header that
+open_ip4_files() read first.
+Returns 0 if so, or -1 if not (it was replaced in between) or on error
+*/
+static int same_db4_head( const struct s_ip4db *pdb )
+{
+	struct s_db4head head;
+
+	if( pdb->pmem != NULL )
+		return memcmp( pdb->pmem, &pdb->head, sizeof(head) ) ? -1 : 0;
+#ifndef WIN32
+	if( pread(pdb->fd, &head, sizeof(head), (off_t) 0) == (ssize_t) sizeof(head)  &&
+	    !memcmp(&head, &pdb->head, sizeof(head)) )
+		return 0;
+#endif
+	return -1;
+}
+
+
+/*
+Same as find_ip4_range_db(), without the range
+*/
+int find_ip4_country_db( unsigned32 ip4, const struct s_ip4db *pdb )
+{
+	unsigned32 range[2];
+
+	return find_ip4_range_db( ip4, pdb, range );
+}
+
+
+/*
+Same as find_ip4_country(), but for a database opened by open_ip4_db():
+resident clusters are walked straight from memory, with no copies nor
+system calls, and only the others are read from disk with pread(),
+which doesn't share a file position between threads.
+Returns the country code if found, placing in "prange[]" the first and
+last IPs of a range of IPs (containing "ip4") that all have it, or
+-1 for not found, -2 for looped cluster indexes, -3 for file access error
+(or cluster index outside of the database)
+*/
+int find_ip4_range_db( unsigned32 ip4, const struct s_ip4db *pdb, unsigned32 *prange )
+{
+	unsigned32 buf[ (1 << DB4_SHIFT_MAX) / sizeof(unsigned32) ];
+					/* buffer for clusters not resident in memory */
+	const void *pc;			/* pointer to current cluster */
+	int ci, i, ni, cc;		/* cluster index, next cluster index, node index, country code */
+
+	COUNT_LOOKUPS4( 1 );
+	if( pdb->ptrie != NULL )
+		return find_ip4_country_trie( ip4, pdb, prange );
+	if( jump_ip4(ip4, pdb, &i, &ni, &cc, prange) )
+		return cc;
+	do	{  /* loops for each cluster */
+		ci = i;
+		COUNT4( clusters, 1 );
+		if( ci < pdb->clusters )
+			pc = pdb->pmem + (((size_t) ci) << pdb->shift);
+		else
+			{
+#ifndef WIN32
+			COUNT4( syscalls, 1 );
+			if( pdb->fd < 0  ||
+			    pread(pdb->fd, buf, pdb->csize, ((off_t) ci) << pdb->shift) != (ssize_t) pdb->csize )
+#endif
+				return -3;  /* file access error, or outside of database */
+			COUNT4( bytes, pdb->csize );
+			pc = buf;
+			}
+		i = search_cluster( pdb, pc, ip4, ni, &cc, prange );
+		if( i < 0 )
+			return cc;
+		ni = pdb->nodes >> 1;  /* next clusters are searched from their root node */
+		}
+		while( ci < i );
+		/* make sure we don't get into an endless loop with bad
+		   cluster indexes */
+	return i == 0 ? -1 : -2;  /* not found, or looped cluster indexes */
+}
+
+
+/*
+Same as find_ip4_country_db(), for the "n" IPs in "pip4", placing each
+result in the same position of "pcc". When the whole database is resident
+in memory, up to BATCH4 lookups are run at the same time, one cluster level
+at a time: as soon as each lookup knows its next cluster, this asks the CPU
+to prefetch it, and only comes back to that lookup after going through all
+of the others, so that the memory latency of each cluster is hidden behind
+the work on other clusters
+*/
+void find_ip4_countries_db( const unsigned32 *pip4, int *pcc, size_t n, const struct s_ip4db *pdb )
+{
+	struct	{
+		unsigned32 ip4;		/* IP being looked up */
+		int ci;			/* its current cluster index */
+		int ni;			/* node index to start at, in that cluster */
+		size_t k;		/* its position in pip4[] and pcc[] */
+		}
+		batch[BATCH4];
+	unsigned32 range[2];		/* range of each result, unused */
+	const unsigned char *pc;
+	size_t k;
+	int b, nb, i, cc;
+
+	if( pdb->fd >= 0  ||  pdb->ptrie != NULL )
+		{
+		/* most clusters come from disk, or there are no
+		   clusters: no point in this */
+		for( k = 0;  k < n;  k++ )
+			pcc[k] = find_ip4_country_db( pip4[k], pdb );
+		return;
+		}
+	COUNT_LOOKUPS4( n );
+	for( nb = 0, k = 0;  nb < BATCH4  &&  k < n;  k++ )
+		{
+		if( jump_ip4(pip4[k], pdb, &batch[nb].ci, &batch[nb].ni, &pcc[k], range) )
+			continue;  /* answered by the jump table alone */
+		batch[nb].ip4 = pip4[k];
+		batch[nb].k = k;
+		nb++;
+		}
+	while( nb > 0 )
+		{
+		for( b = 0;  b < nb; )
+			{
+			if( batch[b].ci < pdb->clusters )
+				{
+				COUNT4( clusters, 1 );
+				pc = pdb->pmem + (((size_t) batch[b].ci) << pdb->shift);
+				i = search_cluster( pdb, pc, batch[b].ip4, batch[b].ni, &cc, range );
+				}
+			else
+				i = batch[b].ci;  /* jump table points outside of database */
+			if( i > batch[b].ci  &&  i < pdb->clusters )
+				{
+				/* on to the next cluster */
+				batch[b].ci = i;
+				batch[b].ni = pdb->nodes >> 1;
+				pc = pdb->pmem + (((size_t) i) << pdb->shift);
+				for( i = 0;  i < (int) pdb->csize;  i += CACHE_LINE_SIZE )
+					PREFETCH( pc + i );
+				b++;
+				continue;
+				}
+			if( i >= 0 )
+				cc = i == 0 ? -1 : i < pdb->clusters ? -2 : -3;
+				/* not found, looped cluster indexes, or outside of database */
+			pcc[ batch[b].k ] = cc;
+			/* this lookup is done: start a new one in its place,
+			   or move the last one here */
+			while( k < n  &&  jump_ip4(pip4[k], pdb, &batch[b].ci, &batch[b].ni, &pcc[k], range) )
+				k++;
+			if( k < n )
+				{
+				batch[b].ip4 = pip4[k];
+				batch[b].k = k++;
+				b++;
+				}
+			else
+				batch[b] = batch[--nb];
+			}
+		}
+}
+
+
+/*
+Finds where the lookup of "ip4" in database "pdb" starts: at the root
+node of cluster DB4_ROOT, or wherever its /16 jump table entry says, placing
+the cluster index in "pci" and the node index in "pni".
+Returns 1 (true) if the jump table entry already had the answer, placing
+in "pcc" the country code if found (and in "prange[]" the first and last
+IPs of the /16), or -1 for not found; or 0 otherwise
+*/
+static int jump_ip4( unsigned32 ip4, const struct s_ip4db *pdb, int *pci, int *pni, int *pcc, unsigned32 *prange )
+{
+	unsigned32 e;			/* jump table entry */
+
+	if( pdb->pjump == NULL )
+		{
+		*pci = DB4_ROOT;  /* the root cluster is surely in cache already */
+		*pni = pdb->nodes >> 1;
+		return 0;
+		}
+	e = pdb->pjump[ ip4 >> JUMP_SHIFT4 ];
+	if( e & JUMP_UNIFORM4 )
+		{
+		*pcc = (e & JUMP_CC_MASK4) == JUMP_NONE4 ? -1 : (int) (e & JUMP_CC_MASK4);
+		prange[0] = ip4 & ~(((unsigned32) 1U << JUMP_SHIFT4) - 1U);
+		prange[1] = ip4 |  (((unsigned32) 1U << JUMP_SHIFT4) - 1U);
+		return 1;
+		}
+	*pci = (int) (e >> TREELEVELS4(pdb->shift));
+	*pni = (int) (e & (unsigned32) pdb->nodes);
+	return 0;
+}
+
+
+/*
+Same as find_ip4_range_db(), for a database opened with IP4DB_TRIE.
+Goes down the trie TRIE_STRIDE4 bits of "ip4" at a time, for as long as
+its slot has a child node, and then returns the value of its leaf (all
+IPs in that slot have the same).
+*/
+static int find_ip4_country_trie( unsigned32 ip4, const struct s_ip4db *pdb, unsigned32 *prange )
+{
+	const struct s_trie4node *pn;	/* pointer to current node */
+	unsigned64 bit;			/* bit of the current slot */
+	unsigned16 cc;
+	int d;				/* trie level */
+
+	pn = pdb->ptrie;
+	bit = (unsigned64) 1U << TRIE_INDEX4( ip4, 0 );
+	for( d = 0;  (pn->vector & bit)  &&  d < TRIE_LEVELS4-1; )
+		{
+		pn = pdb->ptrie + pn->base1 + POPCOUNT64( pn->vector & (bit - 1U) );
+		d++;
+		bit = (unsigned64) 1U << TRIE_INDEX4( ip4, d );
+		}
+	COUNT4( nodes, d + 1 );
+	cc = pdb->pleaves[ pn->base0 + POPCOUNT64( pn->leafvec & ((bit << 1) - 1U) ) - 1 ];
+	if( d < TRIE_LEVELS4-1 )
+		{
+		prange[0] = ip4 & ~(((unsigned32) 1U << (32 - TRIE_STRIDE4*(d+1))) - 1U);
+		prange[1] = ip4 |  (((unsigned32) 1U << (32 - TRIE_STRIDE4*(d+1))) - 1U);
+		}
+	else
+		prange[0] = prange[1] = ip4;
+	return cc == TRIE_NONE4 ? -1 : (int) cc;
+}
+
+
+/*
+Searches for "ip4" in cluster "pc" of database "pdb", with the routine for
+the database's cluster layout and size, starting at node "ni" (only the
+default layout uses it: the others search all nodes at once). Default
+clusters are searched by the unrolled search_cluster4u() up to
+UNROLL_SHIFT_MAX4, and by search_cluster4() above it (or with IP4DB_LOOP)
+*/
+static int search_cluster( const struct s_ip4db *pdb, const void *pc, unsigned32 ip4, int ni, int *pcc, unsigned32 *prange )
+{
+	switch( pdb->layout )
+		{
+		case IP4DB_VECTOR:
+			return search_cluster4v( pc, pdb->nodes, ip4, pcc, prange );
+		case IP4DB_LINE:
+			return search_line4( pc, pdb->nodes, ip4, pcc, prange );
+		default:
+			if( pdb->loop )
+				return search_cluster4( pc, pdb->nodes, ip4, ni, pcc, prange );
+			return search_cluster4u( pc, pdb->nodes, ip4, ni, pcc, prange );
+		}
+}
+
+
+/*
+Binary search for "ip4" in cluster "pc", of "n" nodes (struct s_cluster4
+layout), starting at node "i" (the root node is n >> 1).
+Returns the index of the next cluster to search (0 if none), or
+-1 if the search ended in this cluster, placing in "pcc" the country code
+if found (and in "prange[]" the first and last IPs of its range), or -1 for
+not found
+*/
+static int search_cluster4( const void *pc, int n, unsigned32 ip4, int i, int *pcc, unsigned32 *prange )
+{
+	int step;			/* loop step */
+	const struct s_node4 *pn;	/* pointer to current node */
+	const unsigned16 *pnext;	/* next[] array, after the nodes */
+
+	step = ((i+1) & -(i+1)) >> 1;
+		/* the lowest bit set of i+1 is twice the step that
+		   follows node i; 16 for the root node (31) */
+	for(;;)  /*forever*/  /* loops for each node in a cluster */
+		{
+		pn = (const struct s_node4 *) pc + i;
+		COUNT4( nodes, 1 );
+		if( pn->ip >= (unsigned32) 0xFFFFFFFFU )
+			{
+			*pcc = -1;  /* not found */
+			return -1;
+			}
+		if( ip4 < pn->ip )
+			i -= step;
+		else if( ip4 >= (prange[1] = pn->ip + ( ((unsigned32) (pn->ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((pn->ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) )) )
+			i += step;
+		else
+			{
+			*pcc = (int) (pn->ccsz & CC_MASK4) >> CC_SHIFT4;
+			prange[0] = pn->ip;
+			prange[1]--;
+			return -1;
+			}
+		if( !step )
+			break;
+		step >>= 1;
+		}
+	/* at this point, i is an even number from
+	   0 to n-1 inclusive: all odd numbers
+	   could ONLY have been visited during the previous
+	   iterations (starts at an odd number and all "step"s are
+	   even numbers, except the last that is always 1) */
+	pnext = (const unsigned16 *) ((const struct s_node4 *) pc + n);
+	if( ip4 < pn->ip )
+		return pnext[ i ];
+	else  /* it's only here if not in range, so no need to check upper boundary */
+		return pnext[ i | 1 ];
+}
+
+
+/*
+One tree level of search_cluster4u(): node "i" is compared with "ip4", and
+"i" moves to its left or right child, "step" nodes away, remembering it in
+"c" if it starts at or before "ip4". Neither depends on a branch on "ip4",
+so the compiler can use conditional moves. Unused nodes break out of the
+switch the levels are in, as the tree ended above them (so this can't be
+wrapped in a loop, or a block of its own)
+*/
+#define DESCEND4(step)	pn = (const struct s_node4 *) pc + i;		\
+			COUNT4( nodes, 1 );				\
+			if( pn->ip >= (unsigned32) 0xFFFFFFFFU )	\
+				break;					\
+			ge = ip4 >= pn->ip;				\
+			c = ge ? i : c;					\
+			i += ge ? (step) : -(step)
+
+
+/*
+Same as search_cluster4(), but without branches on the nodes compared: as
+the step from each node only depends on its tree level, the descent from
+node "i" is unrolled into one DESCEND4() per level, entered at the level of
+"i" (counted from the bottom, the number of trailing 0 bits of i+1) by the
+switch, which thus picks the same straight sequence of compares for every
+lookup in a database of the same cluster geometry. It doesn't stop at the
+node whose range contains "ip4": it goes on to the bottom level (or to an
+unused node) as the binary search would, and then only that node can be
+it: the last one passed that starts at or before "ip4" ("c"), as those
+after it, in its right sub-tree, all start after its range. The levels go
+up to those of the largest clusters, DB4_SHIFT_MAX (search_cluster4() does
+any others).
+*/
+static int search_cluster4u( const void *pc, int n, unsigned32 ip4, int i, int *pcc, unsigned32 *prange )
+{
+	const struct s_node4 *pn;	/* pointer to current node */
+	int c = -1;			/* last node passed that starts at or before ip4, if any */
+	int ge = 0;			/* ip4 is at or after the current node's start */
+	int next;			/* next cluster index */
+
+	switch( TRAILING0( (unsigned int) (i+1) ) )
+		{
+		case 10:  DESCEND4( 512 );  /* FALLTHROUGH */
+		case 9:   DESCEND4( 256 );  /* FALLTHROUGH */
+		case 8:   DESCEND4( 128 );  /* FALLTHROUGH */
+		case 7:   DESCEND4( 64 );  /* FALLTHROUGH */
+		case 6:   DESCEND4( 32 );  /* FALLTHROUGH */
+		case 5:   DESCEND4( 16 );  /* FALLTHROUGH */
+		case 4:   DESCEND4( 8 );  /* FALLTHROUGH */
+		case 3:   DESCEND4( 4 );  /* FALLTHROUGH */
+		case 2:   DESCEND4( 2 );  /* FALLTHROUGH */
+		case 1:   DESCEND4( 1 );  /* FALLTHROUGH */
+		case 0:   DESCEND4( 0 );
+			break;
+		default:
+			return search_cluster4( pc, n, ip4, i, pcc, prange );
+		}
+	/* pn is now the node the descent ended at: an unused
+	   one, with no next clusters below it, or one of the
+	   bottom level (i is an even number), and ge says on
+	   which of its branches ip4 is (see search_cluster4()) */
+	next = pn->ip >= (unsigned32) 0xFFFFFFFFU ? 0 : ((const unsigned16 *) ((const struct s_node4 *) pc + n))[ i + ge ];
+	if( c >= 0 )
+		{
+		pn = (const struct s_node4 *) pc + c;
+		prange[1] = pn->ip + ( ((unsigned32) (pn->ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((pn->ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) );
+		if( ip4 < prange[1] )
+			{
+			*pcc = (int) (pn->ccsz & CC_MASK4) >> CC_SHIFT4;
+			prange[0] = pn->ip;
+			prange[1]--;
+			return -1;
+			}
+		}
+	return next;
+}
+
+
+/*
+Same as search_cluster4(), for "vector" clusters.
+Instead of the binary search, this counts how many nodes start at or before
+"ip4", comparing all of them at once; as nodes are in IP order, the only one
+that may contain "ip4" is the last of these.
+*/
+static int search_cluster4v( const void *pc, int n, unsigned32 ip4, int *pcc, unsigned32 *prange )
+{
+	int i, u;			/* branch index, used node count */
+	const unsigned32 *pip;		/* ip[] array (n+1 entries) */
+	const unsigned16 *pccsz;	/* ccsz[] array, after it (n entries), and then next[] */
+	unsigned16 ccsz;
+
+	pip = pc;
+	pccsz = (const unsigned16 *) (pip + n+1);
+	i = count_ip4( pip, n+1, ip4 );
+	COUNT4( nodes, n+1 );
+	/* unused nodes (and the extra last IP) can only be counted
+	   past the last used node if ip4 is all 1s */
+	if( i > n )
+		i = n;
+	for( u = i;  u > 0  &&  pccsz[u-1] == (unsigned16) 0xFFFFU;  u-- )
+		;
+	if( u > 0 )
+		{
+		ccsz = pccsz[u-1];
+		prange[1] = pip[u-1] + ( ((unsigned32) (ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) );
+		if( ip4 < prange[1] )
+			{
+			*pcc = (int) (ccsz & CC_MASK4) >> CC_SHIFT4;
+			prange[0] = pip[u-1];
+			prange[1]--;
+			return -1;
+			}
+		}
+	/* ip4 is on the branch between nodes i-1 and i, which is
+	   next[i] (see search_cluster4()) */
+	return pccsz[ n + i ];
+}
+
+
+/*
+Same as search_cluster4v(), for cache line clusters. These have no next[]
+array: all the next clusters of a cluster have consecutive indexes, from
+the highest IPs to the lowest, so next[i] is "next" plus how many of the
+branches after i have a next cluster, or 0 if branch i has none.
+*/
+static int search_line4( const void *pc, int n, unsigned32 ip4, int *pcc, unsigned32 *prange )
+{
+	int i, u;			/* branch index, used node count */
+	const unsigned32 *pip;		/* ip[] array (n+1 entries) */
+	const unsigned16 *pccsz;	/* ccsz[] array, after it (n entries) */
+	const struct s_line4next *pnext;  /* and the rest of the cluster */
+	unsigned16 ccsz;
+
+	pip = pc;
+	pccsz = (const unsigned16 *) (pip + n+1);
+	pnext = (const struct s_line4next *) (pccsz + n);
+	i = count_ip4( pip, n+1, ip4 );
+	COUNT4( nodes, n+1 );
+	if( i > n )
+		i = n;
+	for( u = i;  u > 0  &&  pccsz[u-1] == (unsigned16) 0xFFFFU;  u-- )
+		;
+	if( u > 0 )
+		{
+		ccsz = pccsz[u-1];
+		prange[1] = pip[u-1] + ( ((unsigned32) (ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) );
+		if( ip4 < prange[1] )
+			{
+			*pcc = (int) (ccsz & CC_MASK4) >> CC_SHIFT4;
+			prange[0] = pip[u-1];
+			prange[1]--;
+			return -1;
+			}
+		}
+	if( !(pnext->nextmask & (1U << i)) )
+		return 0;  /* no next cluster */
+	return (int) pnext->next + POPCOUNT( (unsigned int) pnext->nextmask >> (i+1) );
+}
+
+
+/*
+Opens a cache of lookup results in front of the database handle "pdb",
+with "entries" entries (rounded up to a power of 2, at least 2), for
+find_ip4_country_cached(). It is 2-way set associative, by the upper 24
+bits of the IP (its /24), and each entry holds a found country code and the
+first and last IPs of the range it was found in (see find_ip4_range_db()),
+so it only answers for IPs that are surely in that range, be it larger or
+smaller than a /24. Not found results aren't cached.
+Unlike the database handle, a cache changes on every lookup, so each thread
+must have its own (on the same database handle, if so wished).
+Returns the new cache, or NULL if out of memory
+*/
+struct s_ip4cache *open_ip4_cache( const struct s_ip4db *pdb, size_t entries )
+{
+	struct s_ip4cache *pcache;
+	size_t i;
+
+	pcache = malloc( sizeof(struct s_ip4cache) );
+	if( pcache == NULL )
+		return NULL;
+	for( pcache->shift = 32;  pcache->shift > 1  &&  ((size_t) 2 << (32 - pcache->shift)) < entries;  pcache->shift-- )
+		;
+	pcache->pentries = malloc( ((size_t) 2 << (32 - pcache->shift)) * sizeof(pcache->pentries[0]) );
+	if( pcache->pentries == NULL )
+		{
+		free( pcache );
+		return NULL;
+		}
+	for( i = 0;  i < ((size_t) 2 << (32 - pcache->shift));  i++ )
+		{
+		/* empty: no IP is in this range */
+		pcache->pentries[i].ip_start = (unsigned32) 1U;
+		pcache->pentries[i].ip_end   = (unsigned32) 0U;
+		}
+	pcache->pdb = pdb;
+	pcache->hits = pcache->misses = 0UL;
+	return pcache;
+}
+
+
+/*
+Same as find_ip4_country_db(), through the cache "pcache" (see
+open_ip4_cache())
+*/
+int find_ip4_country_cached( unsigned32 ip4, struct s_ip4cache *pcache )
+{
+	struct s_ip4cacheentry *pe;
+	unsigned32 range[2];
+	int cc;
+
+	pe = &pcache->pentries[ pcache->shift < 32 ? ((unsigned32) ((ip4 >> 8) * (unsigned32) 2654435761U) >> pcache->shift) << 1 : 0 ];
+		/* Knuth's multiplicative hash of the /24, so that
+		   neighbouring /24s don't fall in the same set */
+	if( pe[0].ip_start <= ip4  &&  ip4 <= pe[0].ip_end )
+		{
+		pcache->hits++;
+		return pe[0].cc;
+		}
+	if( pe[1].ip_start <= ip4  &&  ip4 <= pe[1].ip_end )
+		{
+		pcache->hits++;
+		return pe[1].cc;
+		}
+	pcache->misses++;
+	cc = find_ip4_range_db( ip4, pcache->pdb, range );
+	if( cc >= 0 )
+		{
+		/* the newest entry of the set goes first, and the oldest one out */
+		pe[1] = pe[0];
+		pe[0].ip_start = range[0];
+		pe[0].ip_end   = range[1];
+		pe[0].cc       = cc;
+		}
+	return cc;
+}
+
+
+/*
+Places in "phits" and "pmisses" how many lookups through "pcache" were
+answered by the cache itself, and how many went to the database
+*/
+void get_ip4_cache_stats( const struct s_ip4cache *pcache, unsigned long int *phits, unsigned long int *pmisses )
+{
+	*phits = pcache->hits;
+	*pmisses = pcache->misses;
+}
+
+
+/*
+Releases a cache opened by open_ip4_cache(); does nothing if NULL
+*/
+void close_ip4_cache( struct s_ip4cache *pcache )
+{
+	if( pcache == NULL )
+		return;
+	free( pcache->pentries );
+	free( pcache );
+}
+
+
+/*
+Places in "pstats" the lookup counters of this thread, or if "all" is 1
+(true), those of all threads added up (as they stand: other threads may
+be counting at the same time). Counters are only kept if libip2cc is
+compiled with IP2CC_STATS defined; otherwise, they are all 0
+*/
+void get_ip4_stats( struct s_ip4stats *pstats, int all )
+{
+#ifdef IP2CC_STATS
+	const struct s_ip4statsblock *pb;
+
+	memset( pstats, 0, sizeof(struct s_ip4stats) );
+	for( pb = all ? pstatslist4 : pstats4;  pb != NULL;  pb = all ? pb->pnext : NULL )
+		{
+		pstats->lookups  += pb->stats.lookups;
+		pstats->clusters += pb->stats.clusters;
+		pstats->nodes    += pb->stats.nodes;
+		pstats->bytes    += pb->stats.bytes;
+		pstats->syscalls += pb->stats.syscalls;
+		}
+#else
+	memset( pstats, 0, sizeof(struct s_ip4stats) );
+#endif
+}
+
+
+/*
+Outputs to "fp" the lookup counters of each thread that looked up IPs
+(see get_ip4_stats()), and of all of them added up, with their averages
+per lookup
+*/
+void dump_ip4_stats( FILE *fp )
+{
+#ifdef IP2CC_STATS
+	const struct s_ip4statsblock *pb;
+	struct s_ip4stats total;
+	const struct s_ip4stats *ps;
+	double n;
+	int t;
+
+	get_ip4_stats( &total, 1 );  /* true */
+	for( t = 0, pb = pstatslist4;  t >= 0;  t++ )
+		{
+		if( pb != NULL )
+			{
+			ps = &pb->stats;
+			pb = pb->pnext;
+			if( ps->lookups == 0UL )
+				continue;
+			fprintf( fp, "Thread %i", t );
+			}
+		else
+			{
+			ps = &total;
+			fputs( "All threads", fp );
+			t = -2;  /* that's all */
+			}
+		n = ps->lookups ? (double) ps->lookups : 1.0;
+		fprintf( fp, ": %lu lookups, %lu clusters (%.2f per lookup), %lu nodes (%.2f), "
+			     "%lu bytes read (%.1f), %lu system calls (%.2f)\n",
+			 ps->lookups, ps->clusters, ps->clusters / n, ps->nodes, ps->nodes / n,
+			 ps->bytes, ps->bytes / n, ps->syscalls, ps->syscalls / n );
+		}
+#else
+	fputs( "Lookup counters not compiled in (define IP2CC_STATS).\n", fp );
+#endif
+}
+
+
+/*
+Same as find_ip4_country_db(), also outputting to "fp" how the lookup of
+"ip4" went: the jump table entry or the trie slots used, and the path of
+clusters, with each node compared, its decoded range and country code,
+and where the search went from it ("vector" and cache line clusters
+compare all of their nodes at once, so only the one that may contain
+"ip4" is output). It is counted as any other lookup.
+Returns the country code if found, or as find_ip4_country_db()
+*/
+int explain_ip4_db( unsigned32 ip4, const struct s_ip4db *pdb, FILE *fp )
+{
+	unsigned32 buf[ (1 << DB4_SHIFT_MAX) / sizeof(unsigned32) ];
+					/* buffer for clusters not resident in memory */
+	const void *pc;			/* pointer to current cluster */
+	const struct s_node4 *pn;	/* pointer to current node, in default clusters */
+	const struct s_trie4node *ptn;	/* pointer to current trie node */
+	const unsigned32 *pip;		/* ip[] array of current cluster, if "vector" or cache line */
+	const unsigned16 *pccsz;	/* and its ccsz[] array */
+	unsigned32 range[2], e;
+	unsigned64 bit;
+	int ci, i, ni, cc, n, m, step, clusters;
+
+	COUNT_LOOKUPS4( 1 );
+	if( pdb->ptrie == NULL )
+		fprintf( fp, "Database: %s clusters of %i bytes (%i nodes), %lu clusters, %lu ranges, %i country codes\n",
+			 pdb->layout == IP4DB_LINE ? "cache line" : pdb->layout == IP4DB_VECTOR ? "\"vector\"" : "default",
+			 1 << pdb->shift, pdb->nodes, (unsigned long int) pdb->head.clusters, (unsigned long int) pdb->head.ranges,
+			 (int) pdb->head.countries );
+	fputs( "Lookup of ", fp );
+	print_ip4( fp, ip4 );
+	fputs( ":\n", fp );
+	if( pdb->ptrie != NULL )
+		{
+		ptn = pdb->ptrie;
+		for( i = 0;  ;  i++ )
+			{
+			bit = (unsigned64) 1U << TRIE_INDEX4( ip4, i );
+			fprintf( fp, "trie level %i: node %lu, slot %i", i, (unsigned long int) (ptn - pdb->ptrie), (int) TRIE_INDEX4(ip4, i) );
+			if( !(ptn->vector & bit)  ||  i == TRIE_LEVELS4-1 )
+				break;
+			fputs( ", child node\n", fp );
+			ptn = pdb->ptrie + ptn->base1 + POPCOUNT64( ptn->vector & (bit - 1U) );
+			}
+		cc = find_ip4_country_trie( ip4, pdb, range );
+		fprintf( fp, ", leaf: %s for ", get_cc_name(cc, 0) );
+		print_ip4( fp, range[0] );
+		fputs( " - ", fp );
+		print_ip4( fp, range[1] );
+		fputs( "\n", fp );
+		return cc;
+		}
+	if( pdb->pjump != NULL )
+		{
+		e = pdb->pjump[ ip4 >> JUMP_SHIFT4 ];
+		fprintf( fp, "jump table entry %lu (", (unsigned long int) (ip4 >> JUMP_SHIFT4) );
+		print_ip4( fp, ip4 & ~(((unsigned32) 1U << JUMP_SHIFT4) - 1U) );
+		if( e & JUMP_UNIFORM4 )
+			fprintf( fp, "/16): all of it %s\n", (e & JUMP_CC_MASK4) == JUMP_NONE4 ? "not found" :
+								 get_cc_name((int) (e & JUMP_CC_MASK4), 0) );
+		else
+			fprintf( fp, "/16): cluster %lu, node %lu\n", (unsigned long int) (e >> TREELEVELS4(pdb->shift)),
+								    (unsigned long int) (e & (unsigned32) pdb->nodes) );
+		}
+	if( jump_ip4(ip4, pdb, &i, &ni, &cc, range) )
+		return cc;
+	clusters = 0;
+	do	{  /* loops for each cluster, as find_ip4_range_db() */
+		ci = i;
+		clusters++;
+		COUNT4( clusters, 1 );
+		if( ci < pdb->clusters )
+			{
+			pc = pdb->pmem + (((size_t) ci) << pdb->shift);
+			fprintf( fp, "cluster %i (in memory):\n", ci );
+			}
+		else
+			{
+#ifndef WIN32
+			if( pdb->fd < 0  ||
+			    pread(pdb->fd, buf, pdb->csize, ((off_t) ci) << pdb->shift) != (ssize_t) pdb->csize )
+#endif
+				{
+				fprintf( fp, "cluster %i: cannot be read\n", ci );
+				return -3;  /* file access error, or outside of database */
+				}
+			COUNT4( syscalls, 1 );
+			COUNT4( bytes, pdb->csize );
+			pc = buf;
+			fprintf( fp, "cluster %i (read from disk):\n", ci );
+			}
+		i = search_cluster( pdb, pc, ip4, ni, &cc, range );
+		if( pdb->layout == 0 )
+			{
+			/* the binary search of search_cluster4() again, as it goes */
+			for( m = ni, step = ((ni+1) & -(ni+1)) >> 1;  ;  step >>= 1 )
+				{
+				pn = (const struct s_node4 *) pc + m;
+				if( pn->ip >= (unsigned32) 0xFFFFFFFFU  ||  (i < 0  &&  cc >= 0  &&  pn->ip == range[0]) )
+					{
+					explain_node4( fp, m, pn->ip, pn->ccsz, i < 0  &&  cc >= 0 ? "found" : "not found" );
+					break;
+					}
+				explain_node4( fp, m, pn->ip, pn->ccsz, ip4 < pn->ip ? "lower" : "higher" );
+				if( !step )
+					break;
+				m += ip4 < pn->ip ? -step : step;
+				}
+			}
+		else
+			{
+			n = pdb->nodes;
+			pip = pc;
+			pccsz = (const unsigned16 *) (pip + n+1);
+			m = count_ip4( pip, n+1, ip4 );
+			fprintf( fp, "  %i of its %i node IPs are lower than or equal, compared at once\n", m, n+1 );
+			for( m = m < n ? m : n;  m > 0  &&  pccsz[m-1] == (unsigned16) 0xFFFFU;  m-- )
+				;
+			if( m > 0 )
+				explain_node4( fp, m-1, pip[m-1], pccsz[m-1], i < 0  &&  cc >= 0 ? "found" : "higher" );
+			}
+		if( i > 0 )
+			fprintf( fp, "  next: cluster %i\n", i );
+		else if( i < 0 )
+			break;
+		ni = pdb->nodes >> 1;  /* next clusters are searched from their root node */
+		}
+		while( ci < i );
+	if( i >= 0 )
+		cc = i == 0 ? -1 : -2;  /* not found, or looped cluster indexes */
+	fprintf( fp, "%s, after %i cluster%s\n", cc >= 0 ? get_cc_name(cc, 0) : cc == -1 ? "not found" : "looped cluster indexes",
+		 clusters, clusters == 1 ? "" : "s" );
+	return cc;
+}
+
+
+#if !defined(WIN32)  &&  defined(__GNUC__)
+/*
+Opens database "filename" in "mode" (as for open_ip4_db()), as a handle
+that reload_ip4_db() can later switch to a new version of the file, while
+it is in use. Lookups get the current database with acquire_ip4_db(), and
+give it back with release_ip4_db(), which never wait: they only count
+themselves in (or out) of "readers[]", on the side of the parity of the
+generation they started in. A new generation is published by storing its
+database before moving "generation" on, so the previous one is only
+released once all the lookups counted on its side are gone; until then,
+it is kept in "pold", and no new generation is opened.
+Returns the new handle, or NULL on error
+*/
+struct s_ip4reload *open_ip4_reload( const char *filename, int mode )
+{
+	struct s_ip4reload *prl;
+	struct stat st;
+
+	prl = malloc( sizeof(struct s_ip4reload) + strlen(filename) + 1 );
+	if( prl == NULL )
+		return NULL;
+	prl->filename = strcpy( (char *) (prl + 1), filename );
+	prl->mode = mode;
+	prl->pold = NULL;
+	prl->generation = 0UL;
+	prl->readers[0] = prl->readers[1] = 0L;
+	if( stat(filename, &st) != 0  ||  (prl->pdb = open_ip4_db(filename, mode)) == NULL )
+		{
+		free( prl );
+		return NULL;
+		}
+	prl->dev = st.st_dev;
+	prl->ino = st.st_ino;
+	prl->mtime = st.st_mtime;
+	prl->size = st.st_size;
+	return prl;
+}
+
+
+/*
+Starts a lookup on the reloadable database "prl" (see open_ip4_reload()):
+the database handle it returns may be used until release_ip4_db() is
+called with the token placed in "*ptoken", even if a new generation is
+published in the meantime. Never waits, so it may be called from any
+number of threads at the same time.
+Returns the current database handle
+*/
+const struct s_ip4db *acquire_ip4_db( struct s_ip4reload *prl, unsigned long int *ptoken )
+{
+	unsigned long int g;
+
+	for( ;; )
+		{
+		g = __atomic_load_n( &prl->generation, __ATOMIC_SEQ_CST );
+		__atomic_add_fetch( &prl->readers[g & 1UL], 1L, __ATOMIC_SEQ_CST );
+		if( __atomic_load_n(&prl->generation, __ATOMIC_SEQ_CST) == g )
+			break;
+		/* a new generation was published in between: count in again */
+		__atomic_sub_fetch( &prl->readers[g & 1UL], 1L, __ATOMIC_SEQ_CST );
+		}
+	*ptoken = g;
+	return __atomic_load_n( &prl->pdb, __ATOMIC_SEQ_CST );
+}
+
+
+/*
+Ends a lookup started by acquire_ip4_db(), with the token it returned
+*/
+void release_ip4_db( struct s_ip4reload *prl, unsigned long int token )
+{
+	__atomic_sub_fetch( &prl->readers[token & 1UL], 1L, __ATOMIC_RELEASE );
+}
+
+
+/*
+Releases the previous generation of the reloadable database "prl", once
+no lookups are left on it, and then, if its file was replaced (or changed)
+since the current generation was opened, opens the new one and publishes
+it, as the new generation (see open_ip4_reload()). Never waits for
+lookups, so it should be called every now and then (by a single thread
+at a time), and replacing the file while it is open, with rename(), is
+safe: the old file stays in use, until then, as it was.
+Returns 1 if a new generation was published, 0 if not, or -1 if it could
+not be opened, as when its files still don't match (see open_ip4_db()):
+the current one stays in use, and the next call tries again
+*/
+int reload_ip4_db( struct s_ip4reload *prl )
+{
+	struct s_ip4db *pdb;
+	struct stat st;
+
+	if( prl->pold != NULL )
+		{
+		if( __atomic_load_n(&prl->readers[(prl->generation - 1UL) & 1UL], __ATOMIC_ACQUIRE) != 0L )
+			return 0;  /* still in use: not yet */
+		close_ip4_db( prl->pold );
+		prl->pold = NULL;
+		}
+	if( stat(prl->filename, &st) != 0 )
+		return -1;
+	if( st.st_dev == prl->dev  &&  st.st_ino == prl->ino  &&  st.st_mtime == prl->mtime  &&  st.st_size == prl->size )
+		return 0;  /* same file */
+	pdb = open_ip4_db( prl->filename, prl->mode );
+	if( pdb == NULL )
+		return -1;
+	prl->dev = st.st_dev;
+	prl->ino = st.st_ino;
+	prl->mtime = st.st_mtime;
+	prl->size = st.st_size;
+	prl->pold = prl->pdb;
+	__atomic_store_n( &prl->pdb, pdb, __ATOMIC_SEQ_CST );
+	__atomic_add_fetch( &prl->generation, 1UL, __ATOMIC_SEQ_CST );
+	return 1;
+}
+
+
+/*
+Releases a reloadable database opened by open_ip4_reload(), and all of
+its generations; does nothing if NULL. No lookups may be left on it
+*/
+void close_ip4_reload( struct s_ip4reload *prl )
+{
+	if( prl == NULL )
+		return;
+	close_ip4_db( prl->pold );
+	close_ip4_db( prl->pdb );
+	free( prl );
+}
+#endif
+
+
+/*
+Releases a database opened by open_ip4_db(); does nothing if NULL
+*/
+void close_ip4_db( struct s_ip4db *pdb )
+{
+	if( pdb == NULL )
+		return;
+#ifndef WIN32
+	if( pdb->fd >= 0 )
+		close( pdb->fd );
+	if( pdb->mapped )
+		munmap( (void *) pdb->pmem, pdb->size );
+	else
+#endif
+		free( (void *) pdb->pmem );
+	free( pdb->pjump );
+	free( pdb->ptrie );
+	free( pdb->pleaves );
+	free( pdb );
+}
+
+
+/*
+Returns in "*pclusters" and "*psize" how many clusters (and bytes) of a
+database opened by open_ip4_db() are resident in memory
+*/
+void get_ip4_db_stats( const struct s_ip4db *pdb, long int *pclusters, size_t *psize )
+{
+	*pclusters = pdb->clusters;
+	*psize = pdb->size;
+}
+
+
+/*
+Returns the header of a database opened by open_ip4_db(), with its
+cluster geometry, or NULL if only its multibit trie is used
+*/
+const struct s_db4head *get_ip4_db_head( const struct s_ip4db *pdb )
+{
+	return pdb->ptrie == NULL ? &pdb->head : NULL;
+}
+
+
+/*
+Reads the header of the IPv4 database in "fp" (see struct s_db4head) into
+"pdb", and sets its cluster layout, size and number of nodes to match.
+This is where a database built for another geometry, on a machine with
+another byte order, or by another version of mk-ip4db is caught, instead
+of being searched with the wrong cluster layout; and, if "countries" is
+true, also one with another country code table than ours (it may have
+fewer country codes, if they all have the same names).
+Returns 0 if ok, or -1 on error (or if not a database we can read)
+*/
+static int read_db4_head( struct s_ip4db *pdb, FILE *fp, int countries )
+{
+	struct s_db4head *ph;
+	char ccstr[2];
+	int i;
+
+	ph = &pdb->head;
+	if( fseek(fp, 0L, SEEK_SET)  ||  fread(ph, sizeof(struct s_db4head), (size_t) 1, fp) != 1  ||
+	    memcmp(ph->magic, DB4_MAGIC, sizeof(ph->magic))  ||  ph->byteorder != DB4_BYTEORDER  ||
+	    ph->version != DB4_VERSION  ||
+	    (ph->layout != 0  &&  ph->layout != IP4DB_VECTOR  &&  ph->layout != IP4DB_LINE)  ||
+	    ph->shift < DB4_SHIFT_MIN  ||  ph->shift > (ph->layout == IP4DB_LINE ? DB4_LINE_SHIFT_MAX : DB4_SHIFT_MAX)  ||
+	    ph->nodes != NODES4(ph->shift)  ||  ph->clusters <= DB4_ROOT  ||  ph->countries > CNAME_SIZE )
+		return -1;
+	pdb->layout = ph->layout;
+	pdb->shift = ph->shift;
+	pdb->nodes = ph->nodes;
+	pdb->loop = pdb->shift > UNROLL_SHIFT_MAX4;
+	pdb->csize = pdb->layout == IP4DB_LINE ? LINE4_BYTES(pdb->nodes) :
+		     pdb->layout == IP4DB_VECTOR ? CLUSTER4V_BYTES(pdb->nodes) : CLUSTER4_BYTES(pdb->nodes);
+	if( !countries )
+		return 0;
+	if( fseek(fp, ((long int) ph->clusters) << ph->shift, SEEK_SET) )
+		return -1;
+	for( i = 0;  i < (int) ph->countries;  i++ )
+		{
+		if( fread(ccstr, sizeof(ccstr), (size_t) 1, fp) != 1  ||  memcmp(ccstr, cname_up[i], sizeof(ccstr)) )
+			return -1;
+		}
+	return 0;
+}
+
+
+/*
+Reads the identity at the start of a side file of database "pdb" from
+"fp" (see struct s_db4id), for load_jump4() and load_trie4().
+Returns 0 if it is that of the header of "pdb", -2 if not (the side file
+was written along with another database), or -1 on error
+*/
+static int read_db4_id( const struct s_ip4db *pdb, FILE *fp )
+{
+	struct s_db4id id;
+
+	if( fread(&id, sizeof(id), (size_t) 1, fp) != 1 )
+		return -1;
+	if( id.clusters != pdb->head.clusters  ||  id.ranges != pdb->head.ranges  ||  id.stamp != pdb->head.stamp )
+		return -2;
+	return 0;
+}
+
+
+/*
+Loads the /16 jump table of database "filename" (see mk-ip4db -j) into
+memory, for open_ip4_db(); its filename is the database's plus
+JUMP_SUFFIX4, and it must have been written along with the database whose
+header is in "pdb" already (see read_db4_id()).
+Returns 0 if ok, -2 if it was written along with another database, or -1
+on error
+*/
+static int load_jump4( struct s_ip4db *pdb, const char *filename )
+{
+	char *ps;
+	FILE *fp;
+	size_t n;
+	int e;
+
+	ps = malloc( strlen(filename) + sizeof(JUMP_SUFFIX4) );
+	if( ps == NULL )
+		return -1;
+	strcat( strcpy(ps, filename), JUMP_SUFFIX4 );
+	fp = fopen( ps, "rb" );
+	free( ps );
+	if( fp == NULL )
+		return -1;
+	if( (e = read_db4_id(pdb, fp)) != 0 )
+		{
+		fclose( fp );
+		return e;
+		}
+	pdb->pjump = malloc( JUMP_ENTRIES4 * sizeof(unsigned32) );
+	n = pdb->pjump != NULL ? fread( pdb->pjump, sizeof(unsigned32), JUMP_ENTRIES4, fp ) : (size_t) 0;
+	fclose( fp );
+	if( n != JUMP_ENTRIES4 )
+		{
+		free( pdb->pjump );
+		pdb->pjump = NULL;
+		return -1;
+		}
+	return 0;
+}
+
+
+/*
+Maps "filename" read-only into memory (under WIN32, reads it into memory),
+for open_ip4_db().
+Returns 0 if ok, or -1 on error
+*/
+static int map_ip4_db( struct s_ip4db *pdb, const char *filename )
+{
+#ifdef WIN32
+	FILE *fp;
+	long int size;
+	unsigned char *pbuf;
+
+	fp = fopen( filename, "rb" );
+	if( fp == NULL )
+		return -1;
+	if( fseek(fp, 0L, SEEK_END)  ||
+	    (size = ftell(fp)) < (long int) ((((size_t) pdb->head.clusters - 1) << pdb->shift) + pdb->csize)  ||
+	    fseek(fp, 0L, SEEK_SET)  ||  (pbuf = malloc((size_t) size)) == NULL )
+		{
+		fclose( fp );
+		return -1;
+		}
+	if( fread(pbuf, (size_t) size, (size_t) 1, fp) != 1 )
+		{
+		free( pbuf );
+		fclose( fp );
+		return -1;
+		}
+	fclose( fp );
+	pdb->pmem = pbuf;
+	pdb->size = (size_t) size;
+	pdb->mapped = 0;  /* false */
+#else
+	int fd;
+	struct stat bufstat;
+	void *pmap;
+
+	fd = open( filename, O_RDONLY );
+	if( fd < 0 )
+		return -1;
+	if( fstat(fd, &bufstat) != 0  ||
+	    bufstat.st_size < (off_t) ((((size_t) pdb->head.clusters - 1) << pdb->shift) + pdb->csize) )
+		{
+		close( fd );
+		return -1;
+		}
+	pmap = mmap( NULL, (size_t) bufstat.st_size, PROT_READ, MAP_SHARED, fd, (off_t) 0 );
+	close( fd );  /* the mapping stays valid */
+	if( pmap == MAP_FAILED )
+		return -1;
+	pdb->pmem = pmap;
+	pdb->size = (size_t) bufstat.st_size;
+	pdb->mapped = 1;  /* true */
+#endif
+	/* the last cluster need not be padded up to the cluster size, and
+	   the country code table follows it */
+	pdb->clusters = (long int) pdb->head.clusters;
+	return 0;
+}
+
+
+#ifndef WIN32
+/*
+Opens "filename" and loads into memory the clusters of its top tree levels,
+for open_ip4_db(). Cluster levels are loaded while their total size fits in
+"budget" bytes, but the top level is always loaded, and the last level
+never is (unless it is also the top one). The other clusters are read from
+the file as needed.
+Returns 0 if ok, or -1 on error
+*/
+static int pin_ip4_db( struct s_ip4db *pdb, const char *filename, long int budget )
+{
+	const unsigned char *pc;
+	const unsigned16 *pnext;
+	const struct s_line4next *pl;
+	unsigned char *pbuf, *pbufn;
+	long int lo, hi, hin, ci;  /* first and last cluster of current level, last cluster of next one */
+	size_t size;
+	int i;
+
+	pdb->fd = open( filename, O_RDONLY );
+	if( pdb->fd < 0 )
+		return -1;
+	pbuf = NULL;
+	pdb->clusters = 0L;
+	/* the top level is the root cluster, loaded along with the header */
+	for( lo = 0L, hi = DB4_ROOT;  ;  lo = hi+1L, hi = hin )
+		{
+		/* load this level's clusters (they follow the previous
+		   level's) and find the last cluster of the next level */
+		pbufn = realloc( pbuf, ((size_t) hi+1) << pdb->shift );
+		if( pbufn == NULL )
+			break;
+		pbuf = pbufn;
+		size = ((size_t) (hi-lo+1L)) << pdb->shift;
+		if( pread(pdb->fd, pbuf + (((size_t) lo) << pdb->shift), size, ((off_t) lo) << pdb->shift)
+			< (ssize_t) (size - (((size_t) 1 << pdb->shift) - pdb->csize)) )
+			break;  /* the last cluster need not be padded up to the cluster size */
+		hin = hi;
+		for( ci = lo > DB4_ROOT ? lo : DB4_ROOT;  ci <= hi;  ci++ )
+			{
+			/* next[] (or the fields that replace it) is at the
+			   end of the cluster, in all layouts */
+			pc = pbuf + (((size_t) ci) << pdb->shift);
+			if( pdb->layout == IP4DB_LINE )
+				{
+				pl = (const struct s_line4next *) (pc + pdb->csize) - 1;
+				if( pl->nextmask  &&  (long int) pl->next + POPCOUNT(pl->nextmask) - 1L > hin )
+					hin = (long int) pl->next + POPCOUNT(pl->nextmask) - 1L;
+				continue;
+				}
+			pnext = (const unsigned16 *) (pc + pdb->csize) - (pdb->nodes+1);
+			for( i = 0;  i < pdb->nodes+1;  i++ )
+				{
+				if( pnext[i] > hin )
+					hin = pnext[i];
+				}
+			}
+		if( hin == hi )
+			{
+			/* this is the last level: it is only kept if it is
+			   also the top level (database with a single level) */
+			if( lo == 0L )
+				{
+				close( pdb->fd );
+				pdb->fd = -1;  /* none */
+				pdb->clusters = hi+1L;
+				}
+			break;
+			}
+		pdb->clusters = hi+1L;
+		if( (hin+1L) << pdb->shift > budget )
+			break;
+		}
+	if( pdb->clusters == 0L )
+		{
+		free( pbuf );
+		if( pdb->fd >= 0 )
+			close( pdb->fd );
+		return -1;
+		}
+	pdb->pmem = pbuf;
+	pdb->size = ((size_t) pdb->clusters) << pdb->shift;
+	return 0;
+}
+#endif  /* !WIN32 */
+
+
+/*
+Returns how many of the "n" sorted IPs at "pip" ("n" a multiple of 8) are
+lower than or equal to "ip4". With AVX2 or SSE2 instructions, all IPs are
+compared to "ip4", 8 or 4 at a time (as these only compare signed integers,
+the highest bit of both sides is flipped first), and each comparison's
+result (-1 for true) is summed in each lane; otherwise this does a binary
+search
+*/
+static int count_ip4( const void *pip, int n, unsigned32 ip4 )
+{
+#if defined(__AVX2__)
+	__m256i key, bias, sum;
+	__m128i sum4;
+	int i;
+
+	bias = _mm256_set1_epi32( INT_MIN );
+	key = _mm256_xor_si256( _mm256_set1_epi32((int) ip4), bias );
+	sum = _mm256_setzero_si256();
+	for( i = 0;  i < n/8;  i++ )
+		sum = _mm256_add_epi32( sum, _mm256_cmpgt_epi32(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *) pip + i), bias), key) );
+	sum4 = _mm_add_epi32( _mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1) );
+	sum4 = _mm_add_epi32( sum4, _mm_shuffle_epi32(sum4, 0x4E) );
+	sum4 = _mm_add_epi32( sum4, _mm_shuffle_epi32(sum4, 0xB1) );
+	return n + _mm_cvtsi128_si32( sum4 );  /* the sum is minus the IPs greater than ip4 */
+#elif defined(__SSE2__)
+	__m128i key, bias, sum;
+	int i;
+
+	bias = _mm_set1_epi32( INT_MIN );
+	key = _mm_xor_si128( _mm_set1_epi32((int) ip4), bias );
+	sum = _mm_setzero_si128();
+	for( i = 0;  i < n/4;  i++ )
+		sum = _mm_add_epi32( sum, _mm_cmpgt_epi32(_mm_xor_si128(_mm_loadu_si128((const __m128i *) pip + i), bias), key) );
+	sum = _mm_add_epi32( sum, _mm_shuffle_epi32(sum, 0x4E) );
+	sum = _mm_add_epi32( sum, _mm_shuffle_epi32(sum, 0xB1) );
+	return n + _mm_cvtsi128_si32( sum );  /* the sum is minus the IPs greater than ip4 */
+#else
+	const unsigned32 *pip4 = pip;
+	int lo, hi, mid;  /* the first IP greater than ip4 is in [lo, hi] */
+
+	for( lo = 0, hi = n;  lo < hi; )
+		{
+		mid = (lo + hi) >> 1;
+		if( pip4[mid] <= ip4 )
+			lo = mid + 1;
+		else
+			hi = mid;
+		}
+	return lo;
+#endif
+}
+
+
+/*
+Same as find_ip4_country(), for IPv6 address "ip6" in the IPv6 database
+(as written by mk-ip6db) open in "fp". Only its upper 64 bits are searched
+for, which is as far as addresses are assigned to countries.
+Returns the country code if found, or
+-1 for not found, -2 for looped cluster indexes, -3 for file access error
+*/
+int find_ip6_country( unsigned32 ip6[4], FILE *fp )
+{
+	struct s_cluster6 cluster6;	/* buffer where you'll read each cluster into */
+	long int ci, ni;		/* cluster index, next cluster index */
+	int i, step;			/* node index, loop step */
+	struct s_node6 *pn;		/* pointer to current node */
+	unsigned64 ip, start;		/* upper 64 bits of "ip6", and of the current node */
+
+	ip = (((unsigned64) ip6[3]) << 32) | (unsigned64) ip6[2];
+	ni = 0L;
+	do	{  /* loops for each cluster */
+		ci = ni;
+		if( fseek(fp, ci << SECTOR_SIZE_SHIFT, SEEK_SET)  ||
+		    fread( &cluster6, (size_t) CLUSTER6_SIZE, (size_t) 1, fp) != 1 )
+			return -3;  /* file access error */
+		i = NODES_PER_CLUSTER6 >> 1;
+		step = (NODES_PER_CLUSTER6 >> 2) + 1;
+		for(;;)  /*forever*/  /* loops for each node in a cluster */
+			{
+			pn = &cluster6.nodes[i];
+			if( pn->ccsz & LEAF_MASK6 )
+				return -1;  /* not found */
+			start = (((unsigned64) pn->ip[1]) << 32) | (unsigned64) pn->ip[0];
+			if( ip < start )
+				i -= step;
+			else if( ((ip - start) >> (pn->ccsz & RANGE_SHIFT_MASK6)) > (unsigned64) pn->iprange )
+				i += step;  /* (this way, the end of the range can't overflow) */
+			else
+				return (int) (pn->ccsz & CC_MASK6) >> CC_SHIFT6;
+			if( !step )
+				break;
+			step >>= 1;
+			}
+		/* see find_ip4_country() for why i is even here */
+		if( ip < start )
+			ni = (long int) cluster6.next[ i ];
+		else
+			ni = (long int) cluster6.next[ i | 1 ];
+		}
+		while( ci < ni );
+		/* make sure we don't get into an endless loop with bad
+		   cluster indexes */
+	return ni == 0L ? -1 : -2;  /* not found, or looped cluster indexes */
+}
+
+
+/* Value of each character as a hex digit, or -1 if it isn't one
+*/
+static const signed char hex_digit[256] = {
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,	/* '0' */
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,	/* 'A' */
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,	/* 'a' */
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+	};
+
+
+/*
+Parses the IPv4 address (in dotted decimal) at the start of the "len"
+characters at "ps" into "*pip4"; "ps" needs no terminating NUL. The address
+is all the digits and dots there, which must be 4 numbers of 1 to 3 digits,
+up to 255 each, separated by dots. With SSSE3 instructions, it is parsed at
+once in a vector register: the positions of the dots give those of the
+digits of each number, which are shuffled into a 32-bit lane each, and
+multiplied by 100, 10 and 1.
+Returns the number of characters parsed (the address may be followed by
+others), or 0 if there is no IPv4 address there
+*/
+size_t parse_ip4( const char *ps, size_t len, unsigned32 *pip4 )
+{
+#if defined(__SSSE3__)  &&  defined(__GNUC__)
+	__m128i v, d, shuf;
+	unsigned int digits, dots, end, d0, d1, d2;
+	char buf[16];
+
+	if( len >= 16 )
+		v = _mm_loadu_si128( (const __m128i *) ps );
+	else if( ((size_t) ps & (PAGE_SIZE - 1)) <= PAGE_SIZE - 16 )
+		{
+		/* the 16 bytes can't cross into a page that may not be mapped, so
+		   read them all, and zero the ones after the string */
+		v = _mm_loadu_si128( (const __m128i *) ps );
+		v = _mm_and_si128( v, _mm_cmpgt_epi8(_mm_set1_epi8((char) len),
+		                                     _mm_set_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)) );
+		}
+	else
+		{
+		memset( buf, 0, sizeof(buf) );
+		memcpy( buf, ps, len );
+		v = _mm_loadu_si128( (const __m128i *) buf );
+		}
+	d = _mm_sub_epi8( v, _mm_set1_epi8('0') );
+	digits = (unsigned int) _mm_movemask_epi8( _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d) );
+	dots = (unsigned int) _mm_movemask_epi8( _mm_cmpeq_epi8(v, _mm_set1_epi8('.')) );
+	end = (unsigned int) __builtin_ctz( ~(digits | dots) );
+	if( end > 15U )
+		return 0;  /* longer than any IPv4 address */
+	dots &= (1U << end) - 1U;
+	if( POPCOUNT(dots) != 3 )
+		return 0;
+	d0 = (unsigned int) __builtin_ctz( dots );
+	dots &= dots - 1U;
+	d1 = (unsigned int) __builtin_ctz( dots );
+	dots &= dots - 1U;
+	d2 = (unsigned int) __builtin_ctz( dots );
+	if( d0 - 1U > 2U  ||  d1 - d0 - 2U > 2U  ||  d2 - d1 - 2U > 2U  ||  end - d2 - 2U > 2U )
+		return 0;  /* a number with no digits, or more than 3 */
+
+	/* byte k of lane n gets digit (end of number n) - (4 - k), or 0 if that
+	   is before the start of number n */
+	shuf = _mm_sub_epi8( _mm_set_epi32((int) (end * 0x01010101U), (int) (d2 * 0x01010101U),
+	                                   (int) (d1 * 0x01010101U), (int) (d0 * 0x01010101U)),
+	                     _mm_set1_epi32(0x01020304) );
+	shuf = _mm_or_si128( shuf, _mm_cmpgt_epi8(_mm_set_epi32((int) ((d2 + 1U) * 0x01010101U), (int) ((d1 + 1U) * 0x01010101U),
+	                                                         (int) ((d0 + 1U) * 0x01010101U), 0),
+	                                          shuf) );
+	d = _mm_shuffle_epi8( d, shuf );
+	d = _mm_madd_epi16( _mm_maddubs_epi16(d, _mm_set1_epi32(0x010A6400)), _mm_set1_epi16(1) );
+	if( _mm_movemask_epi8(_mm_cmpgt_epi32(d, _mm_set1_epi32(255))) )
+		return 0;
+	d = _mm_shuffle_epi8( d, _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 4, 8, 12) );
+	*pip4 = (unsigned32) _mm_cvtsi128_si32( d );
+	return (size_t) end;
+#else
+	size_t i;
+	unsigned int part, digits, n, c;
+	unsigned32 ip4;
+
+	ip4 = 0;
+	i = 0;
+	for( n = 0;  n < 4;  n++ )
+		{
+		if( n )
+			{
+			if( i >= len  ||  ps[i] != '.' )
+				return 0;
+			i++;
+			}
+		for( part = digits = 0;  i < len  &&  (c = (unsigned int) (ps[i] - '0')) <= 9U;  i++, digits++ )
+			part = part * 10U + c;
+		if( digits - 1U > 2U  ||  part > 255U )
+			return 0;
+		ip4 = (ip4 << 8) | (unsigned32) part;
+		}
+	if( i < len  &&  ps[i] == '.' )
+		return 0;  /* a fifth number */
+	*pip4 = ip4;
+	return i;
+#endif
+}
+
+
+/*
+Parses the IPv6 address at the start of the "len" characters at "ps" into
+"ip6[]" (most significant 32 bits in ip6[3]); "ps" needs no terminating NUL.
+The address may be in any of the text forms of RFC 4291: 8 groups of 1 to 4
+hex digits, separated by colons, where one run of zero groups may be
+replaced by "::", and the last 2 groups may be written as an IPv4 address
+in dotted decimal (as in "::ffff:192.0.2.1").
+Returns the number of characters parsed (the address may be followed by
+others), or 0 if there is no IPv6 address there
+*/
+size_t parse_ip6( const char *ps, size_t len, unsigned32 ip6[4] )
+{
+	unsigned int group[8];
+	unsigned int part, digits, n, gap, k;
+	unsigned32 ip4;
+	size_t i, j;
+	int h;
+
+	i = 0;
+	n = 0;
+	gap = 8;  /* no "::" */
+	if( len >= 2  &&  ps[0] == ':'  &&  ps[1] == ':' )
+		{
+		gap = 0;
+		i = 2;
+		}
+	for( ;; )
+		{
+		for( part = digits = 0;  i + digits < len  &&  (h = hex_digit[ (unsigned char) ps[i + digits] ]) >= 0;  digits++ )
+			part = (part << 4) | (unsigned int) h;
+		if( !digits )
+			{
+			if( gap == n )
+				break;  /* the address ends with "::" */
+			return 0;
+			}
+		if( i + digits < len  &&  ps[i + digits] == '.' )
+			{
+			/* the last 32 bits, as an IPv4 address */
+			if( n > 6U  ||  (j = parse_ip4(ps + i, len - i, &ip4)) == 0 )
+				return 0;
+			group[n++] = (unsigned int) (ip4 >> 16);
+			group[n++] = (unsigned int) (ip4 & 0xFFFFU);
+			i += j;
+			break;
+			}
+		if( digits > 4U )
+			return 0;
+		group[n++] = part;
+		i += digits;
+		if( n == 8U )
+			break;
+		if( i + 1 < len  &&  ps[i] == ':'  &&  ps[i + 1] == ':' )
+			{
+			if( gap != 8U )
+				return 0;  /* only one "::" is allowed */
+			gap = n;
+			i += 2;
+			}
+		else if( i < len  &&  ps[i] == ':' )
+			i++;
+		else
+			break;
+		}
+	if( gap == 8U ? n != 8U : n == 8U )
+		return 0;  /* too few groups, or "::" standing for none */
+
+	/* move the groups after "::" to the end, and zero the ones it stands for */
+	for( k = 8;  n > gap;  )
+		group[--k] = group[--n];
+	while( k > gap )
+		group[--k] = 0;
+	for( k = 0;  k < 4;  k++ )
+		ip6[3 - k] = (((unsigned32) group[2*k]) << 16) | (unsigned32) group[2*k + 1];
+	return i;
+}
+
+
+/*
+Returns the 2-letter ISO code of country code "cc" (in uppercase if
+"uppercase" is non-zero), or "??" if there is no such country code (as for
+a not found result)
+*/
+const char *get_cc_name( int cc, int uppercase )
+{
+	if( cc < 0  ||  cc >= (int) CNAME_SIZE )
+		return "??";
+	return uppercase ? cname_up[cc] : cname_low[cc];
+}
+
+
+/*
+Loads the multibit trie of database "filename" (see mk-ip4db -t) into
+memory, for open_ip4_db(); its filename is the database's plus
+TRIE_SUFFIX4, and it must have been written along with the database whose
+header is in "pdb" already (see read_db4_id()). All child node and leaf
+indexes are checked, so that a damaged file is an error here, and not a
+crash later.
+Returns 0 if ok, -2 if it was written along with another database, or -1
+on error
+*/
+static int load_trie4( struct s_ip4db *pdb, const char *filename )
+{
+	struct s_trie4head head;
+	const struct s_trie4node *pn;
+	unsigned64 leaves;		/* slots that have no child node */
+	unsigned32 n;
+	char *ps;
+	FILE *fp;
+	int ok, e;
+
+	ps = malloc( strlen(filename) + sizeof(TRIE_SUFFIX4) );
+	if( ps == NULL )
+		return -1;
+	strcat( strcpy(ps, filename), TRIE_SUFFIX4 );
+	fp = fopen( ps, "rb" );
+	free( ps );
+	if( fp == NULL )
+		return -1;
+	if( (e = read_db4_id(pdb, fp)) != 0 )
+		{
+		fclose( fp );
+		return e;
+		}
+	ok = fread( &head, sizeof(head), 1, fp ) == 1  &&  head.nodes > 0U  &&  head.leaves > 0U;
+	if( ok )
+		{
+		pdb->ptrie = malloc( (size_t) head.nodes * sizeof(struct s_trie4node) );
+		pdb->pleaves = malloc( (size_t) head.leaves * sizeof(unsigned16) );
+		ok = pdb->ptrie != NULL  &&  pdb->pleaves != NULL  &&
+		     fread( pdb->ptrie, sizeof(struct s_trie4node), head.nodes, fp ) == head.nodes  &&
+		     fread( pdb->pleaves, sizeof(unsigned16), head.leaves, fp ) == head.leaves;
+		}
+	fclose( fp );
+	for( n = 0U;  ok  &&  n < head.nodes;  n++ )
+		{
+		/* child nodes always come after their parent, so lookups
+		   can't loop; and every slot without a child node must have
+		   a leaf, which is only so if the first one starts a run */
+		pn = &pdb->ptrie[n];
+		leaves = ~pn->vector;
+		ok = (pn->vector == 0U  ||  (pn->base1 > n  &&  pn->base1 <= head.nodes  &&
+					     (unsigned32) POPCOUNT64(pn->vector) <= head.nodes - pn->base1))  &&
+		     (leaves == 0U  ||  ((pn->leafvec & (leaves & -leaves))  &&  pn->base0 < head.leaves  &&
+					 (unsigned32) POPCOUNT64(pn->leafvec) <= head.leaves - pn->base0));
+		}
+	if( !ok )
+		{
+		free( pdb->ptrie );
+		free( pdb->pleaves );
+		pdb->ptrie = NULL;
+		pdb->pleaves = NULL;
+		return -1;
+		}
+	return 0;
+}
+
+
+#ifdef __linux__
+/*
+Attaches to the shared memory segment of ip2cc --serve-shm named "name"
+(see shm_open()), and claims a free slot in it, for the lookups of this
+client (a slot left by a process that is gone is free too). Each thread
+must have its own.
+Returns NULL on error, or if all slots are taken
+*/
+struct s_ip4shm *open_ip4_shm( const char *name )
+{
+	struct s_ip4shm *pshm;
+	struct s_shmslot *ps;
+	struct stat bufstat;
+	unsigned32 owner, pid;
+	int fd, i;
+
+	fd = shm_open( name, O_RDWR, 0 );
+	if( fd < 0 )
+		return NULL;
+	pshm = malloc( sizeof(struct s_ip4shm) );
+	if( pshm == NULL  ||  fstat(fd, &bufstat) != 0  ||  bufstat.st_size < (off_t) sizeof(struct s_shmseg) )
+		{
+		free( pshm );
+		close( fd );
+		return NULL;
+		}
+	pshm->pseg = mmap( NULL, sizeof(struct s_shmseg), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( pshm->pseg == MAP_FAILED  ||  __atomic_load_n(&pshm->pseg->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC )
+		{
+		if( pshm->pseg != MAP_FAILED )
+			munmap( pshm->pseg, sizeof(struct s_shmseg) );
+		free( pshm );
+		return NULL;
+		}
+
+	pshm->pslot = NULL;
+	pid = (unsigned32) getpid();
+	for( i = 0;  i < SHM_CLIENTS;  i++ )
+		{
+		ps = &pshm->pseg->slots[i];
+		owner = __atomic_load_n( &ps->owner, __ATOMIC_RELAXED );
+		if( (owner == 0  ||  (kill( (pid_t) owner, 0 ) != 0  &&  errno == ESRCH))  &&
+		    __atomic_compare_exchange_n( &ps->owner, &owner, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED ) )
+			break;
+		}
+	if( i >= SHM_CLIENTS )
+		{
+		close_ip4_shm( pshm );
+		return NULL;
+		}
+	pshm->pslot = ps;
+
+	/* drop whatever a previous owner left in flight */
+	while( __atomic_load_n(&ps->req.tail, __ATOMIC_ACQUIRE) != ps->req.head )
+		{
+		__atomic_store_n( &ps->resp.tail, __atomic_load_n(&ps->resp.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE );
+		wake_shm( pshm->pseg );
+		CPU_RELAX();
+		}
+	__atomic_store_n( &ps->resp.tail, __atomic_load_n(&ps->resp.head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE );
+	return pshm;
+}
+
+
+/*
+Returns the country code of "ip4" if found, as looked up by ip2cc
+--serve-shm through "pshm", or -1 for not found, or -3 if the service is
+gone
+*/
+int find_ip4_country_shm( unsigned32 ip4, struct s_ip4shm *pshm )
+{
+	int cc;
+
+	find_ip4_countries_shm( &ip4, &cc, (size_t) 1, pshm );
+	return cc;
+}
+
+
+/*
+Same as find_ip4_country_shm(), for the "n" IPs at "pip4", into the "n"
+country codes at "pcc": all the requests that fit in the ring are written
+before waiting for the first response, so that the service can look them
+up in batches
+*/
+void find_ip4_countries_shm( const unsigned32 *pip4, int *pcc, size_t n, struct s_ip4shm *pshm )
+{
+	struct s_shmslot *ps = pshm->pslot;
+	unsigned32 head, tail, rhead, rtail, cc;
+	size_t sent, received;
+	long int waits;
+
+	head = ps->req.head;  /* only this client writes these two */
+	rtail = ps->resp.tail;
+	sent = received = 0;
+	waits = 0L;
+	while( received < n )
+		{
+		if( sent < n )
+			{
+			tail = __atomic_load_n( &ps->req.tail, __ATOMIC_ACQUIRE );
+			if( head - tail < SHM_RING )
+				{
+				do	ps->req.entries[ head++ % SHM_RING ] = pip4[ sent++ ];
+					while( sent < n  &&  head - tail < SHM_RING );
+				/* the service must see either the new head, or
+				   this client must see it sleeping */
+				__atomic_store_n( &ps->req.head, head, __ATOMIC_SEQ_CST );
+				if( __atomic_load_n(&pshm->pseg->sleeping, __ATOMIC_SEQ_CST) )
+					wake_shm( pshm->pseg );
+				}
+			}
+		rhead = __atomic_load_n( &ps->resp.head, __ATOMIC_ACQUIRE );
+		if( rhead == rtail )
+			{
+			if( ++waits >= SHM_PATIENCE )
+				{
+				waits = 0L;
+				if( kill( (pid_t) pshm->pseg->service, 0 ) != 0  &&  errno == ESRCH )
+					{
+					while( received < n )
+						pcc[ received++ ] = -3;  /* service is gone */
+					break;
+					}
+				}
+			if( waits > SHM_YIELD )
+				sched_yield();
+			else
+				CPU_RELAX();
+			continue;
+			}
+		do	{
+			cc = ps->resp.entries[ rtail++ % SHM_RING ];
+			pcc[ received++ ] = cc == SERVE_NONE ? -1 : (int) cc;
+			}
+			while( rtail != rhead );
+		__atomic_store_n( &ps->resp.tail, rtail, __ATOMIC_RELEASE );
+		waits = 0L;
+		}
+}
+
+
+/*
+Releases the slot claimed by open_ip4_shm(), and detaches from the shared
+memory segment; does nothing if NULL
+*/
+void close_ip4_shm( struct s_ip4shm *pshm )
+{
+	if( pshm == NULL )
+		return;
+	if( pshm->pslot != NULL )
+		__atomic_store_n( &pshm->pslot->owner, 0, __ATOMIC_RELEASE );
+	munmap( pshm->pseg, sizeof(struct s_shmseg) );
+	free( pshm );
+}
+
+
+/*
+Wakes up the ip2cc --serve-shm service of "pseg", if it is waiting for
+requests
+*/
+static void wake_shm( struct s_shmseg *pseg )
+{
+	__atomic_fetch_add( &pseg->doorbell, 1, __ATOMIC_SEQ_CST );
+	syscall( SYS_futex, &pseg->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0 );
+}
+#endif
+
+
+#ifdef IP2CC_STATS
+/*
+Gives this thread a block of lookup counters of its own, listed in
+"pstatslist4" (or the spare one, if out of memory)
+*/
+static void list_ip4_stats( void )
+{
+	struct s_ip4statsblock *pb;
+
+	pb = calloc( 1, sizeof(struct s_ip4statsblock) );
+	if( pb == NULL )
+		{
+		pstats4 = &statsspare4;
+		return;
+		}
+#ifdef __GNUC__
+	do	pb->pnext = pstatslist4;
+		while( !__sync_bool_compare_and_swap(&pstatslist4, pb->pnext, pb) );
+#else
+	pb->pnext = pstatslist4;
+	pstatslist4 = pb;
+#endif
+	pstats4 = pb;
+}
+#endif
+
+
+/*
+Outputs to "fp" a line for node "i" of a cluster, with its IP "ip" and
+"ccsz" decoded, and "what" the search made of it, for explain_ip4_db()
+*/
+static void explain_node4( FILE *fp, int i, unsigned32 ip, unsigned16 ccsz, const char *what )
+{
+	fprintf( fp, "  node %2i: ", i );
+	if( ip >= (unsigned32) 0xFFFFFFFFU )
+		fputs( "unused", fp );
+	else
+		{
+		print_ip4( fp, ip );
+		fputs( " - ", fp );
+		print_ip4( fp, ip + ( (((unsigned32) (ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4)) - 1U ) );
+		fprintf( fp, " %s", get_cc_name((int) (ccsz & CC_MASK4) >> CC_SHIFT4, 0) );
+		}
+	fprintf( fp, ": %s\n", what );
+}
+
+
+/*
+Outputs IPv4 address "ip4" to "fp", in dotted decimal
+*/
+static void print_ip4( FILE *fp, unsigned32 ip4 )
+{
+	fprintf( fp, "%u.%u.%u.%u", (unsigned int) (ip4 >> 24), (unsigned int) (ip4 >> 16) & 0xFFU,
+				    (unsigned int) (ip4 >> 8) & 0xFFU, (unsigned int) ip4 & 0xFFU );
+}
+
+
+#if !(defined(__GNUC__)  &&  defined(__POPCNT__))
+/*
+Returns the number of bits at 1 in "x", without loops nor tables
+*/
+static int popcount64( unsigned64 x )
+{
+	x = x - ((x >> 1) & (unsigned64) 0x5555555555555555ULL);
+	x = (x & (unsigned64) 0x3333333333333333ULL) + ((x >> 2) & (unsigned64) 0x3333333333333333ULL);
+	x = (x + (x >> 4)) & (unsigned64) 0x0F0F0F0F0F0F0F0FULL;
+	return (int) ((x * (unsigned64) 0x0101010101010101ULL) >> 56);
+}
+#endif
+
+
+#ifndef __GNUC__
+/*
+Returns the number of bits at 1 in "x"
+*/
+static int popcount( unsigned int x )
+{
+	int c;
+
+	for( c = 0;  x;  x &= x - 1U )
+		c++;
+	return c;
+}
+#endif
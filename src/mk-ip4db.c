@@ -6,16 +6,56 @@ GNU C Compiler-aware, for packed structures (see ip2cc.h)
 (C) 2003-2011 Corebase, Easymatic, Cynergi, Pedro Freire
 
 This script can be called with:
-	[-#] <source-ip-to-country-data-file> [<dest-ip4db-file>]
+	[-v|-l] [-s <bytes>] [-j] [-t] [-#|-g] <source-ip-to-country-data-file> [<dest-ip4db-file>]
 
 where -# represents a number specifying the source data file format:
 -1  "<ip-start>","<ip-end>","<iso-country>","...","..."  (default)
 -2  "<ip-start>","<ip-end>","<iso-country>","..."
 -3  "<...>","<...>","<ip-start>","<ip-end>","<iso-country>","...","..."
 -4  "<...>","<...>","<ip-start>","<ip-end>","<iso-country>","..."
+    (as MaxMind's GeoIP country CSV, GeoIPCountryWhois.csv)
+
+or -g says it is a MaxMind legacy GeoIP country database instead (as
+"data/mod_geoip databases/GeoIP.dat.gz"), gzipped or not,
+
+and -v writes "vector" clusters (struct s_cluster4v) instead of the default
+ones (struct s_cluster4), and -l cache line clusters (struct s_line4). -s
+sets the size of the clusters, a power of 2 from 64 bytes to 16kb (128
+bytes for cache line clusters), instead of SECTOR_SIZE (or LINE_SIZE, with
+-l): 4096, say, for the pages of an NVMe drive. The database starts with a
+header that records all this (see struct s_db4head in ip2cc.h), so ip2cc
+reads it whatever it was compiled with. With -j, a /16 jump table is also
+written next to the database (for ip2cc -j), and with -t, a multibit trie
+(for ip2cc -t), both starting with the identity of the database (see
+struct s_db4id in ip2cc.h), so that ip2cc refuses them with any other. All
+are written under a temporary name first, and then renamed over the old
+ones (see "Reloading" in ip2cc.c); a jump table or trie that isn't written
+again is removed, as it belongs to the old database.
 
 Calling it without arguments gives this help.
 
+The source data file is mapped into memory and split, at line boundaries,
+into a chunk per CPU, each parsed by a thread of its own (under WIN32, it
+is read whole, and parsed in a single chunk). Blank lines are ignored,
+lines with a bad IP range or an unknown country code are skipped (with a
+message giving their line number), and the old codes "cs", "tp" and "uk"
+are read as "cz", "tl" and "gb" (see find_cc() in ip2cc-countries.h).
+
+A gzipped source data file, or a zip archive (its first file, which must
+be deflated), is parsed as it is inflated, so it needn't be unzipped
+first: a chunk of READ_BLOCK bytes of it at a time, each parsed by a
+thread of its own while the next ones are inflated (see read_packed()).
+So MaxMind's zip drops, as "data/mod_geoip databases/GeoIPCountryCSV.zip",
+are read as they are, with -4.
+
+A GeoIP database (-g) is read whole into memory, gunzipping it on the way,
+and its trie is walked from the lowest IPs to the highest (see
+ip2cc-geoip.h), so the ranges of its leaves come out already sorted, and
+those next to each other with the same country are merged, without any
+text file in between. Ranges of GeoIP codes that aren't ours (as "EU",
+"AP" or "A1") are skipped, with a message giving how many there were of
+each.
+
 See comments at the top of ip2cc.c for more information.
 
 
@@ -44,17 +84,21 @@ Optimization for space (smaller code) would be best as the algorythm doesn't
 need to be much sped up. For example, the line to compile this for the GNU
 C Compiler (GCC) under Windows, is:
 
-	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 mk-ip4db.c -o mk-ip4db.exe
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 mk-ip4db.c -lz -o mk-ip4db.exe
 
 and for GCC under UNIX (Linux, etc):
 
-	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 mk-ip4db.c -o mk-ip4db
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 -pthread mk-ip4db.c -lz -o mk-ip4db
+
+zlib (-lz) is only needed for gzipped or zip source data files, and
+gzipped GeoIP databases: compile with -DNO_ZLIB, and without -lz, to do
+without it.
 
-PLEASE BEWARE THAT IF YOU COMPILE IP2CC AND MK-IP4DB IN DIFFERENT PLATFORMS,
-THE FILE THAT THE LATTER CREATES MAY NOT WORK WITH THE FORMER, AS EACH
-PLATFORM'S COMPILER MAY HAVE USED DIFFERENT SECTOR_SIZE VALUES! TO PREVENT
-THAT MAKE SURE YOU COMPILER COMMAND LINE DEFINES COMMON SYMBOL SECTOR_SIZE,
-AS IN THE ABOVE EXAMPLE.
+SECTOR_SIZE (and LINE_SIZE) only set the default cluster size: the
+database header records the one it was built with, and ip2cc reads that.
+The header also records the byte order of the machine that built the
+database, and its country code table, and ip2cc refuses to open a
+database built with others than its own.
 
 To test the code, you may try IP number 194.65.14.75 which should result in
 country 'pt' (Portugal) - at least in 2003.
@@ -74,10 +118,19 @@ those ranges.
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+/* for reading the source data file: */
+#ifndef WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 
 #include "ip2cc.h"
 #include "ip2cc-countries.h"
+#include "ip2cc-geoip.h"
 
 
 /* System return values:
@@ -91,42 +144,124 @@ those ranges.
 #define	RANGE_LSB_MASK4		( (RANGE_SHIFT_MASK4 >> RANGE_SHIFT_SHIFT4) ^ ((unsigned16) 0x001F) )
 
 
-/* scanf() format strings for data files
+/* Reading the source data file: maximum number of threads (one per
+   CPU), smallest chunk of the file each one parses (up to the next
+   newline), and maximum number of fields in a line
+*/
+#define READ_MAXTHREADS		64
+#ifndef READ_CHUNK_MIN
+#define READ_CHUNK_MIN		( 1L << 16 )
+#endif
+#define CSV_FIELDS4		8
+
+
+/* Reading a gzipped or zip source data file: bytes inflated into each
+   chunk (up to its last newline), and read from the file at a time
 */
-const char *dfformats[] = {
-	"\"%10lu\",\"%10lu\",\"%2c\",\"%*[^\"]\",\"%*[^\"]\"\n",
-	"\"%10lu\",\"%10lu\",\"%2c\",\"%*[^\"]\"\n",
-	"\"%*[^\"]\",\"%*[^\"]\",\"%10lu\",\"%10lu\",\"%2c\",\"%*[^\"]\",\"%*[^\"]\"\n",
-	"\"%*[^\"]\",\"%*[^\"]\",\"%10lu\",\"%10lu\",\"%2c\",\"%*[^\"]\"\n" };
+#ifndef READ_BLOCK
+#define READ_BLOCK		( (size_t) 1 << 20 )
+#endif
 
 
-/* Buffer used to write a cluster into the file.
-   As SECTOR_SIZE is always >= CLUSTER_SIZE, we add the
-   maximum of SECTOR_SIZE bytes at the end of the real
-   cluster structure to fill in the extra unused bytes
+/* Data file formats: number of fields (each in double quotes, separated
+   by commas) in each line, and which of them (from 0) have the start IP,
+   end IP and country code
 */
-struct s_sector4
+struct s_dfformat
 	{
-	struct s_cluster4 cluster4;
-	char blank[ SECTOR_SIZE ];  /* initialized to all '\0' by C */
+	int fields, ip_start, ip_end, cc;
 	}
-	sector4;
+	dfformats[] = {
+	{ 5, 0, 1, 2 },
+	{ 4, 0, 1, 2 },
+	{ 7, 2, 3, 4 },
+	{ 6, 2, 3, 4 } };
+
+
+/* Nodes of the cluster being written, and the buffer it is laid out in,
+   to be written into the file (the whole cluster size, with the unused
+   bytes at the end as all '\0')
+*/
+struct s_node4 nodes4[ NODES4(DB4_SHIFT_MAX) ];
+unsigned char sector[ 1 << DB4_SHIFT_MAX ];
 
 
-/* Data type and pointers for internal lists and nodes that will
-   be used in creating the final structure. Much of the additional
-   data is repeated from the struct s_node# data type just to ease
-   its use while creating the final clusters and nodes.
+/* Entries of the database, in a single array that grows as needed (see
+   new_entry()): first the IP ranges as read from the source data file,
+   and then, sorted, the entries made from them. Much of the additional
+   data is repeated from the struct s_node# data type just to ease its
+   use while creating the final clusters and nodes. The balanced binary
+   tree of the entries has no pointers: see treeroot().
 */
-struct s_list
+struct s_entry
 	{
 	struct s_node4 node;
 	unsigned32 ip_start, ip_end;
 	int cc, i, treelevel;
 	long int cluster;
-	struct s_list *pprev, *pnext, *treeleft, *treeright;
 	}
-	*pfirst = NULL, *plast = NULL, *treetop = NULL;
+	*entries = NULL;
+long int numentries = 0L, maxentries = 0L;
+
+
+/* Line of the source data file skipped, for a bad IP range or country code
+*/
+struct s_skip
+	{
+	long int line;		/* in its chunk, from 1 */
+	char ccstr[3];		/* bad country code, or "" for a bad IP range */
+	};
+
+
+/* Chunk of the source data file, parsed by a thread of its own (see
+   read_source())
+*/
+struct s_chunk
+	{
+	const char *ps, *pe;		/* its lines, up to (not including) "pe" */
+	const struct s_dfformat *pf;	/* format of the data file */
+	struct s_entry *pentries;	/* IP ranges read, in the order read */
+	long int numentries, maxentries;
+	struct s_skip *pskips;		/* lines skipped */
+	long int numskips, maxskips;
+	long int lines;			/* lines read (up to the bad one, if "error") */
+	int error;			/* 0, READ_BADLINE or READ_NOMEMORY */
+	char *pbuf;			/* its lines, if inflated (see read_packed()) */
+	size_t bufsize;
+#ifndef WIN32
+	pthread_t tid;
+	int started;			/* 1 (true) if "tid" was started */
+#endif
+	};
+#define READ_BADLINE		1
+#define READ_NOMEMORY		2
+
+
+/* Walk of the trie of a GeoIP database (see read_geoip()): the range of
+   the leaves walked so far with the same GeoIP country code, not yet
+   added to the entries, and how many ranges of each code were skipped
+*/
+struct s_geoipwalk
+	{
+	const struct s_geoip *pg;
+	unsigned32 ip_start, ip_end;
+	int id;			/* GeoIP country code of the range, or -1 if none yet */
+	long int skipped[GEOIP_COUNTRIES];
+	};
+
+
+/* Sub-trees of the balanced binary tree whose top levels make up the
+   clusters, in the order the clusters are written (and numbered, from
+   DB4_ROOT): those written so far, and those queued to be (see
+   clusternode())
+*/
+struct s_subtree
+	{
+	long int lo, hi;  /* entries in the sub-tree (see treeroot()) */
+	int fromend;
+	}
+	*subtrees = NULL;
+long int numsubtrees = 0L;
 
 
 /* These hold the most shallow and deepest leaf levels found
@@ -137,11 +272,78 @@ int treelevel_min = INT_MAX;  /* set after running treenode() */
 int treelevel_max = 0;        /* set after running treenode() */
 
 
+/* Multibit trie being built by write_trie4(): its nodes and leaves, and
+   the number of entries it is built from (all of them, except one that
+   ends at the last IP)
+*/
+struct s_trie4node *trie_nodes = NULL;
+unsigned16 *trie_leaves = NULL;
+long int trie_numnodes, trie_numleaves, trie_maxnodes, trie_maxleaves;
+long int ranges;
+
+
+/* Temporary name of the database while it is being written (its name
+   plus NEW_SUFFIX), so that it isn't read half written
+*/
+char *ptemp = NULL;
+
+
+/* Geometry of the clusters being written: as for struct s_cluster4
+   and s_cluster4v, unless writing cache line clusters or given -s
+   (see struct s_db4head)
+*/
+int layout = 0;  /* IP4DB_VECTOR, IP4DB_LINE, or 0 for struct s_cluster4 clusters */
+int cluster_shift = SECTOR_SIZE_SHIFT;
+int nodes_per_cluster = NODES_PER_CLUSTER4;
+int treelevels_per_cluster = TREELEVELS_PER_CLUSTER4;
+
+
+/* Identity of the database being written, recorded in its header and at
+   the start of its side files (see struct s_db4id): its "stamp" is the
+   32-bit FNV-1a hash of all bytes after the header, as they are written
+*/
+struct s_db4id dbid;
+#define STAMP4_BASIS		((unsigned32) 2166136261U)
+#define STAMP4_PRIME		((unsigned32) 16777619U)
+
+
 /* Function prototypes
 */
-struct s_list *treenode( struct s_list *pleft, struct s_list *pright,
-			 long int entries, int level, long int *pnumnodes );
-void treecluster( struct s_list *pnode, long int cluster, int i, int step );
+int read_source( const char *filename, const struct s_dfformat *pf );
+int read_packed( const char *pbase, size_t size, const struct s_dfformat *pf );
+void start_chunk( struct s_chunk *pc );
+void wait_chunk( struct s_chunk *pc );
+int merge_chunk( struct s_chunk *pc, long int *pline );
+const char *map_source( const char *filename, size_t *psize );
+void unmap_source( const char *pbase, size_t size );
+#ifndef WIN32
+void *read_thread( void *pv );
+#endif
+void read_chunk( struct s_chunk *pc );
+int read_geoip( const char *filename );
+int geoip_node( struct s_geoipwalk *pw, unsigned long int node, int depth, unsigned32 ip );
+int geoip_range( struct s_geoipwalk *pw );
+int csv_fields4( const char **pps, const char *pe, const char **pfield, int *plen, int max );
+int parse_ip_field( const char *ps, int len, unsigned32 *pip );
+struct s_entry *new_entry( struct s_entry **ppentries, long int *pnumentries, long int *pmaxentries );
+int fit_ranges( long int *plines_reorder, long int *plines_overlap, long int *plines_overlap_del );
+long int find_bound( const unsigned64 *pbound, long int n, unsigned64 ip );
+int compare_bound( const void *p1, const void *p2 );
+long int treeroot( long int lo, long int hi, int fromend );
+long int treenode( long int lo, long int hi, int fromend, int level );
+long int clusternode( long int lo, long int hi, int fromend, long int cluster, int i, int step, long int *pnext );
+long int queue_subtree( long int lo, long int hi, int fromend );
+int write_head4( FILE *fp );
+unsigned32 stamp4( unsigned32 stamp, const void *p, size_t size );
+void cluster4_to_default( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf );
+void cluster4_to_v( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf );
+int cluster4_to_line( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf );
+int write_jump4( const char *filename );
+int write_trie4( const char *filename );
+int publish_file( const char *filename, const char *suffix );
+void remove_stale( const char *filename, const char *suffix );
+int trienode( long int ni, unsigned32 ip4, int d );
+int range_cc( unsigned32 ip_start, unsigned32 ip_end );
 void free_all( void );
 
 
@@ -149,68 +351,114 @@ void free_all( void );
 */
 int main( int argc, char *argv[] )
 {
-	static const char *dfformat;
+	static const struct s_dfformat *pf;
 	FILE *fp;
-	unsigned long int ip_start, ip_end, range, range2, rmask;
-	long int line, lines, lines_saved, lines_added, lines_reorder,
+	unsigned long int ip_start, range, range2, rmask;
+	long int lines, lines_saved, lines_added, lines_reorder,
 		lines_overlap, lines_overlap_del;
-	long int cluster, clusters, cluster_old;
-	int levelmin, levelmax;
-	char ccstr[] = "??";
-	struct s_list *pl, *pln, **ppl;
-		/* pointer to list, pointer to list new,
-		   pointer to pointer to list */
-	char *ps;
+	long int e, cluster, clusters, nodes;
+	struct s_entry *pe, *pold;
+		/* pointer to entry, pointer to entries before
+		   their ranges were split */
+	char *ps, *pexe;
 	int i, i2, cc;
+	int opt_vector = 0;  /* default: write struct s_cluster4 clusters */
+	int opt_line = 0;    /* ditto */
+	long int opt_size = 0L;  /* default: SECTOR_SIZE (or LINE_SIZE) clusters */
+	int opt_jump = 0;    /* default: no jump table */
+	int opt_trie = 0;    /* default: no multibit trie */
+	int opt_geoip = 0;   /* default: source data file in the format of -# */
+	long int next[NODES4(DB4_SHIFT_MAX)+1];  /* next cluster indexes of the cluster being written */
 
-	/* Parse command-line help and data file format
+	/* Parse command-line options and data file format
 	*/
-	if( argc < 2  ||  argc > 4 )
+	i = 0;  /* default format */
+	for( pexe = *argv++;  *argv != NULL  &&  **argv == '-';  argv++ )
+		{
+		cc = *(*argv+1);
+		if( cc == 'v'  &&  *(*argv+2) == '\0' )
+			opt_vector = 1;  /* true */
+		else if( cc == 'l'  &&  *(*argv+2) == '\0' )
+			opt_line = 1;  /* true */
+		else if( cc == 's'  &&  *(*argv+2) == '\0'  &&  argv[1] != NULL  &&  (opt_size = atol(argv[1])) > 0L )
+			argv++;
+		else if( cc == 'j'  &&  *(*argv+2) == '\0' )
+			opt_jump = 1;  /* true */
+		else if( cc == 't'  &&  *(*argv+2) == '\0' )
+			opt_trie = 1;  /* true */
+		else if( cc == 'g'  &&  *(*argv+2) == '\0' )
+			opt_geoip = 1;  /* true */
+		else if( cc >= '1'  &&  cc <= '0'+sizeof(dfformats)/sizeof(dfformats[0])  &&  *(*argv+2) == '\0' )
+			i = cc - '1';
+		else
+			{
+			fprintf( stderr, "Bad source file format specifier.\n"
+					 "Run %s without arguments for help.\n",
+					 pexe );
+			return RV_ERROR;
+			}
+		}
+	if( argv[0] == NULL  ||  (argv[1] != NULL  &&  argv[2] != NULL)  ||  (opt_vector  &&  opt_line) )
 		{
 		fprintf( stderr, "\n"
-				 "Usage: %s [-#] <source-ip-to-country-data-file> [<dest-ip4db-file>]\n"
+				 "Usage: %s [-v|-l] [-s <bytes>] [-j] [-t] [-#|-g] <source-ip-to-country-data-file> [<dest-ip4db-file>]\n"
 				 "where -# specifies the source file format:\n"
 				 "-1  \"<ip-start>\",\"<ip-end>\",\"<iso-country>\",\"...\",\"...\"  (default)\n"
 				 "-2  \"<ip-start>\",\"<ip-end>\",\"<iso-country>\",\"...\"\n"
 				 "-3  \"<...>\",\"<...>\",\"<ip-start>\",\"<ip-end>\",\"<iso-country>\",\"...\",\"...\"\n"
-				 "-4  \"<...>\",\"<...>\",\"<ip-start>\",\"<ip-end>\",\"<iso-country>\",\"...\"\n"
+				 "-4  \"<...>\",\"<...>\",\"<ip-start>\",\"<ip-end>\",\"<iso-country>\",\"...\"  (MaxMind's GeoIP CSV)\n"
+				 "(gzipped, or the first file of a zip archive, too)\n"
+				 "or -g reads a MaxMind legacy GeoIP country database (GeoIP.dat, gzipped or not) instead,\n"
+				 "and -v writes \"vector\" clusters, -l cache line clusters, -s clusters of <bytes> (a power of 2,\n"
+				 "from 64 to 16384, or to 128 with -l; SECTOR_SIZE, or LINE_SIZE with -l, by default)\n"
+				 "and -j also writes a /16 jump table (for ip2cc -j), -t a multibit trie (for ip2cc -t)\n"
 				 "\n"
 				 "(C) 2003-2011 Corebase, Easymatic\n"
 				 "         www.easymatic.com\n"
 				 "\n",
-				 argv[0] );
+				 pexe );
 		return RV_ERROR;
 		}
-	i = 0;  /* default format */
-	if( *argv[1] == '-' )
+	pf = &dfformats[i];
+
+	/* Geometry of the clusters
+	*/
+	if( opt_vector )
+		layout = IP4DB_VECTOR;
+	else if( opt_line )
 		{
-		cc = *(argv[1]+1);
-		if( cc >= '1'  &&  cc <= '0'+sizeof(dfformats)/sizeof(dfformats[0])  &&  *(argv[1]+2) == '\0' )
-			i = cc - '1';
-		else
+		layout = IP4DB_LINE;
+		cluster_shift = LINE_SIZE_SHIFT;
+		}
+	if( opt_size > 0L )
+		{
+		for( cluster_shift = 0;  (1L << cluster_shift) < opt_size  &&  cluster_shift < DB4_SHIFT_MAX;  cluster_shift++ )
+			;
+		if( (1L << cluster_shift) != opt_size  ||  cluster_shift < DB4_SHIFT_MIN  ||
+		    cluster_shift > (opt_line ? DB4_LINE_SHIFT_MAX : DB4_SHIFT_MAX) )
 			{
-			fprintf( stderr, "Bad source file format specifier.\n"
+			fprintf( stderr, "Bad cluster size (%li).\n"
 					 "Run %s without arguments for help.\n",
-					 argv[0] );
+					 opt_size, pexe );
 			return RV_ERROR;
 			}
-		argv++;
 		}
-	argv++;
-	dfformat = dfformats[i];
+	nodes_per_cluster = NODES4( cluster_shift );
+	treelevels_per_cluster = TREELEVELS4( cluster_shift );
 
 	/* Internal check to make sure binary search algorythm for
 	   finding country codes is working properly
 	*/
 	puts( "Internal tests..." );
-	if( sizeof(struct s_cluster4) > SECTOR_SIZE )
+	if( (opt_line ? LINE4_BYTES(nodes_per_cluster) : CLUSTER4V_BYTES(nodes_per_cluster)) > (size_t) 1 << cluster_shift  ||
+	    sizeof(struct s_db4head) > (size_t) 1 << DB4_SHIFT_MIN )
 		{
 		fprintf( stderr, "Internal error: cluster data (%li) is greater than expected (%i).\n"
-			 "sizeof(nodes[])=%li, sizeof(next[])=%li, NODES_PER_CLUSTER4=%i\n"
+			 "sizeof(struct s_node4)=%li, sizeof(struct s_db4head)=%li, nodes per cluster=%i\n"
 			 "Make sure you call your compiler with options to eliminate holes in structures\n"
 			 "(for instance, in GCC, you must call it with 'gcc -fpack-struct')\n",
-			 (long int) sizeof(struct s_cluster4), SECTOR_SIZE,
-			 (long int) sizeof(struct s_node4[NODES_PER_CLUSTER4]), (long int) sizeof(unsigned16[NODES_PER_CLUSTER4+1]), NODES_PER_CLUSTER4 );
+			 (long int) (opt_line ? LINE4_BYTES(nodes_per_cluster) : CLUSTER4V_BYTES(nodes_per_cluster)), 1 << cluster_shift,
+			 (long int) sizeof(struct s_node4), (long int) sizeof(struct s_db4head), nodes_per_cluster );
 		return RV_ERROR;
 		}
 	for( i = 0;  i < CNAME_SIZE;  i++ )
@@ -221,147 +469,83 @@ int main( int argc, char *argv[] )
 			return RV_ERROR;
 			}
 		}
+	for( i = cc = 0;  i < 26*26;  i++ )
+		{
+		if( cname_index[i / 26][i % 26] >= 0 )
+			cc++;
+		}
+	if( cc != (int) CNAME_SIZE + 3 )  /* and the 3 old codes */
+		{
+		fputs( "Internal error: country code index has unexpected codes.\n", stderr );
+		return RV_ERROR;
+		}
 
-	/* Open and read all the input data file into memory
+	/* Read all the input data file into memory
 	*/
 	puts( "Reading source IP-to-country data file..." );
-	fp = fopen( argv[0], "r" );
-	if( fp == NULL )
+	if( (opt_geoip ? read_geoip(argv[0]) : read_source(argv[0], pf)) != RV_OK )
 		{
-		fprintf( stderr, "Cannot open source IP-to-country data file (%s).\n", argv[0] );
+		free_all();
 		return RV_ERROR;
 		}
-	lines_reorder = lines_overlap = lines_overlap_del = lines = 0L;
-	for( line = 1L;  !feof(fp);  line++ )
+	if( opt_geoip )
+		printf( "Read all %li ranges of source GeoIP country database.\n", numentries );
+	else
+		printf( "Read all %li lines of source IPv4-to-country data file.\n", numentries );
+	if( fit_ranges(&lines_reorder, &lines_overlap, &lines_overlap_del) != 0 )
 		{
-		if( line % 10000L == 0L )
-			printf( "Read %li lines so far...\n", line );
-		if( fscanf(fp, dfformat, &ip_start, &ip_end, ccstr) != 3 )
-			{
-			fclose( fp );
-			free_all();
-			fprintf( stderr, "Error reading line %li of source of IPv4-to-country data file.\n", line );
-			return RV_ERROR;
-			}
-		pln = malloc( sizeof(struct s_list) );
-		if( pln == NULL )
-			{
-			fclose( fp );
-			free_all();
-			fprintf( stderr, "Not enough memory reading line %li of source IPv4-to-country data file.\n", line );
-			return RV_ERROR;
-			}
-		pln->cluster = -1L;  /* "unknown" */
-		pln->pprev = pln->pnext = pln->treeleft = pln->treeright = NULL;
-		pln->treelevel = pln->i = -1;  /* "unset" */
-		pln->ip_start = pln->node.ip = ip_start;
-		pln->ip_end = ip_end;
-		/* replace old ISO2 codes */
-		if( !strcmp(ccstr, "CS")  ||  !strcmp(ccstr, "cs") )
-			strcpy( ccstr, "cz" );
-		else if( !strcmp(ccstr, "TP")  ||  !strcmp(ccstr, "tp") )
-			strcpy( ccstr, "tl" );
-		else if( !strcmp(ccstr, "UK")  ||  !strcmp(ccstr, "uk") )
-			strcpy( ccstr, "gb" );
-		pln->cc = find_cc( ccstr );
-		if( ip_end < ip_start  ||  pln->cc < 0 )
-			{
-			free( pln );
-			if( ip_end < ip_start )
-				fprintf( stderr, "Bad IP range (start IP > end IP) reading line %li of source IPv4-to-country data file.\nSkipping line.\n", line );
-			else
-				fprintf( stderr, "Bad country code '%s' reading line %li of source IPv4-to-country data file.\nSkipping line.\n", ccstr, line );
-			continue;
-			}
-		/* add this line to the list, sorted */
-		lines++;
-		for( ppl = &plast;  (pl=*ppl);  ppl = &(pl->pprev) )
-			{
-			if( pl->ip_start <= ip_start )
-				break;
-			if( pl->ip_start <= ip_end )
-				{
-				lines_overlap++;
-				pln->ip_end = ip_end = pl->ip_start - 1U;
-					/* just eliminate the overlapped part;
-					   if the overlapped ranges refer to
-					   the same country, later redundancy
-					   check will optimize these ranges */
-				if( ip_end < ip_start )
-					{
-					/* if the current node described a range of
-					   only 1 IP, the above expression may have
-					   invalidated the current node's range */
-					lines_overlap_del++;
-					free( pln );
-					continue;
-					}
-				}
-			}
-		if( pl != NULL )
-			{
-			if( ip_start <= pl->ip_end )
-				{
-				/* this condition includes the case
-				   ip_start == pl->ip_start */
-				/* well, we know at least that ip_end does NOT
-				   overlap with any of the following nodes */
-				lines_overlap++;
-				pln->ip_start = pln->node.ip = ip_start = pl->ip_end + 1U;
-				if( ip_end < ip_start )
-					{
-					lines_overlap_del++;
-					free( pln );
-					continue;
-					}
-				}
-			pln->pprev = pl;
-			pln->pnext = pl->pnext;
-			if( pln->pnext != NULL )
-				lines_reorder++;
-			pl->pnext = pln;
-			}
-		else
-			pfirst = pln;
-		*ppl = pln;
+		free_all();
+		fputs( "Not enough memory to sort source IPv4-to-country data file.\n", stderr );
+		return RV_ERROR;
 		}
-	/* lines = line-1L; can't do this, some lines aren't added */
-		/* last line wan't read, it was EOF => "lines" has NUMBER of lines */
-	fclose( fp );
-	printf( "Read all %li lines of source IPv4-to-country data file.\n", lines );
 	printf( "%li lines had to be reordered.\n", lines_reorder );
 	printf( "%li overlapped IP ranges were fixed as possible (%li lines were deleted).\n", lines_overlap, lines_overlap_del );
-	if( pfirst == NULL  ||  plast == NULL )
+	if( numentries == 0L )
 		{
+		free_all();
 		fputs( "Nothing to do.\n", stderr );
 		return RV_ERROR;
 		}
 
-	/* Verify adjacent redundant lines
+	/* Verify adjacent redundant lines, and split the ranges the
+	   database can't hold in a single entry (into a new array)
 	*/
 	puts( "Finding redundancy and ranges..." );
 	lines_saved = lines_added = 0L;
-	for( pl = pfirst;  pl;  pl = pl->pnext )
+	for( lines = 0L, e = 0L;  e < numentries;  e++ )
 		{
-		while( (pln=pl->pnext) != NULL  &&  (pl->ip_end + (unsigned32) 1U) == pln->ip_start  &&  pl->cc == pln->cc )
+		if( lines > 0L  &&  (entries[lines-1L].ip_end + (unsigned32) 1U) == entries[e].ip_start  &&
+		    entries[lines-1L].cc == entries[e].cc )
 			{
 			lines_saved++;
-			pl->ip_end = pln->ip_end;
-			pl->pnext = pln->pnext;
-			if( pl->pnext != NULL )
-				pl->pnext->pprev = pl;
-			else
-				plast = pl;
-			free( pln );
+			entries[lines-1L].ip_end = entries[e].ip_end;
 			}
-		range = pl->ip_end - pl->ip_start + 1UL;
+		else
+			entries[lines++] = entries[e];
+		}
+	pold = entries;
+	entries = NULL;
+	numentries = maxentries = 0L;
+	for( e = 0L;  e < lines;  e++ )
+		{
+		range = pold[e].ip_end - pold[e].ip_start + 1UL;
 		for( i = 0;  (range & 1UL) == 0UL;  i++ )
 			range >>= 1;
 		range <<= ( i & RANGE_LSB_MASK4 );
 		i &= ( RANGE_SHIFT_MASK4 >> RANGE_SHIFT_SHIFT4 );
-		ip_start = pl->ip_start;
+		ip_start = pold[e].ip_start;
 		for(;;)  /*forever*/
 			{
+			pe = new_entry( &entries, &numentries, &maxentries );
+			if( pe == NULL )
+				{
+				free( pold );
+				free_all();
+				fputs( "Not enough memory for new database entry.\n", stderr );
+				return RV_ERROR;
+				}
+			*pe = pold[e];
+			pe->node.ip = ip_start;
 			range2 = range;
 			i2 = i;
 			rmask = RANGE_MASK4;
@@ -371,391 +555,1733 @@ int main( int argc, char *argv[] )
 				rmask  <<= (RANGE_LSB_MASK4 + 1);
 				i2 +=      (RANGE_LSB_MASK4 + 1);
 				}
-			pl->node.ccsz = (((unsigned16) pl->cc) << CC_SHIFT4) | (((unsigned16) i2) << RANGE_SHIFT_SHIFT4) | ((unsigned16) range2-1UL);
+			pe->node.ccsz = (((unsigned16) pe->cc) << CC_SHIFT4) | (((unsigned16) i2) << RANGE_SHIFT_SHIFT4) | ((unsigned16) range2-1UL);
 			range &= ~(rmask | (rmask<<1));  /* make sure pattern 10000 (RANGE_MASK4+1) is fully deleted */
 			if( !range )
 				{
-				if( ip_start + (range2 << i2) - 1U  !=  pl->ip_end )
+				if( ip_start + (range2 << i2) - 1U  !=  pold[e].ip_end )
 					{
 					free_all();
-					fprintf( stderr, "Internal error: bad range; is %lu, should be %lu.\n", (unsigned long int) ip_start+(range2<<i2)-1U, (unsigned long int) pl->ip_end );
+					fprintf( stderr, "Internal error: bad range; is %lu, should be %lu.\n", (unsigned long int) ip_start+(range2<<i2)-1U, (unsigned long int) pold[e].ip_end );
+					free( pold );
 					return RV_ERROR;
 					}
 				break;
 				}
-			pln = malloc( sizeof(struct s_list) );
-			if( pln == NULL )
-				{
-				free_all();
-				fputs( "Not enough memory for new database entry.\n", stderr );
-				return RV_ERROR;
-				}
-			memcpy( pln, pl, sizeof(struct s_list) );
-			ip_start = ( pln->node.ip += ( range2 << i2 ) );
-			pln->pprev = pl;
-			pln->pnext = pl->pnext;
-			if( pln->pnext != NULL )
-				pln->pnext->pprev = pln;
-			else
-				plast = pln;
-			pl->pnext = pln;
-			pl = pln;
+			ip_start += range2 << i2;
 			lines_added++;
 			}
 		}
-	lines = lines - lines_saved + lines_added;
+	free( pold );
+	lines = numentries;
 	printf( "There were %li redundant lines removed.\n"
 		"There were %li entries (lines) added due to database range limitations.\n"
 		"Total entries (lines) = %lu\n",
 		lines_saved, lines_added, lines );
 
-	/* Verify internal bi-direccional linked list
+	/* Verify entries
 	*/
-	puts( "Verifying internal linked lists..." );
-	line = 0L;
-	for( pl = pfirst;  pl;  pl = pl->pnext )
+	puts( "Verifying database entries..." );
+	for( e = 0L;  e < lines;  e++ )
 		{
-		line++;
-		pl->ip_start = pl->node.ip;
-		pl->ip_end   = pl->node.ip + ( ((unsigned32) (pl->node.ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((pl->node.ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) ) - 1U;
-		if( (pl->pnext != NULL  &&  pl->pnext->node.ip <= pl->ip_end) )
+		pe = &entries[e];
+		pe->ip_start = pe->node.ip;
+		pe->ip_end   = pe->node.ip + ( ((unsigned32) (pe->node.ccsz & RANGE_MASK4) + (unsigned32) 1U) << ((pe->node.ccsz & RANGE_SHIFT_MASK4) >> RANGE_SHIFT_SHIFT4) ) - 1U;
+		if( e > 0L  &&  pe->ip_start <= pe[-1].ip_end )
 			{
 			free_all();
-			fprintf( stderr, "Internal error: list entry %lu range overlap by %lu IPs.\n", line, (unsigned long int) pl->ip_end - pl->pnext->node.ip - 1U );
+			fprintf( stderr, "Internal error: list entry %lu range overlap by %lu IPs.\n", e, (unsigned long int) pe[-1].ip_end - pe->ip_start - 1U );
 			return RV_ERROR;
 			}
 		}
-	if( line != lines )
-		{
-		free_all();
-		fprintf( stderr, "Internal error: forward linked list is %lu, not as expected (%lu).\n", line, lines );
-		return RV_ERROR;
-		}
-	line = 0L;
-	for( pl = plast;  pl;  pl = pl->pprev )
-		line++;
-	if( line != lines )
-		{
-		free_all();
-		fprintf( stderr, "Internal error: backward linked list is %lu, not as expected (%lu).\n", line, lines );
-		return RV_ERROR;
-		}
 
 	/* Build tree
 	*/
 	puts( "Building balanced binary tree..." );
-	treetop = treenode( plast, pfirst, lines, 0, NULL );
+	nodes = treenode( 0L, lines-1L, 1, 0 );
 	printf( "There are %i levels in the tree.\n", treelevel_max );
 
 	/* Verify tree
 	*/
 	puts( "Verifying balanced binary tree..." );
-	if( treelevel_max < treelevel_min  ||  treelevel_max-treelevel_min > 1 )
+	if( nodes < 0L )
 		{
 		free_all();
-		fputs( "Internal error: tree leafs are more than one level appart!\n", stderr );
+		fputs( "Internal error: tree is not balanced!\n", stderr );
 		return RV_ERROR;
 		}
-	for( pl = pfirst;  pl;  pl = pl->pnext )
+	if( treelevel_max < treelevel_min  ||  treelevel_max-treelevel_min > 1 )
 		{
-		if( pl->treelevel < 0 )
-			{
-			free_all();
-			fputs( "Internal error: some of the list was not turned into a tree node!\n", stderr );
-			return RV_ERROR;
-			}
-		}
-
-	/* Creating clusters
-	*/
-	puts( "Creating clusters and cluster indexes..." );
-	treecluster( treetop, 0L, 0, 0 );
-	/* now renumber the clusters to make clusters closer to the top
-	   of the tree (and at the same level range, those closer to the right)
-	   have smaller numbers, and hence be closer to the start of the
-	   database file */
-	line = -1L;  /* "line" = first cluster not full of nodes; -1 if none yet */
-	cluster = -1L;
-	for( levelmin = 0, levelmax=TREELEVELS_PER_CLUSTER4-1;
-	     levelmin <= treelevel_max;
-	     (levelmin += TREELEVELS_PER_CLUSTER4), (levelmax += TREELEVELS_PER_CLUSTER4) )
-		{
-		cluster_old = 0L;  /* "none" */
-		cc = 0;
-		for( pl = plast;  pl;  pl = pl->pprev )
-			{
-			if( pl->treelevel < levelmin  ||  levelmax < pl->treelevel )
-				continue;
-			if( cluster_old == 0L  ||  pl->cluster > cluster_old )
-				{
-				if( cluster_old != 0L  &&  cc != NODES_PER_CLUSTER4 )
-					{
-					if( levelmax < treelevel_max-1  ||  cc > NODES_PER_CLUSTER4 )
-						{
-						free_all();
-						fputs( "Internal error: clusters not of expected number/size!\n", stderr );
-						return RV_ERROR;
-						}
-					if( line < 0L )
-						line = cluster;
-					}
-				cluster_old = pl->cluster;
-				cluster++;
-				cc = 0;
-				}
-			if( pl->cluster < cluster_old )
-				{
-				cluster = pl->cluster;
-				free_all();
-				fprintf( stderr, "Internal error: cluster number %li not smaller than %li, as expected!\n", cluster, cluster_old );
-				return RV_ERROR;
-				}
-			pl->cluster = cluster;
-			cc++;
-			}
+		free_all();
+		fputs( "Internal error: tree leafs are more than one level appart!\n", stderr );
+		return RV_ERROR;
 		}
-	clusters = cluster + 1L;
-	if( line < 0L )
-		line = clusters;  /* one more than the last cluster number */
-	printf( "There are %lu clusters in the database file.\n", clusters );
-
-	/* Verifying clusters
-	*/
-	puts( "Verifying clusters..." );
-	for( pl = pfirst;  pl;  pl = pl->pnext )
+	if( nodes != lines )
 		{
-		if( pl->cluster < 0L )
-			{
-			free_all();
-			fputs( "Internal error: some of the tree was not clustered!\n", stderr );
-			return RV_ERROR;
-			}
-		if( pl->i < 0L  ||  pl->i >= NODES_PER_CLUSTER4 )
-			{
-			free_all();
-			fputs( "Internal error: cluster's 'i' index is unset or out of range!\n", stderr );
-			return RV_ERROR;
-			}
+		free_all();
+		fputs( "Internal error: some of the list was not turned into a tree node!\n", stderr );
+		return RV_ERROR;
 		}
 
-	/* Creating target file
+	/* Creating target file, under a temporary name (see publish_file())
 	*/
 	puts( "Creating target database..." );
 	ps = argv[1] != NULL ? argv[1] : DBFILE4;
-	fp = fopen( ps, "wb" );
+	ptemp = malloc( strlen(ps) + sizeof(NEW_SUFFIX) );
+	subtrees = malloc( lines * sizeof(struct s_subtree) );  /* no sub-tree is empty */
+	if( ptemp == NULL  ||  subtrees == NULL )
+		{
+		free_all();
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+	strcat( strcpy(ptemp, ps), NEW_SUFFIX );
+	fp = fopen( ptemp, "wb" );
 	if( fp == NULL )
+		{
+		fprintf( stderr, "Cannot create new empty IPv4-to-country database (%s).\n", ptemp );
+		free( ptemp );
+		ptemp = NULL;  /* nothing to remove */
+		free_all();
+		return RV_ERROR;
+		}
+	dbid.clusters = 0U;
+	dbid.ranges = (unsigned32) lines;
+	dbid.stamp = STAMP4_BASIS;
+	if( write_head4(fp) != 0 )  /* rewritten at the end, with the number of clusters and the stamp */
 		{
 		free_all();
-		fprintf( stderr, "Cannot create new empty IPv4-to-country database (%s).\n", ps );
+		fclose( fp );
+		fputs( "Error writing to database file.\n", stderr );
 		return RV_ERROR;
 		}
-	for( cluster = 0L;  cluster < clusters;  cluster++ )
+
+	/* Creating clusters and writing them, in a single pass: the whole
+	   tree is the first sub-tree queued, and each cluster queues the
+	   sub-trees bellow it, so that clusters closer to the top of the
+	   tree (and at the same level range, those closer to the right)
+	   have smaller numbers, and hence be closer to the start of the
+	   database file (right after its header, in cluster 0)
+	*/
+	subtrees[0].lo = 0L;
+	subtrees[0].hi = lines-1L;
+	subtrees[0].fromend = 1;
+	numsubtrees = 1L;
+	for( cluster = DB4_ROOT;  cluster < DB4_ROOT + numsubtrees;  cluster++ )
 		{
-		if( cluster > 0L  &&  cluster % 100L == 0L )
+		if( cluster % 100L == 0L )
 			printf( "Written %li clusters so far...\n", cluster );
 		/* mark entire cluster for "leaf nodes" */
-		for( i = 0;  i < NODES_PER_CLUSTER4;  i++ )
+		for( i = 0;  i < nodes_per_cluster;  i++ )
 			{
-			sector4.cluster4.nodes[i].ip   = (unsigned32) 0xFFFFFFFFU;
-			sector4.cluster4.nodes[i].ccsz = (unsigned16) 0xFFFFU;
-			sector4.cluster4.next[i]       = (unsigned16) 0x0000U;
+			nodes4[i].ip   = (unsigned32) 0xFFFFFFFFU;
+			nodes4[i].ccsz = (unsigned16) 0xFFFFU;
+			next[i]        = 0L;
 			}
-		sector4.cluster4.next[i] = (unsigned16) 0x0000U;  /* next[] has one more element */
-		cc = 0;
-		for( pl = pfirst;  pl;  pl = pl->pnext )
+		next[i] = 0L;  /* next[] has one more element */
+		e = cluster - DB4_ROOT;
+		nodes = clusternode( subtrees[e].lo, subtrees[e].hi, subtrees[e].fromend, cluster,
+				     nodes_per_cluster >> 1, (nodes_per_cluster >> 2) + 1, next );
+		if( nodes < 0L )
 			{
-			if( pl->cluster == cluster )
-				{
-				i = pl->i;
-				if( sector4.cluster4.nodes[i].ip != (unsigned32) 0xFFFFFFFFU )
-					{
-					free_all();
-					fclose( fp );
-					fprintf( stderr, "Internal error: cluster %li has more than one 'i' index with same value!\n", cluster );
-					return RV_ERROR;
-					}
-				sector4.cluster4.nodes[i].ip   = pl->node.ip;
-				sector4.cluster4.nodes[i].ccsz = pl->node.ccsz;
-				if( (i & 1) == 0 )
-					{
-					if( pl->treeleft != NULL )
-						sector4.cluster4.next[i]   = pl->treeleft->cluster;
-					if( pl->treeright != NULL )
-						sector4.cluster4.next[i+1] = pl->treeright->cluster;
-					}
-				cc++;
-				}
+			free_all();
+			fclose( fp );
+			return RV_ERROR;
+			}
+		/* only clusters with the deepest leaf levels may not be full */
+		i = entries[ treeroot(subtrees[e].lo, subtrees[e].hi, subtrees[e].fromend) ].treelevel;
+		if( nodes != nodes_per_cluster  &&  i + treelevels_per_cluster-1 < treelevel_max-1 )
+			{
+			free_all();
+			fclose( fp );
+			fprintf( stderr, "Internal error: cluster %li was not filled with all its nodes!\n", cluster );
+			return RV_ERROR;
 			}
-		for( i = 0;  i < NODES_PER_CLUSTER4+1; i++ )
+		for( i = 0;  i < nodes_per_cluster+1; i++ )
 			{
-			if( sector4.cluster4.next[i] != 0  &&  sector4.cluster4.next[i] <= cluster )
+			if( next[i] != 0L  &&  next[i] <= cluster )
 				{
 				free_all();
 				fclose( fp );
 				fprintf( stderr, "Internal error: cluster %li has 'next[]' pointers that loop back!\n", cluster );
 				return RV_ERROR;
 				}
+			if( next[i] > 0xFFFFL  &&  !opt_line )
+				{
+				free_all();
+				fclose( fp );
+				fputs( "Too many clusters for 16-bit 'next[]' pointers; try -l.\n", stderr );
+				return RV_ERROR;
+				}
 			}
-		if( cluster < line  &&  cc != NODES_PER_CLUSTER4 )
+		if( opt_line  &&  cluster4_to_line(nodes4, next, sector) != 0 )
 			{
 			free_all();
 			fclose( fp );
-			fprintf( stderr, "Internal error: cluster %li was not filled with all its nodes!\n", cluster );
+			fprintf( stderr, "Internal error: cluster %li has 'next[]' pointers that are not consecutive!\n", cluster );
+			return RV_ERROR;
+			}
+		if( opt_vector )
+			cluster4_to_v( nodes4, next, sector );
+		else if( !opt_line )
+			cluster4_to_default( nodes4, next, sector );
+		if( fwrite(sector, (size_t) 1 << cluster_shift, 1, fp) != 1 )
+			{
+			free_all();
+			fclose( fp );
+			fputs( "Error writing to database file.\n", stderr );
 			return RV_ERROR;
 			}
-		if( fwrite(&sector4, SECTOR_SIZE, 1, fp) != 1 )
+		dbid.stamp = stamp4( dbid.stamp, sector, (size_t) 1 << cluster_shift );
+		}
+	clusters = cluster;
+	printf( "There are %lu clusters in the database file (%i bytes each, the first one its header).\n", clusters, 1 << cluster_shift );
+	/* the country code table, after the last cluster */
+	for( i = 0;  i < (int) CNAME_SIZE;  i++ )
+		{
+		if( fwrite(cname_up[i], 2, 1, fp) != 1 )
 			{
 			free_all();
 			fclose( fp );
 			fputs( "Error writing to database file.\n", stderr );
 			return RV_ERROR;
 			}
+		dbid.stamp = stamp4( dbid.stamp, cname_up[i], (size_t) 2 );
+		}
+	dbid.clusters = (unsigned32) clusters;
+	if( fseek(fp, 0L, SEEK_SET) != 0  ||  write_head4(fp) != 0 )
+		{
+		free_all();
+		fclose( fp );
+		fputs( "Error writing to database file.\n", stderr );
+		return RV_ERROR;
+		}
+
+	if( fclose(fp) != 0 )
+		{
+		free_all();
+		fputs( "Error writing to database file.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* Verifying clusters
+	*/
+	puts( "Verifying clusters..." );
+	for( e = 0L;  e < lines;  e++ )
+		{
+		if( entries[e].cluster < 0L )
+			{
+			free_all();
+			fputs( "Internal error: some of the tree was not clustered!\n", stderr );
+			return RV_ERROR;
+			}
+		}
+	if( (opt_jump  &&  write_jump4(ps))  ||  (opt_trie  &&  write_trie4(ps)) )
+		{
+		free_all();
+		return RV_ERROR;
+		}
+
+	/* Publishing: the new files replace the old ones, each at once, and
+	   the database last, so that whoever opens it (or reloads it, with
+	   reload_ip4_db()) gets its new jump table and trie too (in between,
+	   open_ip4_db() finds them not to match the old database, and tries
+	   again). A jump table or trie left from an older database is then
+	   removed (it would be refused anyway, see struct s_db4id)
+	*/
+	if( (opt_jump  &&  publish_file(ps, JUMP_SUFFIX4))  ||
+	    (opt_trie  &&  publish_file(ps, TRIE_SUFFIX4))  ||
+	    publish_file(ps, "") )
+		{
+		free_all();
+		return RV_ERROR;
 		}
+	free( ptemp );
+	ptemp = NULL;  /* published */
+	if( !opt_jump )
+		remove_stale( ps, JUMP_SUFFIX4 );
+	if( !opt_trie )
+		remove_stale( ps, TRIE_SUFFIX4 );
 
 	/* Done
 	*/
-	fclose( fp );
 	free_all();
 	puts( "All done!" );
 	return RV_OK;
 }
 
 
-/* Creates a balanced tree from the sorted list read from the file.
-   One of "pright" or "pleft" can be NULL, meaning there are no blocks going that way
-   (i.e., you should count blocks on the pointer NOT null); "entries" states how many
-   entries or "lines" there are pointed to by one of the pointers, and "level" has the
-   current tree level (0 for root node, 1 for its two descendants, etc.).
-   Returns the root node for the block being provided.
+/* Reads the source data file "filename", in format "pf", into "entries",
+   in the order of its lines. The file is mapped (or read whole, under
+   WIN32), split at newline boundaries into a chunk per CPU (of at least
+   READ_CHUNK_MIN bytes), and each chunk is parsed by a thread of its own
+   into entries of its own (see read_chunk()), which are then put
+   together, in order. A gzipped file, or a zip archive, is inflated
+   instead, a chunk at a time (see read_packed()). Lines with a bad IP
+   range or country code are skipped, with a message.
+   Returns RV_OK, or RV_ERROR on error (after outputting a message)
 */
-struct s_list *treenode( struct s_list *pleft, struct s_list *pright,
-			 long int entries, int level, long int *pnumnodes )
+int read_source( const char *filename, const struct s_dfformat *pf )
 {
-	struct s_list *pl;
-	long int i, eleft, eright, nodesleft, nodesright;
+	struct s_chunk *pchunks, *pc;
+	const char *pbase, *ps, *pe;
+	size_t size;
+	long int nchunks, k, line;
+	int rv;
 
-	if( entries == 0L  ||  (pleft == NULL  &&  pright == NULL ) )
+	pbase = map_source( filename, &size );
+	if( pbase == NULL )
+		return RV_ERROR;
+	if( size >= 4  &&  ((pbase[0] == '\x1F'  &&  pbase[1] == '\x8B')  ||  !memcmp(pbase, "PK\3\4", 4)) )
 		{
-		if( level < treelevel_min )
-			treelevel_min = level;
-		if( treelevel_max < level )
-			treelevel_max = level;
-		return NULL;
+		rv = read_packed( pbase, size, pf );
+		unmap_source( pbase, size );
+		return rv;
 		}
-	if( entries < 0L )
+
+	/* split it into chunks */
+#ifdef WIN32
+	nchunks = 1L;
+#else
+	nchunks = sysconf( _SC_NPROCESSORS_ONLN );
+	if( nchunks > READ_MAXTHREADS )
+		nchunks = READ_MAXTHREADS;
+#endif
+	if( nchunks > (long int) (size / READ_CHUNK_MIN) )
+		nchunks = (long int) (size / READ_CHUNK_MIN);
+	if( nchunks < 1L )
+		nchunks = 1L;
+	pchunks = calloc( (size_t) nchunks, sizeof(struct s_chunk) );
+	if( pchunks == NULL )
 		{
-		fputs( "Internal error: incorrect number of entries!\n", stderr );
-		return NULL;
+		unmap_source( pbase, size );
+		fputs( "Not enough memory reading source IPv4-to-country data file.\n", stderr );
+		return RV_ERROR;
 		}
-	i = (entries >> 1) - ((entries & 1L) ^ 1L);
-		/* rounding down makes nodes gather closer to the middle of
-		   the IP range, which is fine as the edges have special
-		   meanings */
-	if( pleft != NULL )
+	pe = pbase + size;
+	for( ps = pbase, k = 0L;  k < nchunks;  k++ )
 		{
-		/* "counting by the fingers" the "eleft" and "eright" vars
-		   here and bellow makes sure this is always accurate, despite
-		   the precise expression we use to calculate "i" */
-		eleft  = entries - 1L;
-		eright = 0L;
-		for( pl = pleft;  i--;  pl = pl->pprev )
+		pc = &pchunks[k];
+		pc->pf = pf;
+		pc->ps = ps;
+		pc->pe = pbase + (size_t) ((double) size * (k+1) / nchunks);
+		if( pc->pe < ps )
+			pc->pe = ps;
+		if( k == nchunks-1L )
+			pc->pe = pe;
+		else if( pc->pe > pbase  &&  pc->pe[-1] != '\n' )
 			{
-			if( pl == NULL )
-				{
-				fputs( "Internal error: found unexpected tree leaf!\n", stderr );
-				return NULL;
-				}
-			eleft--;
-			eright++;
+			/* up to the next newline */
+			pc->pe = memchr( pc->pe, '\n', (size_t) (pe - pc->pe) );
+			pc->pe = pc->pe != NULL ? pc->pe + 1 : pe;
 			}
+		ps = pc->pe;
 		}
-	else /* pright != NULL */
+
+	/* parse them, and put them together, in order */
+	for( k = 0L;  k < nchunks;  k++ )
+		start_chunk( &pchunks[k] );
+	rv = RV_OK;
+	for( line = 0L, k = 0L;  k < nchunks;  k++ )
 		{
-		eleft  = 0L;
-		eright = entries - 1L;
-		for( pl = pright;  i--;  pl = pl->pnext )
+		wait_chunk( &pchunks[k] );
+		if( rv == RV_OK )
+			rv = merge_chunk( &pchunks[k], &line );
+		}
+	for( k = 0L;  k < nchunks;  k++ )
+		{
+		free( pchunks[k].pentries );
+		free( pchunks[k].pskips );
+		}
+	free( pchunks );
+	unmap_source( pbase, size );
+	return rv;
+}
+
+
+/* Reads the source data file at "pbase" ("size" bytes), gzipped or a zip
+   archive (its first file, which must be deflated), as read_source()
+   does, but inflating it a chunk at a time: each chunk is READ_BLOCK
+   bytes of it (or more, for a longer line), up to its last newline, and
+   is parsed by a thread of its own while the next ones are inflated,
+   with up to one chunk per CPU (and at least 2) being parsed at a time.
+   The oldest one is put together with the others as soon as it is
+   done, and its buffer is taken by the next one, so the inflated file
+   is never whole, neither on disk nor in memory.
+   Returns RV_OK, or RV_ERROR on error (after outputting a message)
+*/
+int read_packed( const char *pbase, size_t size, const struct s_dfformat *pf )
+{
+#ifdef NO_ZLIB
+	fputs( "Cannot inflate source IPv4-to-country data file (compiled with NO_ZLIB).\n", stderr );
+	return RV_ERROR;
+#else
+	const unsigned char *pin = (const unsigned char *) pbase;
+	const unsigned char *pinend = pin + size;
+	struct s_chunk *pchunks, *pc, *pcprev;
+	z_stream zs;
+	unsigned long int crc;
+	size_t len, carry, tail, n;
+	long int nchunks, k, done, line;
+	int zip, end, zrv, rv;
+	char *ps;
+
+	/* inflate its data (for a zip archive, that of the first file,
+	   after its local header) */
+	memset( &zs, 0, sizeof(zs) );
+	zip = pin[0] == 'P';
+	if( zip )
+		{
+		if( size < 30  ||  (pin[6] & 1)  ||  (pin[8] | pin[9] << 8) != Z_DEFLATED  ||
+		    30UL + (pin[26] | pin[27] << 8) + (pin[28] | pin[29] << 8) > size )
 			{
-			if( pl == NULL )
+			fputs( "The first file of source IPv4-to-country zip archive isn't deflated (or is encrypted).\n", stderr );
+			return RV_ERROR;
+			}
+		zs.next_in = (Bytef *) pin + 30 + (pin[26] | pin[27] << 8) + (pin[28] | pin[29] << 8);
+		zrv = inflateInit2( &zs, -MAX_WBITS );  /* raw deflate */
+		}
+	else
+		{
+		zs.next_in = (Bytef *) pin;
+		zrv = inflateInit2( &zs, 16 + MAX_WBITS );  /* gzip */
+		}
+#ifdef WIN32
+	nchunks = 1L;
+#else
+	nchunks = sysconf( _SC_NPROCESSORS_ONLN );
+	if( nchunks > READ_MAXTHREADS )
+		nchunks = READ_MAXTHREADS;
+	if( nchunks < 2L )
+		nchunks = 2L;
+#endif
+	pchunks = calloc( (size_t) nchunks, sizeof(struct s_chunk) );
+	if( zrv != Z_OK  ||  pchunks == NULL )
+		{
+		if( zrv == Z_OK )
+			inflateEnd( &zs );
+		free( pchunks );
+		fputs( "Not enough memory reading source IPv4-to-country data file.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* chunks "done" to "k"-1 are being parsed, in pchunks[] as a ring */
+	rv = RV_OK;
+	crc = crc32( 0UL, Z_NULL, 0 );
+	carry = tail = 0;  /* line cut at the end of the last chunk, from "tail" */
+	pcprev = NULL;
+	line = 0L;
+	for( end = 0, done = k = 0L;  !end;  k++ )
+		{
+		pc = &pchunks[ k % nchunks ];
+		if( k - done == nchunks )
+			{
+			wait_chunk( pc );
+			rv = merge_chunk( pc, &line );
+			done++;
+			if( rv != RV_OK )
+				break;
+			}
+		if( pc->bufsize < READ_BLOCK + carry )
+			{
+			ps = realloc( pc->pbuf, READ_BLOCK + carry );
+			if( ps == NULL )
 				{
-				fputs( "Internal error: found unexpected tree leaf!\n", stderr );
-				return NULL;
+				fputs( "Not enough memory reading source IPv4-to-country data file.\n", stderr );
+				rv = RV_ERROR;
+				break;
 				}
-			eleft++;
-			eright--;
+			pc->pbuf = ps;
+			pc->bufsize = READ_BLOCK + carry;
 			}
+		if( carry > 0 )
+			memmove( pc->pbuf, pcprev->pbuf + tail, carry );
+
+		/* inflate until its buffer is full, with a newline, or the end */
+		for( len = carry;  rv == RV_OK; )
+			{
+			if( len == pc->bufsize )
+				{
+				if( memchr(pc->pbuf + carry, '\n', len - carry) != NULL )
+					break;
+				ps = realloc( pc->pbuf, pc->bufsize << 1 );  /* a longer line */
+				if( ps == NULL )
+					{
+					fputs( "Not enough memory reading source IPv4-to-country data file.\n", stderr );
+					rv = RV_ERROR;
+					break;
+					}
+				pc->pbuf = ps;
+				pc->bufsize <<= 1;
+				}
+			if( zs.avail_in == 0 )
+				zs.avail_in = (uInt) ((size_t) (pinend - zs.next_in) < READ_BLOCK ? (size_t) (pinend - zs.next_in) : READ_BLOCK);
+			zs.next_out = (Bytef *) pc->pbuf + len;
+			zs.avail_out = (uInt) (pc->bufsize - len);
+			zrv = inflate( &zs, Z_NO_FLUSH );
+			n = pc->bufsize - len - zs.avail_out;
+			if( zip )
+				crc = crc32( crc, (Bytef *) pc->pbuf + len, (uInt) n );
+			len += n;
+			if( zrv == Z_STREAM_END  &&  !zip  &&  pinend - zs.next_in >= 2  &&  zs.next_in[0] == 0x1F  &&  zs.next_in[1] == 0x8B )
+				zrv = inflateReset( &zs );  /* another gzip member */
+			else if( zrv == Z_STREAM_END )
+				{
+				end = 1;  /* true */
+				break;
+				}
+			if( zrv != Z_OK )
+				{
+				fputs( "Error inflating source IPv4-to-country data file (it is damaged or truncated).\n", stderr );
+				rv = RV_ERROR;
+				}
+			}
+		if( rv != RV_OK )
+			break;
+
+		/* the chunk is up to its last newline, and the rest goes to the
+		   next one */
+		pc->pf = pf;
+		pc->ps = pc->pbuf;
+		pc->pe = pc->pbuf + len;
+		if( !end )
+			{
+			while( pc->pe[-1] != '\n' )
+				pc->pe--;
+			}
+		tail = (size_t) (pc->pe - pc->pbuf);
+		carry = len - tail;
+		pcprev = pc;
+		start_chunk( pc );
 		}
-	if( pl->treelevel >= 0 )
+
+	/* a zip archive's file has its CRC-32 in its local header or, if
+	   flag bit 3 is set, in a data descriptor after its data (which may
+	   start with a signature of its own) */
+	if( rv == RV_OK  &&  zip )
 		{
-		fputs( "Internal error: re-visited a tree node!\n", stderr );
+		if( pin[6] & 8 )
+			{
+			pin = zs.next_in;
+			if( pinend - pin >= 8  &&  !memcmp(pin, "PK\7\10", 4) )
+				pin += 4;
+			}
+		else
+			pin += 14;
+		if( pinend - pin < 4  ||  (pin[0] | pin[1] << 8 | (unsigned long int) pin[2] << 16 | (unsigned long int) pin[3] << 24) != crc )
+			{
+			fputs( "Error inflating source IPv4-to-country data file (bad CRC-32).\n", stderr );
+			rv = RV_ERROR;
+			}
+		}
+	for( ;  done < k;  done++ )
+		{
+		wait_chunk( &pchunks[ done % nchunks ] );
+		if( rv == RV_OK )
+			rv = merge_chunk( &pchunks[ done % nchunks ], &line );
+		}
+	inflateEnd( &zs );
+	for( k = 0L;  k < nchunks;  k++ )
+		{
+		free( pchunks[k].pentries );
+		free( pchunks[k].pskips );
+		free( pchunks[k].pbuf );
+		}
+	free( pchunks );
+	return rv;
+#endif
+}
+
+
+/* Starts a thread parsing chunk "pc" of the source data file (see
+   wait_chunk())
+*/
+void start_chunk( struct s_chunk *pc )
+{
+#ifndef WIN32
+	pc->started = pthread_create( &pc->tid, NULL, read_thread, pc ) == 0;
+#else
+	(void) pc;
+#endif
+}
+
+
+/* Waits for the thread parsing chunk "pc" of the source data file to
+   end or, if none was started, parses the chunk itself
+*/
+void wait_chunk( struct s_chunk *pc )
+{
+#ifndef WIN32
+	if( pc->started )
+		{
+		pthread_join( pc->tid, NULL );
+		pc->started = 0;  /* false */
+		return;
+		}
+#endif
+	read_chunk( pc );
+}
+
+
+/* Reports the lines chunk "pc" of the source data file skipped, and its
+   error, if any, with their line numbers in the file ("*pline" lines
+   come before the chunk, and its own are added to it), and moves its
+   entries to the end of "entries". Its arrays are freed, so that it may
+   be used again.
+   Returns RV_OK, or RV_ERROR if the chunk had an error, or if out of
+   memory (after outputting a message)
+*/
+int merge_chunk( struct s_chunk *pc, long int *pline )
+{
+	struct s_skip *psk;
+	void *pv;
+	long int n;
+	int rv;
+
+	for( psk = pc->pskips;  psk < pc->pskips + pc->numskips;  psk++ )
+		{
+		if( psk->ccstr[0] == '\0' )
+			fprintf( stderr, "Bad IP range (start IP > end IP) reading line %li of source IPv4-to-country data file.\nSkipping line.\n", *pline + psk->line );
+		else
+			fprintf( stderr, "Bad country code '%s' reading line %li of source IPv4-to-country data file.\nSkipping line.\n", psk->ccstr, *pline + psk->line );
+		}
+	rv = RV_OK;
+	if( pc->error == READ_BADLINE )
+		fprintf( stderr, "Error reading line %li of source of IPv4-to-country data file.\n", *pline + pc->lines );
+	else if( pc->error == READ_NOMEMORY )
+		fprintf( stderr, "Not enough memory reading line %li of source IPv4-to-country data file.\n", *pline + pc->lines );
+	if( pc->error )
+		rv = RV_ERROR;
+	else if( entries == NULL )
+		{
+		entries = pc->pentries;  /* taken */
+		numentries = pc->numentries;
+		maxentries = pc->maxentries;
+		pc->pentries = NULL;
+		}
+	else if( pc->numentries > 0L )
+		{
+		if( numentries + pc->numentries > maxentries )
+			{
+			n = numentries + pc->numentries > maxentries << 1 ? numentries + pc->numentries : maxentries << 1;
+			pv = realloc( entries, (size_t) n * sizeof(struct s_entry) );
+			if( pv == NULL )
+				{
+				fputs( "Not enough memory reading source IPv4-to-country data file.\n", stderr );
+				rv = RV_ERROR;
+				}
+			else
+				{
+				entries = pv;
+				maxentries = n;
+				}
+			}
+		if( rv == RV_OK )
+			{
+			memcpy( entries + numentries, pc->pentries, (size_t) pc->numentries * sizeof(struct s_entry) );
+			numentries += pc->numentries;
+			}
+		}
+	*pline += pc->lines;
+	free( pc->pentries );
+	free( pc->pskips );
+	pc->pentries = NULL;
+	pc->pskips = NULL;
+	pc->numentries = pc->maxentries = pc->numskips = pc->maxskips = pc->lines = 0L;
+	pc->error = 0;
+	return rv;
+}
+
+
+/* Maps the source data file "filename" into memory (under WIN32, it is
+   read whole into it), and puts its size in "*psize".
+   Returns its contents (not '\0' terminated), or NULL on error (after
+   outputting a message)
+*/
+const char *map_source( const char *filename, size_t *psize )
+{
+	static const char empty[1] = "";
+#ifdef WIN32
+	FILE *fp;
+	char *pbuf;
+	long int size;
+
+	fp = fopen( filename, "rb" );
+	if( fp == NULL  ||  fseek(fp, 0L, SEEK_END) != 0  ||  (size = ftell(fp)) < 0L  ||  fseek(fp, 0L, SEEK_SET) != 0 )
+		{
+		if( fp != NULL )
+			fclose( fp );
+		fprintf( stderr, "Cannot open source IP-to-country data file (%s).\n", filename );
 		return NULL;
 		}
-	nodesleft = nodesright = 0L;
-	pl->treelevel = level;
-	pl->treeleft  = treenode( pl->pprev, NULL, eleft,  level+1, &nodesleft  );
-	pl->treeright = treenode( NULL, pl->pnext, eright, level+1, &nodesright );
-	if( (nodesleft < nodesright  &&  nodesright-nodesleft > 1L)  ||
-	    (nodesright < nodesleft  &&  nodesleft-nodesright > 1L) )
+	*psize = (size_t) size;
+	if( size == 0L )
 		{
-		fputs( "Internal error: tree is not balanced!\n", stderr );
+		fclose( fp );
+		return empty;
+		}
+	pbuf = malloc( (size_t) size );
+	if( pbuf == NULL  ||  fread(pbuf, (size_t) size, (size_t) 1, fp) != 1 )
+		{
+		free( pbuf );
+		fclose( fp );
+		fprintf( stderr, "Cannot read source IP-to-country data file (%s).\n", filename );
+		return NULL;
+		}
+	fclose( fp );
+	return pbuf;
+#else
+	struct stat st;
+	const char *pbase;
+	int fd;
+
+	fd = open( filename, O_RDONLY );
+	if( fd < 0  ||  fstat(fd, &st) != 0 )
+		{
+		if( fd >= 0 )
+			close( fd );
+		fprintf( stderr, "Cannot open source IP-to-country data file (%s).\n", filename );
 		return NULL;
 		}
-	if( pnumnodes != NULL )
-		(*pnumnodes)++;
-	return pl;
+	*psize = (size_t) st.st_size;
+	if( st.st_size == 0 )
+		{
+		close( fd );
+		return empty;
+		}
+	pbase = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, (off_t) 0 );
+	close( fd );
+	if( pbase == MAP_FAILED )
+		{
+		fprintf( stderr, "Cannot map source IP-to-country data file (%s).\n", filename );
+		return NULL;
+		}
+	posix_madvise( (void *) pbase, (size_t) st.st_size, POSIX_MADV_SEQUENTIAL );
+	return pbase;
+#endif
+}
+
+
+/* Releases the source data file contents "pbase", of "size" bytes, from
+   map_source()
+*/
+void unmap_source( const char *pbase, size_t size )
+{
+	if( size == 0 )
+		return;  /* nothing mapped */
+#ifdef WIN32
+	free( (void *) pbase );
+#else
+	munmap( (void *) pbase, size );
+#endif
 }
 
 
-/* Sets "cluster" number and "i" index number to use in clusters,
-   for each node.
-   On first call, use 0L for "cluster", and whichever values you see fit
-   for "i" and "step". This fill an the tree's "cluster" and "i" values;
-   "cluster" values need to be renumbered later for optimization, as it
-   would be too hard for a recursive algorithm to make the numbering
-   we want.
+#ifndef WIN32
+/*
+Thread that parses chunk "pv" (a struct s_chunk) of the source data file
 */
-void treecluster( struct s_list *pnode, long int cluster, int i, int step )
+void *read_thread( void *pv )
 {
-	static long int next_cluster = -2L;  /* grows backwards from -2L */
+	read_chunk( (struct s_chunk *) pv );
+	return NULL;
+}
+#endif
 
-	if( pnode == NULL )
-		return;
-	if( pnode->treelevel % TREELEVELS_PER_CLUSTER4 == 0 )
+
+/* Parses the lines of chunk "pc" of the source data file (see
+   read_source()) into its own entries, and the lines it skips into its
+   own list of them, up to the end of the chunk or the first line it
+   can't read (setting "pc->error"). Blank lines are ignored.
+*/
+void read_chunk( struct s_chunk *pc )
+{
+	const char *pfield[CSV_FIELDS4];
+	int len[CSV_FIELDS4];
+	const struct s_dfformat *pf;
+	const char *ps;
+	struct s_entry *pe;
+	struct s_skip *psk;
+	unsigned32 ip_start, ip_end;
+	char ccstr[3];
+	int n, cc;
+
+	pf = pc->pf;
+	for( ps = pc->ps;  ps < pc->pe; )
 		{
-		/* this is root node of a cluster */
-		cluster = next_cluster--;
-		i = NODES_PER_CLUSTER4 >> 1;
-		step = (NODES_PER_CLUSTER4 >> 2) + 1;
+		pc->lines++;
+		n = csv_fields4( &ps, pc->pe, pfield, len, CSV_FIELDS4 );
+		if( n == 0 )
+			continue;  /* blank line */
+		if( n != pf->fields  ||  len[pf->cc] != 2  ||
+		    !parse_ip_field(pfield[pf->ip_start], len[pf->ip_start], &ip_start)  ||
+		    !parse_ip_field(pfield[pf->ip_end], len[pf->ip_end], &ip_end) )
+			{
+			pc->error = READ_BADLINE;
+			return;
+			}
+		ccstr[0] = pfield[pf->cc][0];
+		ccstr[1] = pfield[pf->cc][1];
+		ccstr[2] = '\0';
+		cc = find_cc( ccstr );  /* old codes too */
+		if( ip_end < ip_start  ||  cc < 0 )
+			{
+			if( pc->numskips == pc->maxskips )
+				{
+				psk = realloc( pc->pskips, (size_t) (pc->maxskips > 0L ? pc->maxskips << 1 : 16L) * sizeof(struct s_skip) );
+				if( psk == NULL )
+					{
+					pc->error = READ_NOMEMORY;
+					return;
+					}
+				pc->pskips = psk;
+				pc->maxskips = pc->maxskips > 0L ? pc->maxskips << 1 : 16L;
+				}
+			psk = &pc->pskips[pc->numskips++];
+			psk->line = pc->lines;
+			strcpy( psk->ccstr, ip_end < ip_start ? "" : ccstr );
+			continue;
+			}
+		pe = new_entry( &pc->pentries, &pc->numentries, &pc->maxentries );
+		if( pe == NULL )
+			{
+			pc->error = READ_NOMEMORY;
+			return;
+			}
+		pe->cluster = -1L;  /* "unknown" */
+		pe->treelevel = pe->i = -1;  /* "unset" */
+		pe->ip_start = pe->node.ip = ip_start;
+		pe->ip_end = ip_end;
+		pe->cc = cc;
 		}
-	if( step <= 0  &&
-	    ((pnode->treeleft  != NULL  &&  pnode->treeleft->cluster  == cluster)  ||
-	     (pnode->treeright != NULL  &&  pnode->treeright->cluster == cluster)) )
+}
+
+
+/* Reads GeoIP country database "filename" (see ip2cc-geoip.h) into
+   "entries", walking its trie.
+   Returns RV_OK, or RV_ERROR on error (after outputting a message)
+*/
+int read_geoip( const char *filename )
+{
+	struct s_geoipwalk walk;
+	int rv, i;
+
+	memset( &walk, 0, sizeof(walk) );
+	walk.pg = load_geoip( filename );
+	if( walk.pg == NULL )
 		{
-		fprintf( stderr, "Internal error: on cluster %li, step reached zero!\n", cluster );
-		return;
+		fprintf( stderr, "Cannot read %s (or it is not a GeoIP country database).\n", filename );
+		return RV_ERROR;
+		}
+	walk.id = -1;  /* no range yet */
+	rv = geoip_node( &walk, 0UL, 0, (unsigned32) 0U );
+	if( rv == 0  &&  geoip_range(&walk) != 0 )
+		rv = READ_NOMEMORY;  /* the last range */
+	for( i = 0;  i < GEOIP_COUNTRIES;  i++ )
+		{
+		if( walk.skipped[i] > 0L )
+			fprintf( stderr, "Unknown country code '%s' in %li ranges of source GeoIP country database.\nSkipping them.\n", geoip_cname[i], walk.skipped[i] );
+		}
+	if( rv == READ_BADLINE )
+		fputs( "Error walking the trie of source GeoIP country database.\n", stderr );
+	else if( rv == READ_NOMEMORY )
+		fputs( "Not enough memory reading source GeoIP country database.\n", stderr );
+	free_geoip( (struct s_geoip *) walk.pg );
+	return rv == 0 ? RV_OK : RV_ERROR;
+}
+
+
+/* Walks the sub-trie of node "node" of the GeoIP database of "pw", at
+   "depth" bits (from 0) into the IPs, which start with those of "ip",
+   0 branch first: the ranges of its leaves go to "pw" in IP order, and
+   those of other countries than the range in "pw" add it to "entries"
+   (see geoip_range()) and take its place.
+   Nodes may be reached from more than one other node (the same sub-trie
+   of two ranges), and are then walked again for each.
+   Returns 0 if ok, READ_BADLINE if the trie is broken (a node that isn't
+   in the database, or one deeper than 32 bits), or READ_NOMEMORY if out
+   of memory
+*/
+int geoip_node( struct s_geoipwalk *pw, unsigned long int node, int depth, unsigned32 ip )
+{
+	unsigned long int x;
+	unsigned32 ipb;
+	int bit, rv;
+
+	for( bit = 0;  bit < 2;  bit++ )
+		{
+		ipb = ip | (unsigned32) bit << (31 - depth);
+		x = GEOIP_RECORD( pw->pg, node, bit );
+		if( x < GEOIP_COUNTRY_BEGIN )
+			{
+			if( x >= (unsigned long int) pw->pg->nodes  ||  depth == 31 )
+				return READ_BADLINE;
+			rv = geoip_node( pw, x, depth + 1, ipb );
+			if( rv != 0 )
+				return rv;
+			continue;
+			}
+		if( x - GEOIP_COUNTRY_BEGIN >= GEOIP_COUNTRIES )
+			return READ_BADLINE;
+		if( (int) (x - GEOIP_COUNTRY_BEGIN) != pw->id )
+			{
+			if( geoip_range(pw) != 0 )
+				return READ_NOMEMORY;
+			pw->id = (int) (x - GEOIP_COUNTRY_BEGIN);
+			pw->ip_start = ipb;
+			}
+		pw->ip_end = depth < 31 ? ipb | (unsigned32) 0xFFFFFFFFUL >> (depth + 1) : ipb;
+		}
+	return 0;
+}
+
+
+/* Adds the range of "pw" (if any) to "entries", unless its GeoIP
+   country code is "--" (no country), or isn't ours (counting it as
+   skipped).
+   Returns 0 if ok, or -1 if out of memory
+*/
+int geoip_range( struct s_geoipwalk *pw )
+{
+	struct s_entry *pe;
+	int cc;
+
+	if( pw->id <= 0 )
+		return 0;  /* none, or "--" */
+	cc = pw->pg->cc[ pw->id ];
+	if( cc < 0 )
+		{
+		pw->skipped[ pw->id ]++;
+		return 0;
+		}
+	pe = new_entry( &entries, &numentries, &maxentries );
+	if( pe == NULL )
+		return -1;
+	pe->cluster = -1L;  /* "unknown" */
+	pe->treelevel = pe->i = -1;  /* "unset" */
+	pe->ip_start = pe->node.ip = pw->ip_start;
+	pe->ip_end = pw->ip_end;
+	pe->cc = cc;
+	return 0;
+}
+
+
+/* Splits the line at "*pps" (up to "pe") into its fields, each in double
+   quotes, separated by commas: the start of each one (past its quote)
+   goes into "pfield[]", and its length into "plen[]", for up to "max"
+   of them. "*pps" is moved to the start of the next line.
+   Returns the number of fields (0 if the line is blank), or -1 if the
+   line is not made of such fields, or has more than "max"
+*/
+int csv_fields4( const char **pps, const char *pe, const char **pfield, int *plen, int max )
+{
+	const char *ps, *peol, *pq;
+	int n;
+
+	ps = *pps;
+	peol = memchr( ps, '\n', (size_t) (pe - ps) );
+	*pps = peol != NULL ? peol + 1 : pe;
+	if( peol == NULL )
+		peol = pe;
+	if( peol > ps  &&  peol[-1] == '\r' )
+		peol--;
+	if( ps == peol )
+		return 0;  /* blank */
+	for( n = 0;  ;  n++ )
+		{
+		if( n == max  ||  ps == peol  ||  *ps != '"' )
+			return -1;
+		ps++;
+		pq = memchr( ps, '"', (size_t) (peol - ps) );
+		if( pq == NULL )
+			return -1;
+		pfield[n] = ps;
+		plen[n] = (int) (pq - ps);
+		ps = pq + 1;
+		if( ps == peol )
+			return n + 1;
+		if( *ps++ != ',' )
+			return -1;
+		}
+}
+
+
+/* Reads the decimal IP of "len" characters at "ps" (up to 10 digits, and
+   no more than the last IP) into "*pip".
+   Returns 1 (true) if ok, or 0 (false) if not
+*/
+int parse_ip_field( const char *ps, int len, unsigned32 *pip )
+{
+	unsigned64 ip;
+	int i;
+
+	if( len < 1  ||  len > 10 )
+		return 0;  /* false */
+	for( ip = (unsigned64) 0U, i = 0;  i < len;  i++ )
+		{
+		if( ps[i] < '0'  ||  ps[i] > '9' )
+			return 0;  /* false */
+		ip = ip * 10U + (unsigned64) (ps[i] - '0');
+		}
+	if( ip > (unsigned64) 0xFFFFFFFFU )
+		return 0;  /* false */
+	*pip = (unsigned32) ip;
+	return 1;  /* true */
+}
+
+
+/* Returns a new entry (uninitialized) at the end of the array
+   "*ppentries" of "*pnumentries" entries, which doubles in size
+   ("*pmaxentries") whenever it is full, or NULL if out of memory (the
+   entries so far are kept).
+*/
+struct s_entry *new_entry( struct s_entry **ppentries, long int *pnumentries, long int *pmaxentries )
+{
+	void *pv;
+
+	if( *pnumentries == *pmaxentries )
+		{
+		pv = realloc( *ppentries, (size_t) (*pmaxentries > 0L ? *pmaxentries << 1 : 1024L) * sizeof(struct s_entry) );
+		if( pv == NULL )
+			return NULL;
+		*ppentries = pv;
+		*pmaxentries = *pmaxentries > 0L ? *pmaxentries << 1 : 1024L;
+		}
+	return &(*ppentries)[(*pnumentries)++];
+}
+
+
+/* Fits the IP ranges in "entries", in the order they were read, into each
+   other, and sorts them: each range is cut to the IPs from its start
+   (or, if a range read before it has that IP, from the end of that range)
+   up to its end or the next IP a range read before it has, whichever
+   comes first. Ranges left with no IPs are deleted.
+   This works on the IPs that start the ranges or follow their ends,
+   sorted: each "segment" from one of these to the next is given to the
+   first range that gets to it, and no range goes through a segment that
+   was already given, so all of it is done in O(n log n) time.
+   The number of ranges read before others that start after them, of
+   ranges cut, and of ranges deleted, go to "*plines_reorder",
+   "*plines_overlap" and "*plines_overlap_del".
+   Returns 0 if ok, or -1 if out of memory
+*/
+int fit_ranges( long int *plines_reorder, long int *plines_overlap, long int *plines_overlap_del )
+{
+	unsigned64 *pbound;  /* the IPs that start or follow ranges, sorted */
+	long int *powner;    /* range each segment was given to, or -1 */
+	long int *pend;      /* segment following the last one of each range */
+	struct s_entry *psorted;
+	long int e, n, j, j0, k, ke, last;
+
+	*plines_reorder = *plines_overlap = *plines_overlap_del = 0L;
+	pbound = malloc( (2 * numentries + 1) * sizeof(unsigned64) );
+	powner = malloc( (2 * numentries + 1) * sizeof(long int) );
+	pend = malloc( (numentries + 1) * sizeof(long int) );
+	psorted = malloc( (numentries + 1) * sizeof(struct s_entry) );
+	if( pbound == NULL  ||  powner == NULL  ||  pend == NULL  ||  psorted == NULL )
+		{
+		free( pbound );
+		free( powner );
+		free( pend );
+		free( psorted );
+		return -1;
+		}
+	for( e = 0L;  e < numentries;  e++ )
+		{
+		pbound[2*e]   = (unsigned64) entries[e].ip_start;
+		pbound[2*e+1] = (unsigned64) entries[e].ip_end + 1U;  /* 1 << 32 after the last IP */
+		}
+	qsort( pbound, (size_t) (2 * numentries), sizeof(unsigned64), compare_bound );
+	for( n = 0L, j = 0L;  j < 2 * numentries;  j++ )
+		{
+		if( n == 0L  ||  pbound[j] != pbound[n-1] )
+			pbound[n++] = pbound[j];
+		}
+	for( j = 0L;  j < n;  j++ )
+		powner[j] = -1L;  /* none */
+
+	last = -1L;  /* segment of the range that starts last, so far */
+	for( e = 0L;  e < numentries;  e++ )
+		{
+		k  = find_bound( pbound, n, (unsigned64) entries[e].ip_start );
+		ke = find_bound( pbound, n, (unsigned64) entries[e].ip_end + 1U );
+		j0 = powner[k] >= 0L ? pend[powner[k]] : k;
+		for( j = j0;  j < ke  &&  powner[j] < 0L;  j++ )
+			powner[j] = e;
+		pend[e] = j;
+		if( j == j0 )
+			{
+			(*plines_overlap)++;
+			(*plines_overlap_del)++;
+			continue;
+			}
+		if( j0 != k  ||  j != ke )
+			(*plines_overlap)++;
+		if( last > k )
+			(*plines_reorder)++;
+		else
+			last = j0;
+		}
+
+	/* the ranges left, in the order of their segments */
+	for( numentries = 0L, j = 0L;  j < n;  j++ )
+		{
+		e = powner[j];
+		if( e < 0L  ||  (j > 0L  &&  powner[j-1] == e) )
+			continue;
+		psorted[numentries] = entries[e];
+		psorted[numentries].ip_start = psorted[numentries].node.ip = (unsigned32) pbound[j];
+		psorted[numentries].ip_end = (unsigned32) (pbound[pend[e]] - 1U);
+		numentries++;
 		}
-	if( pnode->cluster != -1L  ||  pnode->i >= 0 )
+	maxentries = numentries;
+	free( entries );
+	entries = psorted;
+	free( pbound );
+	free( powner );
+	free( pend );
+	return 0;
+}
+
+
+/* Returns the index of "ip" in the "n" sorted IPs "pbound" (it must be
+   there)
+*/
+long int find_bound( const unsigned64 *pbound, long int n, unsigned64 ip )
+{
+	long int lo, hi, mid;
+
+	for( lo = 0L, hi = n;  lo < hi; )
+		{
+		mid = (lo + hi) >> 1;
+		if( pbound[mid] < ip )
+			lo = mid + 1L;
+		else
+			hi = mid;
+		}
+	return lo;
+}
+
+
+/*
+qsort() comparison function for unsigned64s
+*/
+int compare_bound( const void *p1, const void *p2 )
+{
+	unsigned64 b1 = *(const unsigned64 *) p1, b2 = *(const unsigned64 *) p2;
+
+	return b1 < b2 ? -1 : b1 > b2;
+}
+
+
+/* Returns the entry at the root of the sub-tree of entries "lo" to "hi"
+   (lo <= hi) of the balanced binary tree, which has no pointers: the
+   entries before the root make up its left sub-tree, and those after it,
+   its right one. The whole tree, and every left sub-tree, counts its root
+   from its end ("fromend" non-zero), and every right sub-tree from its
+   start.
+*/
+long int treeroot( long int lo, long int hi, int fromend )
+{
+	long int entries, i;
+
+	entries = hi - lo + 1L;
+	i = (entries >> 1) - ((entries & 1L) ^ 1L);
+		/* rounding down makes nodes gather closer to the middle of
+		   the IP range, which is fine as the edges have special
+		   meanings */
+	return fromend ? hi - i : lo + i;
+}
+
+
+/* Sets the tree level of the entries of the sub-tree "lo" to "hi" (none if
+   lo > hi; see treeroot()), "level" being that of its root (0 for root
+   node, 1 for its two descendants, etc.).
+   Returns the number of entries in the sub-tree, or -1 if it is not
+   balanced
+*/
+long int treenode( long int lo, long int hi, int fromend, int level )
+{
+	long int mid, nodesleft, nodesright;
+
+	if( lo > hi )
+		{
+		if( level < treelevel_min )
+			treelevel_min = level;
+		if( treelevel_max < level )
+			treelevel_max = level;
+		return 0L;
+		}
+	mid = treeroot( lo, hi, fromend );
+	entries[mid].treelevel = level;
+	nodesleft  = treenode( lo, mid-1L, 1, level+1 );
+	nodesright = treenode( mid+1L, hi, 0, level+1 );
+	if( nodesleft < 0L  ||  nodesright < 0L  ||
+	    (nodesleft < nodesright  &&  nodesright-nodesleft > 1L)  ||
+	    (nodesright < nodesleft  &&  nodesleft-nodesright > 1L) )
+		return -1L;
+	return nodesleft + nodesright + 1L;
+}
+
+
+/* Puts the sub-tree "lo" to "hi" (none if lo > hi; see treeroot()) into
+   cluster "cluster" (in "nodes4[]" and "pnext[]"), its root at index "i"
+   and the roots of its sub-trees "step" before and after it, down to the
+   bottom level of the cluster. The sub-trees bellow that are queued as
+   the next clusters to write (see queue_subtree()), from the highest IPs
+   to the lowest, so that, as the clusters are written in order, those at
+   the same level range are numbered from right to left.
+   Returns the number of nodes put into the cluster, or -1 on error
+   (already reported)
+*/
+long int clusternode( long int lo, long int hi, int fromend, long int cluster, int i, int step, long int *pnext )
+{
+	struct s_entry *pe;
+	long int mid, nodesleft, nodesright;
+
+	if( lo > hi )
+		return 0L;
+	mid = treeroot( lo, hi, fromend );
+	pe = &entries[mid];
+	if( pe->cluster != -1L  ||  pe->i >= 0 )
 		{
 		fputs( "Internal error: re-visited a tree node!\n", stderr );
-		return;
+		return -1L;
+		}
+	if( i < 0  ||  i >= nodes_per_cluster  ||  nodes4[i].ip != (unsigned32) 0xFFFFFFFFU )
+		{
+		fprintf( stderr, "Internal error: cluster %li has more than one 'i' index with same value!\n", cluster );
+		return -1L;
+		}
+	pe->cluster = cluster;
+	pe->i = i;
+	nodes4[i] = pe->node;
+	if( pe->treelevel % treelevels_per_cluster == treelevels_per_cluster-1 )
+		{
+		/* bottom level of the cluster, where "i" is even */
+		pnext[i+1] = queue_subtree( mid+1L, hi, 0 );
+		pnext[i]   = queue_subtree( lo, mid-1L, 1 );
+		return 1L;
 		}
-	pnode->cluster = cluster;
-	pnode->i = i;
-	treecluster( pnode->treeleft,  cluster, i - step, step >> 1 );
-	treecluster( pnode->treeright, cluster, i + step, step >> 1 );
+	if( step <= 0 )
+		{
+		fprintf( stderr, "Internal error: on cluster %li, step reached zero!\n", cluster );
+		return -1L;
+		}
+	nodesright = clusternode( mid+1L, hi, 0, cluster, i + step, step >> 1, pnext );
+	nodesleft  = clusternode( lo, mid-1L, 1, cluster, i - step, step >> 1, pnext );
+	if( nodesright < 0L  ||  nodesleft < 0L )
+		return -1L;
+	return nodesright + nodesleft + 1L;
 }
 
 
-/* Releases memory from all nodes in memory
-   and empties list pointers
+/* Queues the sub-tree "lo" to "hi" (see treeroot()) in "subtrees", to be
+   written as a cluster after all those queued before it.
+   Returns the number of that cluster, or 0 if the sub-tree is empty
+   (lo > hi)
 */
-void free_all( void )
+long int queue_subtree( long int lo, long int hi, int fromend )
+{
+	if( lo > hi )
+		return 0L;
+	subtrees[numsubtrees].lo = lo;
+	subtrees[numsubtrees].hi = hi;
+	subtrees[numsubtrees].fromend = fromend;
+	return DB4_ROOT + numsubtrees++;
+}
+
+
+/* Writes the header of the database (see struct s_db4head) into "fp",
+   as its cluster 0, with the clusters (this one included), IP ranges and
+   stamp in "dbid".
+   Returns 0 if ok, or -1 on error
+*/
+int write_head4( FILE *fp )
+{
+	struct s_db4head head;
+
+	memset( &head, 0, sizeof(head) );
+	memcpy( head.magic, DB4_MAGIC, sizeof(head.magic) );
+	head.byteorder = DB4_BYTEORDER;
+	head.version = (unsigned16) DB4_VERSION;
+	head.layout = (unsigned16) layout;
+	head.shift = (unsigned16) cluster_shift;
+	head.nodes = (unsigned16) nodes_per_cluster;
+	head.clusters = dbid.clusters;
+	head.ranges = dbid.ranges;
+	head.countries = (unsigned16) CNAME_SIZE;
+	head.stamp = dbid.stamp;
+	memset( sector, 0, (size_t) 1 << cluster_shift );
+	memcpy( sector, &head, sizeof(head) );
+	return fwrite( sector, (size_t) 1 << cluster_shift, 1, fp ) == 1 ? 0 : -1;
+}
+
+
+/* Returns "stamp" (see dbid) updated with the "size" bytes at "p"
+*/
+unsigned32 stamp4( unsigned32 stamp, const void *p, size_t size )
+{
+	const unsigned char *pc;
+
+	for( pc = p;  size > (size_t) 0;  size--, pc++ )
+		stamp = (stamp ^ *pc) * STAMP4_PRIME;
+	return stamp;
+}
+
+
+/* Lays out the "nodes_per_cluster" nodes "pn", with next cluster indexes
+   "pnext[]", as a struct s_cluster4 cluster of that many nodes, at the
+   start of "pbuf" (and all '\0' after it, up to the cluster size).
+*/
+void cluster4_to_default( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf )
+{
+	unsigned16 next;
+	int i;
+
+	memset( pbuf, 0, (size_t) 1 << cluster_shift );
+	memcpy( pbuf, pn, nodes_per_cluster * sizeof(struct s_node4) );
+	pbuf += nodes_per_cluster * sizeof(struct s_node4);
+	for( i = 0;  i < nodes_per_cluster+1;  i++ )
+		{
+		next = (unsigned16) pnext[i];
+		memcpy( pbuf + i * sizeof(unsigned16), &next, sizeof(unsigned16) );
+		}
+}
+
+
+/* Same as cluster4_to_default(), for a "vector" cluster (struct
+   s_cluster4v). Unused nodes get the IP of the next used node (all 1s if
+   none), so that the IP array is always sorted.
+*/
+void cluster4_to_v( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf )
+{
+	unsigned32 *pip;
+	unsigned16 *pccsz;
+	unsigned32 ip;
+	int i;
+
+	memset( pbuf, 0, (size_t) 1 << cluster_shift );
+	pip = (unsigned32 *) pbuf;
+	pccsz = (unsigned16 *) (pip + nodes_per_cluster+1);
+	ip = (unsigned32) 0xFFFFFFFFU;
+	pip[nodes_per_cluster] = ip;
+	for( i = nodes_per_cluster-1;  i >= 0;  i-- )
+		{
+		if( pn[i].ip != (unsigned32) 0xFFFFFFFFU )
+			{
+			ip = pn[i].ip;
+			pccsz[i] = pn[i].ccsz;
+			}
+		else
+			pccsz[i] = (unsigned16) 0xFFFFU;
+		pip[i] = ip;
+		}
+	for( i = 0;  i < nodes_per_cluster+1;  i++ )
+		pccsz[nodes_per_cluster+i] = (unsigned16) pnext[i];
+}
+
+
+/* Same as cluster4_to_v(), for a cache line cluster (struct s_line4).
+   Returns non-zero if the next clusters are not consecutive, from the
+   highest branch to the lowest (which struct s_line4 relies on).
+*/
+int cluster4_to_line( const struct s_node4 *pn, const long int *pnext, unsigned char *pbuf )
+{
+	unsigned32 *pip;
+	unsigned16 *pccsz;
+	struct s_line4next *pl;
+	unsigned32 ip;
+	long int next;
+	int i;
+
+	memset( pbuf, 0, (size_t) 1 << cluster_shift );
+	pip = (unsigned32 *) pbuf;
+	pccsz = (unsigned16 *) (pip + nodes_per_cluster+1);
+	pl = (struct s_line4next *) (pccsz + nodes_per_cluster);
+	ip = (unsigned32) 0xFFFFFFFFU;
+	pip[nodes_per_cluster] = ip;
+	for( i = nodes_per_cluster-1;  i >= 0;  i-- )
+		{
+		if( pn[i].ip != (unsigned32) 0xFFFFFFFFU )
+			{
+			ip = pn[i].ip;
+			pccsz[i] = pn[i].ccsz;
+			}
+		else
+			pccsz[i] = (unsigned16) 0xFFFFU;
+		pip[i] = ip;
+		}
+	pl->next = (unsigned32) 0U;
+	pl->nextmask = (unsigned16) 0x0000U;
+	for( next = 0L, i = nodes_per_cluster;  i >= 0;  i-- )
+		{
+		if( pnext[i] == 0L )
+			continue;
+		if( next == 0L )
+			pl->next = (unsigned32) pnext[i];
+		else if( pnext[i] != next+1L )
+			return 1;
+		next = pnext[i];
+		pl->nextmask |= (unsigned16) (1U << i);
+		}
+	return 0;
+}
+
+
+/* Writes the /16 jump table for the database "filename" (see ip2cc.h),
+   into a file with the same name plus JUMP_SUFFIX4 (plus NEW_SUFFIX, until
+   publish_file()). Clusters must be numbered and written already.
+   For each /16, if all its IPs are in ranges of the same country, or in
+   none, the entry just holds that country code. Otherwise, the searches
+   for all its IPs go the same way down the tree (left of nodes above it,
+   right of nodes bellow it) until the first node whose range overlaps
+   it, so the entry points to that node.
+   Returns 0 if ok, or -1 on error (already reported)
+*/
+int write_jump4( const char *filename )
+{
+	unsigned32 *pjump;
+	unsigned32 ip_start, ip_end;
+	struct s_entry *pl, *pln, *pt, *pend;
+	long int e, lo, hi, uniform;
+	int fromend;
+	char *ps;
+	FILE *fp;
+
+	puts( "Creating jump table..." );
+	pjump = malloc( JUMP_ENTRIES4 * sizeof(unsigned32) );
+	ps = malloc( strlen(filename) + sizeof(JUMP_SUFFIX4) + sizeof(NEW_SUFFIX) );
+	if( pjump == NULL  ||  ps == NULL )
+		{
+		free( pjump );
+		free( ps );
+		fputs( "Not enough memory for jump table.\n", stderr );
+		return -1;
+		}
+	uniform = 0L;
+	pl = entries;
+	pend = entries + numentries;
+	for( e = 0L;  e < JUMP_ENTRIES4;  e++ )
+		{
+		ip_start = ((unsigned32) e) << JUMP_SHIFT4;
+		ip_end   = ip_start | (((unsigned32) 1U << JUMP_SHIFT4) - 1U);
+		while( pl < pend  &&  pl->ip_end < ip_start )
+			pl++;
+		/* ip2cc never finds IPs in a range that ends at the last IP
+		   (its end wraps around to 0), so the jump table doesn't either */
+		if( pl == pend  ||  pl->ip_start > ip_end  ||
+		    (pl->ip_end == (unsigned32) 0xFFFFFFFFU  &&  pl->ip_start <= ip_start) )
+			{
+			pjump[e] = JUMP_UNIFORM4 | JUMP_NONE4;
+			uniform++;
+			continue;
+			}
+		if( pl->ip_start <= ip_start )
+			{
+			/* follow adjacent ranges of the same country */
+			for( pln = pl;  pln->ip_end < ip_end  &&  pln+1 < pend  &&
+					pln[1].ip_start == pln->ip_end + 1U  &&  pln[1].cc == pl->cc  &&
+					pln[1].ip_end != (unsigned32) 0xFFFFFFFFU;  pln++ )
+				;
+			if( pln->ip_end >= ip_end )
+				{
+				pjump[e] = JUMP_UNIFORM4 | (unsigned32) pl->cc;
+				uniform++;
+				continue;
+				}
+			}
+		lo = 0L;
+		hi = numentries-1L;
+		fromend = 1;  /* see treeroot() */
+		for( pt = &entries[treeroot(lo, hi, fromend)];  pt->ip_end < ip_start  ||  pt->ip_start > ip_end;
+		     pt = &entries[treeroot(lo, hi, fromend)] )
+			{
+			if( pt->ip_end < ip_start )
+				{
+				lo = pt - entries + 1L;
+				fromend = 0;
+				}
+			else
+				{
+				hi = pt - entries - 1L;
+				fromend = 1;
+				}
+			}
+			/* can't reach a leaf: "pl" overlaps this /16 */
+		if( pt->cluster >= (long int) (JUMP_UNIFORM4 >> treelevels_per_cluster) )
+			{
+			free( pjump );
+			free( ps );
+			fputs( "Too many clusters for the jump table.\n", stderr );
+			return -1;
+			}
+		pjump[e] = ((unsigned32) pt->cluster << treelevels_per_cluster) | (unsigned32) pt->i;
+		}
+	printf( "%li of the %li /16 jump table entries have a single country code.\n", uniform, JUMP_ENTRIES4 );
+	strcat( strcat( strcpy(ps, filename), JUMP_SUFFIX4 ), NEW_SUFFIX );
+	fp = fopen( ps, "wb" );
+	if( fp == NULL )
+		{
+		fprintf( stderr, "Cannot create new jump table (%s).\n", ps );
+		free( pjump );
+		free( ps );
+		return -1;
+		}
+	e = fwrite( &dbid, sizeof(dbid), 1, fp ) == 1 ? (long int) fwrite( pjump, sizeof(unsigned32), JUMP_ENTRIES4, fp ) : 0L;
+	free( pjump );
+	if( fclose(fp) != 0  ||  e != JUMP_ENTRIES4 )
+		{
+		remove( ps );
+		free( ps );
+		fputs( "Error writing to jump table file.\n", stderr );
+		return -1;
+		}
+	free( ps );
+	return 0;
+}
+
+
+/* Writes the multibit trie for the database "filename" (see ip2cc.h),
+   into a file with the same name plus TRIE_SUFFIX4 (plus NEW_SUFFIX, until
+   publish_file()), built from the same (final) list of IP ranges as the
+   database.
+   Returns 0 if ok, or -1 on error (already reported)
+*/
+int write_trie4( const char *filename )
+{
+	struct s_trie4head head;
+	char *ps;
+	FILE *fp;
+	int ok;
+
+	puts( "Creating multibit trie..." );
+	/* ip2cc never finds IPs in a range that ends at the last IP
+	   (its end wraps around to 0), so the trie doesn't either; only the
+	   last entry can */
+	ranges = numentries;
+	if( entries[ranges-1L].ip_end == (unsigned32) 0xFFFFFFFFU )
+		ranges--;
+	trie_maxnodes = trie_maxleaves = 1024L;
+	trie_numnodes = 1L;  /* the root */
+	trie_numleaves = 0L;
+	trie_nodes = malloc( trie_maxnodes * sizeof(struct s_trie4node) );
+	trie_leaves = malloc( trie_maxleaves * sizeof(unsigned16) );
+	ps = malloc( strlen(filename) + sizeof(TRIE_SUFFIX4) + sizeof(NEW_SUFFIX) );
+	ok = trie_nodes != NULL  &&  trie_leaves != NULL  &&  ps != NULL;
+	if( ok )
+		ok = trienode( 0L, (unsigned32) 0U, 0 ) == 0;
+	if( !ok )
+		fputs( "Not enough memory for multibit trie.\n", stderr );
+	else
+		{
+		printf( "The trie has %li nodes and %li leaves (%li bytes).\n", trie_numnodes, trie_numleaves,
+			(long int) (sizeof(dbid) + sizeof(head) + trie_numnodes * sizeof(struct s_trie4node) + trie_numleaves * sizeof(unsigned16)) );
+		strcat( strcat( strcpy(ps, filename), TRIE_SUFFIX4 ), NEW_SUFFIX );
+		fp = fopen( ps, "wb" );
+		if( fp == NULL )
+			{
+			fprintf( stderr, "Cannot create new multibit trie (%s).\n", ps );
+			ok = 0;  /* false */
+			}
+		else
+			{
+			head.nodes = (unsigned32) trie_numnodes;
+			head.leaves = (unsigned32) trie_numleaves;
+			ok = fwrite( &dbid, sizeof(dbid), 1, fp ) == 1  &&
+			     fwrite( &head, sizeof(head), 1, fp ) == 1  &&
+			     fwrite( trie_nodes, sizeof(struct s_trie4node), trie_numnodes, fp ) == (size_t) trie_numnodes  &&
+			     fwrite( trie_leaves, sizeof(unsigned16), trie_numleaves, fp ) == (size_t) trie_numleaves;
+			if( fclose(fp) != 0  ||  !ok )
+				{
+				remove( ps );
+				fputs( "Error writing to multibit trie file.\n", stderr );
+				ok = 0;  /* false */
+				}
+			}
+		}
+	free( trie_nodes );
+	free( trie_leaves );
+	free( ps );
+	trie_nodes = NULL;
+	trie_leaves = NULL;
+	return ok ? 0 : -1;
+}
+
+
+/* Fills in trie node number "ni" (already allocated), for the IPs that
+   start with "ip4" and go into its level "d", and all the nodes bellow it.
+   A slot all of whose IPs have the same country code (or none) becomes a
+   leaf; any other slot gets a child node, allocated right after all the
+   nodes allocated so far, along with the other child nodes of "ni".
+   Returns 0 if ok, or -1 if out of memory
+*/
+int trienode( long int ni, unsigned32 ip4, int d )
 {
-	struct s_list *pl, *pln;
+	int cc[1 << TRIE_STRIDE4];	/* country code of each slot, or -2 if not all the same */
+	unsigned32 ip_start, size;
+	unsigned64 vector, leafvec;
+	long int base0, base1, i;
+	void *pv;
+	int k, last;
 
-	for( pl = pfirst;  pl;  pl = pln )
+	size = d < TRIE_LEVELS4-1 ? (unsigned32) 1U << (32 - TRIE_STRIDE4*(d+1)) : (unsigned32) 0U;
+	vector = leafvec = (unsigned64) 0U;
+	base0 = trie_numleaves;
+	last = -2;  /* no leaf yet */
+	for( k = 0;  k < (1 << TRIE_STRIDE4);  k++ )
+		{
+		/* on the last level, each IP has 1 << (TRIE_STRIDE4*TRIE_LEVELS4 - 32) slots */
+		ip_start = size ? ip4 + size * k : ip4 + (k >> (TRIE_STRIDE4*TRIE_LEVELS4 - 32));
+		cc[k] = range_cc( ip_start, size ? ip_start + (size-1U) : ip_start );
+		if( cc[k] == -2 )
+			{
+			vector |= (unsigned64) 1U << k;
+			continue;
+			}
+		if( cc[k] != last )
+			{
+			if( trie_numleaves == trie_maxleaves )
+				{
+				pv = realloc( trie_leaves, (trie_maxleaves <<= 1) * sizeof(unsigned16) );
+				if( pv == NULL )
+					return -1;
+				trie_leaves = pv;
+				}
+			trie_leaves[trie_numleaves++] = cc[k] < 0 ? TRIE_NONE4 : (unsigned16) cc[k];
+			leafvec |= (unsigned64) 1U << k;
+			last = cc[k];
+			}
+		}
+	/* allocate all child nodes at once, to be consecutive */
+	base1 = trie_numnodes;
+	for( k = 0;  k < (1 << TRIE_STRIDE4);  k++ )
 		{
-		pln = pl->pnext;
-		free( pl );
+		if( cc[k] != -2 )
+			continue;
+		if( trie_numnodes == trie_maxnodes )
+			{
+			pv = realloc( trie_nodes, (trie_maxnodes <<= 1) * sizeof(struct s_trie4node) );
+			if( pv == NULL )
+				return -1;
+			trie_nodes = pv;
+			}
+		trie_numnodes++;
 		}
-	pfirst = plast = treetop = NULL;
+	trie_nodes[ni].vector = vector;
+	trie_nodes[ni].leafvec = leafvec;
+	trie_nodes[ni].base0 = (unsigned32) base0;
+	trie_nodes[ni].base1 = (unsigned32) base1;
+	for( i = base1, k = 0;  k < (1 << TRIE_STRIDE4);  k++ )
+		{
+		if( cc[k] == -2  &&  trienode(i++, ip4 + size * k, d+1) != 0 )
+			return -1;
+		}
+	return 0;
+}
+
+
+/* Returns the country code of all the IPs from "ip_start" to "ip_end",
+   -1 if none of them has one, or -2 if they don't all have the same
+*/
+int range_cc( unsigned32 ip_start, unsigned32 ip_end )
+{
+	long int lo, hi, mid;
+	struct s_entry *pl;
+
+	/* find the first range that ends at or after ip_start */
+	for( lo = 0L, hi = ranges;  lo < hi; )
+		{
+		mid = (lo + hi) >> 1;
+		if( entries[mid].ip_end < ip_start )
+			lo = mid + 1L;
+		else
+			hi = mid;
+		}
+	if( lo == ranges  ||  entries[lo].ip_start > ip_end )
+		return -1;  /* none */
+	if( entries[lo].ip_start > ip_start )
+		return -2;  /* some with, some without */
+	/* follow adjacent ranges of the same country */
+	for( pl = &entries[lo];  pl->ip_end < ip_end;  pl = &entries[lo] )
+		{
+		if( ++lo == ranges  ||  entries[lo].ip_start != pl->ip_end + 1U  ||  entries[lo].cc != pl->cc )
+			return -2;
+		}
+	return pl->cc;
+}
+
+
+/* Replaces file "filename" plus "suffix" with the one written under the
+   same name plus NEW_SUFFIX, at once, with rename(): ip2cc (and
+   reload_ip4_db()) only ever open either the old file or the new one,
+   never one that is half written. Under WIN32, rename() cannot replace a
+   file, so the old one is removed first.
+   Returns 0 if ok, or -1 on error (already reported; the new file is
+   removed)
+*/
+int publish_file( const char *filename, const char *suffix )
+{
+	char *ps, *pnew;
+	size_t len;
+	int e;
+
+	len = strlen( filename ) + strlen( suffix );
+	ps = malloc( 2 * len + sizeof(NEW_SUFFIX) + 1 );
+	if( ps == NULL )
+		{
+		fputs( "Not enough memory.\n", stderr );
+		return -1;
+		}
+	strcat( strcpy(ps, filename), suffix );
+	pnew = ps + len + 1;
+	strcat( strcat( strcpy(pnew, filename), suffix ), NEW_SUFFIX );
+#ifdef WIN32
+	remove( ps );
+#endif
+	e = rename( pnew, ps );
+	if( e != 0 )
+		{
+		fprintf( stderr, "Cannot replace %s with %s.\n", ps, pnew );
+		remove( pnew );
+		}
+	free( ps );
+	return e != 0 ? -1 : 0;
+}
+
+
+/* Removes file "filename" plus "suffix", if there is one: a side file
+   of an older database, that wasn't written again for the new one
+*/
+void remove_stale( const char *filename, const char *suffix )
+{
+	char *ps;
+
+	ps = malloc( strlen(filename) + strlen(suffix) + 1 );
+	if( ps == NULL )
+		return;
+	strcat( strcpy(ps, filename), suffix );
+	if( remove(ps) == 0 )
+		printf( "Removed %s, left from an older database.\n", ps );
+	free( ps );
+}
+
+
+/* Releases memory from all entries in memory
+   and empties their array
+*/
+void free_all( void )
+{
+	if( ptemp != NULL )
+		{
+		remove( ptemp );  /* never published */
+		free( ptemp );
+		ptemp = NULL;
+		}
+
+	free( entries );
+	free( subtrees );
+	entries = NULL;
+	subtrees = NULL;
+	numentries = maxentries = numsubtrees = 0L;
 }
@@ -0,0 +1,658 @@
+/*
+mk-ip6db.c
+ANSI C
+GNU C Compiler-aware, for packed structures (see ip2cc.h)
+(C) 2003-2011 Corebase, Easymatic, Cynergi, Pedro Freire
+
+This script can be called with:
+	[-#] <source-ip6-to-country-data-file> [<dest-ip6db-file>]
+
+where -# represents a number specifying the source data file format:
+-1  "<ip-start>","<ip-end>","<iso-country>",...  (default)
+-2  "<ip-start>","<ip-end>","<...>","<...>","<iso-country>",...
+
+with IPv6 addresses in any of the text forms parse_ip6() takes (format -2
+is that of MaxMind's GeoIPv6.csv). Fields may have blanks around them, and
+their quotes are optional. The database is written (and verified) under a
+temporary name first, and then renamed over the old one (see "Reloading" in
+ip2cc.c).
+
+Calling it without arguments gives this help.
+
+See comments at the top of ip2cc.c for more information.
+
+
+Database
+--------
+
+The IPv6 database has the same structure as the IPv4 one (see mk-ip4db.c):
+a balanced binary tree of the sorted list of IP ranges, cut into clusters
+of TREELEVELS_PER_CLUSTER6 tree levels (struct s_cluster6), numbered from
+the top of the tree down, so that each lookup reads one cluster per
+cluster level, and cluster 0 is the root. Only the upper 64 bits of each
+address are kept, as no smaller block is ever assigned to a country: a
+range that starts or ends within a /64 is widened to all of it.
+
+A node's range size is "iprange" plus 1, shifted left by the 6-bit shift in
+its "ccsz" (sizes are in /64s). A range that can't be written this way is
+split into several nodes, the first with the largest size that can, and so
+on (a range takes at most 4 nodes). Unused nodes have the LEAF_MASK6 bit of
+"ccsz" set.
+
+
+Compile and test
+----------------
+
+This code needs libip2cc (for parse_ip6() and find_ip6_country()), and
+*MUST* be compiled with the same options as ip2cc (see mk-ip4db.c). For
+GCC under UNIX (Linux, etc):
+
+	gcc -O2 -Os -s -Wall -DNDEBUG -DSECTOR_SIZE=512 mk-ip6db.c libip2cc.c -o mk-ip6db
+
+To test the code, you may try IP number 2001:690::1 which should result in
+country 'pt' (Portugal), with a database from any recent source.
+
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+
+
+#include "ip2cc.h"
+
+
+/* System return values:
+*/
+#define RV_OK			0
+#define RV_ERROR		1
+
+
+/* Longest source data file line, and most fields read from each
+*/
+#define LINE_MAX6		1024
+#define CSV_FIELDS6		8
+
+
+/* Field numbers (0 for the first) of the start IP, end IP and country
+   code in each data file format
+*/
+const int dfformats[][3] = {
+	{ 0, 1, 2 },
+	{ 0, 1, 4 } };
+
+
+/* Buffer used to write a cluster into the file.
+   As SECTOR_SIZE is always >= CLUSTER6_SIZE, we add the
+   maximum of SECTOR_SIZE bytes at the end of the real
+   cluster structure to fill in the extra unused bytes
+*/
+struct s_sector6
+	{
+	struct s_cluster6 cluster6;
+	char blank[ SECTOR_SIZE ];  /* initialized to all '\0' by C */
+	}
+	sector6;
+
+
+/* IP ranges read from the data file (upper 64 bits of each IP), and
+   the nodes they are then written as, in IP order
+*/
+struct s_range6
+	{
+	unsigned64 ip_start, ip_end;
+	int cc;
+	long int line;
+	}
+	*pranges = NULL;
+long int ranges = 0L;
+struct s_node6 *pnodes = NULL;
+long int nodes = 0L;
+
+
+/* Clusters still to be written, in cluster order: each is the subtree
+   of the nodes from "first" to "last" (inclusive), in at most "levels"
+   cluster levels
+*/
+struct s_subtree6
+	{
+	long int first, last;
+	int levels;
+	}
+	*pclusters = NULL;
+long int clusters = 0L;
+
+
+/* Temporary name of the database while it is being written and verified
+   (its name plus NEW_SUFFIX), so that it isn't read half written
+*/
+char *ptemp = NULL;
+
+
+/* Function prototypes
+*/
+int csv_fields( char *ps, char **pfields, int n );
+int compare_range6( const void *p1, const void *p2 );
+unsigned64 node6_start( const struct s_node6 *pn );
+int cluster6( long int cluster );
+int treecluster6( long int first, long int last, int i, int step );
+void free_all( void );
+
+
+/* Main
+*/
+int main( int argc, char *argv[] )
+{
+	static char buf[LINE_MAX6];
+	const int *pf;
+	FILE *fp;
+	unsigned32 ip6[4];
+	unsigned64 ip_start, ip_end, rest, mask;
+	long int line, maxranges, lines_overlap, lines_overlap_del, lines_saved;
+	long int cluster, i, k;
+	char *ps, *pexe, *pstart, *pend, *pcc;
+	char *pfields[CSV_FIELDS6];
+	char ccstr[3];
+	struct s_range6 *pr;
+	int shift, cc;
+
+	/* Parse command-line options and data file format
+	*/
+	pf = dfformats[0];  /* default format */
+	for( pexe = *argv++;  *argv != NULL  &&  **argv == '-';  argv++ )
+		{
+		cc = *(*argv+1);
+		if( cc >= '1'  &&  cc <= '0'+sizeof(dfformats)/sizeof(dfformats[0])  &&  *(*argv+2) == '\0' )
+			pf = dfformats[cc - '1'];
+		else
+			{
+			fprintf( stderr, "Bad source file format specifier.\n"
+					 "Run %s without arguments for help.\n",
+					 pexe );
+			return RV_ERROR;
+			}
+		}
+	if( argv[0] == NULL  ||  (argv[1] != NULL  &&  argv[2] != NULL) )
+		{
+		fprintf( stderr, "\n"
+				 "Usage: %s [-#] <source-ip6-to-country-data-file> [<dest-ip6db-file>]\n"
+				 "where -# specifies the source file format:\n"
+				 "-1  \"<ip-start>\",\"<ip-end>\",\"<iso-country>\",...  (default)\n"
+				 "-2  \"<ip-start>\",\"<ip-end>\",\"<...>\",\"<...>\",\"<iso-country>\",...  (GeoIPv6.csv)\n"
+				 "\n"
+				 "(C) 2003-2011 Corebase, Easymatic\n"
+				 "         www.easymatic.com\n"
+				 "\n",
+				 pexe );
+		return RV_ERROR;
+		}
+
+	/* Internal check
+	*/
+	puts( "Internal tests..." );
+	if( sizeof(struct s_cluster6) > SECTOR_SIZE )
+		{
+		fprintf( stderr, "Internal error: cluster data (%li) is greater than expected (%i).\n"
+			 "Make sure you call your compiler with options to eliminate holes in structures\n"
+			 "(for instance, in GCC, you must call it with 'gcc -fpack-struct')\n",
+			 (long int) sizeof(struct s_cluster6), SECTOR_SIZE );
+		return RV_ERROR;
+		}
+
+	/* Open and read all the input data file into memory
+	*/
+	puts( "Reading source IPv6-to-country data file..." );
+	fp = fopen( argv[0], "r" );
+	if( fp == NULL )
+		{
+		fprintf( stderr, "Cannot open source IPv6-to-country data file (%s).\n", argv[0] );
+		return RV_ERROR;
+		}
+	maxranges = 0L;
+	for( line = 1L;  fgets(buf, sizeof(buf), fp) != NULL;  line++ )
+		{
+		if( line % 10000L == 0L )
+			printf( "Read %li lines so far...\n", line );
+		if( strchr(buf, '\n') == NULL  &&  !feof(fp) )
+			{
+			fclose( fp );
+			free_all();
+			fprintf( stderr, "Line %li of source IPv6-to-country data file is too long.\n", line );
+			return RV_ERROR;
+			}
+		if( buf[ strspn(buf, " \t\r\n") ] == '\0' )
+			continue;  /* blank line */
+		k = (long int) csv_fields( buf, pfields, CSV_FIELDS6 );
+		if( k <= pf[0]  ||  k <= pf[1]  ||  k <= pf[2] )
+			pstart = pend = pcc = "";  /* bad line */
+		else
+			{
+			pstart = pfields[ pf[0] ];
+			pend   = pfields[ pf[1] ];
+			pcc    = pfields[ pf[2] ];
+			}
+		if( strlen(pcc) != 2  ||  parse_ip6(pstart, strlen(pstart), ip6) != strlen(pstart)  ||  !*pstart )
+			{
+			fclose( fp );
+			free_all();
+			fprintf( stderr, "Error reading line %li of source IPv6-to-country data file.\n", line );
+			return RV_ERROR;
+			}
+		ip_start = (((unsigned64) ip6[3]) << 32) | (unsigned64) ip6[2];
+		if( parse_ip6(pend, strlen(pend), ip6) != strlen(pend)  ||  !*pend )
+			{
+			fclose( fp );
+			free_all();
+			fprintf( stderr, "Error reading line %li of source IPv6-to-country data file.\n", line );
+			return RV_ERROR;
+			}
+		ip_end = (((unsigned64) ip6[3]) << 32) | (unsigned64) ip6[2];
+		strcpy( ccstr, pcc );
+		cc = find_cc( ccstr );  /* old codes too */
+		if( ip_end < ip_start  ||  cc < 0 )
+			{
+			if( ip_end < ip_start )
+				fprintf( stderr, "Bad IP range (start IP > end IP) reading line %li of source IPv6-to-country data file.\nSkipping line.\n", line );
+			else
+				fprintf( stderr, "Bad country code '%s' reading line %li of source IPv6-to-country data file.\nSkipping line.\n", ccstr, line );
+			continue;
+			}
+		if( ranges == maxranges )
+			{
+			maxranges = maxranges ? maxranges * 2L : 4096L;
+			pr = realloc( pranges, (size_t) maxranges * sizeof(struct s_range6) );
+			if( pr == NULL )
+				{
+				fclose( fp );
+				free_all();
+				fprintf( stderr, "Not enough memory reading line %li of source IPv6-to-country data file.\n", line );
+				return RV_ERROR;
+				}
+			pranges = pr;
+			}
+		pranges[ranges].ip_start = ip_start;
+		pranges[ranges].ip_end = ip_end;
+		pranges[ranges].cc = cc;
+		pranges[ranges].line = line;
+		ranges++;
+		}
+	if( ferror(fp) )
+		{
+		fclose( fp );
+		free_all();
+		fputs( "Error reading source IPv6-to-country data file.\n", stderr );
+		return RV_ERROR;
+		}
+	fclose( fp );
+	printf( "Read all %li lines of source IPv6-to-country data file.\n", ranges );
+	if( ranges == 0L )
+		{
+		free_all();
+		fputs( "Nothing to do.\n", stderr );
+		return RV_ERROR;
+		}
+
+	/* Sort, and fix overlaps: the range that starts first (or, from the
+	   same IP, the one read first) keeps the IPs of both, so each range
+	   kept starts after the end of the one before
+	*/
+	puts( "Sorting and finding overlaps..." );
+	qsort( pranges, (size_t) ranges, sizeof(struct s_range6), compare_range6 );
+	lines_overlap = lines_overlap_del = 0L;
+	for( i = 1L, k = 0L;  i < ranges;  i++ )
+		{
+		pr = &pranges[i];
+		if( pr->ip_start <= pranges[k].ip_end )
+			{
+			lines_overlap++;
+			if( pr->ip_end <= pranges[k].ip_end )
+				{
+				lines_overlap_del++;
+				continue;
+				}
+			pr->ip_start = pranges[k].ip_end + 1U;
+			}
+		pranges[++k] = *pr;
+		}
+	ranges = k + 1L;
+	printf( "%li overlapped IP ranges were fixed as possible (%li lines were deleted).\n", lines_overlap, lines_overlap_del );
+
+	/* Join adjacent ranges of the same country
+	*/
+	puts( "Finding redundancy and ranges..." );
+	lines_saved = 0L;
+	for( i = 1L, k = 0L;  i < ranges;  i++ )
+		{
+		if( pranges[i].cc == pranges[k].cc  &&  pranges[k].ip_end + 1U == pranges[i].ip_start )
+			{
+			lines_saved++;
+			pranges[k].ip_end = pranges[i].ip_end;
+			}
+		else
+			pranges[++k] = pranges[i];
+		}
+	ranges = k + 1L;
+
+	/* Split ranges into nodes: "rest" is the size of what is left of the
+	   range, minus 1 (so that a range of all IPs doesn't overflow), and
+	   each node takes as much of it as it can, up to 65536 << shift; each
+	   node but the last leaves less than 1 << shift of it, so there are at
+	   most 4 nodes (for shifts of 48, 32, 16 and 0)
+	*/
+	pnodes = malloc( (size_t) ranges * 4 * sizeof(struct s_node6) );
+	if( pnodes == NULL )
+		{
+		free_all();
+		fputs( "Not enough memory for database entries.\n", stderr );
+		return RV_ERROR;
+		}
+	for( i = 0L;  i < ranges;  i++ )
+		{
+		ip_start = pranges[i].ip_start;
+		for(;;)  /*forever*/
+			{
+			rest = pranges[i].ip_end - ip_start;
+			for( shift = 0;  ;  shift++ )
+				{
+				mask = (((unsigned64) 1U) << shift) - 1U;
+				/* k = (rest + 1) >> shift */
+				k = (long int) (rest >> shift) + ((rest & mask) == mask ? 1L : 0L);
+				if( k <= 0x10000L )
+					break;
+				}
+			pnodes[nodes].ip[1] = (unsigned32) (ip_start >> 32);
+			pnodes[nodes].ip[0] = (unsigned32) ip_start;
+			pnodes[nodes].iprange = (unsigned16) (k - 1L);
+			pnodes[nodes].ccsz = (((unsigned16) pranges[i].cc) << CC_SHIFT6) | (unsigned16) shift;
+			nodes++;
+			if( (((unsigned64) k - 1U) << shift) + mask == rest )
+				break;  /* the whole rest of the range */
+			ip_start += ((unsigned64) k) << shift;
+			}
+		}
+	printf( "There were %li redundant lines removed.\n"
+		"There were %li entries (lines) added due to database range limitations.\n"
+		"Total entries (lines) = %li\n",
+		lines_saved, nodes - ranges, nodes );
+
+	/* Create the target file, one cluster at a time: cluster 0 is the
+	   tree of all nodes, in as few cluster levels as they fit in, and each
+	   cluster adds the subtrees below it to the list, as its next clusters
+	*/
+	puts( "Creating target database..." );
+	pclusters = malloc( (size_t) (nodes + 1L) * sizeof(struct s_subtree6) );
+	if( pclusters == NULL )
+		{
+		free_all();
+		fputs( "Not enough memory for cluster list.\n", stderr );
+		return RV_ERROR;
+		}
+	ps = argv[1] != NULL ? argv[1] : DBFILE6;
+	ptemp = malloc( strlen(ps) + sizeof(NEW_SUFFIX) );
+	if( ptemp == NULL )
+		{
+		free_all();
+		fputs( "Not enough memory.\n", stderr );
+		return RV_ERROR;
+		}
+	strcat( strcpy(ptemp, ps), NEW_SUFFIX );
+	fp = fopen( ptemp, "wb" );
+	if( fp == NULL )
+		{
+		fprintf( stderr, "Cannot create new empty IPv6-to-country database (%s).\n", ptemp );
+		free( ptemp );
+		ptemp = NULL;  /* nothing to remove */
+		free_all();
+		return RV_ERROR;
+		}
+	pclusters[0].first = 0L;
+	pclusters[0].last = nodes - 1L;
+	pclusters[0].levels = 1;
+	for( k = (long int) NODES_PER_CLUSTER6;  k < nodes;  k = k * (NODES_PER_CLUSTER6 + 1L) + (long int) NODES_PER_CLUSTER6 )
+		pclusters[0].levels++;
+	clusters = 1L;
+	for( cluster = 0L;  cluster < clusters;  cluster++ )
+		{
+		if( cluster > 0L  &&  cluster % 100L == 0L )
+			printf( "Written %li clusters so far...\n", cluster );
+		/* mark entire cluster for "leaf nodes" */
+		for( i = 0L;  i < NODES_PER_CLUSTER6;  i++ )
+			{
+			sector6.cluster6.nodes[i].ip[0]   = (unsigned32) 0xFFFFFFFFU;
+			sector6.cluster6.nodes[i].ip[1]   = (unsigned32) 0xFFFFFFFFU;
+			sector6.cluster6.nodes[i].iprange = (unsigned16) 0xFFFFU;
+			sector6.cluster6.nodes[i].ccsz    = (unsigned16) 0xFFFFU;
+			sector6.cluster6.next[i]          = (unsigned32) 0U;
+			}
+		sector6.cluster6.next[i] = (unsigned32) 0U;  /* next[] has one more element */
+		if( cluster6(cluster) != 0 )
+			{
+			free_all();
+			fclose( fp );
+			fprintf( stderr, "Internal error: cluster %li does not fit its subtree!\n", cluster );
+			return RV_ERROR;
+			}
+		if( fwrite(&sector6, SECTOR_SIZE, 1, fp) != 1 )
+			{
+			free_all();
+			fclose( fp );
+			fputs( "Error writing to database file.\n", stderr );
+			return RV_ERROR;
+			}
+		}
+	if( fclose(fp) != 0 )
+		{
+		free_all();
+		fputs( "Error writing to database file.\n", stderr );
+		return RV_ERROR;
+		}
+	printf( "There are %li clusters in the database file, in %i levels.\n", clusters, pclusters[0].levels );
+
+	/* Verify the database, by looking up the first and last IPs of every
+	   range in it
+	*/
+	puts( "Verifying database..." );
+	fp = fopen( ptemp, "rb" );
+	if( fp == NULL )
+		{
+		fprintf( stderr, "Cannot open new IPv6-to-country database (%s).\n", ptemp );
+		free_all();
+		return RV_ERROR;
+		}
+	ip6[1] = ip6[0] = (unsigned32) 0U;
+	for( i = 0L;  i < ranges;  i++ )
+		{
+		for( k = 0L;  k < 2L;  k++ )
+			{
+			ip_start = k ? pranges[i].ip_end : pranges[i].ip_start;
+			ip6[3] = (unsigned32) (ip_start >> 32);
+			ip6[2] = (unsigned32) ip_start;
+			if( find_ip6_country(ip6, fp) != pranges[i].cc )
+				{
+				fclose( fp );
+				free_all();
+				fprintf( stderr, "Internal error: range from line %li is not found in the database!\n", pranges[i].line );
+				return RV_ERROR;
+				}
+			}
+		}
+	fclose( fp );
+
+	/* Publishing: the new database replaces the old one at once, with
+	   rename(), so ip2cc only ever opens either of them, never one that is
+	   half written (under WIN32, rename() cannot replace a file, so the
+	   old one is removed first)
+	*/
+#ifdef WIN32
+	remove( ps );
+#endif
+	if( rename(ptemp, ps) != 0 )
+		{
+		fprintf( stderr, "Cannot replace %s with %s.\n", ps, ptemp );
+		free_all();
+		return RV_ERROR;
+		}
+	free( ptemp );
+	ptemp = NULL;  /* published */
+
+	/* Done
+	*/
+	free_all();
+	puts( "All done!" );
+	return RV_OK;
+}
+
+
+/* Splits CSV line "ps" into up to "n" fields, placing in "pfields[]" each
+field without the blanks and quotes around it (these are replaced by '\0's
+in "ps"). Quoted fields may not have quotes in them, and others may not
+have commas.
+Returns the number of fields found
+*/
+int csv_fields( char *ps, char **pfields, int n )
+{
+	char *pe, *pcomma;
+	int k;
+
+	for( k = 0;  k < n;  k++ )
+		{
+		ps += strspn( ps, " \t" );
+		if( *ps == '"' )
+			{
+			pe = strchr( ++ps, '"' );
+			if( pe == NULL )
+				return k;
+			pcomma = strchr( pe, ',' );
+			}
+		else
+			{
+			pe = ps + strcspn( ps, ",\r\n" );
+			pcomma = *pe == ',' ? pe : NULL;
+			while( pe > ps  &&  (pe[-1] == ' '  ||  pe[-1] == '\t') )
+				pe--;
+			}
+		*pe = '\0';
+		pfields[k] = ps;
+		if( pcomma == NULL )
+			return k + 1;
+		ps = pcomma + 1;
+		}
+	return n;
+}
+
+
+/* qsort() comparison of two struct s_range6, by start IP, and then
+   by line, so that overlaps are fixed in the same way every time
+*/
+int compare_range6( const void *p1, const void *p2 )
+{
+	const struct s_range6 *pr1 = p1, *pr2 = p2;
+
+	if( pr1->ip_start != pr2->ip_start )
+		return pr1->ip_start < pr2->ip_start ? -1 : 1;
+	return pr1->line < pr2->line ? -1 : pr1->line > pr2->line;
+}
+
+
+/* Returns the start IP (upper 64 bits) of node "pn"
+*/
+unsigned64 node6_start( const struct s_node6 *pn )
+{
+	return (((unsigned64) pn->ip[1]) << 32) | (unsigned64) pn->ip[0];
+}
+
+
+/* Fills in the cluster being written (sector6) as cluster number
+"cluster" of the list, and adds its next clusters to the list. A cluster
+of up to NODES_PER_CLUSTER6 nodes has no next clusters; otherwise, it is
+full, and its nodes split the others into as few subtrees as fit in one
+less cluster level (the last gaps between its nodes are left empty).
+Returns 0 if ok, or -1 on error
+*/
+int cluster6( long int cluster )
+{
+	long int first, last, n, cap, k, q, r, size;
+	int g, levels;
+
+	first = pclusters[cluster].first;
+	last = pclusters[cluster].last;
+	levels = pclusters[cluster].levels;
+	n = last - first + 1L;
+	if( n <= (long int) NODES_PER_CLUSTER6 )
+		return treecluster6( first, last, NODES_PER_CLUSTER6 >> 1, (NODES_PER_CLUSTER6 >> 2) + 1 );
+	/* "cap" nodes fit in a subtree of one less cluster level */
+	for( cap = 0L, g = 1;  g < levels;  g++ )
+		cap = cap * (NODES_PER_CLUSTER6 + 1L) + (long int) NODES_PER_CLUSTER6;
+	k = (n - (long int) NODES_PER_CLUSTER6 + cap - 1L) / cap;  /* next clusters */
+	if( levels < 2  ||  k > (long int) NODES_PER_CLUSTER6 + 1L )
+		return -1;
+	q = (n - (long int) NODES_PER_CLUSTER6) / k;
+	r = (n - (long int) NODES_PER_CLUSTER6) % k;
+	for( g = 0;  g <= NODES_PER_CLUSTER6;  g++ )
+		{
+		if( g < k )
+			{
+			size = q + (g < r ? 1L : 0L);
+			if( clusters > (long int) 0xFFFFFFFFUL )
+				return -1;
+			sector6.cluster6.next[g] = (unsigned32) clusters;
+			pclusters[clusters].first = first;
+			pclusters[clusters].last = first + size - 1L;
+			pclusters[clusters].levels = levels - 1;
+			clusters++;
+			first += size;
+			}
+		if( g < NODES_PER_CLUSTER6 )
+			{
+			/* the nodes of a full cluster are in IP order */
+			if( first > last  ||  (g > 0  &&  node6_start(&sector6.cluster6.nodes[g-1]) >= node6_start(&pnodes[first])) )
+				return -1;
+			sector6.cluster6.nodes[g] = pnodes[first++];
+			}
+		}
+	return first == last + 1L ? 0 : -1;
+}
+
+
+/* Places the balanced binary subtree of nodes "first" to "last" (inclusive)
+   in the cluster being written, with its root at node index "i", and
+   "step" as in find_ip6_country().
+   Returns 0 if ok, or -1 on error (if the subtree doesn't fit)
+*/
+int treecluster6( long int first, long int last, int i, int step )
+{
+	long int mid;
+
+	if( first > last )
+		return 0;  /* empty subtree: the node stays unused */
+	mid = first + ((last - first) >> 1);
+	if( i < 0  ||  i >= NODES_PER_CLUSTER6  ||  (!step  &&  first != last) )
+		return -1;
+	if( mid > first  &&  node6_start(&pnodes[mid-1]) >= node6_start(&pnodes[mid]) )
+		return -1;  /* not sorted */
+	sector6.cluster6.nodes[i] = pnodes[mid];
+	if( treecluster6(first, mid - 1L, i - step, step >> 1) != 0 )
+		return -1;
+	return treecluster6( mid + 1L, last, i + step, step >> 1 );
+}
+
+
+/* Releases all memory and empties its pointers
+*/
+void free_all( void )
+{
+	if( ptemp != NULL )
+		{
+		remove( ptemp );  /* never published */
+		free( ptemp );
+		ptemp = NULL;
+		}
+	free( pranges );
+	free( pnodes );
+	free( pclusters );
+	pranges = NULL;
+	pnodes = NULL;
+	pclusters = NULL;
+}